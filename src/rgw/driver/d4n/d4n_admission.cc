@@ -0,0 +1,120 @@
+#include "d4n_admission.h"
+#include <boost/algorithm/string.hpp>
+
+#define dout_subsys ceph_subsys_rgw
+#define dout_context g_ceph_context
+
+RGWD4NFrequencySketch::RGWD4NFrequencySketch(uint64_t width, uint64_t _sample_size)
+  : sample_size(std::max<uint64_t>(_sample_size, 1))
+{
+  uint64_t w = 1;
+
+  while (w < width) {
+    w <<= 1;
+  }
+
+  mask = w - 1;
+  table.assign(w * depth, 0);
+}
+
+uint64_t RGWD4NFrequencySketch::index(uint64_t hash, unsigned row) const {
+  /* Rows use independent hashes derived from two halves of one hash */
+  uint64_t h1 = hash;
+  uint64_t h2 = (hash >> 32) | (hash << 32);
+  h2 = h2 * 0x9e3779b97f4a7c15ULL + 1;
+
+  return row * (mask + 1) + ((h1 + row * h2) & mask);
+}
+
+void RGWD4NFrequencySketch::age() {
+  for (auto& counter : table) {
+    counter >>= 1;
+  }
+
+  additions /= 2;
+}
+
+void RGWD4NFrequencySketch::increment(const std::string& key) {
+  uint64_t hash = std::hash<std::string>{}(key);
+  std::lock_guard l{lock};
+  bool added = false;
+
+  for (unsigned row = 0; row < depth; ++row) {
+    uint8_t& counter = table[index(hash, row)];
+
+    if (counter < max_count) {
+      counter++;
+      added = true;
+    }
+  }
+
+  if (added && ++additions >= sample_size) {
+    age();
+  }
+}
+
+unsigned RGWD4NFrequencySketch::estimate(const std::string& key) {
+  uint64_t hash = std::hash<std::string>{}(key);
+  std::lock_guard l{lock};
+  unsigned count = max_count;
+
+  for (unsigned row = 0; row < depth; ++row) {
+    count = std::min<unsigned>(count, table[index(hash, row)]);
+  }
+
+  return count;
+}
+
+/* The sketch is sized to the number of blocks the cache holds; the sample
+ * size follows the usual TinyLFU choice of ten times that number */
+RGWD4NAdmission::RGWD4NAdmission(CephContext* cct, uint64_t capacity, uint64_t block_size)
+  : use_sketch(cct->_conf->rgw_d4n_admission_policy == "tinylfu"),
+    max_object_size(cct->_conf->rgw_d4n_admission_max_object_size),
+    sketch(std::max<uint64_t>(capacity / std::max<uint64_t>(block_size, 1), 1024),
+           10 * std::max<uint64_t>(capacity / std::max<uint64_t>(block_size, 1), 1024))
+{
+  std::vector<std::string> names;
+  boost::split(names, cct->_conf->rgw_d4n_admission_buckets, boost::is_any_of(", "), boost::token_compress_on);
+
+  for (auto& name : names) {
+    if (!name.empty()) {
+      buckets.insert(name);
+    }
+  }
+}
+
+void RGWD4NAdmission::record(const std::string& oid, uint64_t offset) {
+  if (use_sketch) {
+    sketch.increment(buildKey(oid, offset));
+  }
+}
+
+bool RGWD4NAdmission::admit(const std::string& bucket_name, uint64_t obj_size,
+                            const std::string& oid, uint64_t offset,
+                            const std::string* victim_oid, uint64_t victim_offset) {
+  if (max_object_size > 0 && obj_size > max_object_size) {
+    dout(20) << "RGW D4N Admission: Rejected block " << offset << " of " << oid
+             << " because the object is larger than " << max_object_size << " bytes" << dendl;
+    return false;
+  }
+
+  if (!use_sketch || !victim_oid) {
+    return true;
+  }
+
+  if (!buckets.empty() && !buckets.count(bucket_name)) {
+    return true;
+  }
+
+  unsigned candidate = sketch.estimate(buildKey(oid, offset));
+  unsigned victim = sketch.estimate(buildKey(*victim_oid, victim_offset));
+
+  if (candidate <= victim) {
+    dout(20) << "RGW D4N Admission: Rejected block " << offset << " of " << oid
+             << " with frequency " << candidate << " in favor of block " << victim_offset
+             << " of " << *victim_oid << " with frequency " << victim << dendl;
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,62 @@
+#ifndef CEPH_RGWD4NADMISSION_H
+#define CEPH_RGWD4NADMISSION_H
+
+#include "rgw_common.h"
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+/* Count-min sketch of how often each block has been requested. Counters
+ * saturate at 15, and all of them are halved once sample_size requests
+ * have been recorded, so the estimate reflects recent popularity. */
+class RGWD4NFrequencySketch {
+  public:
+    /* width is rounded up to a power of two */
+    RGWD4NFrequencySketch(uint64_t width, uint64_t _sample_size);
+
+    void increment(const std::string& key);
+    unsigned estimate(const std::string& key);
+
+  private:
+    static constexpr unsigned depth = 4;
+    static constexpr uint8_t max_count = 15;
+
+    std::mutex lock;
+    uint64_t mask;
+    uint64_t sample_size;
+    uint64_t additions = 0;
+    std::vector<uint8_t> table;
+
+    uint64_t index(uint64_t hash, unsigned row) const;
+    void age();
+};
+
+/* TinyLFU admission: once the cache is full, a block is only cached if it
+ * has been requested more often than the block it would evict. Blocks read
+ * or written once, such as those of a bucket being scanned, are rejected
+ * without disturbing the cached working set. */
+class RGWD4NAdmission {
+  public:
+    RGWD4NAdmission(CephContext* cct, uint64_t capacity, uint64_t block_size);
+
+    /* Counts a request for the block */
+    void record(const std::string& oid, uint64_t offset);
+    /* Decides whether a block of an object of obj_size bytes is cached.
+     * victim names the block it would evict, if any. */
+    bool admit(const std::string& bucket_name, uint64_t obj_size,
+               const std::string& oid, uint64_t offset,
+               const std::string* victim_oid, uint64_t victim_offset);
+
+  private:
+    bool use_sketch;
+    uint64_t max_object_size;
+    std::set<std::string> buckets; /* Empty if the filter applies to all buckets */
+    RGWD4NFrequencySketch sketch;
+
+    static std::string buildKey(const std::string& oid, uint64_t offset) {
+      return oid + "#" + std::to_string(offset);
+    }
+};
+
+#endif
@@ -0,0 +1,335 @@
+#include "d4n_blockstore.h"
+#include "common/errno.h"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if __has_include(<filesystem>)
+#include <filesystem>
+namespace efs = std::filesystem;
+#else
+#include <experimental/filesystem>
+namespace efs = std::experimental::filesystem;
+#endif
+
+#define dout_subsys ceph_subsys_rgw
+#define dout_context g_ceph_context
+
+/* How durable a block is is up to the persistence redis is configured with */
+int RGWD4NRedisBlockStore::putBlock(const std::string& oid, uint64_t offset, buffer::list& data, bool compressed,
+                                    bool sync, optional_yield y) {
+  std::string key = buildBlockIndex(oid, offset);
+  std::string zkey = buildCompressedBlockIndex(oid, offset);
+
+  /* A copy in the other format holds the same data, so readers may see
+   * either while it is replaced */
+  auto b = batch(oid);
+  b.add({"SET", compressed ? zkey : key, data.to_str()});
+  b.add({"DEL", compressed ? key : zkey});
+  b.add({"SADD", buildBlockSetIndex(oid), std::to_string(offset)});
+
+  if (b.exec(y) < 0 || b.reply(0).is_error() || b.reply(1).is_error() || b.reply(2).is_error()) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int RGWD4NRedisBlockStore::getBlocks(const std::string& oid, const std::vector<uint64_t>& offsets, std::vector<buffer::list>* data,
+                                     std::vector<bool>* compressed, optional_yield y) {
+  std::vector<std::string> cmd{"MGET"};
+
+  for (const auto& offset : offsets) {
+    cmd.push_back(buildBlockIndex(oid, offset));
+  }
+
+  for (const auto& offset : offsets) {
+    cmd.push_back(buildCompressedBlockIndex(oid, offset));
+  }
+
+  auto b = batch(oid);
+  b.add(std::move(cmd));
+
+  if (b.exec(y) < 0 || !b.reply(0).is_array()) {
+    return -1;
+  }
+
+  const auto& arr = b.reply(0).as_array();
+  data->resize(offsets.size());
+  compressed->assign(offsets.size(), false);
+
+  for (size_t i = 0; i < offsets.size() && offsets.size() + i < arr.size(); ++i) {
+    if (arr[i].is_string()) {
+      (*data)[i].append(arr[i].as_string());
+    } else if (arr[offsets.size() + i].is_string()) {
+      (*data)[i].append(arr[offsets.size() + i].as_string());
+      (*compressed)[i] = true;
+    }
+  }
+
+  return 0;
+}
+
+int RGWD4NRedisBlockStore::delBlock(const std::string& oid, uint64_t offset, optional_yield y) {
+  auto b = batch(oid);
+  b.add({"DEL", buildBlockIndex(oid, offset), buildCompressedBlockIndex(oid, offset)});
+  b.add({"SREM", buildBlockSetIndex(oid), std::to_string(offset)});
+
+  if (b.exec(y) < 0 || b.reply(0).is_error() || b.reply(1).is_error()) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int RGWD4NRedisBlockStore::delBlocks(const std::string& oid, optional_yield y) {
+  std::vector<std::string> cmd{"DEL", buildBlockSetIndex(oid)};
+
+  /* Find the object's data blocks */
+  {
+    auto b = batch(oid);
+    b.add({"SMEMBERS", buildBlockSetIndex(oid)});
+
+    if (b.exec(y) < 0 || !b.reply(0).is_array()) {
+      return -1;
+    }
+
+    for (const auto& offset : b.reply(0).as_array()) {
+      try {
+        uint64_t ofs = std::stoull(offset.as_string());
+        cmd.push_back(buildBlockIndex(oid, ofs));
+        cmd.push_back(buildCompressedBlockIndex(oid, ofs));
+      } catch(std::exception &e) {}
+    }
+  }
+
+  auto b = batch(oid);
+  b.add(std::move(cmd));
+
+  if (b.exec(y) < 0 || !b.reply(0).is_integer()) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int RGWD4NLocalBlockStore::init(bool evict) {
+  if (location.empty()) {
+    dout(0) << "ERROR: RGW D4N Cache: Local data cache path is not configured" << dendl;
+    return -EINVAL;
+  }
+
+  if (location.back() == '/') {
+    location.pop_back();
+  }
+
+  try {
+    if (efs::exists(location)) {
+      if (evict) {
+        dout(5) << "RGW D4N Cache: Evicting local data cache at " << location << dendl;
+
+        for (auto& p : efs::directory_iterator(location)) {
+          efs::remove_all(p.path());
+        }
+      }
+    } else {
+      efs::create_directories(location);
+    }
+  } catch (const efs::filesystem_error& e) {
+    dout(0) << "ERROR: RGW D4N Cache: Failed to initialize local data cache at " << location << ": " << e.what() << dendl;
+    return -e.code().value();
+  }
+
+  return 0;
+}
+
+int RGWD4NLocalBlockStore::listBlocks(const std::function<void(const std::string& oid, uint64_t offset, uint64_t size)>& f) {
+  struct Found {
+    efs::file_time_type mtime;
+    std::string oid;
+    uint64_t offset;
+    uint64_t size;
+  };
+  std::vector<Found> found;
+
+  try {
+    for (auto& dir : efs::directory_iterator(location)) {
+      if (!efs::is_directory(dir.path())) {
+        continue;
+      }
+
+      std::string oid = url_decode(dir.path().filename().string());
+
+      for (auto& file : efs::directory_iterator(dir.path())) {
+        std::string name = file.path().filename().string();
+
+        if (name.find(".tmp.") != std::string::npos) {
+          efs::remove(file.path());
+          continue;
+        }
+
+        /* Compressed blocks are named by their offset followed by ".z" */
+        char* end;
+        uint64_t offset = strtoull(name.c_str(), &end, 10);
+
+        if (end == name.c_str() || (*end && strcmp(end, ".z") != 0)) {
+          continue;
+        }
+
+        found.push_back({efs::last_write_time(file.path()), oid, offset, efs::file_size(file.path())});
+      }
+    }
+  } catch (const efs::filesystem_error& e) {
+    dout(0) << "ERROR: RGW D4N Cache: Failed to list local data cache at " << location << ": " << e.what() << dendl;
+    return -e.code().value();
+  }
+
+  std::sort(found.begin(), found.end(), [] (const Found& a, const Found& b) { return a.mtime < b.mtime; });
+
+  for (const auto& b : found) {
+    f(b.oid, b.offset, b.size);
+  }
+
+  return 0;
+}
+
+std::string RGWD4NLocalBlockStore::buildObjectPath(const std::string& oid) {
+  return location + "/" + url_encode(oid, true);
+}
+
+/* Writes the file and waits for its data to reach the disk */
+static int write_file_sync(const std::string& path, buffer::list& data) {
+  int fd = TEMP_FAILURE_RETRY(::open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600));
+
+  if (fd < 0) {
+    return -errno;
+  }
+
+  int ret = data.write_fd(fd);
+
+  if (ret == 0 && ::fsync(fd) < 0) {
+    ret = -errno;
+  }
+
+  VOID_TEMP_FAILURE_RETRY(::close(fd));
+  return ret;
+}
+
+/* Waits for the entries of the directory to reach the disk */
+static int sync_dir(const std::string& path) {
+  int fd = TEMP_FAILURE_RETRY(::open(path.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC));
+
+  if (fd < 0) {
+    return -errno;
+  }
+
+  int ret = (::fsync(fd) < 0) ? -errno : 0;
+
+  VOID_TEMP_FAILURE_RETRY(::close(fd));
+  return ret;
+}
+
+int RGWD4NLocalBlockStore::putBlock(const std::string& oid, uint64_t offset, buffer::list& data, bool compressed,
+                                    bool sync, optional_yield y) {
+  std::string path = buildBlockPath(oid, offset, compressed);
+
+  /* Readers only ever see complete blocks; the block is written under a
+   * temporary name and renamed into place */
+  std::string tmp = path + ".tmp." + std::to_string(tmp_seq++);
+
+  try {
+    efs::create_directories(buildObjectPath(oid));
+  } catch (const efs::filesystem_error& e) {
+    dout(10) << "RGW D4N Cache: Failed to create " << buildObjectPath(oid) << ": " << e.what() << dendl;
+    return -1;
+  }
+
+  int ret = sync ? write_file_sync(tmp, data) : data.write_file(tmp.c_str(), 0600);
+
+  if (ret < 0) {
+    dout(10) << "RGW D4N Cache: Failed to write " << tmp << ": " << cpp_strerror(ret) << dendl;
+    ::unlink(tmp.c_str());
+    return -1;
+  }
+
+  if (::rename(tmp.c_str(), path.c_str()) < 0) {
+    ret = -errno;
+    dout(10) << "RGW D4N Cache: Failed to rename " << tmp << ": " << cpp_strerror(ret) << dendl;
+    ::unlink(tmp.c_str());
+    return -1;
+  }
+
+  /* The rename, and the object's directory if it was just created, have to
+   * be on disk as well for the block to be found after a crash */
+  if (sync) {
+    ret = sync_dir(buildObjectPath(oid));
+
+    if (ret == 0) {
+      ret = sync_dir(location);
+    }
+
+    if (ret < 0) {
+      dout(10) << "RGW D4N Cache: Failed to sync " << path << ": " << cpp_strerror(ret) << dendl;
+      return -1;
+    }
+  }
+
+  /* Drop the block's copy in the other format, if any */
+  ::unlink(buildBlockPath(oid, offset, !compressed).c_str());
+
+  return 0;
+}
+
+int RGWD4NLocalBlockStore::getBlocks(const std::string& oid, const std::vector<uint64_t>& offsets, std::vector<buffer::list>* data,
+                                     std::vector<bool>* compressed, optional_yield y) {
+  data->resize(offsets.size());
+  compressed->assign(offsets.size(), false);
+
+  for (size_t i = 0; i < offsets.size(); ++i) {
+    std::string path = buildBlockPath(oid, offsets[i]);
+    std::string err;
+    int ret = (*data)[i].read_file(path.c_str(), &err);
+
+    if (ret == -ENOENT) {
+      path = buildBlockPath(oid, offsets[i], true);
+      ret = (*data)[i].read_file(path.c_str(), &err);
+      (*compressed)[i] = (ret >= 0);
+    }
+
+    if (ret < 0) {
+      if (ret != -ENOENT) {
+        dout(10) << "RGW D4N Cache: Failed to read " << path << ": " << err << dendl;
+      }
+      (*data)[i].clear();
+    }
+  }
+
+  return 0;
+}
+
+int RGWD4NLocalBlockStore::delBlock(const std::string& oid, uint64_t offset, optional_yield y) {
+  for (bool compressed : {false, true}) {
+    std::string path = buildBlockPath(oid, offset, compressed);
+
+    if (::unlink(path.c_str()) < 0 && errno != ENOENT) {
+      int ret = -errno;
+      dout(10) << "RGW D4N Cache: Failed to remove " << path << ": " << cpp_strerror(ret) << dendl;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int RGWD4NLocalBlockStore::delBlocks(const std::string& oid, optional_yield y) {
+  std::error_code ec;
+  efs::remove_all(buildObjectPath(oid), ec);
+
+  if (ec) {
+    dout(10) << "RGW D4N Cache: Failed to remove " << buildObjectPath(oid) << ": " << ec.message() << dendl;
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,98 @@
+#ifndef CEPH_RGWD4NBLOCKSTORE_H
+#define CEPH_RGWD4NBLOCKSTORE_H
+
+#include "rgw_common.h"
+#include "d4n_redis.h"
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+/* Storage for the data blocks of cached objects. Blocks are addressed by
+ * the object's oid and their offset within the object; where a block is
+ * cached is tracked separately by the block directory. */
+class RGWD4NBlockStore {
+  public:
+    virtual ~RGWD4NBlockStore() = default;
+
+    /* compressed is set for blocks held in the compressed format of
+     * RGWD4NCache. They are kept apart from plain blocks, so that readers
+     * always know which of the two they got. sync is set for blocks that are
+     * the only copy of their data, which must survive a crash once stored. */
+    virtual int putBlock(const std::string& oid, uint64_t offset, buffer::list& data, bool compressed,
+                         bool sync, optional_yield y) = 0;
+    /* Blocks that are not stored are returned empty; compressed is set for
+     * each block */
+    virtual int getBlocks(const std::string& oid, const std::vector<uint64_t>& offsets, std::vector<buffer::list>* data,
+                          std::vector<bool>* compressed, optional_yield y) = 0;
+    virtual int delBlock(const std::string& oid, uint64_t offset, optional_yield y) = 0;
+    /* Removes every block of the object */
+    virtual int delBlocks(const std::string& oid, optional_yield y) = 0;
+    /* Whether the blocks are visible to the other gateways */
+    virtual bool is_shared() const = 0;
+    /* Calls f with the size of each block the store already holds, least
+     * recently written first, so that a restarted gateway can account for
+     * them. Shared stores leave that to the gateways that wrote them. */
+    virtual int listBlocks(const std::function<void(const std::string& oid, uint64_t offset, uint64_t size)>& f) {
+      return 0;
+    }
+};
+
+/* Blocks are kept as redis strings alongside the object's metadata */
+class RGWD4NRedisBlockStore : public RGWD4NBlockStore {
+  public:
+    RGWD4NRedisBlockStore(RGWD4NRedisCluster* _cluster, std::chrono::milliseconds _timeout):cluster(_cluster),
+                                                                                           timeout(_timeout) {}
+
+    int putBlock(const std::string& oid, uint64_t offset, buffer::list& data, bool compressed,
+                 bool sync, optional_yield y) override;
+    int getBlocks(const std::string& oid, const std::vector<uint64_t>& offsets, std::vector<buffer::list>* data,
+                  std::vector<bool>* compressed, optional_yield y) override;
+    int delBlock(const std::string& oid, uint64_t offset, optional_yield y) override;
+    int delBlocks(const std::string& oid, optional_yield y) override;
+    bool is_shared() const override { return true; }
+
+  private:
+    RGWD4NRedisCluster* cluster;
+    std::chrono::milliseconds timeout;
+    RGWD4NRedisBatch batch(const std::string& oid) { return RGWD4NRedisBatch(cluster->get(oid), timeout); }
+    std::string buildBlockIndex(const std::string& oid, uint64_t offset) {
+      return "rgw-object:" + oid + ":block:" + std::to_string(offset);
+    }
+    std::string buildCompressedBlockIndex(const std::string& oid, uint64_t offset) {
+      return "rgw-object:" + oid + ":zblock:" + std::to_string(offset);
+    }
+    /* Offsets of all blocks cached for an object, used to remove them */
+    std::string buildBlockSetIndex(const std::string& oid) { return "rgw-object:" + oid + ":blocks"; }
+};
+
+/* Blocks are kept as files on a local file system, one directory per
+ * object, so the cache is bounded by disk rather than memory. Redis then
+ * only holds object metadata and the block directory. */
+class RGWD4NLocalBlockStore : public RGWD4NBlockStore {
+  public:
+    RGWD4NLocalBlockStore(std::string _location):location(std::move(_location)) {}
+
+    /* Creates the cache directory, removing old contents if evict is set */
+    int init(bool evict);
+
+    int putBlock(const std::string& oid, uint64_t offset, buffer::list& data, bool compressed,
+                 bool sync, optional_yield y) override;
+    int getBlocks(const std::string& oid, const std::vector<uint64_t>& offsets, std::vector<buffer::list>* data,
+                  std::vector<bool>* compressed, optional_yield y) override;
+    int delBlock(const std::string& oid, uint64_t offset, optional_yield y) override;
+    int delBlocks(const std::string& oid, optional_yield y) override;
+    bool is_shared() const override { return false; }
+    /* Also removes the temporary files of writes that never finished */
+    int listBlocks(const std::function<void(const std::string& oid, uint64_t offset, uint64_t size)>& f) override;
+
+  private:
+    std::string location;
+    std::atomic<uint64_t> tmp_seq{0};
+    std::string buildObjectPath(const std::string& oid);
+    std::string buildBlockPath(const std::string& oid, uint64_t offset, bool compressed = false) {
+      return buildObjectPath(oid) + "/" + std::to_string(offset) + (compressed ? ".z" : "");
+    }
+};
+
+#endif
@@ -1,490 +1,587 @@
 #include "d4n_datacache.h"
+#include "d4n_perf_counters.h"
+#include "common/perf_counters.h"
+#include "include/random.h"
 
 #define dout_subsys ceph_subsys_rgw
 #define dout_context g_ceph_context
 
-/* Base metadata and data fields should remain consistent */
-std::vector<std::string> baseFields {
-  "mtime",
-  "object_size",
-  "accounted_size",
-  "epoch",
-  "version_id",
-  "source_zone_short_id",
-  "bucket_count",
-  "bucket_size",
-  "user_quota.max_size",
-  "user_quota.max_objects",
-  "max_buckets",
-  "data"};
-
-std::vector< std::pair<std::string, std::string> > RGWD4NCache::buildObject(rgw::sal::Attrs* binary) {
-  std::vector< std::pair<std::string, std::string> > values;
-  rgw::sal::Attrs::iterator attrs;
- 
-  /* Convert to vector */
-  if (binary != NULL) {
-    for (attrs = binary->begin(); attrs != binary->end(); ++attrs) {
-      values.push_back(std::make_pair(attrs->first, attrs->second.to_str()));
+/* Metadata is only replaced if it still holds the value the update was
+ * based on. An empty expected value means the object was not cached.
+ * KEYS: metadata, version; ARGV: expected value, new value, new version */
+static const std::string casObjectScript =
+  "local cur = redis.call('GET', KEYS[1]) "
+  "if cur == false then "
+  "  if ARGV[1] ~= '' then return -1 end "
+  "elseif cur ~= ARGV[1] then return 0 end "
+  "redis.call('MSET', KEYS[1], ARGV[2], KEYS[2], ARGV[3]) "
+  "return 1";
+
+static constexpr int casRetries = 10;
+
+RGWD4NMetaCache::RGWD4NMetaCache(size_t capacity, size_t num_shards)
+  : shards(std::max<size_t>(num_shards, 1))
+{
+  shard_capacity = std::max<size_t>(capacity / shards.size(), 1);
+}
+
+bool RGWD4NMetaCache::get(const std::string& oid, Entry* entry) {
+  Shard& s = shard(oid);
+  std::lock_guard l{s.lock};
+  auto it = s.entries.find(oid);
+
+  if (it == s.entries.end()) {
+    return false;
+  }
+
+  s.lru.splice(s.lru.begin(), s.lru, it->second.second);
+  *entry = it->second.first;
+  return true;
+}
+
+void RGWD4NMetaCache::put(const std::string& oid, const RGWD4NObjectMeta& meta, const std::string& version) {
+  Shard& s = shard(oid);
+  std::lock_guard l{s.lock};
+  auto it = s.entries.find(oid);
+
+  if (it == s.entries.end()) {
+    s.lru.push_front(oid);
+    it = s.entries.emplace(oid, std::make_pair(Entry(), s.lru.begin())).first;
+
+    if (s.entries.size() > shard_capacity) {
+      s.entries.erase(s.lru.back());
+      s.lru.pop_back();
     }
-  } 
+  } else {
+    s.lru.splice(s.lru.begin(), s.lru, it->second.second);
+  }
 
-  return values; 
+  Entry& entry = it->second.first;
+  entry.meta = meta;
+  entry.version = version;
+  entry.validated = ceph::mono_clock::now();
 }
 
-int RGWD4NCache::findClient(cpp_redis::client *client) { 
-  if (client->is_connected())
-    return 0;
+void RGWD4NMetaCache::validated(const std::string& oid) {
+  Shard& s = shard(oid);
+  std::lock_guard l{s.lock};
+  auto it = s.entries.find(oid);
 
-  if (host == "" || port == 0) { 
-    dout(10) << "RGW D4N Cache: D4N cache endpoint was not configured correctly" << dendl;
-    return EDESTADDRREQ;
+  if (it != s.entries.end()) {
+    it->second.first.validated = ceph::mono_clock::now();
   }
+}
+
+void RGWD4NMetaCache::erase(const std::string& oid) {
+  Shard& s = shard(oid);
+  std::lock_guard l{s.lock};
+  auto it = s.entries.find(oid);
 
-  client->connect(host, port, nullptr);
+  if (it != s.entries.end()) {
+    s.lru.erase(it->second.second);
+    s.entries.erase(it);
+  }
+}
 
-  if (!client->is_connected())
-    return ECONNREFUSED;
+void RGWD4NMetaCache::unvalidate() {
+  for (auto& s : shards) {
+    std::lock_guard l{s.lock};
 
-  return 0;
+    /* Long enough ago for any TTL to have passed */
+    for (auto& entry : s.entries) {
+      entry.second.first.validated = ceph::mono_time();
+    }
+  }
 }
 
-int RGWD4NCache::existKey(std::string key) { 
-  int result = -1;
-  std::vector<std::string> keys;
-  keys.push_back(key);
+std::string RGWD4NCache::newVersion() {
+  return std::to_string(ceph::util::generate_random_number<uint64_t>());
+}
 
-  if (!client.is_connected()) {
-    return result;
+void RGWD4NCache::invalidateLocal(const std::string& oid) {
+  if (!meta_cache) {
+    return;
   }
 
-  try {
-    client.exists(keys, [&result](cpp_redis::reply &reply) {
-      if (reply.is_integer()) {
-        result = reply.as_integer(); /* Returns 1 upon success */
-      }
-    });
+  if (oid.empty()) {
+    meta_cache->unvalidate();
+  } else {
+    meta_cache->erase(oid);
+  }
+}
+
+int RGWD4NCache::revalidate(const std::string& oid, optional_yield y) {
+  RGWD4NMetaCache::Entry entry;
+
+  if (!meta_cache || !meta_cache->get(oid, &entry)) {
+    return -2;
+  }
+
+  int ret = checkVersion(oid, entry.version, y);
+
+  if (ret == 0) {
+    meta_cache->validated(oid);
+  } else {
+    meta_cache->erase(oid);
+  }
+
+  return ret;
+}
+
+int RGWD4NCache::existKey(std::string key, optional_yield y) {
+  int result = -1;
+
+  /* The key does not name the object it belongs to, so every endpoint is asked */
+  for (const auto& pool : cluster->get_pools()) {
+    RGWD4NRedisBatch b(pool.get(), timeout);
+    b.add({"EXISTS", key});
+
+    if (b.exec(y) < 0 || !b.reply(0).is_integer()) {
+      continue;
+    }
+
+    result = b.reply(0).as_integer(); /* Returns 1 upon success */
+
+    if (result > 0)
+      break;
+  }
 
-    client.sync_commit(std::chrono::milliseconds(1000));
-  } catch(std::exception &e) {}
-  
   return result;
 }
 
-int RGWD4NCache::setObject(std::string oid, rgw::sal::Attrs* attrs) {
-  /* Creating the index based on oid */
-  std::string key = "rgw-object:" + oid + ":cache";
-  std::string result;
+int RGWD4NCache::readObject(const std::string& oid, RGWD4NObjectMeta* meta, std::string* raw,
+                            std::string* version, optional_yield y) {
+  auto b = batch(oid);
+  /* Read together so the version matches the metadata */
+  b.add({"MGET", buildIndex(oid), buildVersionIndex(oid)});
 
-  if (!client.is_connected()) {
-    findClient(&client);
+  if (b.exec(y) < 0 || !b.reply(0).is_array() || b.reply(0).as_array().size() != 2) {
+    return -1;
   }
 
-  /* Every set will be treated as new */
+  const auto& value = b.reply(0).as_array()[0];
+  const auto& ver = b.reply(0).as_array()[1];
+
+  if (value.is_null()) {
+    return -2;
+  }
+
+  if (!value.is_string()) {
+    return -1;
+  }
+
+  *raw = value.as_string();
+  *version = ver.is_string() ? ver.as_string() : std::string();
+
+  buffer::list bl;
+  bl.append(*raw);
+
   try {
-    std::vector< std::pair<std::string, std::string> > redisObject = buildObject(attrs);
-      
-    if (redisObject.empty()) {
-      return -1;
-    }
-      
-    client.hmset(key, redisObject, [&result](cpp_redis::reply &reply) {
-      if (!reply.is_null()) {
-        result = reply.as_string();
-      }
-    });
+    auto iter = bl.cbegin();
+    decode(*meta, iter);
+  } catch (buffer::error& err) {
+    dout(0) << "RGW D4N Cache: Failed to decode metadata of " << oid << ": " << err.what() << dendl;
+    return -1;
+  }
 
-    client.sync_commit(std::chrono::milliseconds(1000));
+  return 0;
+}
 
-    if (result != "OK") {
-      return -1;
-    }
-  } catch(std::exception &e) {
+int RGWD4NCache::checkVersion(const std::string& oid, const std::string& version, optional_yield y) {
+  auto b = batch(oid);
+  b.add({"GET", buildVersionIndex(oid)});
+
+  if (b.exec(y) < 0) {
     return -1;
   }
 
+  if (!b.reply(0).is_string() || b.reply(0).as_string() != version) {
+    return -ESTALE;
+  }
+
   return 0;
 }
 
-int RGWD4NCache::getObject(std::string oid, 
-    rgw::sal::Attrs* newAttrs, 
-    std::vector< std::pair<std::string, std::string> >* newMetadata) 
-{
-  std::string result;
-  std::string key = "rgw-object:" + oid + ":cache";
-
-  if (!client.is_connected()) {
-    findClient(&client);
-  }
-
-  if (existKey(key)) {
-    int field_exist = -1;
-    
-    rgw::sal::Attrs::iterator it;
-    std::vector< std::pair<std::string, std::string> > redisObject;
-    std::vector<std::string> getFields;
-
-    /* Retrieve existing fields from cache */
-    try {
-      client.hgetall(key, [&getFields](cpp_redis::reply &reply) {
-	if (reply.is_array()) {
-	  auto arr = reply.as_array();
-
-	  if (!arr[0].is_null()) {
-	    for (long unsigned int i = 0; i < arr.size() - 1; i += 2) {
-	      getFields.push_back(arr[i].as_string());
-	    }
-	  }
-	}
-      });
-
-      client.sync_commit(std::chrono::milliseconds(1000));
-    } catch(std::exception &e) {
-      return -1;
+int RGWD4NCache::modifyObject(const std::string& oid, bool create,
+                              const std::function<int(RGWD4NObjectMeta&)>& update, optional_yield y) {
+  for (int i = 0; i < casRetries; ++i) {
+    RGWD4NObjectMeta meta;
+    std::string raw;
+    std::string version;
+    int ret = readObject(oid, &meta, &raw, &version, y);
+
+    if (ret == -2 && !create) {
+      dout(20) << "RGW D4N Cache: Object is not in cache." << dendl;
+      return -2;
+    } else if (ret < 0 && ret != -2) {
+      return ret;
     }
 
-    /* Only data exists */
-    if (getFields.size() == 1 && getFields[0] == "data")
-      return 0;
+    ret = update(meta);
 
-    /* Ensure all metadata, attributes, and data has been set */
-    for (const auto& field : baseFields) { 
-      auto it = std::find_if(getFields.begin(), getFields.end(),
-        [&](const auto& comp) { return comp == field; });
-
-      if (it != getFields.end()) {
-	int index = std::distance(getFields.begin(), it);
-	getFields.erase(getFields.begin() + index);
-      } else {
-        return -1;
-      }
+    if (ret < 0) {
+      return ret;
     }
 
-    /* Get attributes from cache */
-    try {
-      client.hmget(key, getFields, [&field_exist, &newAttrs, &getFields](cpp_redis::reply &reply) {
-        if (reply.is_array()) {
-	  auto arr = reply.as_array();
-
-	  if (!arr[0].is_null()) {
-	    field_exist = 0;
-
-            for (long unsigned int i = 0; i < getFields.size(); ++i) {
-	      std::string tmp = arr[i].as_string();
-              buffer::list bl;
-	      bl.append(tmp);
-	      newAttrs->insert({getFields[i], bl});
-            }
-	  }
-	}
-      });
-
-      client.sync_commit(std::chrono::milliseconds(1000));
-    } catch(std::exception &e) {
+    buffer::list bl;
+    encode(meta, bl);
+    version = newVersion();
+
+    auto b = batch(oid);
+    b.add({"EVAL", casObjectScript, "2", buildIndex(oid), buildVersionIndex(oid),
+           raw, bl.to_str(), version});
+
+    if (b.exec(y) < 0 || !b.reply(0).is_integer()) {
+      invalidateLocal(oid);
       return -1;
     }
-    
-    if (field_exist == 0) {
-      field_exist = -1;
-
-      getFields.clear();
-      getFields.insert(getFields.begin(), baseFields.begin(), baseFields.end());
-      getFields.pop_back(); /* Do not query for data field */
-
-      /* Get metadata from cache */
-      try {
-	client.hmget(key, getFields, [&field_exist, &newMetadata, &getFields](cpp_redis::reply &reply) {
-	  if (reply.is_array()) {
-	    auto arr = reply.as_array();
-
-	    if (!arr[0].is_null()) {
-	      field_exist = 0;
-
-	      for (long unsigned int i = 0; i < getFields.size(); ++i) {
-		newMetadata->push_back({getFields[i], arr[i].as_string()});
-	      }
-	    }
-	  }
-	});
-
-	client.sync_commit(std::chrono::milliseconds(1000));
-      } catch(std::exception &e) {
-	return -1;
+
+    if (b.reply(0).as_integer() > 0) {
+      if (meta_cache) {
+        meta_cache->put(oid, meta, version);
       }
-    } else {
-      return -1;
+
+      return ret;
+    } else if (b.reply(0).as_integer() < 0 && !create) {
+      /* Deleted since it was read */
+      return -2;
     }
-  } else {
-    dout(20) << "RGW D4N Cache: Object was not retrievable." << dendl;
-    return -2;
   }
 
-  return 0;
+  dout(20) << "RGW D4N Cache: Metadata of " << oid << " kept changing; update abandoned." << dendl;
+  return -1;
 }
 
-int RGWD4NCache::copyObject(std::string original_oid, std::string copy_oid, rgw::sal::Attrs* attrs) {
-  std::string result;
-  std::vector< std::pair<std::string, std::string> > redisObject;
-  std::string key = "rgw-object:" + original_oid + ":cache";
+int RGWD4NCache::setObject(std::string oid, const RGWD4NObjectMeta& meta, optional_yield y) {
+  buffer::list bl;
+  encode(meta, bl);
+  std::string version = newVersion();
 
-  if (!client.is_connected()) {
-    findClient(&client);
+  auto b = batch(oid);
+  b.add({"MSET", buildIndex(oid), bl.to_str(), buildVersionIndex(oid), version});
+
+  if (b.exec(y) < 0 || b.reply(0).is_error()) {
+    invalidateLocal(oid);
+    return -1;
   }
 
-  /* Read values from cache */
-  if (existKey(key)) {
-    try {
-      client.hgetall(key, [&redisObject](cpp_redis::reply &reply) {
-        if (reply.is_array()) {
-	  auto arr = reply.as_array();
+  if (meta_cache) {
+    meta_cache->put(oid, meta, version);
+  }
 
-	  if (!arr[0].is_null()) {
-            for (long unsigned int i = 0; i < arr.size() - 1; i += 2) {
-	      redisObject.push_back({arr[i].as_string(), arr[i + 1].as_string()});
-	    }
-	  }
-	}
-      });
+  return 0;
+}
 
-      client.sync_commit(std::chrono::milliseconds(1000));
-    } catch(std::exception &e) {
-      return -1;
+int RGWD4NCache::getObject(std::string oid, RGWD4NObjectMeta* meta, optional_yield y) {
+  RGWD4NMetaCache::Entry entry;
+  bool found = false;
+
+  if (meta_cache && meta_cache->get(oid, &entry)) {
+    bool trusted;
+    {
+      std::lock_guard l{trusted_lock};
+      trusted = meta_trusted && meta_trusted();
     }
-  } else {
-    return -2; 
-  }
-
-  /* Build copy with updated values */
-  if (!redisObject.empty()) {
-    rgw::sal::Attrs::iterator attr;
-    
-    for (attr = attrs->begin(); attr != attrs->end(); ++attr) {
-      auto it = std::find_if(redisObject.begin(), redisObject.end(),
-        [&](const auto& pair) { return pair.first == attr->first; });
-
-      if (it != redisObject.end()) {
-	int index = std::distance(redisObject.begin(), it);
-	redisObject[index] = {attr->first, attr->second.to_str()};
-      } else {
-	redisObject.push_back(std::make_pair(attr->first, attr->second.to_str()));
+
+    if (trusted && ceph::mono_clock::now() - entry.validated < meta_ttl) {
+      found = true;
+    } else if (int ret = checkVersion(oid, entry.version, y); ret == 0) {
+      meta_cache->validated(oid);
+      found = true;
+    } else {
+      meta_cache->erase(oid);
+
+      /* The change was not announced, or not yet */
+      if (ret == -ESTALE) {
+        std::function<void(const std::string&)> changed;
+        {
+          std::lock_guard l{trusted_lock};
+          changed = meta_changed;
+        }
+
+        if (changed) {
+          changed(oid);
+        }
       }
     }
-  } else {
-    return -1;
   }
 
-  /* Set copy with new values */
-  key = "rgw-object:" + copy_oid + ":cache";
+  if (found) {
+    dout(20) << "RGW D4N Cache: Metadata of " << oid << " found in process." << dendl;
+    *meta = std::move(entry.meta);
 
-  try {
-    client.hmset(key, redisObject, [&result](cpp_redis::reply &reply) {
-      if (!reply.is_null()) {
-        result = reply.as_string();
+    if (d4n_perfcounter) {
+      d4n_perfcounter->inc(l_d4n_meta_l1_hit);
+    }
+  } else {
+    std::string raw;
+    std::string version;
+    int ret = readObject(oid, meta, &raw, &version, y);
+
+    if (ret == -2) {
+      dout(20) << "RGW D4N Cache: Object was not retrievable." << dendl;
+
+      if (d4n_perfcounter) {
+        d4n_perfcounter->inc(l_d4n_meta_miss);
       }
-    });
 
-    client.sync_commit(std::chrono::milliseconds(1000));
+      return -2;
+    } else if (ret < 0) {
+      return ret;
+    }
 
-    if (result != "OK") {
-      return -1;
+    if (d4n_perfcounter) {
+      d4n_perfcounter->inc(l_d4n_meta_l2_hit);
+    }
+
+    if (meta_cache && !version.empty()) {
+      meta_cache->put(oid, *meta, version);
     }
-  } catch(std::exception &e) {
+  }
+
+  /* Ensure all metadata, attributes, and data has been set */
+  if (!meta->has_metadata || meta->block_size == 0) {
     return -1;
   }
-   
+
   return 0;
 }
 
-int RGWD4NCache::delObject(std::string oid) {
-  int result = 0;
-  std::vector<std::string> keys;
-  std::string key = "rgw-object:" + oid + ":cache";
-  keys.push_back(key);
+int RGWD4NCache::copyObject(std::string original_oid, std::string copy_oid, const ceph::real_time& mtime,
+                            const std::string* version_id, rgw::sal::Attrs* attrs, optional_yield y) {
+  RGWD4NObjectMeta meta;
+  std::string raw;
+  std::string version;
+  int ret = readObject(original_oid, &meta, &raw, &version, y);
 
-  if (!client.is_connected()) {
-    findClient(&client);
+  if (ret < 0) {
+    return ret;
   }
 
-  if (existKey(key)) {
-    try {
-      client.del(keys, [&result](cpp_redis::reply &reply) {
-	if (reply.is_integer()) {
-	  result = reply.as_integer();
-	}
-      });
+  /* Data blocks are not copied, so neither are the fields describing them,
+   * and the copy is not one of the objects waiting to be written back */
+  meta.clear_data();
+  meta.dirty_gen = 0;
+  meta.mtime = mtime;
 
-      client.sync_commit(std::chrono::milliseconds(1000));
-      
-      return result - 1;
-    } catch(std::exception &e) {
-      return -1;
-    }
-  } else {
-    dout(20) << "RGW D4N Cache: Object is not in cache." << dendl;
-    return -2;
+  if (version_id) {
+    meta.version_id = *version_id;
   }
+
+  for (const auto& attr : *attrs) {
+    meta.attrs[attr.first] = attr.second;
+  }
+
+  return setObject(copy_oid, meta, y);
 }
 
-int RGWD4NCache::updateAttr(std::string oid, rgw::sal::Attrs* attr) {
-  std::string result;
-  std::string key = "rgw-object:" + oid + ":cache";
+int RGWD4NCache::delObject(std::string oid, optional_yield y) {
+  std::string key = buildIndex(oid);
 
-  if (!client.is_connected()) {
-    findClient(&client);
+  invalidateLocal(oid);
+
+  if (store->delBlocks(oid, y) < 0) {
+    return -1;
   }
-  
-  if (existKey(key)) { 
-    try {
-      std::vector< std::pair<std::string, std::string> > redisObject;
-      auto it = attr->begin();
-      redisObject.push_back({it->first, it->second.to_str()});
 
-      client.hmset(key, redisObject, [&result](cpp_redis::reply &reply) {
-	if (!reply.is_null()) {
-	  result = reply.as_string();
-	}
-      });
+  auto b = batch(oid);
+  b.add({"DEL", key, buildVersionIndex(oid)});
 
-      client.sync_commit(std::chrono::milliseconds(1000));
+  if (b.exec(y) < 0 || !b.reply(0).is_integer()) {
+    return -1;
+  }
 
-      if (result != "OK") {
-	return -1;
-      }
-    } catch(std::exception &e) {
-      return -1;
-    }
-  } else {
+  if (b.reply(0).as_integer() == 0) {
+    dout(20) << "RGW D4N Cache: Object is not in cache." << dendl;
     return -2;
   }
 
   return 0;
 }
 
-int RGWD4NCache::delAttrs(std::string oid, std::vector<std::string>& baseFields, std::vector<std::string>& deleteFields) {
-  int result = 0;
-  std::string key = "rgw-object:" + oid + ":cache";
-
-  if (!client.is_connected()) {
-    findClient(&client);
+int RGWD4NCache::setAttrs(std::string oid, rgw::sal::Attrs* attrs, optional_yield y) {
+  if (attrs->empty()) {
+    return -1;
   }
 
-  if (existKey(key)) {
-    /* Find if attribute doesn't exist */
-    for (const auto& delField : deleteFields) {
-      if (std::find(baseFields.begin(), baseFields.end(), delField) == baseFields.end()) {
-        deleteFields.erase(std::find(deleteFields.begin(), deleteFields.end(), delField));
-      }
+  return modifyObject(oid, true, [attrs](RGWD4NObjectMeta& meta) {
+    for (const auto& attr : *attrs) {
+      meta.attrs[attr.first] = attr.second;
     }
 
-    try {
-      client.hdel(key, deleteFields, [&result](cpp_redis::reply &reply) {
-	if (reply.is_integer()) {
-	  result = reply.as_integer();
-	}
-      });
-
-      client.sync_commit(std::chrono::milliseconds(1000));
-      
-      return result - 1;
-    } catch(std::exception &e) {
-      return -1;
+    return 0;
+  }, y);
+}
+
+int RGWD4NCache::updateAttr(std::string oid, rgw::sal::Attrs* attr, optional_yield y) {
+  auto it = attr->begin();
+
+  return modifyObject(oid, false, [it](RGWD4NObjectMeta& meta) {
+    meta.attrs[it->first] = it->second;
+    return 0;
+  }, y);
+}
+
+int RGWD4NCache::delAttrs(std::string oid, std::vector<std::string>& baseFields, std::vector<std::string>& deleteFields, optional_yield y) {
+  /* Find if attribute doesn't exist */
+  deleteFields.erase(std::remove_if(deleteFields.begin(), deleteFields.end(),
+    [&baseFields](const std::string& delField) {
+      return std::find(baseFields.begin(), baseFields.end(), delField) == baseFields.end();
+    }), deleteFields.end());
+
+  return modifyObject(oid, false, [&deleteFields](RGWD4NObjectMeta& meta) {
+    int removed = 0;
+
+    for (const auto& field : deleteFields) {
+      removed += meta.attrs.erase(field);
     }
-  } 
-  
-  dout(20) << "RGW D4N Cache: Object is not in cache." << dendl;
-  return -2;
+
+    return removed;
+  }, y);
 }
 
-int RGWD4NCache::appendData(std::string oid, buffer::list& data) {
-  std::string result;
-  std::string value = "";
-  std::string key = "rgw-object:" + oid + ":cache";
+int RGWD4NCache::clearDirty(std::string oid, uint64_t gen, optional_yield y) {
+  int ret = modifyObject(oid, false, [gen](RGWD4NObjectMeta& meta) {
+    if (meta.dirty_gen != gen) {
+      return -ECANCELED;
+    }
 
-  if (!client.is_connected()) {
-    findClient(&client);
+    meta.dirty_gen = 0;
+    return 0;
+  }, y);
+
+  return ret == -ECANCELED ? 0 : ret;
+}
+
+void RGWD4NCache::initCompression() {
+  if (cct->_conf->rgw_d4n_compression == "none") {
+    return;
   }
 
-  if (existKey(key)) {
-    try {
-      client.hget(key, "data", [&value](cpp_redis::reply &reply) {
-	if (!reply.is_null()) {
-	  value = reply.as_string();
-	}
-      });
+  compressor = Compressor::create(cct, cct->_conf->rgw_d4n_compression);
+  compression_ratio = cct->_conf->rgw_d4n_compression_required_ratio;
 
-      client.sync_commit(std::chrono::milliseconds(1000));
-    } catch(std::exception &e) {
-      return -1;
-    }
+  if (!compressor) {
+    dout(0) << "ERROR: RGW D4N Cache: Cannot load compressor of type "
+            << cct->_conf->rgw_d4n_compression << "; caching blocks uncompressed" << dendl;
   }
+}
 
-  try {
-    /* Append to existing value or set as new value */
-    std::string temp = value + data.to_str();
-    std::vector< std::pair<std::string, std::string> > field;
-    field.push_back({"data", temp});
-
-    client.hmset(key, field, [&result](cpp_redis::reply &reply) {
-      if (!reply.is_null()) {
-        result = reply.as_string();
+int RGWD4NCache::putBlock(std::string oid, uint64_t offset, buffer::list& data, optional_yield y,
+                          bool compress, RGWD4NStoredBlock* stored, bool sync) {
+  if (compressor && compress) {
+    bufferlist out;
+    RGWD4NBlockHeader header;
+    header.compression = compressor->get_type_name();
+    header.size = data.length();
+
+    if (compressor->compress(data, out, header.compressor_message) == 0) {
+      bufferlist bl;
+      encode(header, bl);
+      bl.claim_append(out);
+
+      if (bl.length() <= data.length() * compression_ratio) {
+        if (d4n_perfcounter) {
+          d4n_perfcounter->inc(l_d4n_comp_in_b, data.length());
+          d4n_perfcounter->inc(l_d4n_comp_out_b, bl.length());
+        }
+
+        if (stored) {
+          stored->compression = header.compression;
+          stored->size = bl.length();
+        }
+
+        return store->putBlock(oid, offset, bl, true, sync, y);
       }
-    });
+    }
 
-    client.sync_commit(std::chrono::milliseconds(1000));
+    dout(20) << "RGW D4N Cache: Block " << offset << " of " << oid << " does not compress well; "
+             << "storing it uncompressed" << dendl;
 
-    if (result != "OK") {
-      return -1;
+    if (d4n_perfcounter) {
+      d4n_perfcounter->inc(l_d4n_comp_skip);
     }
-  } catch(std::exception &e) {
-    return -1;
   }
 
-  return 0;
+  if (stored) {
+    stored->compression.clear();
+    stored->size = data.length();
+  }
+
+  return store->putBlock(oid, offset, data, false, sync, y);
 }
 
-int RGWD4NCache::deleteData(std::string oid) {
-  int result = 0;
-  std::string key = "rgw-object:" + oid + ":cache";
-  std::vector<std::string> deleteField;
-  deleteField.push_back("data");
+int RGWD4NCache::decompressBlock(const std::string& oid, uint64_t offset, buffer::list& bl) {
+  RGWD4NBlockHeader header;
+  auto iter = bl.cbegin();
 
-  if (!client.is_connected()) {
-    findClient(&client);
+  try {
+    decode(header, iter);
+  } catch (buffer::error& err) {
+    dout(0) << "RGW D4N Cache: Failed to decode header of block " << offset << " of " << oid << dendl;
+    return -1;
   }
 
-  if (existKey(key)) {
-    int field_exist = -1;
+  CompressorRef c;
 
-    try {
-      client.hget(key, "data", [&field_exist](cpp_redis::reply &reply) {
-	if (!reply.is_null()) {
-	  field_exist = 0;
-	}
-      });
+  {
+    std::lock_guard l{decompressors_lock};
+    auto& d = decompressors[header.compression];
 
-      client.sync_commit(std::chrono::milliseconds(1000));
-    } catch(std::exception &e) {
-      return -1;
+    if (!d) {
+      d = Compressor::create(cct, header.compression);
     }
 
-    if (field_exist == 0) {
-      try {
-	client.hdel(key, deleteField, [&result](cpp_redis::reply &reply) {
-	  if (reply.is_integer()) {
-	    result = reply.as_integer(); /* Returns 1 upon success */
-	  }
-	});
+    c = d;
+  }
 
-	client.sync_commit(std::chrono::milliseconds(1000));
+  if (!c) {
+    dout(0) << "RGW D4N Cache: Cannot load compressor of type " << header.compression << " to read block "
+            << offset << " of " << oid << dendl;
+    return -1;
+  }
 
-        return result - 1;
-      } catch(std::exception &e) {
-	return -1;
-      }
-    } else {
-      return -1;
+  bufferlist out;
+
+  if (c->decompress(iter, bl.length() - iter.get_off(), out, header.compressor_message) < 0 ||
+      out.length() != header.size) {
+    dout(0) << "RGW D4N Cache: Failed to decompress block " << offset << " of " << oid << dendl;
+    return -1;
+  }
+
+  bl = std::move(out);
+  return 0;
+}
+
+int RGWD4NCache::getBlocks(std::string oid, const std::vector<uint64_t>& offsets, std::vector<buffer::list>* data, optional_yield y) {
+  std::vector<bool> compressed;
+
+  if (store->getBlocks(oid, offsets, data, &compressed, y) < 0) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < offsets.size(); ++i) {
+    if (compressed[i] && decompressBlock(oid, offsets[i], (*data)[i]) < 0) {
+      (*data)[i].clear();
     }
-  } else {
-    return 0; /* No delete was necessary */
   }
+
+  return 0;
+}
+
+int RGWD4NCache::delBlock(std::string oid, uint64_t offset, optional_yield y) {
+  return store->delBlock(oid, offset, y);
+}
+
+int RGWD4NCache::deleteData(std::string oid, optional_yield y) {
+  if (store->delBlocks(oid, y) < 0) {
+    return -1;
+  }
+
+  int ret = modifyObject(oid, false, [](RGWD4NObjectMeta& meta) {
+    meta.clear_data();
+    return 0;
+  }, y);
+
+  return ret == -2 ? 0 : ret;
 }
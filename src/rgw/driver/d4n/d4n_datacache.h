@@ -2,39 +2,309 @@
 #define CEPH_RGWD4NCACHE_H
 
 #include "rgw_common.h"
+#include "d4n_redis.h"
+#include "d4n_blockstore.h"
+#include "common/ceph_time.h"
+#include "compressor/Compressor.h"
 #include <cpp_redis/cpp_redis>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <unordered_map>
 #include <iostream>
 
+/* Cached metadata of an object, stored as a single encoded value under the
+ * object's index so that a lookup is one GET */
+struct RGWD4NObjectMeta {
+  /* Set once the writer has recorded the object's metadata; entries created
+   * by attribute updates alone only hold attrs */
+  bool has_metadata = false;
+  ceph::real_time mtime;
+  uint64_t object_size = 0;
+  uint64_t accounted_size = 0;
+  uint64_t epoch = 0;
+  std::string version_id;
+  uint32_t source_zone_short_id = 0;
+  uint64_t bucket_count = 0;
+  uint64_t bucket_size = 0;
+  int64_t user_quota_max_size = -1;
+  int64_t user_quota_max_objects = -1;
+  int32_t max_buckets = 0;
+  /* Set once all of the object's data blocks have been written */
+  uint64_t data_size = 0;
+  uint64_t block_size = 0;
+  rgw::sal::Attrs attrs;
+  /* Generation of the dirty log entry of an object acknowledged in
+   * write-back mode and not yet written to the backing store, or zero */
+  uint64_t dirty_gen = 0;
+
+  void clear_data() {
+    data_size = 0;
+    block_size = 0;
+  }
+
+  void encode(bufferlist& bl) const {
+    ENCODE_START(1, 1, bl);
+    encode(has_metadata, bl);
+    encode(mtime, bl);
+    encode(object_size, bl);
+    encode(accounted_size, bl);
+    encode(epoch, bl);
+    encode(version_id, bl);
+    encode(source_zone_short_id, bl);
+    encode(bucket_count, bl);
+    encode(bucket_size, bl);
+    encode(user_quota_max_size, bl);
+    encode(user_quota_max_objects, bl);
+    encode(max_buckets, bl);
+    encode(data_size, bl);
+    encode(block_size, bl);
+    encode(attrs, bl);
+    encode(dirty_gen, bl);
+    ENCODE_FINISH(bl);
+  }
+
+  void decode(bufferlist::const_iterator& bl) {
+    DECODE_START(1, bl);
+    decode(has_metadata, bl);
+    decode(mtime, bl);
+    decode(object_size, bl);
+    decode(accounted_size, bl);
+    decode(epoch, bl);
+    decode(version_id, bl);
+    decode(source_zone_short_id, bl);
+    decode(bucket_count, bl);
+    decode(bucket_size, bl);
+    decode(user_quota_max_size, bl);
+    decode(user_quota_max_objects, bl);
+    decode(max_buckets, bl);
+    decode(data_size, bl);
+    decode(block_size, bl);
+    decode(attrs, bl);
+    decode(dirty_gen, bl);
+    DECODE_FINISH(bl);
+  }
+};
+WRITE_CLASS_ENCODER(RGWD4NObjectMeta)
+
+/* In-process copy of recently used object metadata, kept in front of the
+ * copy in redis. Each entry carries the version token its metadata was
+ * stored with in redis and the time it was last known to be current. The
+ * entries are spread over shards by oid, each with its own lock and its
+ * own least recently used list, and are bounded in number. */
+class RGWD4NMetaCache {
+  public:
+    struct Entry {
+      RGWD4NObjectMeta meta;
+      std::string version;
+      ceph::mono_time validated;
+    };
+
+    RGWD4NMetaCache(size_t capacity, size_t num_shards);
+
+    bool get(const std::string& oid, Entry* entry);
+    void put(const std::string& oid, const RGWD4NObjectMeta& meta, const std::string& version);
+    /* Records that the entry was found to be current */
+    void validated(const std::string& oid);
+    void erase(const std::string& oid);
+    /* Has every entry checked against redis on its next use */
+    void unvalidate();
+
+  private:
+    struct Shard {
+      std::mutex lock;
+      std::unordered_map<std::string, std::pair<Entry, std::list<std::string>::iterator>> entries;
+      std::list<std::string> lru; /* Most recently used first */
+    };
+
+    size_t shard_capacity;
+    std::vector<Shard> shards;
+
+    Shard& shard(const std::string& oid) {
+      return shards[std::hash<std::string>{}(oid) % shards.size()];
+    }
+};
+
+/* Precedes the data of a block stored compressed, so that gateways with
+ * other compression settings can still read it */
+struct RGWD4NBlockHeader {
+  std::string compression; /* Name of the compressor plugin */
+  uint64_t size = 0; /* Of the block before compression */
+  std::optional<int32_t> compressor_message;
+
+  void encode(bufferlist& bl) const {
+    ENCODE_START(1, 1, bl);
+    encode(compression, bl);
+    encode(size, bl);
+    encode(compressor_message, bl);
+    ENCODE_FINISH(bl);
+  }
+
+  void decode(bufferlist::const_iterator& bl) {
+    DECODE_START(1, bl);
+    decode(compression, bl);
+    decode(size, bl);
+    decode(compressor_message, bl);
+    DECODE_FINISH(bl);
+  }
+};
+WRITE_CLASS_ENCODER(RGWD4NBlockHeader)
+
+/* How putBlock() stored a block */
+struct RGWD4NStoredBlock {
+  std::string compression; /* Empty if the block is stored as is */
+  uint64_t size = 0; /* Bytes the block takes in the cache */
+};
+
 class RGWD4NCache {
   public:
     CephContext *cct;
 
-    RGWD4NCache() {}
-    RGWD4NCache(std::string cacheHost, int cachePort):host(cacheHost), port(cachePort) {}
+    RGWD4NCache() {
+      cluster = std::make_unique<RGWD4NRedisCluster>(std::vector<RGWD4NRedisCluster::Endpoint>{}, pool_size, 1);
+      store = std::make_unique<RGWD4NRedisBlockStore>(cluster.get(), timeout);
+    }
+    RGWD4NCache(std::string cacheHost, int cachePort):host(cacheHost), port(cachePort) {
+      cluster = std::make_unique<RGWD4NRedisCluster>(std::vector<RGWD4NRedisCluster::Endpoint>{{host, port}}, pool_size, 1);
+      store = std::make_unique<RGWD4NRedisBlockStore>(cluster.get(), timeout);
+    }
 
     void init(CephContext *_cct) {
       cct = _cct;
       host = cct->_conf->rgw_d4n_host;
       port = cct->_conf->rgw_d4n_port;
+      pool_size = cct->_conf->rgw_d4n_redis_pool_size;
+      timeout = std::chrono::milliseconds(cct->_conf->rgw_d4n_redis_timeout_ms);
+      block_size = cct->_conf->rgw_max_chunk_size;
+      cluster = RGWD4NRedisCluster::create(cct);
+      store = std::make_unique<RGWD4NRedisBlockStore>(cluster.get(), timeout);
+      capacity = cct->_conf->rgw_d4n_redis_cache_size;
+      meta_ttl = std::chrono::milliseconds(cct->_conf->rgw_d4n_meta_cache_ttl_ms);
+
+      if (cct->_conf->rgw_d4n_meta_cache_size > 0) {
+        meta_cache = std::make_unique<RGWD4NMetaCache>(cct->_conf->rgw_d4n_meta_cache_size,
+                                                       cct->_conf->rgw_d4n_meta_cache_shards);
+      }
+
+      initCompression();
+
+      if (cct->_conf->rgw_d4n_data_store == "local") {
+        auto local = std::make_unique<RGWD4NLocalBlockStore>(cct->_conf->rgw_d4n_l1_datacache_persistent_path);
+        /* Objects not yet written back are only held in the cache */
+        bool evict = cct->_conf->rgw_d4n_l1_evict_cache_on_start && !cct->_conf->rgw_d4n_write_back;
+
+        if (local->init(evict) == 0) {
+          store = std::move(local);
+          capacity = cct->_conf->rgw_d4n_l1_datacache_size;
+        }
+      }
     }
 
-    int findClient(cpp_redis::client *client);
-    int existKey(std::string key);
-    int setObject(std::string oid, rgw::sal::Attrs* attrs);
-    int getObject(std::string oid, rgw::sal::Attrs* newAttrs, std::vector< std::pair<std::string, std::string> >* newMetadata);
-    int copyObject(std::string original_oid, std::string copy_oid, rgw::sal::Attrs* attrs);
-    int delObject(std::string oid);
-    int updateAttr(std::string oid, rgw::sal::Attrs* attr);
-    int delAttrs(std::string oid, std::vector<std::string>& baseFields, std::vector<std::string>& deleteFields);
-    int appendData(std::string oid, buffer::list& data);
-    int deleteData(std::string oid);
+    int existKey(std::string key, optional_yield y);
+    /* Replaces the object's cached metadata */
+    int setObject(std::string oid, const RGWD4NObjectMeta& meta, optional_yield y);
+    /* Fails unless both the metadata and the data blocks have been cached */
+    int getObject(std::string oid, RGWD4NObjectMeta* meta, optional_yield y);
+    /* Caches the metadata of the original object under copy_oid with the
+     * given mtime and version, merging attrs into its attributes */
+    int copyObject(std::string original_oid, std::string copy_oid, const ceph::real_time& mtime,
+                   const std::string* version_id, rgw::sal::Attrs* attrs, optional_yield y);
+    int delObject(std::string oid, optional_yield y);
+    /* Adds or replaces attributes, caching them even if the object isn't */
+    int setAttrs(std::string oid, rgw::sal::Attrs* attrs, optional_yield y);
+    int updateAttr(std::string oid, rgw::sal::Attrs* attr, optional_yield y);
+    int delAttrs(std::string oid, std::vector<std::string>& baseFields, std::vector<std::string>& deleteFields, optional_yield y);
+    /* Marks the object as written back unless it was written again since
+     * the dirty log entry of generation gen */
+    int clearDirty(std::string oid, uint64_t gen, optional_yield y);
+    /* Compresses the block if rgw_d4n_compression is set, compress is true
+     * and compression saves enough space. stored, if set, tells how the
+     * block was stored. sync waits for the block to be durable. */
+    int putBlock(std::string oid, uint64_t offset, buffer::list& data, optional_yield y,
+                 bool compress = true, RGWD4NStoredBlock* stored = nullptr, bool sync = false);
+    /* Blocks are returned uncompressed; those that can't be decompressed
+     * are returned empty, as if they were not cached */
+    int getBlocks(std::string oid, const std::vector<uint64_t>& offsets, std::vector<buffer::list>* data, optional_yield y);
+    int delBlock(std::string oid, uint64_t offset, optional_yield y);
+    int deleteData(std::string oid, optional_yield y);
+    /* Lists the blocks the tier already held when the gateway started */
+    int listBlocks(const std::function<void(const std::string& oid, uint64_t offset, uint64_t size)>& f) {
+      return store->listBlocks(f);
+    }
+
+    /* Object data is cached as separate blocks of block_size bytes, each
+     * written once at its offset within the object */
+    uint64_t get_block_size() { return block_size; }
+    /* Bytes of block data this gateway may keep in the configured tier */
+    uint64_t get_capacity() { return capacity; }
+    /* Whether other gateways read the blocks this one caches */
+    bool blocks_shared() { return store->is_shared(); }
+    RGWD4NRedisCluster* get_cluster() { return cluster.get(); }
+    /* trusted returns true while this gateway is told of every change other
+     * gateways make. Metadata held in process is then used without asking
+     * redis whether it is current, until it is older than
+     * rgw_d4n_meta_cache_ttl_ms. */
+    void set_meta_trusted(std::function<bool()> trusted) {
+      std::lock_guard l{trusted_lock};
+      meta_trusted = std::move(trusted);
+    }
+    /* changed is called with the oid of each object whose metadata held
+     * in process turns out to have been changed by another gateway */
+    void set_meta_changed(std::function<void(const std::string&)> changed) {
+      std::lock_guard l{trusted_lock};
+      meta_changed = std::move(changed);
+    }
+    /* Drops metadata held in process for the object. With an empty oid the
+     * metadata of every object is instead checked on its next use. */
+    void invalidateLocal(const std::string& oid);
+    /* Returns 0 if the metadata held in process for the object is still
+     * current, and -2 if none is held. Stale metadata is dropped. */
+    int revalidate(const std::string& oid, optional_yield y);
+    std::chrono::milliseconds get_timeout() { return timeout; }
 
   private:
-    cpp_redis::client client;
+    std::unique_ptr<RGWD4NRedisCluster> cluster;
+    std::unique_ptr<RGWD4NBlockStore> store;
     std::string host = "";
     int port = 0;
-    std::vector< std::pair<std::string, std::string> > buildObject(rgw::sal::Attrs* binary);
+    size_t pool_size = 64;
+    std::chrono::milliseconds timeout{1000};
+    uint64_t block_size = 4 * 1024 * 1024;
+    uint64_t capacity = 1024 * 1024 * 1024;
+    std::unique_ptr<RGWD4NMetaCache> meta_cache; /* Unset if disabled */
+    CompressorRef compressor; /* Unset if disabled */
+    double compression_ratio = 1.0;
+    /* Compressors of the blocks read, which may have been written by
+     * gateways with other settings */
+    std::mutex decompressors_lock;
+    std::map<std::string, CompressorRef> decompressors;
+    std::mutex trusted_lock;
+    std::function<bool()> meta_trusted;
+    std::function<void(const std::string&)> meta_changed;
+    std::chrono::milliseconds meta_ttl{0};
+    /* All keys of an object are placed on the endpoint its oid hashes to */
+    RGWD4NRedisBatch batch(const std::string& oid) { return RGWD4NRedisBatch(cluster->get(oid), timeout); }
+    /* Reads the metadata along with the version token it was stored with */
+    int readObject(const std::string& oid, RGWD4NObjectMeta* meta, std::string* raw,
+                   std::string* version, optional_yield y);
+    /* Returns 0 if the metadata in redis still has the given version */
+    int checkVersion(const std::string& oid, const std::string& version, optional_yield y);
+    /* Applies update to the cached metadata and writes it back only if no
+     * other gateway changed it in between, retrying otherwise. An update
+     * returning a negative value is abandoned with that value. */
+    int modifyObject(const std::string& oid, bool create,
+                     const std::function<int(RGWD4NObjectMeta&)>& update, optional_yield y);
+    std::string buildIndex(const std::string& oid) { return "rgw-object:" + oid + ":cache"; }
+    /* Changes along with the metadata; written in the same command */
+    std::string buildVersionIndex(const std::string& oid) { return "rgw-object:" + oid + ":version"; }
+    static std::string newVersion();
+    /* Loads the compressor named by rgw_d4n_compression */
+    void initCompression();
+    /* Returns the block held in bl before compression */
+    int decompressBlock(const std::string& oid, uint64_t offset, buffer::list& bl);
 };
 
 #endif
@@ -1,90 +1,129 @@
 #include "d4n_directory.h"
+#include <boost/algorithm/string.hpp>
 
 #define dout_subsys ceph_subsys_rgw
 #define dout_context g_ceph_context
 
-int RGWBlockDirectory::findClient(cpp_redis::client *client) {
-  if (client->is_connected())
-    return 0;
+/* Hosts are kept as a '_'-separated list; the scripts add or remove one
+ * host without racing against other gateways updating the same block */
+static const std::string addBlockHostScript =
+  "local hosts = redis.call('HGET', KEYS[1], 'hosts') "
+  "if not hosts or hosts == '' then hosts = ARGV[1] "
+  "elseif string.find('_' .. hosts .. '_', '_' .. ARGV[1] .. '_', 1, true) == nil then "
+  "  hosts = hosts .. '_' .. ARGV[1] end "
+  "redis.call('HSET', KEYS[1], 'hosts', hosts, 'size', ARGV[2], 'bucket_name', ARGV[3], "
+  "  'obj_name', ARGV[4], 'version', ARGV[5], 'block_id', ARGV[6], 'compression', ARGV[7]) "
+  "return redis.call('SADD', KEYS[2], KEYS[1])";
+
+static const std::string delBlockHostScript =
+  "local hosts = redis.call('HGET', KEYS[1], 'hosts') "
+  "if not hosts then return -1 end "
+  "local kept = {} "
+  "for h in string.gmatch(hosts, '[^_]+') do "
+  "  if h ~= ARGV[1] then table.insert(kept, h) end end "
+  "if #kept == 0 then "
+  "  redis.call('SREM', KEYS[2], KEYS[1]) "
+  "  return redis.call('DEL', KEYS[1]) end "
+  "return redis.call('HSET', KEYS[1], 'hosts', table.concat(kept, '_'))";
+
+static const std::string delValueScript =
+  "for _, blk in ipairs(redis.call('SMEMBERS', KEYS[2])) do "
+  "  redis.call('DEL', blk) end "
+  "redis.call('DEL', KEYS[2]) "
+  "return redis.call('DEL', KEYS[1])";
+
+std::string RGWBlockDirectory::buildIndex(const cache_block *ptr) {
+  return "rgw-object:" + ptr->c_obj.bucket_name + ":" + ptr->c_obj.obj_name + ":" +
+         ptr->c_obj.version + ":directory";
+}
 
-  if (host == "" || port == 0) {
-    dout(10) << "RGW D4N Directory: D4N directory endpoint was not configured correctly" << dendl;
-    return EDESTADDRREQ;
-  }
+std::string RGWBlockDirectory::buildBlockIndex(const cache_block *ptr) {
+  return "rgw-block:" + ptr->c_obj.bucket_name + ":" + ptr->c_obj.obj_name + ":" +
+         ptr->c_obj.version + ":" + std::to_string(ptr->block_id);
+}
 
-  client->connect(host, port, nullptr);
+int RGWBlockDirectory::existKey(std::string key, optional_yield y) {
+  int result = -1;
 
-  if (!client->is_connected())
-    return ECONNREFUSED;
+  /* The key does not name the object it belongs to, so every endpoint is asked */
+  for (const auto& pool : cluster->get_pools()) {
+    RGWD4NRedisBatch b(pool.get(), timeout);
+    b.add({"EXISTS", key});
 
-  return 0;
-}
+    if (b.exec(y) < 0 || !b.reply(0).is_integer()) {
+      continue;
+    }
 
-std::string RGWBlockDirectory::buildIndex(cache_block *ptr) {
-  return "rgw-object:" + ptr->c_obj.obj_name + ":directory";
-}
+    result = b.reply(0).as_integer(); /* Returns 1 upon success */
 
-int RGWBlockDirectory::existKey(std::string key) {
-  int result = -1;
-  std::vector<std::string> keys;
-  keys.push_back(key);
-  
-  if (!client.is_connected()) {
-    return result;
+    if (result > 0)
+      break;
   }
 
-  try {
-    client.exists(keys, [&result](cpp_redis::reply &reply) {
-      if (reply.is_integer()) {
-        result = reply.as_integer(); /* Returns 1 upon success */
-      }
-    });
-    
-    client.sync_commit(std::chrono::milliseconds(1000));
-  } catch(std::exception &e) {}
-
   return result;
 }
 
-int RGWBlockDirectory::setValue(cache_block *ptr) {
-  /* Creating the index based on obj_name */
+int RGWBlockDirectory::setValue(const cache_block *ptr, optional_yield y) {
+  /* Creating the index based on bucket, obj_name and version */
   std::string key = buildIndex(ptr);
-  if (!client.is_connected()) { 
-    findClient(&client);
-  }
-
-  std::string result;
-  std::vector<std::string> keys;
-  keys.push_back(key);
 
   /* Every set will be new */
   if (host == "" || port == 0) {
     dout(10) << "RGW D4N Directory: Directory endpoint not configured correctly" << dendl;
     return -1;
   }
-    
-  std::string endpoint = host + ":" + std::to_string(port);
-  std::vector<std::pair<std::string, std::string>> list;
-    
+
+  /* Entries without a location are recorded as cached by this gateway */
+  std::string endpoint;
+
+  if (ptr->hosts_list.empty()) {
+    endpoint = get_endpoint();
+  } else {
+    for (const auto& h : ptr->hosts_list) {
+      if (!endpoint.empty())
+        endpoint += "_";
+      endpoint += h;
+    }
+  }
+
   /* Creating a list of key's properties */
-  list.push_back(make_pair("key", key));
-  list.push_back(make_pair("size", std::to_string(ptr->size_in_bytes)));
-  list.push_back(make_pair("bucket_name", ptr->c_obj.bucket_name));
-  list.push_back(make_pair("obj_name", ptr->c_obj.obj_name));
-  list.push_back(make_pair("hosts", endpoint)); 
+  auto b = batch(ptr);
+  b.add({"HSET", key,
+         "key", key,
+         "size", std::to_string(ptr->size_in_bytes),
+         "bucket_name", ptr->c_obj.bucket_name,
+         "obj_name", ptr->c_obj.obj_name,
+         "hosts", endpoint});
+
+  if (b.exec(y) < 0 || !b.reply(0).is_integer()) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int RGWBlockDirectory::getValue(cache_block *ptr, optional_yield y) {
+  std::string key = buildIndex(ptr);
+  auto b = batch(ptr);
+  b.add({"HMGET", key, "key", "hosts", "size", "bucket_name", "obj_name"});
+
+  if (b.exec(y) < 0 || !b.reply(0).is_array()) {
+    return -1;
+  }
+
+  const auto& arr = b.reply(0).as_array();
+
+  if (arr.size() < 5 || arr[0].is_null()) {
+    dout(20) << "RGW D4N Directory: Block is not in directory." << dendl;
+    return -2;
+  }
 
   try {
-    client.hmset(key, list, [&result](cpp_redis::reply &reply) {
-      if (!reply.is_null()) {
-        result = reply.as_string();
-      }
-    });
-
-    client.sync_commit(std::chrono::milliseconds(1000));
-    
-    if (result != "OK") {
-      return -1;
-    }
+    ptr->hosts_list.clear();
+    boost::split(ptr->hosts_list, arr[1].as_string(), boost::is_any_of("_"));
+    ptr->size_in_bytes = std::stoull(arr[2].as_string());
+    ptr->c_obj.bucket_name = arr[3].as_string();
+    ptr->c_obj.obj_name = arr[4].as_string();
   } catch(std::exception &e) {
     return -1;
   }
@@ -92,88 +131,91 @@ int RGWBlockDirectory::setValue(cache_block *ptr) {
   return 0;
 }
 
-int RGWBlockDirectory::getValue(cache_block *ptr) {
+int RGWBlockDirectory::delValue(const cache_block *ptr, optional_yield y) {
   std::string key = buildIndex(ptr);
+  auto b = batch(ptr);
+  b.add({"EVAL", delValueScript, "2", key, buildBlockSetIndex(ptr)});
+
+  if (b.exec(y) < 0 || !b.reply(0).is_integer()) {
+    return -1;
+  }
 
-  if (!client.is_connected()) {
-    findClient(&client);
+  if (b.reply(0).as_integer() == 0) {
+    dout(20) << "RGW D4N Directory: Block is not in directory." << dendl;
+    return -2;
   }
 
-  if (existKey(key)) {
-    int field_exist = -1;
-    
-    std::string hosts;
-    std::string size;
-    std::string bucket_name;
-    std::string obj_name;
-    std::vector<std::string> fields;
+  return 0;
+}
 
-    fields.push_back("key");
-    fields.push_back("hosts");
-    fields.push_back("size");
-    fields.push_back("bucket_name");
-    fields.push_back("obj_name");
+int RGWBlockDirectory::addBlockHost(const cache_block *ptr, const std::string& blockHost, optional_yield y) {
+  auto b = batch(ptr);
+  b.add({"EVAL", addBlockHostScript, "2", buildBlockIndex(ptr), buildBlockSetIndex(ptr),
+         blockHost,
+         std::to_string(ptr->size_in_bytes),
+         ptr->c_obj.bucket_name,
+         ptr->c_obj.obj_name,
+         ptr->c_obj.version,
+         std::to_string(ptr->block_id),
+         ptr->compression});
+
+  if (b.exec(y) < 0 || !b.reply(0).is_integer()) {
+    return -1;
+  }
 
-    try {
-      client.hmget(key, fields, [&key, &hosts, &size, &bucket_name, &obj_name, &field_exist](cpp_redis::reply &reply) {
-        if (reply.is_array()) {
-	  auto arr = reply.as_array();
-
-	  if (!arr[0].is_null()) {
-	    field_exist = 0;
-	    key = arr[0].as_string();
-	    hosts = arr[1].as_string();
-	    size = arr[2].as_string();
-	    bucket_name = arr[3].as_string();
-	    obj_name = arr[4].as_string();
-	  }
-	}
-      });
-
-      client.sync_commit(std::chrono::milliseconds(1000));
-
-      if (field_exist < 0) {
-        return field_exist;
-      }
-
-      /* Currently, there can only be one host */
-      ptr->size_in_bytes = std::stoi(size);
-      ptr->c_obj.bucket_name = bucket_name;
-      ptr->c_obj.obj_name = obj_name;
-    } catch(std::exception &e) {
-      return -1;
-    }
+  return 0;
+}
+
+int RGWBlockDirectory::delBlockHost(const cache_block *ptr, const std::string& blockHost, optional_yield y) {
+  auto b = batch(ptr);
+  b.add({"EVAL", delBlockHostScript, "2", buildBlockIndex(ptr), buildBlockSetIndex(ptr), blockHost});
+
+  if (b.exec(y) < 0 || !b.reply(0).is_integer()) {
+    return -1;
+  }
+
+  if (b.reply(0).as_integer() < 0) {
+    dout(20) << "RGW D4N Directory: Block is not in directory." << dendl;
+    return -2;
   }
 
   return 0;
 }
 
-int RGWBlockDirectory::delValue(cache_block *ptr) {
-  int result = 0;
-  std::vector<std::string> keys;
-  std::string key = buildIndex(ptr);
-  keys.push_back(key);
-  
-  if (!client.is_connected()) {
-    findClient(&client);
+int RGWBlockDirectory::getBlockValues(std::vector<cache_block>* blocks, optional_yield y) {
+  if (blocks->empty()) {
+    return 0;
+  }
+
+  auto b = batch(&blocks->front());
+
+  for (const auto& blk : *blocks) {
+    b.add({"HMGET", buildBlockIndex(&blk), "hosts", "size", "compression"});
   }
-  
-  if (existKey(key)) {
+
+  if (b.exec(y) < 0) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < blocks->size(); ++i) {
+    auto& blk = (*blocks)[i];
+    blk.hosts_list.clear();
+
+    if (!b.reply(i).is_array() || b.reply(i).as_array().size() < 3 ||
+        !b.reply(i).as_array()[0].is_string()) {
+      continue;
+    }
+
+    const auto& arr = b.reply(i).as_array();
+
     try {
-      client.del(keys, [&result](cpp_redis::reply &reply) {
-        if (reply.is_integer()) {
-          result = reply.as_integer(); /* Returns 1 upon success */
-        }
-      });
-	
-      client.sync_commit(std::chrono::milliseconds(1000));	
-
-      return result - 1;
+      boost::split(blk.hosts_list, arr[0].as_string(), boost::is_any_of("_"), boost::token_compress_on);
+      blk.size_in_bytes = std::stoull(arr[1].as_string());
+      blk.compression = arr[2].is_string() ? arr[2].as_string() : "";
     } catch(std::exception &e) {
-      return -1;
+      blk.hosts_list.clear();
     }
-  } else {
-    dout(20) << "RGW D4N Directory: Block is not in directory." << dendl;
-    return -2;
   }
+
+  return 0;
 }
@@ -2,19 +2,25 @@
 #define CEPH_RGWD4NDIRECTORY_H
 
 #include "rgw_common.h"
+#include "d4n_redis.h"
 #include <cpp_redis/cpp_redis>
 #include <string>
 #include <iostream>
 
 struct cache_obj {
-  std::string bucket_name; /* s3 bucket name */
+  std::string bucket_name; /* s3 bucket name, prefixed by its tenant and '/' if it has one */
   std::string obj_name; /* s3 obj name */
+  std::string version; /* s3 obj instance, empty if unversioned */
 };
 
+/* Directory entries are built by each request for the object it operates
+ * on and are never shared between requests */
 struct cache_block {
   cache_obj c_obj;
-  uint64_t size_in_bytes; /* block size_in_bytes */
-  std::vector<std::string> hosts_list; /* Currently not supported: list of hostnames <ip:port> of block locations */
+  uint64_t block_id = 0; /* offset of the block within the object */
+  uint64_t size_in_bytes = 0; /* block size_in_bytes */
+  std::vector<std::string> hosts_list; /* list of hostnames <ip:port> of block locations */
+  std::string compression; /* compressor of the cached block, empty if uncompressed */
 };
 
 class RGWDirectory {
@@ -25,29 +31,58 @@ class RGWDirectory {
 
 class RGWBlockDirectory: RGWDirectory {
   public:
-    RGWBlockDirectory() {}
-    RGWBlockDirectory(std::string blockHost, int blockPort):host(blockHost), port(blockPort) {}
+    RGWBlockDirectory() {
+      cluster = std::make_unique<RGWD4NRedisCluster>(std::vector<RGWD4NRedisCluster::Endpoint>{}, pool_size, 1);
+    }
+    RGWBlockDirectory(std::string blockHost, int blockPort):host(blockHost), port(blockPort) {
+      cluster = std::make_unique<RGWD4NRedisCluster>(std::vector<RGWD4NRedisCluster::Endpoint>{{host, port}}, pool_size, 1);
+    }
     
     void init(CephContext *_cct) {
       cct = _cct;
       host = cct->_conf->rgw_d4n_host;
       port = cct->_conf->rgw_d4n_port;
+      pool_size = cct->_conf->rgw_d4n_redis_pool_size;
+      timeout = std::chrono::milliseconds(cct->_conf->rgw_d4n_redis_timeout_ms);
+      cluster = RGWD4NRedisCluster::create(cct);
     }
 	
-    int findClient(cpp_redis::client *client);
-    int existKey(std::string key);
-    int setValue(cache_block *ptr);
-    int getValue(cache_block *ptr);
-    int delValue(cache_block *ptr);
+    /* Safe to call concurrently once init() has returned; each call leases
+     * its own redis connection and only touches the entry passed to it */
+    int existKey(std::string key, optional_yield y);
+    int setValue(const cache_block *ptr, optional_yield y);
+    int getValue(cache_block *ptr, optional_yield y);
+    int delValue(const cache_block *ptr, optional_yield y);
 
-    std::string get_host() { return host; }
-    int get_port() { return port; }
+    /* Entries for individual blocks, keyed by bucket, object, version and
+     * block_id, list the gateways holding a copy of the block. They are
+     * removed together with the object's entry, which is keyed the same
+     * way, by delValue(). */
+    int addBlockHost(const cache_block *ptr, const std::string& blockHost, optional_yield y);
+    int delBlockHost(const cache_block *ptr, const std::string& blockHost, optional_yield y);
+    /* Blocks must belong to the same object; hosts_list is left empty for
+     * blocks without an entry */
+    int getBlockValues(std::vector<cache_block>* blocks, optional_yield y);
+
+    std::string get_host() const { return host; }
+    int get_port() const { return port; }
+    /* Location recorded for blocks cached by this gateway */
+    std::string get_endpoint() const { return host + ":" + std::to_string(port); }
 
   private:
-    cpp_redis::client client;
-    std::string buildIndex(cache_block *ptr);
+    std::unique_ptr<RGWD4NRedisCluster> cluster;
+    std::string buildIndex(const cache_block *ptr);
+    std::string buildBlockIndex(const cache_block *ptr);
+    std::string buildBlockSetIndex(const cache_block *ptr) { return buildIndex(ptr) + ":blocks"; }
     std::string host = "";
     int port = 0;
+    size_t pool_size = 64;
+    std::chrono::milliseconds timeout{1000};
+    /* Entries are placed on the same endpoint as the object's cache keys,
+     * which are hashed on the bucket and object name the same way */
+    RGWD4NRedisBatch batch(const cache_block *ptr) {
+      return RGWD4NRedisBatch(cluster->get(ptr->c_obj.bucket_name + "/" + ptr->c_obj.obj_name), timeout);
+    }
 };
 
 #endif
@@ -0,0 +1,133 @@
+#include "d4n_invalidation.h"
+
+#define dout_subsys ceph_subsys_rgw
+#define dout_context g_ceph_context
+
+const std::string RGWD4NInvalidator::channel = "rgw-d4n:invalidate";
+
+RGWD4NInvalidator::~RGWD4NInvalidator() {
+  for (auto& sub : subscribers) {
+    sub->disconnect(true);
+  }
+}
+
+int RGWD4NInvalidator::start() {
+  for (const auto& pool : cluster->get_pools()) {
+    auto sub = std::make_unique<cpp_redis::subscriber>();
+    auto dropped = std::make_shared<std::atomic<bool>>(false);
+
+    /* Notices published while the connection was down are lost; the
+     * subscription is restored along with the connection */
+    auto on_connect = [this, dropped](const std::string& host, std::size_t port,
+                                      cpp_redis::subscriber::connect_state status) {
+      if (status == cpp_redis::subscriber::connect_state::dropped) {
+        if (!dropped->exchange(true)) {
+          dout(5) << "RGW D4N Invalidator: Lost connection to " << host << ":" << port << dendl;
+          disconnected++;
+        }
+      } else if (status == cpp_redis::subscriber::connect_state::ok && dropped->exchange(false)) {
+        dout(5) << "RGW D4N Invalidator: Reconnected to " << host << ":" << port << dendl;
+        disconnected--;
+        missed();
+      }
+    };
+
+    try {
+      sub->connect(pool->get_host(), pool->get_port(), on_connect, timeout.count(), -1, timeout.count());
+      sub->subscribe(channel, [this](const std::string&, const std::string& message) {
+        received(message);
+      });
+      sub->commit();
+    } catch (std::exception& e) {
+      dout(0) << "RGW D4N Invalidator: Failed to subscribe to " << pool->get_host() << ":"
+              << pool->get_port() << ": " << e.what() << dendl;
+      return -ECONNREFUSED;
+    }
+
+    subscribers.push_back(std::move(sub));
+  }
+
+  create("d4n_invalidate");
+  started = true;
+  return 0;
+}
+
+void RGWD4NInvalidator::stop() {
+  {
+    std::lock_guard l{lock};
+    stopping = true;
+    cond.notify_all();
+  }
+
+  if (is_started()) {
+    join();
+  }
+}
+
+int RGWD4NInvalidator::publish(const std::string& oid, optional_yield y) {
+  RGWD4NRedisBatch b(cluster->get(oid), timeout);
+  b.add({"PUBLISH", channel, gateway_id + "\n" + oid});
+
+  if (b.exec(y) < 0) {
+    dout(10) << "RGW D4N Invalidator: Failed to publish invalidation of " << oid << dendl;
+    return -1;
+  }
+
+  return 0;
+}
+
+void RGWD4NInvalidator::received(const std::string& message) {
+  auto pos = message.find('\n');
+
+  /* Notices of this gateway's own changes are ignored */
+  if (pos == std::string::npos || message.compare(0, pos, gateway_id) == 0) {
+    return;
+  }
+
+  std::lock_guard l{lock};
+
+  if (lost) {
+    return;
+  }
+
+  if (queue.size() >= max_queued) {
+    lost = true;
+    queue.clear();
+  } else {
+    queue.push_back(message.substr(pos + 1));
+  }
+
+  cond.notify_one();
+}
+
+void RGWD4NInvalidator::missed() {
+  std::lock_guard l{lock};
+  lost = true;
+  queue.clear();
+  cond.notify_one();
+}
+
+void* RGWD4NInvalidator::entry() {
+  std::unique_lock l{lock};
+
+  while (!stopping) {
+    if (lost) {
+      lost = false;
+      l.unlock();
+      dout(5) << "RGW D4N Invalidator: Notices may have been missed; revalidating all objects" << dendl;
+      handler("");
+      l.lock();
+    } else if (!queue.empty()) {
+      std::string oid = std::move(queue.front());
+      queue.pop_front();
+      l.unlock();
+      dout(20) << "RGW D4N Invalidator: Invalidating " << oid << dendl;
+      handler(oid);
+      l.lock();
+    } else {
+      cond.wait(l);
+    }
+  }
+
+  return nullptr;
+}
@@ -0,0 +1,66 @@
+#ifndef CEPH_RGWD4NINVALIDATION_H
+#define CEPH_RGWD4NINVALIDATION_H
+
+#include "rgw_common.h"
+#include "d4n_redis.h"
+#include "common/Thread.h"
+#include "common/ceph_mutex.h"
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* Tells the other gateways sharing the D4N cache when an object was
+ * written or deleted, so they can drop what they hold of it in process.
+ * A notice is published on a dedicated channel of the endpoint the
+ * object's oid hashes to, and every gateway subscribes to the channel on
+ * all endpoints. Notices are handled on a thread of their own rather than
+ * on the redis client's network thread. */
+class RGWD4NInvalidator : public Thread {
+  public:
+    /* Called with the oid of an object another gateway changed, or with an
+     * empty oid when notices may have been missed and everything held in
+     * process must be checked */
+    using Handler = std::function<void(const std::string& oid)>;
+
+    RGWD4NInvalidator(RGWD4NRedisCluster* _cluster, const std::string& _gateway_id,
+                      std::chrono::milliseconds _timeout, Handler _handler)
+      : cluster(_cluster), gateway_id(_gateway_id), timeout(_timeout), handler(std::move(_handler)) {}
+    ~RGWD4NInvalidator() override;
+
+    /* Subscribes to every endpoint and starts handling notices */
+    int start();
+    void stop();
+    /* Tells the other gateways the object changed */
+    int publish(const std::string& oid, optional_yield y);
+    /* Whether every subscription is connected, so no notice can be missed */
+    bool is_live() const { return started && disconnected == 0; }
+
+    void* entry() override;
+
+  private:
+    static const std::string channel;
+    /* Notices beyond this are dropped in favour of invalidating everything */
+    static constexpr size_t max_queued = 4096;
+
+    RGWD4NRedisCluster* cluster;
+    std::string gateway_id;
+    std::chrono::milliseconds timeout;
+    Handler handler;
+    std::vector<std::unique_ptr<cpp_redis::subscriber>> subscribers;
+
+    ceph::mutex lock = ceph::make_mutex("RGWD4NInvalidator");
+    ceph::condition_variable cond;
+    bool stopping = false;
+    bool lost = false;
+    std::atomic<bool> started = false;
+    std::atomic<int> disconnected = 0;
+    std::deque<std::string> queue;
+
+    void received(const std::string& message);
+    void missed();
+};
+
+#endif
@@ -0,0 +1,96 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab ft=cpp
+
+#include "d4n_perf_counters.h"
+#include "common/perf_counters.h"
+#include "common/ceph_context.h"
+
+PerfCounters *d4n_perfcounter = NULL;
+
+int d4n_perf_start(CephContext *cct)
+{
+  PerfCountersBuilder plb(cct, "rgw_d4n", l_d4n_first, l_d4n_last);
+
+  // Redis round trips, values are in nanoseconds
+  PerfHistogramCommon::axis_config_d lat_axis_config{
+    "Latency (usec)",
+    PerfHistogramCommon::SCALE_LOG2, ///< Latency in logarithmic scale
+    0,                               ///< Start at 0
+    10000,                           ///< Quantization unit is 10usec
+    24,                              ///< Enough to cover the longest timeouts
+  };
+
+  // Commands sent in one round trip
+  PerfHistogramCommon::axis_config_d cmds_axis_config{
+    "Commands per batch",
+    PerfHistogramCommon::SCALE_LOG2, ///< Batch size in logarithmic scale
+    0,                               ///< Start at 0
+    1,                               ///< Quantization unit is 1 command
+    12,                              ///< Enough to cover the largest batches
+  };
+
+  // The counters are meant for sizing the cache, so they are all exported
+  plb.set_prio_default(PerfCountersBuilder::PRIO_USEFUL);
+
+  plb.add_u64_counter(l_d4n_meta_l1_hit, "meta_l1_hit", "Object metadata lookups served in process");
+  plb.add_u64_counter(l_d4n_meta_l2_hit, "meta_l2_hit", "Object metadata lookups served from redis");
+  plb.add_u64_counter(l_d4n_meta_miss, "meta_miss", "Object metadata lookups not cached");
+
+  plb.add_u64_counter(l_d4n_dir_lookup, "dir_lookup", "Block directory lookups");
+  plb.add_time_avg(l_d4n_dir_lookup_lat, "dir_lookup_lat", "Block directory lookup latency");
+
+  plb.add_u64_counter(l_d4n_block_hit, "block_hit", "Blocks read from the local cache");
+  plb.add_u64_counter(l_d4n_block_peer_hit, "block_peer_hit", "Blocks read from other gateways");
+  plb.add_u64_counter(l_d4n_block_miss, "block_miss", "Blocks read from the backing store");
+  plb.add_u64_counter(l_d4n_cache_out_b, "cache_out_b", "Bytes read from the local cache",
+		      NULL, 0, unit_t(UNIT_BYTES));
+  plb.add_u64_counter(l_d4n_cache_in_b, "cache_in_b", "Bytes written to the local cache",
+		      NULL, 0, unit_t(UNIT_BYTES));
+  plb.add_u64_counter(l_d4n_peer_in_b, "peer_in_b", "Bytes read from other gateways",
+		      NULL, 0, unit_t(UNIT_BYTES));
+  plb.add_u64_counter(l_d4n_backend_in_b, "backend_in_b", "Bytes read from the backing store",
+		      NULL, 0, unit_t(UNIT_BYTES));
+
+  plb.add_u64_counter(l_d4n_admit_reject, "admit_reject", "Blocks turned away by the admission filter");
+  plb.add_u64_counter(l_d4n_evict, "evict", "Blocks evicted");
+  plb.add_u64_counter(l_d4n_evict_b, "evict_b", "Bytes evicted",
+		      NULL, 0, unit_t(UNIT_BYTES));
+
+  plb.add_u64_counter(l_d4n_comp_in_b, "comp_in_b", "Bytes of blocks cached compressed, before compression",
+		      NULL, 0, unit_t(UNIT_BYTES));
+  plb.add_u64_counter(l_d4n_comp_out_b, "comp_out_b", "Bytes of blocks cached compressed, after compression",
+		      NULL, 0, unit_t(UNIT_BYTES));
+  plb.add_u64_counter(l_d4n_comp_skip, "comp_skip", "Blocks cached uncompressed as they did not compress well");
+
+  plb.add_u64_counter(l_d4n_prefetch, "prefetch", "Prefetches queued");
+  plb.add_u64_counter(l_d4n_prefetch_dropped, "prefetch_dropped", "Prefetches dropped for lack of budget");
+  plb.add_u64_counter(l_d4n_prefetch_b, "prefetch_b", "Bytes prefetched",
+		      NULL, 0, unit_t(UNIT_BYTES));
+
+  plb.add_u64_counter(l_d4n_wb_put, "wb_put", "Objects acknowledged in write-back mode");
+  plb.add_u64_counter(l_d4n_wb_flush, "wb_flush", "Objects written back");
+  plb.add_u64_counter(l_d4n_wb_flush_fail, "wb_flush_fail", "Failed attempts to write back objects");
+
+  plb.add_u64_counter(l_d4n_invalidate, "invalidate", "Invalidations received from other gateways");
+
+  plb.add_u64_counter(l_d4n_redis_batch, "redis_batch", "Redis round trips");
+  plb.add_u64_counter(l_d4n_redis_cmd, "redis_cmd", "Redis commands");
+  plb.add_u64_counter(l_d4n_redis_fail, "redis_fail", "Failed redis round trips");
+  plb.add_time_avg(l_d4n_redis_lat, "redis_lat", "Redis round trip latency");
+  plb.add_u64_counter_histogram(
+    l_d4n_redis_lat_hist, "redis_lat_histogram",
+    lat_axis_config, cmds_axis_config,
+    "Histogram of redis round trip latency (nanoseconds) vs. commands per batch");
+
+  d4n_perfcounter = plb.create_perf_counters();
+  cct->get_perfcounters_collection()->add(d4n_perfcounter);
+  return 0;
+}
+
+void d4n_perf_stop(CephContext *cct)
+{
+  ceph_assert(d4n_perfcounter);
+  cct->get_perfcounters_collection()->remove(d4n_perfcounter);
+  delete d4n_perfcounter;
+  d4n_perfcounter = NULL;
+}
@@ -0,0 +1,57 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab ft=cpp
+
+#pragma once
+
+#include "include/common_fwd.h"
+
+/* Set while a D4N filter is running, so every use must allow for NULL */
+extern PerfCounters *d4n_perfcounter;
+
+extern int d4n_perf_start(CephContext *cct);
+extern void d4n_perf_stop(CephContext *cct);
+
+enum {
+  l_d4n_first = 15500,
+
+  l_d4n_meta_l1_hit,
+  l_d4n_meta_l2_hit,
+  l_d4n_meta_miss,
+
+  l_d4n_dir_lookup,
+  l_d4n_dir_lookup_lat,
+
+  l_d4n_block_hit,
+  l_d4n_block_peer_hit,
+  l_d4n_block_miss,
+  l_d4n_cache_out_b,
+  l_d4n_cache_in_b,
+  l_d4n_peer_in_b,
+  l_d4n_backend_in_b,
+
+  l_d4n_admit_reject,
+  l_d4n_evict,
+  l_d4n_evict_b,
+
+  l_d4n_comp_in_b,
+  l_d4n_comp_out_b,
+  l_d4n_comp_skip,
+
+  l_d4n_prefetch,
+  l_d4n_prefetch_dropped,
+  l_d4n_prefetch_b,
+
+  l_d4n_wb_put,
+  l_d4n_wb_flush,
+  l_d4n_wb_flush_fail,
+
+  l_d4n_invalidate,
+
+  l_d4n_redis_batch,
+  l_d4n_redis_cmd,
+  l_d4n_redis_fail,
+  l_d4n_redis_lat,
+  l_d4n_redis_lat_hist,
+
+  l_d4n_last,
+};
@@ -0,0 +1,166 @@
+#include "d4n_policy.h"
+
+#define dout_subsys ceph_subsys_rgw
+#define dout_context g_ceph_context
+
+std::unique_ptr<RGWD4NPolicy> RGWD4NPolicy::create(const std::string& name, uint64_t capacity) {
+  if (name == "lfu") {
+    return std::make_unique<RGWD4NLFUPolicy>(capacity);
+  } else if (name == "gdsf") {
+    return std::make_unique<RGWD4NGDSFPolicy>(capacity);
+  }
+
+  return std::make_unique<RGWD4NLRUPolicy>(capacity);
+}
+
+void RGWD4NPolicy::requeue(Entry& entry) {
+  if (entry.pos != queue.end()) {
+    queue.erase(entry.pos);
+  }
+
+  entry.priority = priority(entry);
+  entry.pos = queue.emplace(entry.priority, &entry);
+}
+
+void RGWD4NPolicy::remove(const std::string& key) {
+  auto it = entries.find(key);
+
+  if (it == entries.end()) {
+    return;
+  }
+
+  Entry& entry = it->second;
+  auto obj = objects.find(entry.block.oid);
+
+  if (obj != objects.end()) {
+    obj->second.erase(entry.block.offset);
+
+    if (obj->second.empty()) {
+      objects.erase(obj);
+    }
+  }
+
+  queue.erase(entry.pos);
+  size -= entry.block.size;
+  entries.erase(it);
+}
+
+void RGWD4NPolicy::insert(const Block& block, double cost, std::vector<Block>* victims) {
+  std::lock_guard l{lock};
+  std::string key = buildKey(block.oid, block.offset);
+
+  /* A block that was cached again replaces the earlier copy */
+  remove(key);
+
+  if (cost > 0) {
+    total_cost += cost;
+    costed++;
+  } else {
+    cost = costed ? total_cost / costed : 1;
+  }
+
+  Entry& entry = entries[key];
+  entry.block = block;
+  entry.cost = cost;
+  entry.hits = 1;
+  entry.last_access = ++clock;
+  entry.pos = queue.end();
+  requeue(entry);
+
+  objects[block.oid][block.offset] = &entry;
+  size += block.size;
+
+  while (size > capacity && !queue.empty()) {
+    Entry* victim = queue.begin()->second;
+
+    dout(20) << "RGW D4N Policy: Evicting block " << victim->block.offset << " of "
+             << victim->block.oid << " with priority " << victim->priority << dendl;
+
+    evicted(*victim);
+    victims->push_back(victim->block);
+    remove(buildKey(victim->block.oid, victim->block.offset));
+  }
+}
+
+bool RGWD4NPolicy::peek_victim(uint64_t block_size, Block* victim) {
+  std::lock_guard l{lock};
+
+  if (size + block_size <= capacity || queue.empty()) {
+    return false;
+  }
+
+  *victim = queue.begin()->second->block;
+  return true;
+}
+
+void RGWD4NPolicy::access(const std::string& oid, uint64_t offset) {
+  std::lock_guard l{lock};
+  auto it = entries.find(buildKey(oid, offset));
+
+  if (it == entries.end()) {
+    return;
+  }
+
+  it->second.hits++;
+  it->second.last_access = ++clock;
+  requeue(it->second);
+}
+
+bool RGWD4NPolicy::contains(const std::string& oid, uint64_t offset) {
+  std::lock_guard l{lock};
+  return entries.count(buildKey(oid, offset));
+}
+
+void RGWD4NPolicy::erase(const std::string& oid, uint64_t offset) {
+  std::lock_guard l{lock};
+  remove(buildKey(oid, offset));
+}
+
+void RGWD4NPolicy::erase_object(const std::string& oid, std::vector<Block>* erased) {
+  std::lock_guard l{lock};
+  auto obj = objects.find(oid);
+
+  if (obj == objects.end()) {
+    return;
+  }
+
+  std::vector<uint64_t> offsets;
+
+  for (const auto& block : obj->second) {
+    offsets.push_back(block.first);
+
+    if (erased) {
+      erased->push_back(block.second->block);
+    }
+  }
+
+  for (auto offset : offsets) {
+    remove(buildKey(oid, offset));
+  }
+}
+
+void RGWD4NPolicy::clear(std::vector<Block>* erased) {
+  std::lock_guard l{lock};
+
+  for (const auto& entry : entries) {
+    erased->push_back(entry.second.block);
+  }
+
+  entries.clear();
+  objects.clear();
+  queue.clear();
+  size = 0;
+}
+
+void RGWD4NPolicy::list_objects(std::vector<std::string>* oids) {
+  std::lock_guard l{lock};
+
+  for (const auto& obj : objects) {
+    oids->push_back(obj.first);
+  }
+}
+
+uint64_t RGWD4NPolicy::get_size() {
+  std::lock_guard l{lock};
+  return size;
+}
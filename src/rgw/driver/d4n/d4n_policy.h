@@ -0,0 +1,125 @@
+#ifndef CEPH_RGWD4NPOLICY_H
+#define CEPH_RGWD4NPOLICY_H
+
+#include "rgw_common.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Tracks the blocks this gateway has cached and decides which to evict
+ * once their total size exceeds the capacity of the cache tier. Each block
+ * is given a priority by the policy when it is cached or read, and the
+ * block with the lowest priority is evicted first; blocks of equal
+ * priority are evicted least recently used first. */
+class RGWD4NPolicy {
+  public:
+    struct Block {
+      std::string bucket_name;
+      std::string oid; /* Key of the object in the cache */
+      std::string obj_name; /* Name of the object in its bucket */
+      std::string version;
+      uint64_t offset = 0;
+      uint64_t size = 0; /* Bytes the block takes in the cache */
+      std::string compression; /* Empty if the block is stored uncompressed */
+    };
+
+    RGWD4NPolicy(uint64_t _capacity):capacity(_capacity) {}
+    virtual ~RGWD4NPolicy() = default;
+
+    /* Returns the policy named by rgw_d4n_eviction_policy */
+    static std::unique_ptr<RGWD4NPolicy> create(const std::string& name, uint64_t capacity);
+
+    /* Records a newly cached block along with the cost of fetching it, and
+     * returns the blocks that must be evicted to stay within capacity. A
+     * cost of zero means the cost is unknown. */
+    void insert(const Block& block, double cost, std::vector<Block>* victims);
+    /* Returns false if a block of the given size fits without eviction,
+     * otherwise sets victim to the first block that would be evicted */
+    bool peek_victim(uint64_t block_size, Block* victim);
+    void access(const std::string& oid, uint64_t offset);
+    bool contains(const std::string& oid, uint64_t offset);
+    void erase(const std::string& oid, uint64_t offset);
+    /* Forgets every block of the object */
+    void erase(const std::string& oid) { erase_object(oid, nullptr); }
+    /* As erase(), returning the blocks in erased if set */
+    void erase_object(const std::string& oid, std::vector<Block>* erased);
+    /* Forgets every block, returning them in erased */
+    void clear(std::vector<Block>* erased);
+    /* Lists the objects with blocks in the cache */
+    void list_objects(std::vector<std::string>* oids);
+
+    uint64_t get_capacity() const { return capacity; }
+    uint64_t get_size();
+
+  protected:
+    struct Entry {
+      Block block;
+      double cost = 0;
+      uint64_t hits = 0;
+      uint64_t last_access = 0;
+      double priority = 0;
+      std::multimap<double, Entry*>::iterator pos;
+    };
+
+    virtual double priority(const Entry& entry) = 0;
+    /* Called with the lock held as each block is evicted */
+    virtual void evicted(const Entry& entry) {}
+
+  private:
+    uint64_t capacity;
+    uint64_t size = 0;
+    uint64_t clock = 0;
+    double total_cost = 0;
+    uint64_t costed = 0;
+    std::mutex lock;
+    std::unordered_map<std::string, Entry> entries;
+    std::unordered_map<std::string, std::map<uint64_t, Entry*>> objects;
+    std::multimap<double, Entry*> queue;
+
+    static std::string buildKey(const std::string& oid, uint64_t offset) {
+      return oid + "#" + std::to_string(offset);
+    }
+    void requeue(Entry& entry);
+    void remove(const std::string& key);
+};
+
+/* Least recently used */
+class RGWD4NLRUPolicy : public RGWD4NPolicy {
+  public:
+    using RGWD4NPolicy::RGWD4NPolicy;
+
+  protected:
+    double priority(const Entry& entry) override { return entry.last_access; }
+};
+
+/* Least frequently used */
+class RGWD4NLFUPolicy : public RGWD4NPolicy {
+  public:
+    using RGWD4NPolicy::RGWD4NPolicy;
+
+  protected:
+    double priority(const Entry& entry) override { return entry.hits; }
+};
+
+/* Greedy-Dual-Size-Frequency: blocks that are read often, were expensive
+ * to fetch and take little space are kept longest. The inflation value
+ * rises to the priority of each evicted block so that blocks which are no
+ * longer read eventually age out. */
+class RGWD4NGDSFPolicy : public RGWD4NPolicy {
+  public:
+    using RGWD4NPolicy::RGWD4NPolicy;
+
+  protected:
+    double priority(const Entry& entry) override {
+      return inflation + entry.hits * entry.cost / std::max<uint64_t>(entry.block.size, 1);
+    }
+    void evicted(const Entry& entry) override { inflation = entry.priority; }
+
+  private:
+    double inflation = 0;
+};
+
+#endif
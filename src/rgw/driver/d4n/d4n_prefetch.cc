@@ -0,0 +1,72 @@
+#include "d4n_prefetch.h"
+
+#define dout_subsys ceph_subsys_rgw
+#define dout_context g_ceph_context
+
+bool RGWD4NAccessTracker::record(const std::string& oid, uint64_t ofs, uint64_t end,
+                                 uint64_t obj_size, uint64_t block_size,
+                                 uint64_t* pf_ofs, uint64_t* pf_end) {
+  if (depth == 0 || block_size == 0) {
+    return false;
+  }
+
+  std::lock_guard l{lock};
+  auto it = streams.find(oid);
+
+  if (it == streams.end()) {
+    lru.push_front(oid);
+    it = streams.emplace(oid, Stream()).first;
+    it->second.pos = lru.begin();
+
+    if (streams.size() > max_streams) {
+      streams.erase(lru.back());
+      lru.pop_back();
+    }
+  } else {
+    lru.splice(lru.begin(), lru, it->second.pos);
+  }
+
+  Stream& stream = it->second;
+
+  if (stream.run > 0 && ofs >= stream.last_ofs && ofs <= stream.next_ofs + block_size) {
+    stream.run++;
+    stream.next_ofs = std::max(stream.next_ofs, end + 1);
+  } else {
+    stream.run = 1;
+    stream.next_ofs = end + 1;
+    stream.prefetched_to = 0;
+  }
+
+  stream.last_ofs = ofs;
+
+  if (stream.run < trigger) {
+    return false;
+  }
+
+  /* The read itself covers every block it touches */
+  uint64_t start = std::max((end / block_size + 1) * block_size, stream.prefetched_to);
+  uint64_t limit = std::min((end / block_size + 1 + depth) * block_size, obj_size);
+
+  /* Prefetch in batches, once the stream has consumed half of what is ahead */
+  if (start >= limit || stream.prefetched_to >= end + 1 + depth * block_size / 2) {
+    return false;
+  }
+
+  dout(20) << "RGW D4N Access Tracker: Sequential reads of " << oid << "; prefetching bytes "
+           << start << "-" << limit - 1 << dendl;
+
+  stream.prefetched_to = limit;
+  *pf_ofs = start;
+  *pf_end = limit - 1;
+  return true;
+}
+
+void RGWD4NAccessTracker::forget(const std::string& oid) {
+  std::lock_guard l{lock};
+  auto it = streams.find(oid);
+
+  if (it != streams.end()) {
+    lru.erase(it->second.pos);
+    streams.erase(it);
+  }
+}
@@ -0,0 +1,50 @@
+#ifndef CEPH_RGWD4NPREFETCH_H
+#define CEPH_RGWD4NPREFETCH_H
+
+#include "rgw_common.h"
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/* Follows the reads of each object to spot clients reading it front to
+ * back, and decides which blocks ahead of such a stream to prefetch. A
+ * read continues a stream if it starts no earlier than the previous read
+ * and no more than a block past its end. Only the most recently read
+ * max_streams objects are followed. */
+class RGWD4NAccessTracker {
+  public:
+    /* trigger is the number of sequential reads after which blocks are
+     * prefetched, and depth the number of blocks kept ahead of the stream */
+    RGWD4NAccessTracker(uint64_t _max_streams, uint64_t _trigger, uint64_t _depth)
+      : max_streams(std::max<uint64_t>(_max_streams, 1)),
+        trigger(std::max<uint64_t>(_trigger, 1)), depth(_depth) {}
+
+    /* Records a read of bytes ofs to end, inclusive, of an object. Returns
+     * true and sets the inclusive range pf_ofs to pf_end if blocks after the
+     * read should be prefetched. The range starts and ends on block
+     * boundaries or at the end of the object. */
+    bool record(const std::string& oid, uint64_t ofs, uint64_t end,
+                uint64_t obj_size, uint64_t block_size,
+                uint64_t* pf_ofs, uint64_t* pf_end);
+    /* Stops following the object, which was overwritten or deleted */
+    void forget(const std::string& oid);
+
+  private:
+    struct Stream {
+      uint64_t last_ofs = 0;
+      uint64_t next_ofs = 0;
+      uint64_t run = 0;
+      uint64_t prefetched_to = 0; /* End of the blocks prefetched so far */
+      std::list<std::string>::iterator pos;
+    };
+
+    uint64_t max_streams;
+    uint64_t trigger;
+    uint64_t depth;
+    std::mutex lock;
+    std::unordered_map<std::string, Stream> streams;
+    std::list<std::string> lru; /* Most recently read first */
+};
+
+#endif
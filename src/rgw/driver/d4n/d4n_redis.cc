@@ -0,0 +1,271 @@
+#include "d4n_redis.h"
+#include "d4n_perf_counters.h"
+#include "common/perf_counters.h"
+#include "common/async/completion.h"
+#include "include/ceph_hash.h"
+#include <boost/algorithm/string.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <condition_variable>
+
+#define dout_subsys ceph_subsys_rgw
+#define dout_context g_ceph_context
+
+namespace {
+
+using Completion = ceph::async::Completion<void(boost::system::error_code)>;
+
+/* Shared with the reply callbacks, which run on the redis client's network
+ * thread and may outlive exec() when a batch times out */
+struct BatchState {
+  std::mutex lock;
+  std::condition_variable cond;
+  std::vector<cpp_redis::reply> replies;
+  size_t outstanding;
+  std::unique_ptr<Completion> completion;
+
+  explicit BatchState(size_t n) : replies(n), outstanding(n) {}
+};
+
+template <typename CompletionToken>
+auto async_commit(boost::asio::io_context& context, cpp_redis::client& client,
+                  const std::shared_ptr<BatchState>& state,
+                  boost::asio::steady_timer& timer, std::chrono::milliseconds timeout,
+                  CompletionToken&& token)
+{
+  using Signature = void(boost::system::error_code);
+  boost::asio::async_completion<CompletionToken, Signature> init(token);
+  {
+    std::lock_guard l{state->lock};
+    state->completion = Completion::create(context.get_executor(),
+                                           std::move(init.completion_handler));
+  }
+
+  /* Armed once the completion is published, as the timer may fire on
+   * another thread of the io_context right away */
+  timer.expires_after(timeout);
+  timer.async_wait([state](boost::system::error_code ec) {
+    if (ec)
+      return; /* Cancelled after the replies arrived */
+
+    std::lock_guard l{state->lock};
+    if (state->completion) {
+      ceph::async::post(std::move(state->completion),
+                        make_error_code(boost::system::errc::timed_out));
+    }
+  });
+
+  client.commit();
+  return init.result.get();
+}
+
+} // anonymous namespace
+
+RGWD4NRedisPool::~RGWD4NRedisPool() {
+  for (auto& conn : idle) {
+    conn->disconnect(true);
+  }
+}
+
+int RGWD4NRedisPool::get(Conn& conn) {
+  {
+    std::lock_guard l{lock};
+
+    while (!idle.empty()) {
+      conn = std::move(idle.back());
+      idle.pop_back();
+
+      if (conn->is_connected())
+        return 0;
+    }
+  }
+
+  if (host == "" || port == 0) {
+    dout(10) << "RGW D4N Redis: D4N endpoint was not configured correctly" << dendl;
+    conn.reset();
+    return -EDESTADDRREQ;
+  }
+
+  conn = std::make_unique<cpp_redis::client>();
+
+  try {
+    conn->connect(host, port, nullptr);
+  } catch (std::exception &e) {
+    dout(10) << "RGW D4N Redis: Failed to connect to " << host << ":" << port << ": " << e.what() << dendl;
+  }
+
+  if (!conn->is_connected()) {
+    conn.reset();
+    return -ECONNREFUSED;
+  }
+
+  return 0;
+}
+
+void RGWD4NRedisPool::put(Conn&& conn) {
+  if (!conn || !conn->is_connected())
+    return;
+
+  std::lock_guard l{lock};
+
+  if (idle.size() < max_idle) {
+    idle.push_back(std::move(conn));
+  }
+}
+
+size_t RGWD4NRedisBatch::add(std::vector<std::string> cmd) {
+  cmds.push_back(std::move(cmd));
+  return cmds.size() - 1;
+}
+
+int RGWD4NRedisBatch::exec(optional_yield y) {
+  if (cmds.empty())
+    return 0;
+
+  auto start = ceph::mono_clock::now();
+  int ret = round_trip(y);
+
+  if (d4n_perfcounter) {
+    auto lat = ceph::mono_clock::now() - start;
+    d4n_perfcounter->inc(l_d4n_redis_batch);
+    d4n_perfcounter->inc(l_d4n_redis_cmd, cmds.size());
+    d4n_perfcounter->tinc(l_d4n_redis_lat, lat);
+    d4n_perfcounter->hinc(l_d4n_redis_lat_hist, std::chrono::nanoseconds(lat).count(), cmds.size());
+
+    if (ret < 0) {
+      d4n_perfcounter->inc(l_d4n_redis_fail);
+    }
+  }
+
+  return ret;
+}
+
+int RGWD4NRedisBatch::round_trip(optional_yield y) {
+  RGWD4NRedisPool::Conn conn;
+  int ret = pool->get(conn);
+
+  if (ret < 0)
+    return ret;
+
+  auto state = std::make_shared<BatchState>(cmds.size());
+
+  try {
+    for (size_t i = 0; i < cmds.size(); ++i) {
+      conn->send(cmds[i], [state, i](cpp_redis::reply &reply) {
+        std::lock_guard l{state->lock};
+        state->replies[i] = reply;
+
+        if (--state->outstanding == 0) {
+          if (state->completion) {
+            ceph::async::post(std::move(state->completion), boost::system::error_code{});
+          }
+          state->cond.notify_all();
+        }
+      });
+    }
+
+    if (y) {
+      auto& context = y.get_io_context();
+      boost::asio::steady_timer timer(context);
+
+      boost::system::error_code ec;
+      async_commit(context, *conn, state, timer, timeout, y.get_yield_context()[ec]);
+      timer.cancel();
+    } else {
+      conn->commit();
+
+      std::unique_lock l{state->lock};
+      state->cond.wait_for(l, timeout, [&state] { return state->outstanding == 0; });
+    }
+  } catch (std::exception &e) {
+    dout(10) << "RGW D4N Redis: Batch of " << cmds.size() << " commands failed: " << e.what() << dendl;
+    return -EIO;
+  }
+
+  std::lock_guard l{state->lock};
+
+  if (state->outstanding > 0) {
+    /* Late replies would still be queued on this connection, so drop it */
+    dout(10) << "RGW D4N Redis: Batch of " << cmds.size() << " commands timed out" << dendl;
+    return -ETIMEDOUT;
+  }
+
+  replies = std::move(state->replies);
+  pool->put(std::move(conn));
+
+  return 0;
+}
+
+RGWD4NRedisCluster::RGWD4NRedisCluster(const std::vector<Endpoint>& endpoints, size_t max_idle, unsigned vnodes) {
+  for (const auto& [host, port] : endpoints) {
+    pools.push_back(std::make_unique<RGWD4NRedisPool>(host, port, max_idle));
+  }
+
+  /* An unconfigured endpoint still gets a pool, which reports the error */
+  if (pools.empty()) {
+    pools.push_back(std::make_unique<RGWD4NRedisPool>("", 0, max_idle));
+  }
+
+  vnodes = std::max(vnodes, 1u);
+
+  for (const auto& pool : pools) {
+    std::string name = pool->get_host() + ":" + std::to_string(pool->get_port());
+
+    for (unsigned i = 0; i < vnodes; ++i) {
+      std::string vnode = name + "#" + std::to_string(i);
+      ring.emplace(ceph_str_hash_rjenkins(vnode.c_str(), vnode.length()), pool.get());
+    }
+  }
+}
+
+std::unique_ptr<RGWD4NRedisCluster> RGWD4NRedisCluster::create(CephContext* cct) {
+  std::vector<Endpoint> endpoints;
+
+  if (parse_endpoints(cct->_conf->rgw_d4n_redis_endpoints, &endpoints) < 0) {
+    ldout(cct, 0) << "ERROR: RGW D4N Redis: Invalid rgw_d4n_redis_endpoints: "
+                  << cct->_conf->rgw_d4n_redis_endpoints << dendl;
+    endpoints.clear();
+  }
+
+  if (endpoints.empty()) {
+    endpoints.emplace_back(cct->_conf->rgw_d4n_host, cct->_conf->rgw_d4n_port);
+  }
+
+  return std::make_unique<RGWD4NRedisCluster>(endpoints, cct->_conf->rgw_d4n_redis_pool_size,
+                                              cct->_conf->rgw_d4n_redis_vnodes);
+}
+
+int RGWD4NRedisCluster::parse_endpoints(const std::string& str, std::vector<Endpoint>* endpoints) {
+  std::vector<std::string> entries;
+  boost::split(entries, str, boost::is_any_of(", "), boost::token_compress_on);
+
+  for (auto& entry : entries) {
+    if (entry.empty())
+      continue;
+
+    auto pos = entry.rfind(':');
+
+    if (pos == std::string::npos || pos == 0) {
+      return -EINVAL;
+    }
+
+    try {
+      endpoints->emplace_back(entry.substr(0, pos), std::stoi(entry.substr(pos + 1)));
+    } catch (std::exception &e) {
+      return -EINVAL;
+    }
+  }
+
+  return 0;
+}
+
+RGWD4NRedisPool* RGWD4NRedisCluster::get(const std::string& key) const {
+  if (pools.size() == 1)
+    return pools.front().get();
+
+  auto it = ring.lower_bound(ceph_str_hash_rjenkins(key.c_str(), key.length()));
+
+  if (it == ring.end())
+    it = ring.begin();
+
+  return it->second;
+}
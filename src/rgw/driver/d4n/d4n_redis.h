@@ -0,0 +1,92 @@
+#ifndef CEPH_RGWD4NREDIS_H
+#define CEPH_RGWD4NREDIS_H
+
+#include "rgw_common.h"
+#include "common/async/yield_context.h"
+#include <cpp_redis/cpp_redis>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* Pool of connections to a single redis endpoint. A connection is leased
+ * for the duration of one batch, so concurrent requests never interleave
+ * commands or wait on each other's replies. Up to max_idle connections are
+ * kept open between leases; when the pool is empty a new connection is
+ * opened instead of waiting, and surplus connections are closed on return. */
+class RGWD4NRedisPool {
+  public:
+    using Conn = std::unique_ptr<cpp_redis::client>;
+
+    RGWD4NRedisPool(std::string _host, int _port, size_t _max_idle):host(std::move(_host)),
+                                                                   port(_port),
+                                                                   max_idle(_max_idle) {}
+    ~RGWD4NRedisPool();
+
+    int get(Conn& conn);
+    void put(Conn&& conn);
+
+    const std::string& get_host() const { return host; }
+    int get_port() const { return port; }
+
+  private:
+    std::string host;
+    int port;
+    size_t max_idle;
+    std::mutex lock;
+    std::vector<Conn> idle;
+};
+
+/* Set of redis endpoints the D4N cache and directory are spread across.
+ * Each endpoint is placed on a hash ring at a number of virtual nodes
+ * derived from its address, and a key is served by the first node at or
+ * after its hash. Adding or removing an endpoint therefore only moves the
+ * keys adjacent to its own nodes. Callers hash on the object name so that
+ * all keys belonging to one object share an endpoint and can be batched. */
+class RGWD4NRedisCluster {
+  public:
+    using Endpoint = std::pair<std::string, int>;
+
+    RGWD4NRedisCluster(const std::vector<Endpoint>& endpoints, size_t max_idle, unsigned vnodes);
+
+    /* Builds the cluster from rgw_d4n_redis_endpoints, falling back to
+     * rgw_d4n_host and rgw_d4n_port when no list is configured */
+    static std::unique_ptr<RGWD4NRedisCluster> create(CephContext* cct);
+    /* Parses a comma-separated list of host:port pairs */
+    static int parse_endpoints(const std::string& str, std::vector<Endpoint>* endpoints);
+
+    RGWD4NRedisPool* get(const std::string& key) const;
+    const std::vector<std::unique_ptr<RGWD4NRedisPool>>& get_pools() const { return pools; }
+
+  private:
+    std::vector<std::unique_ptr<RGWD4NRedisPool>> pools;
+    std::map<uint32_t, RGWD4NRedisPool*> ring;
+};
+
+/* Commands queued on a batch are written to a single leased connection and
+ * flushed in one round trip by exec(). When exec() is given a yield context
+ * the coroutine is suspended until every reply has arrived; otherwise the
+ * calling thread blocks. Replies are available by the index add() returned. */
+class RGWD4NRedisBatch {
+  public:
+    RGWD4NRedisBatch(RGWD4NRedisPool* _pool, std::chrono::milliseconds _timeout):pool(_pool),
+                                                                               timeout(_timeout) {}
+
+    size_t add(std::vector<std::string> cmd);
+    int exec(optional_yield y);
+
+    const cpp_redis::reply& reply(size_t i) const { return replies[i]; }
+    size_t size() const { return cmds.size(); }
+
+  private:
+    RGWD4NRedisPool* pool;
+    std::chrono::milliseconds timeout;
+    std::vector<std::vector<std::string>> cmds;
+    std::vector<cpp_redis::reply> replies;
+
+    int round_trip(optional_yield y);
+};
+
+#endif
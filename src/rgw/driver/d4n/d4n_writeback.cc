@@ -0,0 +1,109 @@
+#include "d4n_writeback.h"
+
+#define dout_subsys ceph_subsys_rgw
+#define dout_context g_ceph_context
+
+/* KEYS: log, entries, generation counter; ARGV: oid, encoded entry */
+static const std::string addEntryScript =
+  "local gen = redis.call('INCR', KEYS[3]) "
+  "redis.call('ZADD', KEYS[1], gen, ARGV[1]) "
+  "redis.call('HSET', KEYS[2], ARGV[1], ARGV[2]) "
+  "return gen";
+
+/* KEYS: log, entries; ARGV: oid, generation */
+static const std::string removeEntryScript =
+  "local gen = redis.call('ZSCORE', KEYS[1], ARGV[1]) "
+  "if gen == false or tonumber(gen) ~= tonumber(ARGV[2]) then return 0 end "
+  "redis.call('ZREM', KEYS[1], ARGV[1]) "
+  "redis.call('HDEL', KEYS[2], ARGV[1]) "
+  "return 1";
+
+int RGWD4NDirtyLog::add(RGWD4NDirtyEntry* entry, optional_yield y) {
+  bufferlist bl;
+  encode(*entry, bl);
+
+  auto b = batch();
+  b.add({"EVAL", addEntryScript, "3", logKey, entriesKey(), genKey(), entry->oid, bl.to_str()});
+
+  if (b.exec(y) < 0 || !b.reply(0).is_integer()) {
+    dout(0) << "RGW D4N Dirty Log: Failed to record " << entry->oid << dendl;
+    return -1;
+  }
+
+  entry->gen = b.reply(0).as_integer();
+  return 0;
+}
+
+int RGWD4NDirtyLog::list(uint64_t max, std::vector<std::string>* oids, optional_yield y) {
+  auto b = batch();
+  b.add({"ZRANGE", logKey, "0", std::to_string(max - 1)});
+
+  if (b.exec(y) < 0 || !b.reply(0).is_array()) {
+    return -1;
+  }
+
+  for (const auto& oid : b.reply(0).as_array()) {
+    oids->push_back(oid.as_string());
+  }
+
+  return 0;
+}
+
+int RGWD4NDirtyLog::get(const std::string& oid, RGWD4NDirtyEntry* entry, optional_yield y) {
+  auto b = batch();
+  b.add({"ZSCORE", logKey, oid});
+  b.add({"HGET", entriesKey(), oid});
+
+  if (b.exec(y) < 0) {
+    return -1;
+  }
+
+  if (!b.reply(0).is_string() || !b.reply(1).is_string()) {
+    return -2;
+  }
+
+  bufferlist bl;
+  bl.append(b.reply(1).as_string());
+
+  try {
+    auto iter = bl.cbegin();
+    decode(*entry, iter);
+  } catch (buffer::error& err) {
+    dout(0) << "RGW D4N Dirty Log: Failed to decode entry of " << oid << ": " << err.what() << dendl;
+    return -1;
+  }
+
+  entry->gen = std::stoull(b.reply(0).as_string());
+  return 0;
+}
+
+int RGWD4NDirtyLog::remove(const RGWD4NDirtyEntry& entry, optional_yield y) {
+  auto b = batch();
+  b.add({"EVAL", removeEntryScript, "2", logKey, entriesKey(), entry.oid, std::to_string(entry.gen)});
+
+  if (b.exec(y) < 0 || !b.reply(0).is_integer()) {
+    return -1;
+  }
+
+  if (b.reply(0).as_integer() == 0) {
+    return -ECANCELED;
+  }
+
+  return 0;
+}
+
+int RGWD4NDirtyLog::discard(const std::string& oid, optional_yield y) {
+  auto b = batch();
+  b.add({"ZREM", logKey, oid});
+  b.add({"HDEL", entriesKey(), oid});
+
+  if (b.exec(y) < 0 || !b.reply(0).is_integer()) {
+    return -1;
+  }
+
+  if (b.reply(0).as_integer() == 0) {
+    return -2;
+  }
+
+  return 0;
+}
@@ -0,0 +1,110 @@
+#ifndef CEPH_RGWD4NWRITEBACK_H
+#define CEPH_RGWD4NWRITEBACK_H
+
+#include "rgw_common.h"
+#include "d4n_redis.h"
+#include <string>
+#include <vector>
+
+/* Everything needed to write an object acknowledged in write-back mode to
+ * the backing store: the object's data is held in the cache's blocks, and
+ * the rest is what the writer was given for the PUT */
+struct RGWD4NDirtyEntry {
+  /* Assigned by the log; a newer PUT of the object gets a higher value */
+  uint64_t gen = 0;
+  std::string oid; /* Key of the object in the cache */
+  rgw_bucket bucket;
+  rgw_obj_key key;
+  rgw_user owner;
+  rgw_placement_rule placement_rule;
+  uint64_t olh_epoch = 0;
+  std::string unique_tag;
+  uint64_t size = 0;
+  uint64_t block_size = 0;
+  uint64_t accounted_size = 0;
+  std::string etag;
+  ceph::real_time mtime;
+  ceph::real_time delete_at;
+  std::string user_data;
+  std::map<std::string, bufferlist> attrs;
+
+  void encode(bufferlist& bl) const {
+    ENCODE_START(1, 1, bl);
+    encode(oid, bl);
+    encode(bucket, bl);
+    encode(key, bl);
+    encode(owner, bl);
+    encode(placement_rule, bl);
+    encode(olh_epoch, bl);
+    encode(unique_tag, bl);
+    encode(size, bl);
+    encode(block_size, bl);
+    encode(accounted_size, bl);
+    encode(etag, bl);
+    encode(mtime, bl);
+    encode(delete_at, bl);
+    encode(user_data, bl);
+    encode(attrs, bl);
+    ENCODE_FINISH(bl);
+  }
+
+  void decode(bufferlist::const_iterator& bl) {
+    DECODE_START(1, bl);
+    decode(oid, bl);
+    decode(bucket, bl);
+    decode(key, bl);
+    decode(owner, bl);
+    decode(placement_rule, bl);
+    decode(olh_epoch, bl);
+    decode(unique_tag, bl);
+    decode(size, bl);
+    decode(block_size, bl);
+    decode(accounted_size, bl);
+    decode(etag, bl);
+    decode(mtime, bl);
+    decode(delete_at, bl);
+    decode(user_data, bl);
+    decode(attrs, bl);
+    DECODE_FINISH(bl);
+  }
+};
+WRITE_CLASS_ENCODER(RGWD4NDirtyEntry)
+
+/* Log of the objects a gateway has acknowledged but not yet written to the
+ * backing store. It is kept in redis next to the cached blocks, so objects
+ * whose PUT was acknowledged are still flushed after the gateway restarts.
+ * Each object has at most one entry, the one of its latest PUT, and entries
+ * are listed oldest first. */
+class RGWD4NDirtyLog {
+  public:
+    RGWD4NDirtyLog(RGWD4NRedisCluster* _cluster, const std::string& gateway_id,
+                   std::chrono::milliseconds _timeout):cluster(_cluster),
+                                                      logKey("rgw-d4n:dirty:" + gateway_id),
+                                                      timeout(_timeout) {}
+
+    /* Records the entry, replacing any earlier one of the object, and sets
+     * its generation */
+    int add(RGWD4NDirtyEntry* entry, optional_yield y);
+    /* Lists the objects with entries, oldest first */
+    int list(uint64_t max, std::vector<std::string>* oids, optional_yield y);
+    /* Returns -2 if the object has no entry */
+    int get(const std::string& oid, RGWD4NDirtyEntry* entry, optional_yield y);
+    /* Removes the entry once it has been flushed. Returns -ECANCELED if the
+     * object was written again since the entry was read. */
+    int remove(const RGWD4NDirtyEntry& entry, optional_yield y);
+    /* Drops the object's entry whatever its generation. Returns -2 if the
+     * object had none. */
+    int discard(const std::string& oid, optional_yield y);
+
+  private:
+    RGWD4NRedisCluster* cluster;
+    std::string logKey;
+    std::chrono::milliseconds timeout;
+
+    /* The log is small, so all of its keys live on one endpoint */
+    RGWD4NRedisBatch batch() { return RGWD4NRedisBatch(cluster->get(logKey), timeout); }
+    std::string entriesKey() { return logKey + ":entries"; }
+    std::string genKey() { return logKey + ":gen"; }
+};
+
+#endif
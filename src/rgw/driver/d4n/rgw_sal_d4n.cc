@@ -14,6 +14,12 @@
  */
 
 #include "rgw_sal_d4n.h"
+#include "rgw_rest_conn.h"
+#include "common/hostname.h"
+#include "common/perf_counters.h"
+#include "driver/d4n/d4n_perf_counters.h"
+#include <limits>
+#include <set>
 
 #define dout_subsys ceph_subsys_rgw
 #define dout_context g_ceph_context
@@ -36,15 +42,605 @@ static inline Object* nextObject(Object* t)
   return dynamic_cast<FilterObject*>(t)->get_next();
 }
 
+D4NFilterDriver::~D4NFilterDriver()
+{
+  delete blk_dir; 
+  delete d4n_cache;
+}
+
 int D4NFilterDriver::initialize(CephContext *cct, const DoutPrefixProvider *dpp)
 {
   FilterDriver::initialize(cct, dpp);
+  d4n_perf_start(cct);
   blk_dir->init(cct);
   d4n_cache->init(cct);
+  peer_address = cct->_conf->rgw_d4n_peer_address;
+  policy = RGWD4NPolicy::create(cct->_conf->rgw_d4n_eviction_policy, d4n_cache->get_capacity());
+  admission = std::make_unique<RGWD4NAdmission>(cct, d4n_cache->get_capacity(), d4n_cache->get_block_size());
+
+  std::string gateway_id = ceph_get_hostname() + ":" + cct->_conf->name.to_str();
+
+  if (cct->_conf->rgw_d4n_invalidation) {
+    invalidator = std::make_unique<RGWD4NInvalidator>(d4n_cache->get_cluster(), gateway_id,
+						      d4n_cache->get_timeout(),
+						      [this] (const std::string& oid) { invalidate(oid); });
+
+    if (invalidator->start() < 0) {
+      ldpp_dout(dpp, 0) << "ERROR: D4N Filter: Failed to subscribe to invalidations" << dendl;
+      invalidator.reset();
+    } else {
+      d4n_cache->set_meta_trusted([inv = invalidator.get()] { return inv->is_live(); });
+      d4n_cache->set_meta_changed([this] (const std::string& oid) { invalidate(oid); });
+    }
+  }
+
+  if (cct->_conf->rgw_d4n_write_back && !d4n_cache->blocks_shared() && peer_address.empty()) {
+    /* The other gateways could neither read nor fetch the blocks of objects
+     * this one acknowledged */
+    ldpp_dout(dpp, 0) << "ERROR: D4N Filter: Write-back needs rgw_d4n_peer_address with a local "
+		      << "data cache; writing through" << dendl;
+  } else if (cct->_conf->rgw_d4n_write_back) {
+    /* Each gateway flushes the objects it acknowledged itself */
+    dirty_log = std::make_unique<RGWD4NDirtyLog>(d4n_cache->get_cluster(), gateway_id,
+						 d4n_cache->get_timeout());
+    cleaner = std::make_unique<D4NFilterCleaner>(cct, this, dirty_log.get());
+    cleaner->create("d4n_cleaner");
+  }
+
+  load_blocks(dpp);
+
+  if (cct->_conf->rgw_d4n_prefetch_blocks > 0) {
+    tracker = std::make_unique<RGWD4NAccessTracker>(cct->_conf->rgw_d4n_prefetch_max_streams,
+						    cct->_conf->rgw_d4n_prefetch_trigger,
+						    cct->_conf->rgw_d4n_prefetch_blocks);
+    prefetcher = std::make_unique<D4NFilterPrefetcher>(cct, this);
+    prefetcher->create("d4n_prefetch");
+  }
   
   return 0;
 }
 
+void D4NFilterDriver::finalize(void)
+{
+  /* Objects not yet written back stay in the dirty log for the next start */
+  if (cleaner) {
+    cleaner->stop();
+    cleaner.reset();
+  }
+
+  if (prefetcher) {
+    prefetcher->stop();
+    prefetcher.reset();
+  }
+
+  if (invalidator) {
+    d4n_cache->set_meta_trusted(nullptr);
+    d4n_cache->set_meta_changed(nullptr);
+    invalidator->stop();
+    invalidator.reset();
+  }
+
+  if (d4n_perfcounter) {
+    d4n_perf_stop(ctx());
+  }
+
+  FilterDriver::finalize();
+}
+
+int D4NFilterDriver::cache_block_data(const DoutPrefixProvider* dpp, Object* obj, uint64_t ofs,
+				      bufferlist& bl, optional_yield y, double cost, bool* compress)
+{
+  if (admission) {
+    RGWD4NPolicy::Block victim;
+    bool full = policy->peek_victim(bl.length(), &victim);
+    uint64_t obj_size = std::max<uint64_t>(obj->get_obj_size(), ofs + bl.length());
+
+    if (!admission->admit(obj->get_bucket()->get_name(), obj_size, cache_oid(obj), ofs,
+			  full ? &victim.oid : nullptr, victim.offset)) {
+      ldpp_dout(dpp, 20) << "D4N Filter: Block " << ofs << " not admitted to the cache." << dendl;
+
+      if (d4n_perfcounter) {
+	d4n_perfcounter->inc(l_d4n_admit_reject);
+      }
+      return 0;
+    }
+  }
+
+  /* Data RGW compressed or encrypted won't compress any further. Writers
+   * don't have the attrs yet and clear compress themselves. */
+  const auto& attrs = obj->get_attrs();
+  bool try_compress = (!compress || *compress) &&
+		      !attrs.count(RGW_ATTR_COMPRESSION) && !attrs.count(RGW_ATTR_CRYPT_MODE);
+  RGWD4NStoredBlock stored;
+
+  int ret = d4n_cache->putBlock(cache_oid(obj), ofs, bl, y, try_compress, &stored);
+
+  if (ret < 0) {
+    return ret;
+  }
+
+  if (compress && stored.compression.empty()) {
+    *compress = false;
+  }
+
+  if (d4n_perfcounter) {
+    d4n_perfcounter->inc(l_d4n_cache_in_b, bl.length());
+  }
+
+  /* The cache is charged for the space the block takes in it */
+  RGWD4NPolicy::Block block;
+  block.bucket_name = cache_bucket(obj->get_bucket()->get_key());
+  block.oid = cache_oid(obj);
+  block.obj_name = obj->get_key().get_oid();
+  block.version = obj->get_instance();
+  block.offset = ofs;
+  block.size = stored.size;
+  block.compression = stored.compression;
+
+  track_block(dpp, block, cost, y);
+
+  return 0;
+}
+
+void D4NFilterDriver::track_block(const DoutPrefixProvider* dpp, const RGWD4NPolicy::Block& block,
+				  double cost, optional_yield y)
+{
+  std::vector<RGWD4NPolicy::Block> victims;
+  policy->insert(block, cost, &victims);
+  add_block_host(dpp, block, y);
+
+  for (const auto& victim : victims) {
+    evict_block(dpp, victim, y);
+  }
+}
+
+void D4NFilterDriver::add_block_host(const DoutPrefixProvider* dpp, const RGWD4NPolicy::Block& block,
+				     optional_yield y)
+{
+  if (peer_address.empty()) {
+    return;
+  }
+
+  cache_block entry;
+  entry.c_obj.bucket_name = block.bucket_name;
+  entry.c_obj.obj_name = block.obj_name;
+  entry.c_obj.version = block.version;
+  entry.block_id = block.offset;
+  entry.size_in_bytes = block.size;
+  entry.compression = block.compression;
+
+  /* The block is still usable locally if the directory can't be updated */
+  if (blk_dir->addBlockHost(&entry, peer_address, y) < 0) {
+    ldpp_dout(dpp, 20) << "D4N Filter: Directory add block host operation failed." << dendl;
+  }
+}
+
+void D4NFilterDriver::load_blocks(const DoutPrefixProvider* dpp)
+{
+  std::set<std::string> dirty;
+
+  /* Shared blocks are tracked by the gateways that cached them */
+  if (d4n_cache->blocks_shared()) {
+    return;
+  }
+
+  if (dirty_log) {
+    std::vector<std::string> oids;
+
+    /* Evicting a block of an object not yet written back would lose it */
+    if (dirty_log->list(std::numeric_limits<int64_t>::max(), &oids, null_yield) < 0) {
+      ldpp_dout(dpp, 0) << "ERROR: D4N Filter: Failed to list the dirty log; blocks cached before "
+			<< "the start are not counted against the capacity" << dendl;
+      return;
+    }
+
+    dirty.insert(oids.begin(), oids.end());
+  }
+
+  uint64_t count = 0;
+  uint64_t bytes = 0;
+  int ret = d4n_cache->listBlocks([&] (const std::string& oid, uint64_t offset, uint64_t size) {
+    if (dirty.count(oid)) {
+      return;
+    }
+
+    /* Which bucket and version the block belongs to is not kept with it */
+    RGWD4NPolicy::Block block;
+    block.oid = oid;
+    block.offset = offset;
+    block.size = size;
+    std::vector<RGWD4NPolicy::Block> victims;
+    policy->insert(block, 0, &victims);
+
+    for (const auto& victim : victims) {
+      evict_block(dpp, victim, null_yield);
+    }
+
+    count++;
+    bytes += size;
+  });
+
+  if (ret < 0) {
+    ldpp_dout(dpp, 0) << "ERROR: D4N Filter: Failed to list the blocks already cached, ret=" << ret << dendl;
+  } else if (count) {
+    ldpp_dout(dpp, 5) << "D4N Filter: Found " << count << " blocks of " << bytes
+		      << " bytes cached before the start" << dendl;
+  }
+}
+
+void D4NFilterDriver::evict_block(const DoutPrefixProvider* dpp, const RGWD4NPolicy::Block& block,
+				  optional_yield y)
+{
+  ldpp_dout(dpp, 20) << "D4N Filter: Evicting block " << block.offset << " of " << block.oid << dendl;
+
+  if (d4n_perfcounter) {
+    d4n_perfcounter->inc(l_d4n_evict);
+    d4n_perfcounter->inc(l_d4n_evict_b, block.size);
+  }
+
+  if (d4n_cache->delBlock(block.oid, block.offset, y) < 0) {
+    ldpp_dout(dpp, 20) << "D4N Filter: Cache delete block operation failed." << dendl;
+  }
+
+  /* The bucket of blocks found at start is unknown, so is their entry */
+  if (!peer_address.empty() && !block.bucket_name.empty()) {
+    cache_block entry;
+    entry.c_obj.bucket_name = block.bucket_name;
+    entry.c_obj.obj_name = block.obj_name;
+    entry.c_obj.version = block.version;
+    entry.block_id = block.offset;
+
+    if (blk_dir->delBlockHost(&entry, peer_address, y) < 0) {
+      ldpp_dout(dpp, 20) << "D4N Filter: Directory delete block host operation failed." << dendl;
+    }
+  }
+}
+
+int D4NFilterDriver::lookup_object(cache_block* blk, optional_yield y)
+{
+  auto start = ceph::mono_clock::now();
+  int ret = blk_dir->getValue(blk, y);
+
+  if (d4n_perfcounter) {
+    d4n_perfcounter->inc(l_d4n_dir_lookup);
+    d4n_perfcounter->tinc(l_d4n_dir_lookup_lat, ceph::mono_clock::now() - start);
+  }
+
+  return ret;
+}
+
+void D4NFilterDriver::invalidate_peers(const DoutPrefixProvider* dpp, const std::string& oid,
+				       optional_yield y)
+{
+  if (invalidator && invalidator->publish(oid, y) < 0) {
+    ldpp_dout(dpp, 20) << "D4N Filter: Invalidation publish operation failed." << dendl;
+  }
+}
+
+void D4NFilterDriver::invalidate(const std::string& oid)
+{
+  NoDoutPrefix dpp(ctx(), dout_subsys);
+  std::vector<RGWD4NPolicy::Block> blocks;
+
+  if (d4n_perfcounter) {
+    d4n_perfcounter->inc(l_d4n_invalidate);
+  }
+
+  d4n_cache->invalidateLocal(oid);
+
+  if (oid.empty()) {
+    /* Notices may have been missed. The blocks of an object are only kept
+     * if the metadata held of it in process is found to be current. */
+    std::vector<std::string> oids;
+    policy->list_objects(&oids);
+
+    for (const auto& o : oids) {
+      if (d4n_cache->revalidate(o, null_yield) < 0) {
+	policy->erase_object(o, &blocks);
+
+	if (tracker) {
+	  tracker->forget(o);
+	}
+      }
+    }
+
+    ldpp_dout(&dpp, 5) << "D4N Filter: Dropped " << blocks.size() << " blocks of objects that may have changed" << dendl;
+  } else {
+    policy->erase_object(oid, &blocks);
+
+    if (tracker) {
+      tracker->forget(oid);
+    }
+  }
+
+  /* Shared blocks were already replaced or removed by the writer */
+  if (d4n_cache->blocks_shared()) {
+    return;
+  }
+
+  for (const auto& block : blocks) {
+    evict_block(&dpp, block, null_yield);
+  }
+}
+
+int D4NFilterDriver::fetch_peer_block(const DoutPrefixProvider* dpp, Object* obj, const std::string& host,
+				      uint64_t ofs, uint64_t len, bufferlist* bl, optional_yield y)
+{
+  RGWRESTConn* conn;
+
+  {
+    std::lock_guard l{peer_lock};
+    auto& c = peer_conns[host];
+
+    if (!c) {
+      /* Requests are signed with the zone's system key */
+      c = std::make_unique<RGWRESTConn>(dpp->get_cct(), this, host, std::list<std::string>{host},
+					std::nullopt);
+    }
+
+    conn = c.get();
+  }
+
+  RGWStreamIntoBufferlist cb(*bl);
+  RGWRESTConn::get_obj_params params;
+  params.uid = obj->get_bucket()->get_info().owner;
+  params.get_op = true;
+  params.cb = &cb;
+  params.range_is_set = true;
+  params.range_start = ofs;
+  params.range_end = ofs + len - 1;
+
+  RGWRESTStreamRWRequest* req = nullptr;
+  int ret = conn->get_obj(dpp, obj->get_obj(), params, true, &req);
+
+  if (ret < 0) {
+    return ret;
+  }
+
+  return conn->complete_request(req, nullptr, nullptr, nullptr, nullptr, nullptr, y);
+}
+
+void* D4NFilterCleaner::entry()
+{
+  ldpp_dout(this, 5) << "started" << dendl;
+  auto interval = std::chrono::milliseconds(cct->_conf->rgw_d4n_write_back_interval_ms);
+  std::unique_lock l{lock};
+
+  while (!stopping) {
+    l.unlock();
+
+    std::vector<std::string> oids;
+    int ret = log->list(cct->_conf->rgw_d4n_write_back_batch_size, &oids, null_yield);
+
+    if (ret < 0) {
+      ldpp_dout(this, 0) << "ERROR: failed to list dirty log" << dendl;
+    }
+
+    uint64_t flushed = 0;
+
+    for (const auto& oid : oids) {
+      if (flush_object(oid) == 0) {
+	flushed++;
+      }
+
+      std::lock_guard sl{lock};
+
+      if (stopping)
+	break;
+    }
+
+    l.lock();
+
+    /* Keep going while a full batch could be flushed */
+    if (!stopping && (oids.size() < cct->_conf->rgw_d4n_write_back_batch_size || flushed < oids.size())) {
+      cond.wait_for(l, interval);
+    }
+  }
+
+  ldpp_dout(this, 5) << "stopped" << dendl;
+  return nullptr;
+}
+
+void D4NFilterCleaner::stop()
+{
+  {
+    std::lock_guard l{lock};
+    stopping = true;
+    cond.notify_all();
+  }
+
+  join();
+}
+
+void D4NFilterCleaner::wait(std::unique_lock<ceph::mutex>& l, optional_yield y)
+{
+  if (y) {
+    Waiter waiter(y.get_io_context());
+    waiters.push_back(waiter);
+    l.unlock();
+
+    /* Woken early by notify() */
+    waiter.timer.expires_after(std::chrono::seconds(1));
+
+    boost::system::error_code ec;
+    waiter.timer.async_wait(y.get_yield_context()[ec]);
+
+    l.lock();
+    waiters.erase(waiters.iterator_to(waiter));
+    return;
+  }
+
+  flushing_cond.wait(l);
+}
+
+void D4NFilterCleaner::notify()
+{
+  flushing_cond.notify_all();
+
+  for (auto& waiter : waiters) {
+    waiter.timer.cancel();
+  }
+}
+
+int D4NFilterCleaner::flush_object(const std::string& oid)
+{
+  hold(oid, null_yield);
+
+  /* The entry is read again since a newer PUT may have replaced it */
+  RGWD4NDirtyEntry entry;
+  int ret = log->get(oid, &entry, null_yield);
+
+  if (ret == 0) {
+    ret = flush(entry);
+  } else if (ret == -2) {
+    ret = 0;
+  }
+
+  release(oid);
+  return ret;
+}
+
+void D4NFilterCleaner::hold(const std::string& oid, optional_yield y)
+{
+  std::unique_lock l{lock};
+
+  while (flushing.count(oid)) {
+    wait(l, y);
+  }
+
+  flushing.insert(oid);
+}
+
+void D4NFilterCleaner::release(const std::string& oid)
+{
+  std::lock_guard l{lock};
+  flushing.erase(oid);
+  notify();
+}
+
+int D4NFilterCleaner::flush(RGWD4NDirtyEntry& entry)
+{
+  RGWD4NCache* cache = filter->get_d4n_cache();
+  std::vector<uint64_t> offsets;
+  std::vector<bufferlist> blocks;
+
+  for (uint64_t ofs = 0; ofs < entry.size; ofs += entry.block_size) {
+    offsets.push_back(ofs);
+  }
+
+  if (!offsets.empty() && cache->getBlocks(entry.oid, offsets, &blocks, null_yield) < 0) {
+    ldpp_dout(this, 0) << "ERROR: failed to read blocks of " << entry.oid << dendl;
+    return -EIO;
+  }
+
+  for (size_t i = 0; i < offsets.size(); ++i) {
+    if (blocks[i].length() != std::min(entry.block_size, entry.size - offsets[i])) {
+      /* Nothing else holds the data, so the entry can never be flushed */
+      ldpp_dout(this, 0) << "ERROR: block " << offsets[i] << " of " << entry.oid
+			 << " is missing from the cache; dropping the object" << dendl;
+      log->remove(entry, null_yield);
+      return -ENOENT;
+    }
+  }
+
+  Driver* next = filter->get_next();
+  std::unique_ptr<Bucket> bucket;
+  int ret = next->get_bucket(this, nullptr, entry.bucket, &bucket, null_yield);
+
+  if (ret == -ENOENT) {
+    ldpp_dout(this, 0) << "ERROR: bucket " << entry.bucket << " of " << entry.oid
+		       << " no longer exists; dropping the object" << dendl;
+    log->remove(entry, null_yield);
+    return ret;
+  } else if (ret < 0) {
+    return ret;
+  }
+
+  std::unique_ptr<Object> obj = bucket->get_object(entry.key);
+  std::unique_ptr<Writer> writer = next->get_atomic_writer(this, null_yield, obj.get(), entry.owner,
+							   &entry.placement_rule, entry.olh_epoch,
+							   entry.unique_tag);
+
+  ret = writer->prepare(null_yield);
+
+  for (size_t i = 0; ret >= 0 && i < offsets.size(); ++i) {
+    ret = writer->process(std::move(blocks[i]), offsets[i]);
+  }
+
+  if (ret >= 0) {
+    ret = writer->process({}, entry.size);
+  }
+
+  if (ret >= 0) {
+    ceph::real_time mtime;
+    rgw_zone_set zones_trace;
+    bool canceled = false;
+
+    ret = writer->complete(entry.accounted_size, entry.etag, &mtime, entry.mtime, entry.attrs,
+			   entry.delete_at, nullptr, nullptr, &entry.user_data, &zones_trace,
+			   &canceled, null_yield);
+  }
+
+  if (ret < 0) {
+    ldpp_dout(this, 0) << "ERROR: failed to write " << entry.oid << " to the backing store, ret="
+		       << ret << dendl;
+
+    if (d4n_perfcounter) {
+      d4n_perfcounter->inc(l_d4n_wb_flush_fail);
+    }
+    return ret;
+  }
+
+  ldpp_dout(this, 20) << "flushed " << entry.oid << " generation " << entry.gen << dendl;
+
+  if (d4n_perfcounter) {
+    d4n_perfcounter->inc(l_d4n_wb_flush);
+  }
+
+  /* A newer PUT keeps the object dirty and its blocks out of the policy */
+  if (log->remove(entry, null_yield) < 0) {
+    return 0;
+  }
+
+  if (cache->clearDirty(entry.oid, entry.gen, null_yield) < 0) {
+    ldpp_dout(this, 20) << "failed to mark " << entry.oid << " as written back" << dendl;
+  }
+
+  for (size_t i = 0; i < offsets.size(); ++i) {
+    RGWD4NPolicy::Block block;
+    block.bucket_name = D4NFilterDriver::cache_bucket(entry.bucket);
+    block.oid = entry.oid;
+    block.obj_name = entry.key.get_oid();
+    block.offset = offsets[i];
+    block.size = std::min(entry.block_size, entry.size - offsets[i]);
+
+    filter->track_block(this, block, 0, null_yield);
+  }
+
+  return 0;
+}
+
+int D4NFilterCleaner::discard(const std::string& oid, optional_yield y)
+{
+  /* The object can't be flushed until the entry is gone */
+  hold(oid, y);
+  int ret = log->discard(oid, y);
+  release(oid);
+
+  return ret;
+}
+
+std::string D4NFilterDriver::cache_oid(Object* obj)
+{
+  Bucket* bucket = obj->get_bucket();
+
+  if (!bucket) {
+    return obj->get_key().get_oid();
+  }
+
+  return cache_bucket(bucket->get_key()) + "/" + obj->get_key().get_oid();
+}
+
 std::unique_ptr<User> D4NFilterDriver::get_user(const rgw_user &u)
 {
   std::unique_ptr<User> user = next->get_user(u);
@@ -88,6 +684,21 @@ int D4NFilterUser::create_bucket(const DoutPrefixProvider* dpp,
   return 0;
 }
 
+int D4NFilterObject::write_back_dirty(const DoutPrefixProvider* dpp)
+{
+  if (!filter->get_cleaner()) {
+    return 0;
+  }
+
+  int ret = filter->get_cleaner()->flush_object(D4NFilterDriver::cache_oid(this));
+
+  if (ret < 0) {
+    ldpp_dout(dpp, 0) << "D4N Filter: Failed to write back " << get_key().get_oid() << dendl;
+  }
+
+  return ret;
+}
+
 int D4NFilterObject::copy_object(User* user,
                               req_info* info,
                               const rgw_zone_id& source_zone,
@@ -116,31 +727,56 @@ int D4NFilterObject::copy_object(User* user,
                               const DoutPrefixProvider* dpp,
                               optional_yield y)
 {
-  /* Append additional metadata to attributes */
-  rgw::sal::Attrs baseAttrs = this->get_attrs();
-  buffer::list bl;
+  /* The backing store copies from its own copy of the source */
+  int flushReturn = write_back_dirty(dpp);
 
-  bl.append(to_iso_8601(*mtime));
-  baseAttrs.insert({"mtime", bl});
-  bl.clear();
-  
-  if (version_id != NULL) { 
-    bl.append(*version_id);
-    baseAttrs.insert({"version_id", bl});
-    bl.clear();
-  }
- 
-  if (!etag->empty()) {
-    bl.append(*etag);
-    baseAttrs.insert({"etag", bl});
-    bl.clear();
+  if (flushReturn < 0) {
+    return flushReturn;
   }
 
-  if (attrs_mod == rgw::sal::ATTRSMOD_REPLACE) { /* Replace */
-    rgw::sal::Attrs::iterator iter;
+  std::string dest_oid = D4NFilterDriver::cache_oid(dest_object);
+  D4NFilterCleaner* cleaner = filter->get_cleaner();
 
-    for (const auto& pair : attrs) {
-      iter = baseAttrs.find(pair.first);
+  /* A destination not yet written back keeps its only copy until the copy
+   * has replaced it, and is not written after it */
+  if (cleaner) {
+    cleaner->hold(dest_oid, y);
+  }
+
+  int ret = next->copy_object(user, info, source_zone,
+                           nextObject(dest_object),
+                           nextBucket(dest_bucket),
+                           nextBucket(src_bucket),
+                           dest_placement, src_mtime, mtime,
+                           mod_ptr, unmod_ptr, high_precision_time, if_match,
+                           if_nomatch, attrs_mod, copy_if_newer, attrs,
+                           category, olh_epoch, delete_at, version_id, tag,
+                           etag, progress_cb, progress_data, dpp, y);
+
+  if (ret < 0) {
+    if (cleaner) {
+      cleaner->release(dest_oid);
+    }
+    return ret;
+  }
+
+  if (cleaner && filter->get_dirty_log()->discard(dest_oid, y) == 0) {
+    filter->get_d4n_cache()->deleteData(dest_oid, y);
+  }
+
+  rgw::sal::Attrs baseAttrs = this->get_attrs();
+
+  if (!etag->empty()) {
+    buffer::list bl;
+    bl.append(*etag);
+    baseAttrs.insert({"etag", bl});
+  }
+
+  if (attrs_mod == rgw::sal::ATTRSMOD_REPLACE) { /* Replace */
+    rgw::sal::Attrs::iterator iter;
+
+    for (const auto& pair : attrs) {
+      iter = baseAttrs.find(pair.first);
     
       if (iter != baseAttrs.end()) {
         iter->second = pair.second;
@@ -152,294 +788,1192 @@ int D4NFilterObject::copy_object(User* user,
     baseAttrs.insert(attrs.begin(), attrs.end()); 
   }
 
-  int copyObjReturn = filter->get_d4n_cache()->copyObject(this->get_key().get_oid(), dest_object->get_key().get_oid(), &baseAttrs);
+  int copyObjReturn = filter->get_d4n_cache()->copyObject(D4NFilterDriver::cache_oid(this), dest_oid,
+									*mtime, version_id, &baseAttrs, y);
+
+  if (copyObjReturn < 0) {
+    ldpp_dout(dpp, 20) << "D4N Filter: Cache copy object operation failed." << dendl;
+  } else {
+    ldpp_dout(dpp, 20) << "D4N Filter: Cache copy object operation succeeded." << dendl;
+  }
+
+  if (cleaner) {
+    cleaner->release(dest_oid);
+  }
+
+  filter->invalidate_peers(dpp, dest_oid, y);
+
+  return ret;
+}
+
+int D4NFilterObject::set_obj_attrs(const DoutPrefixProvider* dpp, Attrs* setattrs,
+                            Attrs* delattrs, optional_yield y) 
+{
+  int flushReturn = write_back_dirty(dpp);
+
+  if (flushReturn < 0) {
+    return flushReturn;
+  }
+
+  if (setattrs != NULL) {
+    /* Ensure setattrs and delattrs do not overlap */
+    if (delattrs != NULL) {
+      for (const auto& attr : *delattrs) {
+        if (std::find(setattrs->begin(), setattrs->end(), attr) != setattrs->end()) {
+          delattrs->erase(std::find(delattrs->begin(), delattrs->end(), attr));
+        }
+      }
+    }
+
+    int updateAttrsReturn = filter->get_d4n_cache()->setAttrs(D4NFilterDriver::cache_oid(this), setattrs, y);
+
+    if (updateAttrsReturn < 0) {
+      ldpp_dout(dpp, 20) << "D4N Filter: Cache set object attributes operation failed." << dendl;
+    } else {
+      ldpp_dout(dpp, 20) << "D4N Filter: Cache set object attributes operation succeeded." << dendl;
+    }
+  }
+
+  if (delattrs != NULL) {
+    std::vector<std::string> delFields;
+    Attrs::iterator attrs;
+
+    /* Extract fields from delattrs */
+    for (attrs = delattrs->begin(); attrs != delattrs->end(); ++attrs) {
+      delFields.push_back(attrs->first);
+    }
+
+    Attrs currentattrs = this->get_attrs();
+    std::vector<std::string> currentFields;
+    
+    /* Extract fields from current attrs */
+    for (attrs = currentattrs.begin(); attrs != currentattrs.end(); ++attrs) {
+      currentFields.push_back(attrs->first);
+    }
+    
+    int delAttrsReturn = filter->get_d4n_cache()->delAttrs(D4NFilterDriver::cache_oid(this), currentFields, delFields, y);
+
+    if (delAttrsReturn < 0) {
+      ldpp_dout(dpp, 20) << "D4N Filter: Cache delete object attributes operation failed." << dendl;
+    } else {
+      ldpp_dout(dpp, 20) << "D4N Filter: Cache delete object attributes operation succeeded." << dendl;
+    }
+  }
+
+  int ret = next->set_obj_attrs(dpp, setattrs, delattrs, y);
+  filter->invalidate_peers(dpp, D4NFilterDriver::cache_oid(this), y);
+
+  return ret;
+}
+
+int D4NFilterObject::get_obj_attrs(optional_yield y, const DoutPrefixProvider* dpp,
+                                rgw_obj* target_obj)
+{
+  RGWD4NObjectMeta meta;
+  int getAttrsReturn = filter->get_d4n_cache()->getObject(D4NFilterDriver::cache_oid(this), &meta, y);
+
+  if (getAttrsReturn < 0) {
+    ldpp_dout(dpp, 20) << "D4N Filter: Cache get object attributes operation failed." << dendl;
+
+    return next->get_obj_attrs(y, dpp, target_obj);
+  } else {
+    int setAttrsReturn = this->set_attrs(meta.attrs);
+    
+    if (setAttrsReturn < 0) {
+      ldpp_dout(dpp, 20) << "D4N Filter: Cache get object attributes operation failed." << dendl;
+
+      return next->get_obj_attrs(y, dpp, target_obj);
+    } else {
+      ldpp_dout(dpp, 20) << "D4N Filter: Cache get object attributes operation succeeded." << dendl;
+  
+      return 0;
+    }
+  }
+}
+
+int D4NFilterObject::modify_obj_attrs(const char* attr_name, bufferlist& attr_val,
+                               optional_yield y, const DoutPrefixProvider* dpp) 
+{
+  int flushReturn = write_back_dirty(dpp);
+
+  if (flushReturn < 0) {
+    return flushReturn;
+  }
+
+  Attrs update;
+  update[(std::string)attr_name] = attr_val;
+  int updateAttrsReturn = filter->get_d4n_cache()->updateAttr(D4NFilterDriver::cache_oid(this), &update, y);
+
+  if (updateAttrsReturn < 0) {
+    ldpp_dout(dpp, 20) << "D4N Filter: Cache modify object attribute operation failed." << dendl;
+  } else {
+    ldpp_dout(dpp, 20) << "D4N Filter: Cache modify object attribute operation succeeded." << dendl;
+  }
+
+  int ret = next->modify_obj_attrs(attr_name, attr_val, y, dpp);
+  filter->invalidate_peers(dpp, D4NFilterDriver::cache_oid(this), y);
+
+  return ret;
+}
+
+int D4NFilterObject::delete_obj_attrs(const DoutPrefixProvider* dpp, const char* attr_name,
+                               optional_yield y) 
+{
+  int flushReturn = write_back_dirty(dpp);
+
+  if (flushReturn < 0) {
+    return flushReturn;
+  }
+
+  std::vector<std::string> delFields;
+  delFields.push_back((std::string)attr_name);
+  
+  Attrs::iterator attrs;
+  Attrs currentattrs = this->get_attrs();
+  std::vector<std::string> currentFields;
+  
+  /* Extract fields from current attrs */
+  for (attrs = currentattrs.begin(); attrs != currentattrs.end(); ++attrs) {
+    currentFields.push_back(attrs->first);
+  }
+  
+  int delAttrReturn = filter->get_d4n_cache()->delAttrs(D4NFilterDriver::cache_oid(this), currentFields, delFields, y);
+
+  if (delAttrReturn < 0) {
+    ldpp_dout(dpp, 20) << "D4N Filter: Cache delete object attribute operation failed." << dendl;
+  } else {
+    ldpp_dout(dpp, 20) << "D4N Filter: Cache delete object attribute operation succeeded." << dendl;
+  }
+  
+  int ret = next->delete_obj_attrs(dpp, attr_name, y);
+  filter->invalidate_peers(dpp, D4NFilterDriver::cache_oid(this), y);
+
+  return ret;
+}
+
+std::unique_ptr<Object> D4NFilterDriver::get_object(const rgw_obj_key& k)
+{
+  std::unique_ptr<Object> o = next->get_object(k);
+
+  return std::make_unique<D4NFilterObject>(std::move(o), this);
+}
+
+std::unique_ptr<Writer> D4NFilterDriver::get_atomic_writer(const DoutPrefixProvider *dpp,
+				  optional_yield y,
+				  rgw::sal::Object* obj,
+				  const rgw_user& owner,
+				  const rgw_placement_rule *ptail_placement_rule,
+				  uint64_t olh_epoch,
+				  const std::string& unique_tag)
+{
+  std::unique_ptr<Writer> writer = next->get_atomic_writer(dpp, y, nextObject(obj),
+							   owner, ptail_placement_rule,
+							   olh_epoch, unique_tag);
+
+  return std::make_unique<D4NFilterWriter>(std::move(writer), this, obj, dpp, true, y,
+					   owner, ptail_placement_rule, olh_epoch, unique_tag);
+}
+
+std::unique_ptr<Object::ReadOp> D4NFilterObject::get_read_op()
+{
+  std::unique_ptr<ReadOp> r = next->get_read_op();
+  return std::make_unique<D4NFilterReadOp>(std::move(r), this);
+}
+
+std::unique_ptr<Object::DeleteOp> D4NFilterObject::get_delete_op()
+{
+  std::unique_ptr<DeleteOp> d = next->get_delete_op();
+  return std::make_unique<D4NFilterDeleteOp>(std::move(d), this);
+}
+
+int D4NFilterObject::D4NFilterReadOp::prepare(optional_yield y, const DoutPrefixProvider* dpp)
+{
+  blk = cache_block();
+  blk.c_obj.bucket_name = D4NFilterDriver::cache_bucket(source->get_bucket()->get_key());
+  blk.c_obj.obj_name = source->get_key().get_oid();
+  blk.c_obj.version = source->get_instance();
+
+  int getDirReturn = source->filter->lookup_object(&blk, y);
+  blk_found = (getDirReturn == 0);
+
+  if (getDirReturn < 0) {
+    ldpp_dout(dpp, 20) << "D4N Filter: Directory get operation failed." << dendl;
+  } else {
+    ldpp_dout(dpp, 20) << "D4N Filter: Directory get operation succeeded." << dendl;
+  }
+
+  RGWD4NObjectMeta meta;
+  int getObjReturn = source->filter->get_d4n_cache()->getObject(D4NFilterDriver::cache_oid(source), &meta, y);
+  dirty = (getObjReturn == 0 && meta.dirty_gen != 0);
+
+  /* Objects not yet written back don't exist in the backing store */
+  int ret;
+
+  if (dirty) {
+    ret = check_dirty_conditions(dpp, meta);
+  } else {
+    next->params = params;
+    ret = next->prepare(y, dpp);
+  }
+
+  if (ret < 0) {
+    return ret;
+  }
+  
+  if (getObjReturn < 0) {
+    ldpp_dout(dpp, 20) << "D4N Filter: Cache get object operation failed." << dendl;
+  } else {
+    /* Set metadata locally */
+    RGWQuotaInfo quota_info;
+    RGWObjState dirty_state;
+    RGWObjState* astate = &dirty_state;
+
+    if (dirty) {
+      dirty_state.exists = true;
+    } else {
+      source->get_obj_state(dpp, &astate, y);
+    }
+
+    astate->mtime = meta.mtime;
+    source->set_obj_size(meta.object_size);
+    astate->accounted_size = meta.accounted_size;
+    astate->epoch = meta.epoch;
+    source->set_instance(meta.version_id);
+    astate->zone_short_id = meta.source_zone_short_id;
+    source->get_bucket()->set_count(meta.bucket_count);
+    source->get_bucket()->set_size(meta.bucket_size);
+    quota_info.max_size = meta.user_quota_max_size;
+    quota_info.max_objects = meta.user_quota_max_objects;
+    source->get_bucket()->get_owner()->set_max_buckets(meta.max_buckets);
+
+    source->get_bucket()->get_owner()->set_info(quota_info);
+    source->set_obj_state(*astate);
+   
+    /* Set attributes locally */
+    int setAttrsReturn = source->set_attrs(meta.attrs);
+
+    if (setAttrsReturn < 0) {
+      ldpp_dout(dpp, 20) << "D4N Filter: Cache get object operation failed." << dendl;
+    } else {
+      ldpp_dout(dpp, 20) << "D4N Filter: Cache get object operation succeeded." << dendl;
+    }   
+  }
+
+  return ret;
+}
+
+/* Passes data read from the next driver on to the client while writing
+ * every complete block of it to the cache. The range read from the next
+ * driver starts on a block boundary, so the client only receives the part
+ * that was requested. */
+class D4NFilterFillCB : public RGWGetDataCB {
+  private:
+    D4NFilterDriver* filter;
+    const DoutPrefixProvider* dpp;
+    Object* obj;
+    RGWGetDataCB* client_cb;
+    uint64_t ofs;
+    uint64_t end; /* Inclusive, as for iterate() */
+    uint64_t obj_size;
+    optional_yield y;
+    uint64_t cur_ofs;
+    bufferlist pending;
+    uint64_t pending_ofs;
+    bool cache_data = true;
+    bool compress = true; /* Until a block doesn't compress well */
+    ceph::mono_time start = ceph::mono_clock::now();
+    uint64_t received = 0;
+
+  public:
+    D4NFilterFillCB(D4NFilterDriver* _filter, const DoutPrefixProvider* _dpp, Object* _obj,
+		    RGWGetDataCB* _cb, uint64_t blk_ofs, uint64_t _ofs, uint64_t _end,
+		    uint64_t _obj_size, optional_yield _y) : filter(_filter), dpp(_dpp),
+							     obj(_obj), client_cb(_cb),
+							     ofs(_ofs), end(_end), obj_size(_obj_size),
+							     y(_y), cur_ofs(blk_ofs),
+							     pending_ofs(blk_ofs) {}
+
+    virtual int handle_data(bufferlist& bl, off_t bl_ofs, off_t bl_len) override {
+      bufferlist data;
+      data.substr_of(bl, bl_ofs, bl_len);
+
+      if (d4n_perfcounter) {
+	d4n_perfcounter->inc(l_d4n_backend_in_b, bl_len);
+      }
+
+      uint64_t lo = std::max(cur_ofs, ofs);
+      uint64_t hi = std::min(cur_ofs + bl_len, end + 1);
+
+      /* Prefetches have no client */
+      if (client_cb && lo < hi) {
+	bufferlist out;
+	out.substr_of(data, lo - cur_ofs, hi - lo);
+
+	int r = client_cb->handle_data(out, 0, hi - lo);
+
+	if (r < 0)
+	  return r;
+      }
+
+      if (cache_data) {
+	pending.append(data);
+	received += bl_len;
+
+	if (flush_blocks() < 0) {
+	  ldpp_dout(dpp, 20) << "D4N Filter: Cache put block operation failed." << dendl;
+	  cache_data = false;
+	  pending.clear();
+	}
+      }
+
+      cur_ofs += bl_len;
+      return 0;
+    }
+
+  private:
+    int flush_blocks() {
+      uint64_t block_size = filter->get_d4n_cache()->get_block_size();
+
+      /* The last block of the object is the only one that may be short */
+      while (pending.length() >= block_size ||
+	     (pending.length() > 0 && pending_ofs + pending.length() == obj_size)) {
+	bufferlist block;
+	pending.splice(0, std::min<uint64_t>(block_size, pending.length()), &block);
+
+	/* Blocks are charged their share of the time spent reading so far */
+	double elapsed = std::chrono::duration<double, std::micro>(ceph::mono_clock::now() - start).count();
+	double cost = received ? elapsed * block.length() / received : 0;
+
+	int r = filter->cache_block_data(dpp, obj, pending_ofs, block, y, cost, &compress);
+
+	if (r < 0)
+	  return r;
+
+	pending_ofs += block.length();
+      }
+
+      return 0;
+    }
+};
+
+void* D4NFilterPrefetcher::entry()
+{
+  ldpp_dout(this, 5) << "started" << dendl;
+  std::unique_lock l{lock};
+
+  while (!stopping) {
+    if (queue.empty()) {
+      cond.wait(l);
+      continue;
+    }
+
+    Request req = std::move(queue.front());
+    queue.pop_front();
+    l.unlock();
+
+    int ret = prefetch(req);
+
+    if (ret < 0) {
+      ldpp_dout(this, 20) << "prefetch of " << req.key << " bytes " << req.ofs << "-" << req.end
+			  << " failed, ret=" << ret << dendl;
+    }
+
+    l.lock();
+    reserved -= req.end - req.ofs + 1;
+  }
+
+  ldpp_dout(this, 5) << "stopped" << dendl;
+  return nullptr;
+}
+
+void D4NFilterPrefetcher::stop()
+{
+  {
+    std::lock_guard l{lock};
+    stopping = true;
+    cond.notify_all();
+  }
+
+  join();
+}
+
+bool D4NFilterPrefetcher::submit(Request&& req)
+{
+  uint64_t len = req.end - req.ofs + 1;
+  std::lock_guard l{lock};
+
+  if (stopping || reserved + len > budget) {
+    return false;
+  }
+
+  reserved += len;
+  queue.push_back(std::move(req));
+  cond.notify_one();
+
+  return true;
+}
+
+int D4NFilterPrefetcher::prefetch(const Request& req)
+{
+  uint64_t block_size = filter->get_d4n_cache()->get_block_size();
+  std::unique_ptr<Bucket> bucket;
+  int ret = filter->get_next()->get_bucket(this, nullptr, req.bucket, &bucket, null_yield);
+
+  if (ret < 0) {
+    return ret;
+  }
+
+  std::unique_ptr<Object> obj = bucket->get_object(req.key);
+  std::unique_ptr<Object::ReadOp> op = obj->get_read_op();
+
+  if (!req.etag.empty()) {
+    op->params.if_match = req.etag.c_str();
+  }
+
+  ret = op->prepare(null_yield, this);
+
+  if (ret < 0) {
+    return ret;
+  }
+
+  if (obj->get_obj_size() != req.obj_size) {
+    return -ECANCELED;
+  }
+
+  std::string oid = D4NFilterDriver::cache_oid(obj.get());
+
+  /* The backing store's copy of an object written back since is stale */
+  if (filter->get_cleaner()) {
+    RGWD4NObjectMeta meta;
+
+    if (filter->get_d4n_cache()->getObject(oid, &meta, null_yield) == 0 && meta.dirty_gen != 0) {
+      return -ECANCELED;
+    }
+  }
+  uint64_t ofs = req.ofs;
+
+  /* Blocks the stream's reads brought in meanwhile are skipped */
+  while (ofs <= req.end) {
+    while (ofs <= req.end && filter->get_policy()->contains(oid, ofs)) {
+      ofs += block_size;
+    }
+
+    if (ofs > req.end) {
+      break;
+    }
+
+    uint64_t end = ofs;
+
+    while (end + block_size <= req.end && !filter->get_policy()->contains(oid, end + block_size)) {
+      end += block_size;
+    }
+
+    end = std::min(end + block_size - 1, req.end);
+
+    if (RGWD4NAdmission* admission = filter->get_admission()) {
+      /* The blocks are expected to be read, like those before them */
+      for (uint64_t o = ofs; o <= end; o += block_size) {
+	admission->record(oid, o);
+      }
+    }
+
+    D4NFilterFillCB cb(filter, this, obj.get(), nullptr, ofs, ofs, end, req.obj_size, null_yield);
+    ret = op->iterate(this, ofs, end, &cb, null_yield);
+
+    if (ret < 0) {
+      return ret;
+    }
+
+    ldpp_dout(this, 20) << "prefetched " << oid << " bytes " << ofs << "-" << end << dendl;
+
+    if (d4n_perfcounter) {
+      d4n_perfcounter->inc(l_d4n_prefetch_b, end - ofs + 1);
+    }
+    ofs = end + 1;
+  }
+
+  return 0;
+}
+
+int D4NFilterObject::D4NFilterReadOp::check_dirty_conditions(const DoutPrefixProvider* dpp,
+							     const RGWD4NObjectMeta& meta)
+{
+  std::string etag;
+  auto iter = meta.attrs.find(RGW_ATTR_ETAG);
+
+  if (iter != meta.attrs.end()) {
+    etag = rgw_string_unquote(iter->second.to_str());
+  }
+
+  if (params.mod_ptr && meta.mtime <= *params.mod_ptr) {
+    return -ERR_NOT_MODIFIED;
+  }
+
+  if (params.unmod_ptr && meta.mtime > *params.unmod_ptr) {
+    return -ERR_PRECONDITION_FAILED;
+  }
+
+  if (params.if_match && rgw_string_unquote(params.if_match) != etag) {
+    return -ERR_PRECONDITION_FAILED;
+  }
+
+  if (params.if_nomatch && rgw_string_unquote(params.if_nomatch) == etag) {
+    return -ERR_NOT_MODIFIED;
+  }
+
+  if (params.lastmod) {
+    *params.lastmod = meta.mtime;
+  }
+
+  return 0;
+}
+
+int D4NFilterObject::D4NFilterReadOp::fill_blocks(const DoutPrefixProvider* dpp,
+						  uint64_t blk_ofs, uint64_t blk_end,
+						  int64_t ofs, int64_t end,
+						  RGWGetDataCB* cb, optional_yield y)
+{
+  if (dirty) {
+    ldpp_dout(dpp, 0) << "ERROR: D4N Filter: blocks " << blk_ofs << "-" << blk_end << " of "
+		      << source->get_key().get_oid() << " are missing and not yet written back" << dendl;
+    return -EIO;
+  }
+
+  D4NFilterFillCB fill_cb(source->filter, dpp, source, cb,
+			  blk_ofs, ofs, end, source->get_obj_size(), y);
+
+  return next->iterate(dpp, blk_ofs, blk_end, &fill_cb, y);
+}
+
+void D4NFilterObject::D4NFilterReadOp::fetch_peer_blocks(const DoutPrefixProvider* dpp,
+							const std::vector<uint64_t>& offsets,
+							std::vector<bufferlist>* blocks,
+							optional_yield y)
+{
+  D4NFilterDriver* filter = source->filter;
+  uint64_t block_size = filter->get_d4n_cache()->get_block_size();
+  uint64_t obj_size = source->get_obj_size();
+
+  if (filter->get_peer_address().empty()) {
+    return;
+  }
+
+  /* Peers return the object's data as a client sees it, which only matches
+   * the stored blocks when the object is neither compressed nor encrypted */
+  const auto& attrs = source->get_attrs();
+
+  if (attrs.count(RGW_ATTR_COMPRESSION) || attrs.count(RGW_ATTR_CRYPT_MODE)) {
+    return;
+  }
+
+  std::vector<cache_block> missing;
+  std::vector<size_t> indexes;
+
+  for (size_t i = 0; i < offsets.size(); ++i) {
+    if ((*blocks)[i].length() == std::min(block_size, obj_size - offsets[i]))
+      continue;
+
+    cache_block entry;
+    entry.c_obj.bucket_name = D4NFilterDriver::cache_bucket(source->get_bucket()->get_key());
+    entry.c_obj.obj_name = source->get_key().get_oid();
+    entry.c_obj.version = source->get_instance();
+    entry.block_id = offsets[i];
+
+    missing.push_back(std::move(entry));
+    indexes.push_back(i);
+  }
+
+  if (missing.empty() || filter->get_block_dir()->getBlockValues(&missing, y) < 0) {
+    return;
+  }
+
+  /* An entry listing this gateway for a block it doesn't hold is stale. It
+   * is removed before asking any peer, so that a peer with a stale entry of
+   * its own can't send the request back here. */
+  for (auto& entry : missing) {
+    auto self = std::find(entry.hosts_list.begin(), entry.hosts_list.end(), filter->get_peer_address());
+
+    if (self != entry.hosts_list.end()) {
+      entry.hosts_list.erase(self);
+      filter->get_block_dir()->delBlockHost(&entry, filter->get_peer_address(), y);
+    }
+  }
+
+  for (size_t j = 0; j < missing.size(); ++j) {
+    size_t i = indexes[j];
+    uint64_t len = std::min(block_size, obj_size - offsets[i]);
+
+    for (const auto& host : missing[j].hosts_list) {
+      bufferlist bl;
+      auto fetch_start = ceph::mono_clock::now();
+
+      if (filter->fetch_peer_block(dpp, source, host, offsets[i], len, &bl, y) < 0 ||
+	  bl.length() != len) {
+	ldpp_dout(dpp, 20) << "D4N Filter: Peer fetch of block " << offsets[i] << " from " << host << " failed." << dendl;
+	continue;
+      }
+
+      ldpp_dout(dpp, 20) << "D4N Filter: Fetched block " << offsets[i] << " from peer " << host << dendl;
+
+      if (d4n_perfcounter) {
+	d4n_perfcounter->inc(l_d4n_block_peer_hit);
+	d4n_perfcounter->inc(l_d4n_peer_in_b, bl.length());
+      }
+
+      double cost = std::chrono::duration<double, std::micro>(ceph::mono_clock::now() - fetch_start).count();
+
+      if (filter->cache_block_data(dpp, source, offsets[i], bl, y, cost) < 0) {
+	ldpp_dout(dpp, 20) << "D4N Filter: Cache put block operation failed." << dendl;
+      }
+
+      (*blocks)[i] = std::move(bl);
+      break;
+    }
+  }
+}
+
+void D4NFilterObject::D4NFilterReadOp::prefetch_ahead(const DoutPrefixProvider* dpp,
+						     uint64_t ofs, uint64_t end)
+{
+  D4NFilterDriver* filter = source->filter;
+
+  if (!filter->get_prefetcher()) {
+    return;
+  }
+
+  D4NFilterPrefetcher::Request req;
+
+  if (!filter->get_tracker()->record(D4NFilterDriver::cache_oid(source), ofs, end, source->get_obj_size(),
+				     filter->get_d4n_cache()->get_block_size(), &req.ofs, &req.end)) {
+    return;
+  }
+
+  req.bucket = source->get_bucket()->get_key();
+  req.key = source->get_key();
+  req.obj_size = source->get_obj_size();
+
+  auto iter = source->get_attrs().find(RGW_ATTR_ETAG);
+
+  if (iter != source->get_attrs().end()) {
+    req.etag = rgw_string_unquote(iter->second.to_str());
+  }
+
+  if (!filter->get_prefetcher()->submit(std::move(req))) {
+    ldpp_dout(dpp, 20) << "D4N Filter: Prefetch budget exhausted; not prefetching." << dendl;
+
+    if (d4n_perfcounter) {
+      d4n_perfcounter->inc(l_d4n_prefetch_dropped);
+    }
+  } else if (d4n_perfcounter) {
+    d4n_perfcounter->inc(l_d4n_prefetch);
+  }
+}
+
+int D4NFilterObject::D4NFilterReadOp::iterate(const DoutPrefixProvider* dpp, int64_t ofs, int64_t end,
+					      RGWGetDataCB* cb, optional_yield y)
+{
+  RGWD4NCache* cache = source->filter->get_d4n_cache();
+  uint64_t block_size = cache->get_block_size();
+  uint64_t obj_size = source->get_obj_size();
+
+  if (ofs < 0 || end < ofs || (uint64_t)end >= obj_size || block_size == 0) {
+    return next->iterate(dpp, ofs, end, cb, y);
+  }
+
+  std::string oid = D4NFilterDriver::cache_oid(source);
+  uint64_t first_blk = ofs / block_size * block_size;
+  uint64_t last_blk = end / block_size * block_size;
+  uint64_t last_byte = std::min(last_blk + block_size, obj_size) - 1;
+
+  if (RGWD4NAdmission* admission = source->filter->get_admission()) {
+    for (uint64_t o = first_blk; o <= last_blk; o += block_size) {
+      admission->record(oid, o);
+    }
+  }
+
+  if (!dirty) {
+    prefetch_ahead(dpp, ofs, end);
+  }
+
+  /* Objects read without prepare() are looked up here */
+  if (!blk_found && !dirty) {
+    blk = cache_block();
+    blk.c_obj.bucket_name = D4NFilterDriver::cache_bucket(source->get_bucket()->get_key());
+    blk.c_obj.obj_name = source->get_key().get_oid();
+    blk.c_obj.version = source->get_instance();
+    blk_found = (source->filter->lookup_object(&blk, y) == 0);
+  }
+
+  /* The blocks of an object not yet written back are all in the cache,
+   * as its metadata says, whatever the directory holds */
+  if (!dirty && (!blk_found || blk.size_in_bytes != obj_size)) {
+    ldpp_dout(dpp, 20) << "D4N Filter: Directory get operation failed; reading object from backend." << dendl;
+
+    if (d4n_perfcounter) {
+      d4n_perfcounter->inc(l_d4n_block_miss, (last_blk - first_blk) / block_size + 1);
+    }
+
+    int ret = fill_blocks(dpp, first_blk, last_byte, ofs, end, cb, y);
+
+    if (ret < 0)
+      return ret;
+
+    blk.size_in_bytes = obj_size;
+    blk.hosts_list = {source->filter->get_block_dir()->get_endpoint()};
+
+    if (source->filter->get_block_dir()->setValue(&blk, y) < 0) {
+      ldpp_dout(dpp, 20) << "D4N Filter: Directory set operation failed." << dendl;
+    } else {
+      blk_found = true;
+    }
+
+    return 0;
+  }
+
+  /* Look up as many blocks at once as a single backend read would cover */
+  uint64_t window = std::max<uint64_t>(1, dpp->get_cct()->_conf->rgw_get_obj_window_size / block_size);
+
+  for (uint64_t win_ofs = first_blk; win_ofs <= last_blk; win_ofs += window * block_size) {
+    std::vector<uint64_t> offsets;
+
+    for (uint64_t o = win_ofs; o <= last_blk && offsets.size() < window; o += block_size) {
+      offsets.push_back(o);
+    }
+
+    std::vector<bufferlist> blocks;
+
+    if (cache->getBlocks(oid, offsets, &blocks, y) < 0) {
+      ldpp_dout(dpp, 20) << "D4N Filter: Cache get blocks operation failed." << dendl;
+      blocks.assign(offsets.size(), bufferlist());
+    }
+
+    for (size_t i = 0; i < offsets.size(); ++i) {
+      if (blocks[i].length() == std::min(block_size, obj_size - offsets[i])) {
+	source->filter->get_policy()->access(oid, offsets[i]);
+
+	if (d4n_perfcounter) {
+	  d4n_perfcounter->inc(l_d4n_block_hit);
+	  d4n_perfcounter->inc(l_d4n_cache_out_b, blocks[i].length());
+	}
+      }
+    }
+
+    fetch_peer_blocks(dpp, offsets, &blocks, y);
+
+    /* Consecutive blocks that are missing are read from the backend together */
+    std::optional<uint64_t> miss_ofs;
+
+    for (size_t i = 0; i <= offsets.size(); ++i) {
+      bool hit = false;
+
+      if (i < offsets.size()) {
+	uint64_t expected = std::min(block_size, obj_size - offsets[i]);
+	hit = blocks[i].length() == expected;
+      }
+
+      if (i < offsets.size() && !hit) {
+	if (!miss_ofs)
+	  miss_ofs = offsets[i];
+
+	if (d4n_perfcounter) {
+	  d4n_perfcounter->inc(l_d4n_block_miss);
+	}
+	continue;
+      }
+
+      if (miss_ofs) {
+	uint64_t miss_end = (i < offsets.size() ? offsets[i] : std::min(offsets.back() + block_size, obj_size)) - 1;
+
+	ldpp_dout(dpp, 20) << "D4N Filter: Cache missed blocks " << *miss_ofs << "-" << miss_end << dendl;
+
+	int ret = fill_blocks(dpp, *miss_ofs, miss_end, std::max<int64_t>(ofs, *miss_ofs),
+			      std::min<int64_t>(end, miss_end), cb, y);
+
+	if (ret < 0)
+	  return ret;
 
-  if (copyObjReturn < 0) {
-    ldpp_dout(dpp, 20) << "D4N Filter: Cache copy object operation failed." << dendl;
-  } else {
-    ldpp_dout(dpp, 20) << "D4N Filter: Cache copy object operation succeeded." << dendl;
+	miss_ofs.reset();
+      }
+
+      if (i == offsets.size())
+	break;
+
+      uint64_t lo = std::max<uint64_t>(offsets[i], ofs);
+      uint64_t hi = std::min<uint64_t>(offsets[i] + blocks[i].length(), end + 1);
+
+      int ret = cb->handle_data(blocks[i], lo - offsets[i], hi - lo);
+
+      if (ret < 0)
+	return ret;
+    }
   }
 
-  return next->copy_object(user, info, source_zone,
-                           nextObject(dest_object),
-                           nextBucket(dest_bucket),
-                           nextBucket(src_bucket),
-                           dest_placement, src_mtime, mtime,
-                           mod_ptr, unmod_ptr, high_precision_time, if_match,
-                           if_nomatch, attrs_mod, copy_if_newer, attrs,
-                           category, olh_epoch, delete_at, version_id, tag,
-                           etag, progress_cb, progress_data, dpp, y);
+  ldpp_dout(dpp, 20) << "D4N Filter: Cache iterate operation succeeded." << dendl;
+
+  return 0;
 }
 
-int D4NFilterObject::set_obj_attrs(const DoutPrefixProvider* dpp, Attrs* setattrs,
-                            Attrs* delattrs, optional_yield y) 
+int D4NFilterObject::D4NFilterDeleteOp::delete_obj(const DoutPrefixProvider* dpp,
+					   optional_yield y)
 {
-  if (setattrs != NULL) {
-    /* Ensure setattrs and delattrs do not overlap */
-    if (delattrs != NULL) {
-      for (const auto& attr : *delattrs) {
-        if (std::find(setattrs->begin(), setattrs->end(), attr) != setattrs->end()) {
-          delattrs->erase(std::find(delattrs->begin(), delattrs->end(), attr));
-        }
-      }
-    }
+  std::string oid = D4NFilterDriver::cache_oid(source);
+  D4NFilterCleaner* cleaner = source->filter->get_cleaner();
+  bool was_dirty = false;
+  int ret = 0;
+
+  /* An object not yet written back must not be written after its delete,
+   * and its only copy is kept until the backing store has deleted its own */
+  if (cleaner) {
+    RGWD4NDirtyEntry entry;
+
+    cleaner->hold(oid, y);
+    was_dirty = (source->filter->get_dirty_log()->get(oid, &entry, y) != -2);
+  }
 
-    int updateAttrsReturn = filter->get_d4n_cache()->setObject(this->get_key().get_oid(), setattrs);
+  if (was_dirty) {
+    ret = next->delete_obj(dpp, y);
 
-    if (updateAttrsReturn < 0) {
-      ldpp_dout(dpp, 20) << "D4N Filter: Cache set object attributes operation failed." << dendl;
-    } else {
-      ldpp_dout(dpp, 20) << "D4N Filter: Cache set object attributes operation succeeded." << dendl;
+    /* The object only ever existed in the cache */
+    if (ret == -ENOENT) {
+      ret = 0;
+    }
+
+    if (ret == 0) {
+      source->filter->get_dirty_log()->discard(oid, y);
     }
   }
 
-  if (delattrs != NULL) {
-    std::vector<std::string> delFields;
-    Attrs::iterator attrs;
+  if (ret == 0) {
+    cache_block blk;
+    blk.c_obj.bucket_name = D4NFilterDriver::cache_bucket(source->get_bucket()->get_key());
+    blk.c_obj.obj_name = source->get_key().get_oid();
+    blk.c_obj.version = source->get_instance();
 
-    /* Extract fields from delattrs */
-    for (attrs = delattrs->begin(); attrs != delattrs->end(); ++attrs) {
-      delFields.push_back(attrs->first);
+    int delDirReturn = source->filter->get_block_dir()->delValue(&blk, y);
+
+    if (delDirReturn < 0) {
+      ldpp_dout(dpp, 20) << "D4N Filter: Directory delete operation failed." << dendl;
+    } else {
+      ldpp_dout(dpp, 20) << "D4N Filter: Directory delete operation succeeded." << dendl;
     }
 
-    Attrs currentattrs = this->get_attrs();
-    std::vector<std::string> currentFields;
-    
-    /* Extract fields from current attrs */
-    for (attrs = currentattrs.begin(); attrs != currentattrs.end(); ++attrs) {
-      currentFields.push_back(attrs->first);
+    source->filter->get_policy()->erase(oid);
+
+    if (source->filter->get_tracker()) {
+      source->filter->get_tracker()->forget(oid);
     }
-    
-    int delAttrsReturn = filter->get_d4n_cache()->delAttrs(this->get_key().get_oid(), currentFields, delFields);
 
-    if (delAttrsReturn < 0) {
-      ldpp_dout(dpp, 20) << "D4N Filter: Cache delete object attributes operation failed." << dendl;
+    int delObjReturn = source->filter->get_d4n_cache()->delObject(oid, y);
+
+    if (delObjReturn < 0) {
+      ldpp_dout(dpp, 20) << "D4N Filter: Cache delete operation failed." << dendl;
     } else {
-      ldpp_dout(dpp, 20) << "D4N Filter: Cache delete object attributes operation succeeded." << dendl;
+      ldpp_dout(dpp, 20) << "D4N Filter: Cache delete operation succeeded." << dendl;
     }
   }
 
-  return next->set_obj_attrs(dpp, setattrs, delattrs, y);  
+  if (!was_dirty) {
+    ret = next->delete_obj(dpp, y);
+  }
+
+  if (cleaner) {
+    cleaner->release(oid);
+  }
+
+  source->filter->invalidate_peers(dpp, oid, y);
+  return ret;
 }
 
-int D4NFilterObject::get_obj_attrs(optional_yield y, const DoutPrefixProvider* dpp,
-                                rgw_obj* target_obj)
+int D4NFilterWriter::prepare(optional_yield y) 
 {
-  rgw::sal::Attrs newAttrs;
-  std::vector< std::pair<std::string, std::string> > newMetadata;
-  int getAttrsReturn = filter->get_d4n_cache()->getObject(this->get_key().get_oid(), 
-						  &newAttrs, 
-						  &newMetadata);
-
-  if (getAttrsReturn < 0) {
-    ldpp_dout(dpp, 20) << "D4N Filter: Cache get object attributes operation failed." << dendl;
+  pending.clear();
+  pending_ofs = 0;
+  cache_data = true;
+  processed = false;
+  wb_data.clear();
+  wb_ended = false;
+
+  /* The object's attrs only arrive in complete(), too late for the blocks
+   * cached as the data is written. Data the placement has RGW compress is
+   * not compressed again; encrypted data is recognized by its first block
+   * not compressing well. */
+  const rgw_placement_rule& rule = wb_entry.placement_rule.empty() ?
+				   obj->get_bucket()->get_placement_rule() : wb_entry.placement_rule;
+  compress = filter->get_compression_type(rule) == "none";
+
+  /* The blocks of an earlier PUT not yet written back are the only copy of
+   * its data, so they are neither flushed here nor replaced until this PUT
+   * has reached the backing store. This PUT is written through, as its own
+   * blocks would take their place. */
+  supersedes_dirty = false;
+  superseded_etag.reset();
+
+  if (filter->get_cleaner()) {
+    RGWD4NDirtyEntry entry;
+    int getReturn = filter->get_dirty_log()->get(D4NFilterDriver::cache_oid(obj), &entry, y);
+    supersedes_dirty = (getReturn != -2);
+
+    if (getReturn == 0) {
+      superseded_etag = entry.etag;
+    }
+  }
 
-    return next->get_obj_attrs(y, dpp, target_obj);
+  if (supersedes_dirty) {
+    cache_data = false;
   } else {
-    int setAttrsReturn = this->set_attrs(newAttrs);
-    
-    if (setAttrsReturn < 0) {
-      ldpp_dout(dpp, 20) << "D4N Filter: Cache get object attributes operation failed." << dendl;
+    delete_data(false);
+  }
 
-      return next->get_obj_attrs(y, dpp, target_obj);
-    } else {
-      ldpp_dout(dpp, 20) << "D4N Filter: Cache get object attributes operation succeeded." << dendl;
-  
-      return 0;
-    }
+  write_back = !supersedes_dirty && filter->get_cleaner() && wb_target && atomic &&
+	       !obj->get_bucket()->versioned();
+
+  if (write_back) {
+    return 0;
   }
+
+  return next->prepare(y);
 }
 
-int D4NFilterObject::modify_obj_attrs(const char* attr_name, bufferlist& attr_val,
-                               optional_yield y, const DoutPrefixProvider* dpp) 
+int D4NFilterWriter::check_superseded_conditions(const char* if_match, const char* if_nomatch)
 {
-  Attrs update;
-  update[(std::string)attr_name] = attr_val;
-  int updateAttrsReturn = filter->get_d4n_cache()->updateAttr(this->get_key().get_oid(), &update);
+  if (if_match && strcmp(if_match, "*") != 0 && rgw_string_unquote(if_match) != *superseded_etag) {
+    ldpp_dout(save_dpp, 10) << "D4N Filter: If-Match precondition failed." << dendl;
+    return -ERR_PRECONDITION_FAILED;
+  }
 
-  if (updateAttrsReturn < 0) {
-    ldpp_dout(dpp, 20) << "D4N Filter: Cache modify object attribute operation failed." << dendl;
-  } else {
-    ldpp_dout(dpp, 20) << "D4N Filter: Cache modify object attribute operation succeeded." << dendl;
+  if (if_nomatch && (strcmp(if_nomatch, "*") == 0 || rgw_string_unquote(if_nomatch) == *superseded_etag)) {
+    ldpp_dout(save_dpp, 10) << "D4N Filter: If-None-Match precondition failed." << dendl;
+    return -ERR_PRECONDITION_FAILED;
   }
 
-  return next->modify_obj_attrs(attr_name, attr_val, y, dpp);  
+  return 0;
 }
 
-int D4NFilterObject::delete_obj_attrs(const DoutPrefixProvider* dpp, const char* attr_name,
-                               optional_yield y) 
+void D4NFilterWriter::delete_data(bool meta)
 {
-  std::vector<std::string> delFields;
-  delFields.push_back((std::string)attr_name);
-  
-  Attrs::iterator attrs;
-  Attrs currentattrs = this->get_attrs();
-  std::vector<std::string> currentFields;
-  
-  /* Extract fields from current attrs */
-  for (attrs = currentattrs.begin(); attrs != currentattrs.end(); ++attrs) {
-    currentFields.push_back(attrs->first);
+  filter->get_policy()->erase(D4NFilterDriver::cache_oid(obj));
+
+  if (filter->get_tracker()) {
+    filter->get_tracker()->forget(D4NFilterDriver::cache_oid(obj));
   }
-  
-  int delAttrReturn = filter->get_d4n_cache()->delAttrs(this->get_key().get_oid(), currentFields, delFields);
 
-  if (delAttrReturn < 0) {
-    ldpp_dout(dpp, 20) << "D4N Filter: Cache delete object attribute operation failed." << dendl;
+  RGWD4NCache* cache = filter->get_d4n_cache();
+  int delDataReturn = meta ? cache->delObject(D4NFilterDriver::cache_oid(obj), y) :
+			     cache->deleteData(D4NFilterDriver::cache_oid(obj), y);
+
+  if (delDataReturn < 0 && delDataReturn != -2) {
+    ldpp_dout(save_dpp, 20) << "D4N Filter: Cache delete data operation failed." << dendl;
   } else {
-    ldpp_dout(dpp, 20) << "D4N Filter: Cache delete object attribute operation succeeded." << dendl;
+    ldpp_dout(save_dpp, 20) << "D4N Filter: Cache delete data operation succeeded." << dendl;
   }
-  
-  return next->delete_obj_attrs(dpp, attr_name, y);  
 }
 
-std::unique_ptr<Object> D4NFilterDriver::get_object(const rgw_obj_key& k)
+int D4NFilterWriter::write_through()
 {
-  std::unique_ptr<Object> o = next->get_object(k);
+  write_back = false;
 
-  return std::make_unique<D4NFilterObject>(std::move(o), this);
-}
+  int ret = next->prepare(y);
 
-std::unique_ptr<Writer> D4NFilterDriver::get_atomic_writer(const DoutPrefixProvider *dpp,
-				  optional_yield y,
-				  rgw::sal::Object* obj,
-				  const rgw_user& owner,
-				  const rgw_placement_rule *ptail_placement_rule,
-				  uint64_t olh_epoch,
-				  const std::string& unique_tag)
-{
-  std::unique_ptr<Writer> writer = next->get_atomic_writer(dpp, y, nextObject(obj),
-							   owner, ptail_placement_rule,
-							   olh_epoch, unique_tag);
+  if (ret < 0) {
+    return ret;
+  }
 
-  return std::make_unique<D4NFilterWriter>(std::move(writer), this, obj, dpp, true);
-}
+  uint64_t len = wb_data.length();
 
-std::unique_ptr<Object::ReadOp> D4NFilterObject::get_read_op()
-{
-  std::unique_ptr<ReadOp> r = next->get_read_op();
-  return std::make_unique<D4NFilterReadOp>(std::move(r), this);
-}
+  if (len > 0) {
+    ret = process(std::move(wb_data), 0);
 
-std::unique_ptr<Object::DeleteOp> D4NFilterObject::get_delete_op()
-{
-  std::unique_ptr<DeleteOp> d = next->get_delete_op();
-  return std::make_unique<D4NFilterDeleteOp>(std::move(d), this);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+
+  if (wb_ended) {
+    return process({}, len);
+  }
+
+  return 0;
 }
 
-int D4NFilterObject::D4NFilterReadOp::prepare(optional_yield y, const DoutPrefixProvider* dpp)
+int D4NFilterWriter::flush_blocks(bool flush_all)
 {
-  int getDirReturn = source->filter->get_block_dir()->getValue(source->filter->get_cache_block());
+  uint64_t block_size = filter->get_d4n_cache()->get_block_size();
 
-  if (getDirReturn < 0) {
-    ldpp_dout(dpp, 20) << "D4N Filter: Directory get operation failed." << dendl;
-  } else {
-    ldpp_dout(dpp, 20) << "D4N Filter: Directory get operation succeeded." << dendl;
+  while (pending.length() >= block_size || (flush_all && pending.length() > 0)) {
+    bufferlist block;
+    pending.splice(0, std::min<uint64_t>(block_size, pending.length()), &block);
+
+    if (filter->get_admission()) {
+      filter->get_admission()->record(D4NFilterDriver::cache_oid(obj), pending_ofs);
+    }
+
+    int putBlockReturn = filter->cache_block_data(save_dpp, obj, pending_ofs, block, y, 0, &compress);
+
+    if (putBlockReturn < 0) {
+      return putBlockReturn;
+    }
+
+    pending_ofs += block.length();
   }
 
-  rgw::sal::Attrs newAttrs;
-  std::vector< std::pair<std::string, std::string> > newMetadata;
-  int getObjReturn = source->filter->get_d4n_cache()->getObject(source->get_key().get_oid(), 
-							&newAttrs, 
-							&newMetadata);
+  return 0;
+}
 
-  int ret = next->prepare(y, dpp);
-  
-  if (getObjReturn < 0) {
-    ldpp_dout(dpp, 20) << "D4N Filter: Cache get object operation failed." << dendl;
-  } else {
-    /* Set metadata locally */
-    RGWQuotaInfo quota_info;
-    RGWObjState* astate;
-    source->get_obj_state(dpp, &astate, y);
-
-    for (auto it = newMetadata.begin(); it != newMetadata.end(); ++it) {
-      if (!std::strcmp(it->first.data(), "mtime")) {
-        parse_time(it->second.data(), &astate->mtime); 
-      } else if (!std::strcmp(it->first.data(), "object_size")) {
-	source->set_obj_size(std::stoull(it->second));
-      } else if (!std::strcmp(it->first.data(), "accounted_size")) {
-	astate->accounted_size = std::stoull(it->second);
-      } else if (!std::strcmp(it->first.data(), "epoch")) {
-	astate->epoch = std::stoull(it->second);
-      } else if (!std::strcmp(it->first.data(), "version_id")) {
-	source->set_instance(it->second);
-      } else if (!std::strcmp(it->first.data(), "source_zone_short_id")) {
-	astate->zone_short_id = static_cast<uint32_t>(std::stoul(it->second));
-      } else if (!std::strcmp(it->first.data(), "bucket_count")) {
-	source->get_bucket()->set_count(std::stoull(it->second));
-      } else if (!std::strcmp(it->first.data(), "bucket_size")) {
-	source->get_bucket()->set_size(std::stoull(it->second));
-      } else if (!std::strcmp(it->first.data(), "user_quota.max_size")) {
-        quota_info.max_size = std::stoull(it->second);
-      } else if (!std::strcmp(it->first.data(), "user_quota.max_objects")) {
-        quota_info.max_objects = std::stoull(it->second);
-      } else if (!std::strcmp(it->first.data(), "max_buckets")) {
-        source->get_bucket()->get_owner()->set_max_buckets(std::stoull(it->second));
+int D4NFilterWriter::process(bufferlist&& data, uint64_t offset)
+{
+  if (write_back) {
+    if (data.length() == 0) {
+      wb_ended = true;
+      return 0;
+    }
+
+    if (offset != wb_data.length() || wb_ended ||
+	wb_data.length() + data.length() > filter->ctx()->_conf->rgw_d4n_write_back_max_object_size) {
+      int ret = write_through();
+
+      if (ret < 0) {
+	return ret;
       }
+
+      return process(std::move(data), offset);
     }
 
-    source->get_bucket()->get_owner()->set_info(quota_info);
-    source->set_obj_state(*astate);
-   
-    /* Set attributes locally */
-    int setAttrsReturn = source->set_attrs(newAttrs);
+    wb_data.append(data);
+    return 0;
+  }
 
-    if (setAttrsReturn < 0) {
-      ldpp_dout(dpp, 20) << "D4N Filter: Cache get object operation failed." << dendl;
+  processed = true;
+
+  if (cache_data) {
+    int flushReturn = 0;
+
+    if (offset != pending_ofs + pending.length()) {
+      /* Only sequential writes are cached */
+      flushReturn = -EINVAL;
+    } else if (data.length() == 0) {
+      flushReturn = flush_blocks(true);
     } else {
-      ldpp_dout(dpp, 20) << "D4N Filter: Cache get object operation succeeded." << dendl;
-    }   
+      pending.append(data); /* Shares the buffers passed on to the next writer */
+      flushReturn = flush_blocks(false);
+    }
+
+    if (flushReturn < 0) {
+      ldpp_dout(save_dpp, 20) << "D4N Filter: Cache put block operation failed." << dendl;
+      cache_data = false;
+      pending.clear();
+    } else {
+      ldpp_dout(save_dpp, 20) << "D4N Filter: Cache put block operation succeeded." << dendl;
+    }
   }
 
-  return ret;
+  return next->process(std::move(data), offset);
 }
 
-int D4NFilterObject::D4NFilterDeleteOp::delete_obj(const DoutPrefixProvider* dpp,
-					   optional_yield y)
+int D4NFilterWriter::complete_write_back(size_t accounted_size, const std::string& etag,
+					 ceph::real_time *mtime, ceph::real_time set_mtime,
+					 std::map<std::string, bufferlist>& attrs,
+					 ceph::real_time delete_at, const std::string *user_data)
 {
-  int delDirReturn = source->filter->get_block_dir()->delValue(source->filter->get_cache_block());
+  RGWD4NCache* cache = filter->get_d4n_cache();
+  std::string oid = D4NFilterDriver::cache_oid(obj);
+  uint64_t block_size = cache->get_block_size();
+  uint64_t size = wb_data.length();
+  bool compress = !attrs.count(RGW_ATTR_COMPRESSION) && !attrs.count(RGW_ATTR_CRYPT_MODE);
+
+  /* The blocks are written directly: until they are flushed they are the
+   * only copy of the data, so they bypass admission and eviction, and are
+   * on disk before the PUT is acknowledged */
+  for (uint64_t ofs = 0; ofs < size; ofs += block_size) {
+    bufferlist block;
+    block.substr_of(wb_data, ofs, std::min(block_size, size - ofs));
+    RGWD4NStoredBlock stored;
+
+    if (cache->putBlock(oid, ofs, block, y, compress, &stored, true) < 0) {
+      ldpp_dout(save_dpp, 20) << "D4N Filter: Cache put block operation failed." << dendl;
+      return -EIO;
+    }
 
-  if (delDirReturn < 0) {
-    ldpp_dout(dpp, 20) << "D4N Filter: Directory delete operation failed." << dendl;
-  } else {
-    ldpp_dout(dpp, 20) << "D4N Filter: Directory delete operation succeeded." << dendl;
-  }
+    compress = compress && !stored.compression.empty();
 
-  int delObjReturn = source->filter->get_d4n_cache()->delObject(source->get_key().get_oid());
+    /* Other gateways read the object from here until it is flushed */
+    RGWD4NPolicy::Block entry;
+    entry.bucket_name = D4NFilterDriver::cache_bucket(obj->get_bucket()->get_key());
+    entry.oid = oid;
+    entry.obj_name = obj->get_key().get_oid();
+    entry.version = obj->get_instance();
+    entry.offset = ofs;
+    entry.size = stored.size;
+    entry.compression = stored.compression;
 
-  if (delObjReturn < 0) {
-    ldpp_dout(dpp, 20) << "D4N Filter: Cache delete operation failed." << dendl;
-  } else {
-    ldpp_dout(dpp, 20) << "D4N Filter: Cache delete operation succeeded." << dendl;
+    filter->add_block_host(save_dpp, entry, y);
   }
 
-  return next->delete_obj(dpp, y);
-}
+  ceph::real_time now = real_clock::is_zero(set_mtime) ? real_clock::now() : set_mtime;
+
+  wb_entry.oid = oid;
+  wb_entry.bucket = obj->get_bucket()->get_key();
+  wb_entry.key = obj->get_key();
+  wb_entry.size = size;
+  wb_entry.block_size = block_size;
+  wb_entry.accounted_size = accounted_size;
+  wb_entry.etag = etag;
+  wb_entry.mtime = now;
+  wb_entry.delete_at = delete_at;
+  wb_entry.user_data = user_data ? *user_data : std::string();
+  wb_entry.attrs = attrs;
+
+  if (filter->get_dirty_log()->add(&wb_entry, y) < 0) {
+    return -EIO;
+  }
 
-int D4NFilterWriter::prepare(optional_yield y) 
-{
-  int delDataReturn = filter->get_d4n_cache()->deleteData(obj->get_key().get_oid()); 
+  RGWD4NObjectMeta meta;
+  meta.has_metadata = true;
+  meta.mtime = now;
+  meta.object_size = size;
+  meta.accounted_size = accounted_size;
+  meta.bucket_count = obj->get_bucket()->get_count();
+  meta.bucket_size = obj->get_bucket()->get_size();
 
-  if (delDataReturn < 0) {
-    ldpp_dout(save_dpp, 20) << "D4N Filter: Cache delete data operation failed." << dendl;
-  } else {
-    ldpp_dout(save_dpp, 20) << "D4N Filter: Cache delete data operation succeeded." << dendl;
+  RGWUserInfo info = obj->get_bucket()->get_owner()->get_info();
+  meta.user_quota_max_size = info.quota.user_quota.max_size;
+  meta.user_quota_max_objects = info.quota.user_quota.max_objects;
+  meta.max_buckets = obj->get_bucket()->get_owner()->get_max_buckets();
+  meta.data_size = size;
+  meta.block_size = block_size;
+  meta.attrs = attrs;
+  meta.dirty_gen = wb_entry.gen;
+
+  if (cache->setObject(oid, meta, y) < 0) {
+    /* Reads go to the backing store, which doesn't have the object yet */
+    ldpp_dout(save_dpp, 20) << "D4N Filter: Cache set operation failed." << dendl;
+    filter->get_dirty_log()->discard(oid, y);
+    return -EIO;
   }
 
-  return next->prepare(y);
-}
+  /* Until the object is flushed this gateway is the only one holding it */
+  cache_block blk;
+  RGWBlockDirectory* block_dir = filter->get_block_dir();
 
-int D4NFilterWriter::process(bufferlist&& data, uint64_t offset)
-{
-  int appendDataReturn = filter->get_d4n_cache()->appendData(obj->get_key().get_oid(), data);
+  blk.hosts_list.push_back(block_dir->get_endpoint());
+  blk.size_in_bytes = size;
+  blk.c_obj.bucket_name = D4NFilterDriver::cache_bucket(obj->get_bucket()->get_key());
+  blk.c_obj.obj_name = obj->get_key().get_oid();
+  blk.c_obj.version = obj->get_instance();
 
-  if (appendDataReturn < 0) {
-    ldpp_dout(save_dpp, 20) << "D4N Filter: Cache append data operation failed." << dendl;
-  } else {
-    ldpp_dout(save_dpp, 20) << "D4N Filter: Cache append data operation succeeded." << dendl;
+  if (block_dir->setValue(&blk, y) < 0) {
+    ldpp_dout(save_dpp, 20) << "D4N Filter: Directory set operation failed." << dendl;
   }
 
-  return next->process(std::move(data), offset);
+  if (mtime) {
+    *mtime = now;
+  }
+
+  ldpp_dout(save_dpp, 20) << "D4N Filter: Object " << oid << " acknowledged in write-back mode." << dendl;
+
+  if (d4n_perfcounter) {
+    d4n_perfcounter->inc(l_d4n_wb_put);
+  }
+  return 0;
 }
 
 int D4NFilterWriter::complete(size_t accounted_size, const std::string& etag,
@@ -451,15 +1985,57 @@ int D4NFilterWriter::complete(size_t accounted_size, const std::string& etag,
                        rgw_zone_set *zones_trace, bool *canceled,
                        optional_yield y)
 {
-  cache_block* temp_cache_block = filter->get_cache_block();
+  std::string oid = D4NFilterDriver::cache_oid(obj);
+  D4NFilterCleaner* cleaner = filter->get_cleaner();
+
+  if (write_back) {
+    int ret = -EINVAL;
+
+    /* Conditional PUTs are evaluated by the backing store */
+    if (!if_match && !if_nomatch) {
+      ret = complete_write_back(accounted_size, etag, mtime, set_mtime, attrs, delete_at, user_data);
+    }
+
+    if (ret == 0) {
+      filter->invalidate_peers(save_dpp, D4NFilterDriver::cache_oid(obj), y);
+      return 0;
+    }
+
+    ret = write_through();
+
+    if (ret < 0) {
+      return ret;
+    }
+  }
+
+  /* An earlier PUT not yet written back is not written after this one, and
+   * is only dropped once this one has reached the backing store */
+  if (cleaner) {
+    cleaner->hold(oid, y);
+  }
+
+  if (superseded_etag && (if_match || if_nomatch)) {
+    int condReturn = check_superseded_conditions(if_match, if_nomatch);
+
+    if (condReturn < 0) {
+      cleaner->release(oid);
+      return condReturn;
+    }
+
+    if_match = nullptr;
+    if_nomatch = nullptr;
+  }
+
+  cache_block blk;
   RGWBlockDirectory* temp_block_dir = filter->get_block_dir();
 
-  temp_cache_block->hosts_list.push_back(temp_block_dir->get_host() + ":" + std::to_string(temp_block_dir->get_port())); 
-  temp_cache_block->size_in_bytes = accounted_size;
-  temp_cache_block->c_obj.bucket_name = obj->get_bucket()->get_name();
-  temp_cache_block->c_obj.obj_name = obj->get_key().get_oid();
+  blk.hosts_list.push_back(temp_block_dir->get_endpoint());
+  blk.size_in_bytes = accounted_size;
+  blk.c_obj.bucket_name = D4NFilterDriver::cache_bucket(obj->get_bucket()->get_key());
+  blk.c_obj.obj_name = obj->get_key().get_oid();
+  blk.c_obj.version = obj->get_instance();
 
-  int setDirReturn = temp_block_dir->setValue(temp_cache_block);
+  int setDirReturn = temp_block_dir->setValue(&blk, y);
 
   if (setDirReturn < 0) {
     ldpp_dout(save_dpp, 20) << "D4N Filter: Directory set operation failed." << dendl;
@@ -472,81 +2048,69 @@ int D4NFilterWriter::complete(size_t accounted_size, const std::string& etag,
   int ret = next->complete(accounted_size, etag, mtime, set_mtime, attrs,
 			delete_at, if_match, if_nomatch, user_data, zones_trace,
 			canceled, y);
-  obj->get_obj_attrs(y, save_dpp, NULL);
-  obj->get_obj_state(save_dpp, &astate, y);
 
-  /* Append additional metadata to attributes */ 
-  rgw::sal::Attrs baseAttrs = obj->get_attrs();
-  rgw::sal::Attrs attrs_temp = baseAttrs;
-  buffer::list bl;
+  if (cleaner) {
+    /* The metadata of a superseded PUT describes data no longer held, so
+     * it goes as well */
+    if (ret == 0 && (filter->get_dirty_log()->discard(oid, y) == 0 || supersedes_dirty)) {
+      delete_data(true);
+      cache_data = false;
+    }
+
+    cleaner->release(oid);
+  }
 
-  bl.append(to_iso_8601(obj->get_mtime()));
-  baseAttrs.insert({"mtime", bl});
-  bl.clear();
+  if (ret < 0) {
+    return ret;
+  }
 
-  bl.append(std::to_string(obj->get_obj_size()));
-  baseAttrs.insert({"object_size", bl});
-  bl.clear();
+  supersedes_dirty = false;
+  obj->get_obj_attrs(y, save_dpp, NULL);
+  obj->get_obj_state(save_dpp, &astate, y);
 
-  bl.append(std::to_string(accounted_size));
-  baseAttrs.insert({"accounted_size", bl});
-  bl.clear();
- 
-  bl.append(std::to_string(astate->epoch));
-  baseAttrs.insert({"epoch", bl});
-  bl.clear();
+  RGWD4NObjectMeta meta;
+  meta.has_metadata = true;
+  meta.mtime = obj->get_mtime();
+  meta.object_size = obj->get_obj_size();
+  meta.accounted_size = accounted_size;
+  meta.epoch = astate->epoch;
 
   if (obj->have_instance()) {
-    bl.append(obj->get_instance());
-    baseAttrs.insert({"version_id", bl});
-    bl.clear();
-  } else {
-    bl.append(""); /* Empty value */
-    baseAttrs.insert({"version_id", bl});
-    bl.clear();
+    meta.version_id = obj->get_instance();
   }
 
-  auto iter = attrs_temp.find(RGW_ATTR_SOURCE_ZONE);
-  if (iter != attrs_temp.end()) {
-    bl.append(std::to_string(astate->zone_short_id));
-    baseAttrs.insert({"source_zone_short_id", bl});
-    bl.clear();
-  } else {
-    bl.append("0"); /* Initialized to zero */
-    baseAttrs.insert({"source_zone_short_id", bl});
-    bl.clear();
-  }
+  meta.attrs = obj->get_attrs();
 
-  bl.append(std::to_string(obj->get_bucket()->get_count()));
-  baseAttrs.insert({"bucket_count", bl});
-  bl.clear();
+  if (meta.attrs.find(RGW_ATTR_SOURCE_ZONE) != meta.attrs.end()) {
+    meta.source_zone_short_id = astate->zone_short_id;
+  }
 
-  bl.append(std::to_string(obj->get_bucket()->get_size()));
-  baseAttrs.insert({"bucket_size", bl});
-  bl.clear();
+  meta.bucket_count = obj->get_bucket()->get_count();
+  meta.bucket_size = obj->get_bucket()->get_size();
 
   RGWUserInfo info = obj->get_bucket()->get_owner()->get_info();
-  bl.append(std::to_string(info.quota.user_quota.max_size));
-  baseAttrs.insert({"user_quota.max_size", bl});
-  bl.clear();
-
-  bl.append(std::to_string(info.quota.user_quota.max_objects));
-  baseAttrs.insert({"user_quota.max_objects", bl});
-  bl.clear();
-
-  bl.append(std::to_string(obj->get_bucket()->get_owner()->get_max_buckets()));
-  baseAttrs.insert({"max_buckets", bl});
-  bl.clear();
+  meta.user_quota_max_size = info.quota.user_quota.max_size;
+  meta.user_quota_max_objects = info.quota.user_quota.max_objects;
+  meta.max_buckets = obj->get_bucket()->get_owner()->get_max_buckets();
+
+  /* Write any data not followed by an end-of-data process() call, and
+     record the data blocks only once all of them are in the cache */
+  if (processed && cache_data && flush_blocks(true) == 0) {
+    meta.data_size = pending_ofs;
+    meta.block_size = filter->get_d4n_cache()->get_block_size();
+  }
 
-  baseAttrs.insert(attrs.begin(), attrs.end());
+  meta.attrs.insert(attrs.begin(), attrs.end());
 
-  int setObjReturn = filter->get_d4n_cache()->setObject(obj->get_key().get_oid(), &baseAttrs);
+  int setObjReturn = filter->get_d4n_cache()->setObject(D4NFilterDriver::cache_oid(obj), meta, y);
 
   if (setObjReturn < 0) {
     ldpp_dout(save_dpp, 20) << "D4N Filter: Cache set operation failed." << dendl;
   } else {
     ldpp_dout(save_dpp, 20) << "D4N Filter: Cache set operation succeeded." << dendl;
   }
+
+  filter->invalidate_peers(save_dpp, D4NFilterDriver::cache_oid(obj), y);
   
   return ret;
 }
@@ -23,29 +23,165 @@
 
 #include "driver/d4n/d4n_directory.h"
 #include "driver/d4n/d4n_datacache.h"
+#include "driver/d4n/d4n_policy.h"
+#include "driver/d4n/d4n_admission.h"
+#include "driver/d4n/d4n_writeback.h"
+#include "driver/d4n/d4n_prefetch.h"
+#include "driver/d4n/d4n_invalidation.h"
+#include "common/Thread.h"
+#include "common/ceph_mutex.h"
+#include "common/async/yield_context.h"
+
+#include <boost/intrusive/list.hpp>
+#include <boost/asio/basic_waitable_timer.hpp>
+#include <deque>
+#include <optional>
+#include <mutex>
+#include <set>
+
+class RGWRESTConn;
 
 namespace rgw { namespace sal {
 
+class D4NFilterDriver;
+
+/* Writes objects acknowledged in write-back mode to the backing store in
+ * the order of the dirty log. Entries left in the log when the gateway
+ * stopped are flushed once it restarts. */
+class D4NFilterCleaner : public Thread, public DoutPrefixProvider {
+  private:
+    CephContext* cct;
+    D4NFilterDriver* filter;
+    RGWD4NDirtyLog* log;
+    ceph::mutex lock = ceph::make_mutex("D4NFilterCleaner");
+    ceph::condition_variable cond;
+    bool stopping = false;
+
+    /* Objects being written to the backing store, or held back from it */
+    std::set<std::string> flushing;
+    ceph::condition_variable flushing_cond;
+
+    /* Requests waiting on the lock from a coroutine, woken by cancelling
+     * their timer rather than through flushing_cond */
+    struct Waiter : boost::intrusive::list_base_hook<> {
+      using Clock = std::chrono::steady_clock;
+      using Executor = boost::asio::io_context::executor_type;
+      using Timer = boost::asio::basic_waitable_timer<Clock,
+	    boost::asio::wait_traits<Clock>, Executor>;
+      Timer timer;
+      explicit Waiter(boost::asio::io_context& ioc) : timer(ioc) {}
+    };
+    boost::intrusive::list<Waiter> waiters;
+
+    /* Waits for a change to flushing, suspending the coroutine of y if
+     * there is one instead of blocking its thread */
+    void wait(std::unique_lock<ceph::mutex>& l, optional_yield y);
+    void notify();
+    int flush(RGWD4NDirtyEntry& entry);
+
+  public:
+    D4NFilterCleaner(CephContext* _cct, D4NFilterDriver* _filter, RGWD4NDirtyLog* _log) : cct(_cct),
+											filter(_filter), log(_log) {}
+
+    void* entry() override;
+    void stop();
+    void signal() {
+      std::lock_guard l{lock};
+      cond.notify_all();
+    }
+    /* Writes the latest acknowledged PUT of the object to the backing
+     * store, if it has not been already */
+    int flush_object(const std::string& oid);
+    /* Keeps the object from being flushed until release(), once any flush
+     * of it in progress has finished, so that an older write can't land
+     * after the request holding it */
+    void hold(const std::string& oid, optional_yield y);
+    void release(const std::string& oid);
+    /* Drops the object's dirty log entry, so a deleted or replaced object
+     * is not written back. Returns -2 if the object had none. */
+    int discard(const std::string& oid, optional_yield y);
+
+    CephContext* get_cct() const override { return cct; }
+    unsigned get_subsys() const override { return ceph_subsys_rgw; }
+    std::ostream& gen_prefix(std::ostream& out) const override { return out << "D4N cleaner: "; }
+};
+
+/* Reads blocks ahead of sequential streams from the backing store into the
+ * cache. Requests are only accepted while the bytes queued and being read
+ * stay within rgw_d4n_prefetch_budget; the rest are dropped, so prefetching
+ * never holds up or crowds out the reads clients are waiting for. */
+class D4NFilterPrefetcher : public Thread, public DoutPrefixProvider {
+  public:
+    struct Request {
+      rgw_bucket bucket;
+      rgw_obj_key key;
+      std::string etag; /* The blocks are only cached if the object is unchanged */
+      uint64_t obj_size = 0;
+      uint64_t ofs = 0;
+      uint64_t end = 0; /* Inclusive */
+    };
+
+  private:
+    CephContext* cct;
+    D4NFilterDriver* filter;
+    uint64_t budget;
+    uint64_t reserved = 0;
+    ceph::mutex lock = ceph::make_mutex("D4NFilterPrefetcher");
+    ceph::condition_variable cond;
+    bool stopping = false;
+    std::deque<Request> queue;
+
+    int prefetch(const Request& req);
+
+  public:
+    D4NFilterPrefetcher(CephContext* _cct, D4NFilterDriver* _filter) : cct(_cct), filter(_filter),
+								     budget(_cct->_conf->rgw_d4n_prefetch_budget) {}
+
+    void* entry() override;
+    void stop();
+    /* Returns false if the request was dropped for lack of budget */
+    bool submit(Request&& req);
+
+    CephContext* get_cct() const override { return cct; }
+    unsigned get_subsys() const override { return ceph_subsys_rgw; }
+    std::ostream& gen_prefix(std::ostream& out) const override { return out << "D4N prefetcher: "; }
+};
+
 class D4NFilterDriver : public FilterDriver {
   private:
     RGWBlockDirectory* blk_dir;
-    cache_block* c_blk;
     RGWD4NCache* d4n_cache;
+    std::unique_ptr<RGWD4NPolicy> policy;
+    std::unique_ptr<RGWD4NAdmission> admission;
+
+    /* Address other gateways use to fetch blocks cached here; blocks are
+     * only recorded in the directory per block when it is set */
+    std::string peer_address;
+    std::mutex peer_lock;
+    std::map<std::string, std::unique_ptr<RGWRESTConn>> peer_conns;
+
+    /* Only set when rgw_d4n_write_back is enabled */
+    std::unique_ptr<RGWD4NDirtyLog> dirty_log;
+    std::unique_ptr<D4NFilterCleaner> cleaner;
+
+    /* Only set when rgw_d4n_invalidation is enabled */
+    std::unique_ptr<RGWD4NInvalidator> invalidator;
+
+    /* Only set when rgw_d4n_prefetch_blocks is nonzero */
+    std::unique_ptr<RGWD4NAccessTracker> tracker;
+    std::unique_ptr<D4NFilterPrefetcher> prefetcher;
 
   public:
     D4NFilterDriver(Driver* _next) : FilterDriver(_next) 
     {
       blk_dir = new RGWBlockDirectory(); /* Initialize directory address with cct */
-      c_blk = new cache_block();
       d4n_cache = new RGWD4NCache();
+      policy = RGWD4NPolicy::create("lru", d4n_cache->get_capacity());
     }
-    virtual ~D4NFilterDriver() {
-      delete blk_dir; 
-      delete c_blk;
-      delete d4n_cache;
-    }
+    virtual ~D4NFilterDriver();
 
     virtual int initialize(CephContext *cct, const DoutPrefixProvider *dpp) override;
+    virtual void finalize(void) override;
     virtual std::unique_ptr<User> get_user(const rgw_user& u) override;
 
     virtual std::unique_ptr<Object> get_object(const rgw_obj_key& k) override;
@@ -57,9 +193,57 @@ class D4NFilterDriver : public FilterDriver {
 				  const rgw_placement_rule *ptail_placement_rule,
 				  uint64_t olh_epoch,
 				  const std::string& unique_tag) override;
+    /* Key the cache holds the object under, so that objects of the same
+     * name in other buckets are kept apart */
+    static std::string cache_oid(Object* obj);
+    /* Bucket recorded in the directory, qualified by its tenant so that the
+     * entries of an object are placed with its cache keys */
+    static std::string cache_bucket(const rgw_bucket& bucket) { return bucket.get_key('/', 0); }
     RGWBlockDirectory* get_block_dir() { return blk_dir; }
-    cache_block* get_cache_block() { return c_blk; }
     RGWD4NCache* get_d4n_cache() { return d4n_cache; }
+    RGWD4NPolicy* get_policy() { return policy.get(); }
+    RGWD4NAdmission* get_admission() { return admission.get(); }
+    const std::string& get_peer_address() const { return peer_address; }
+    RGWD4NDirtyLog* get_dirty_log() { return dirty_log.get(); }
+    D4NFilterCleaner* get_cleaner() { return cleaner.get(); }
+    RGWD4NAccessTracker* get_tracker() { return tracker.get(); }
+    D4NFilterPrefetcher* get_prefetcher() { return prefetcher.get(); }
+    Driver* get_next() { return next; }
+
+    /* Writes a block to the local cache and records this gateway as
+     * holding it, evicting other blocks if the cache is full. Blocks turned
+     * away by the admission filter are not cached. cost is the time in
+     * microseconds it took to fetch the block, or zero if unknown. If
+     * compress is set, the block is only compressed if it is true, and it
+     * is cleared when the block doesn't compress well, so that callers can
+     * skip trying for the rest of the object. */
+    int cache_block_data(const DoutPrefixProvider* dpp, Object* obj, uint64_t ofs,
+			 bufferlist& bl, optional_yield y, double cost = 0, bool* compress = nullptr);
+    /* Hands a block already in the cache over to the eviction policy */
+    void track_block(const DoutPrefixProvider* dpp, const RGWD4NPolicy::Block& block,
+		     double cost, optional_yield y);
+    /* Records this gateway in the directory as holding a block, so the
+     * other gateways can read it from here */
+    void add_block_host(const DoutPrefixProvider* dpp, const RGWD4NPolicy::Block& block,
+			optional_yield y);
+    /* Hands the blocks kept in the cache from before the gateway started
+     * over to the eviction policy, except those of objects not yet
+     * written back, which are tracked once they are flushed */
+    void load_blocks(const DoutPrefixProvider* dpp);
+    /* Removes a block from the cache and its directory entry */
+    void evict_block(const DoutPrefixProvider* dpp, const RGWD4NPolicy::Block& block,
+		     optional_yield y);
+    /* Looks up the object's directory entry */
+    int lookup_object(cache_block* blk, optional_yield y);
+    /* Tells the other gateways the object was written or deleted */
+    void invalidate_peers(const DoutPrefixProvider* dpp, const std::string& oid, optional_yield y);
+    /* Drops what this gateway holds in process of an object another
+     * gateway changed. With an empty oid, it is kept only for the objects
+     * whose metadata held in process is still current. */
+    void invalidate(const std::string& oid);
+    /* Reads a block from the cache of the gateway at host */
+    int fetch_peer_block(const DoutPrefixProvider* dpp, Object* obj, const std::string& host,
+			 uint64_t ofs, uint64_t len, bufferlist* bl, optional_yield y);
 };
 
 class D4NFilterUser : public FilterUser {
@@ -107,15 +291,37 @@ class D4NFilterObject : public FilterObject {
   private:
     D4NFilterDriver* filter;
 
+    /* Writes the object to the backing store if it was only acknowledged in
+     * write-back mode, before an operation the backing store carries out */
+    int write_back_dirty(const DoutPrefixProvider* dpp);
+
   public:
     struct D4NFilterReadOp : FilterReadOp {
       D4NFilterObject* source;
+      cache_block blk; /* Directory entry found by prepare() */
+      bool blk_found = false;
+      bool dirty = false; /* Only held in the cache until written back */
 
       D4NFilterReadOp(std::unique_ptr<ReadOp> _next, D4NFilterObject* _source) : FilterReadOp(std::move(_next)),
 										 source(_source) {}
       virtual ~D4NFilterReadOp() = default;
 
       virtual int prepare(optional_yield y, const DoutPrefixProvider* dpp) override;
+      virtual int iterate(const DoutPrefixProvider* dpp, int64_t ofs, int64_t end,
+			  RGWGetDataCB* cb, optional_yield y) override;
+
+    private:
+      /* Evaluates the request's conditions for an object that is only held
+       * in the cache, as the backing store would */
+      int check_dirty_conditions(const DoutPrefixProvider* dpp, const RGWD4NObjectMeta& meta);
+      /* Fills in blocks missing from the local cache with copies held by
+       * other gateways */
+      void fetch_peer_blocks(const DoutPrefixProvider* dpp, const std::vector<uint64_t>& offsets,
+			     std::vector<bufferlist>* blocks, optional_yield y);
+      int fill_blocks(const DoutPrefixProvider* dpp, uint64_t blk_ofs, uint64_t blk_end,
+		      int64_t ofs, int64_t end, RGWGetDataCB* cb, optional_yield y);
+      /* Queues the blocks ahead of a sequential stream for prefetching */
+      void prefetch_ahead(const DoutPrefixProvider* dpp, uint64_t ofs, uint64_t end);
     };
 
     struct D4NFilterDeleteOp : FilterDeleteOp {
@@ -170,16 +376,63 @@ class D4NFilterWriter : public FilterWriter {
     D4NFilterDriver* filter; 
     const DoutPrefixProvider* save_dpp;
     bool atomic;
+    optional_yield y;
+
+    /* Data not yet written to the cache is held until it fills a block */
+    bufferlist pending;
+    uint64_t pending_ofs = 0;
+    bool cache_data = true;
+    bool compress = true; /* Until a block doesn't compress well */
+    bool processed = false;
+
+    /* In write-back mode the object's data is held here, and only passed on
+     * to the next writer if the object turns out not to qualify */
+    bool write_back = false;
+    bool wb_ended = false;
+    bufferlist wb_data;
+    RGWD4NDirtyEntry wb_entry; /* Arguments the next writer was created with */
+    bool wb_target = false;
+    /* The object has a PUT not yet written back, whose data is kept until
+     * this one has reached the backing store */
+    bool supersedes_dirty = false;
+    std::optional<std::string> superseded_etag; /* If its entry could be read */
+
+    /* Drops the object's cached data, and its metadata as well if meta is
+     * set */
+    void delete_data(bool meta);
+    /* Evaluates the PUT's conditions against the PUT it supersedes, which
+     * the backing store doesn't have yet */
+    int check_superseded_conditions(const char* if_match, const char* if_nomatch);
+    int flush_blocks(bool flush_all);
+    /* Leaves write-back mode, replaying the data held so far */
+    int write_through();
+    int complete_write_back(size_t accounted_size, const std::string& etag,
+			    ceph::real_time *mtime, ceph::real_time set_mtime,
+			    std::map<std::string, bufferlist>& attrs,
+			    ceph::real_time delete_at, const std::string *user_data);
 
   public:
     D4NFilterWriter(std::unique_ptr<Writer> _next, D4NFilterDriver* _filter, Object* _obj, 
-	const DoutPrefixProvider* _dpp) : FilterWriter(std::move(_next), _obj),
-					  filter(_filter),
-					  save_dpp(_dpp), atomic(false) {}
+	const DoutPrefixProvider* _dpp, optional_yield _y) : FilterWriter(std::move(_next), _obj),
+							     filter(_filter),
+							     save_dpp(_dpp), atomic(false), y(_y) {}
     D4NFilterWriter(std::unique_ptr<Writer> _next, D4NFilterDriver* _filter, Object* _obj, 
-	const DoutPrefixProvider* _dpp, bool _atomic) : FilterWriter(std::move(_next), _obj),
-							filter(_filter),
-							save_dpp(_dpp), atomic(_atomic) {}
+	const DoutPrefixProvider* _dpp, bool _atomic, optional_yield _y) : FilterWriter(std::move(_next), _obj),
+									   filter(_filter),
+									   save_dpp(_dpp), atomic(_atomic), y(_y) {}
+    D4NFilterWriter(std::unique_ptr<Writer> _next, D4NFilterDriver* _filter, Object* _obj, 
+	const DoutPrefixProvider* _dpp, bool _atomic, optional_yield _y,
+	const rgw_user& owner, const rgw_placement_rule* ptail_placement_rule,
+	uint64_t olh_epoch, const std::string& unique_tag) : D4NFilterWriter(std::move(_next), _filter, _obj,
+									     _dpp, _atomic, _y) {
+      wb_entry.owner = owner;
+      if (ptail_placement_rule) {
+	wb_entry.placement_rule = *ptail_placement_rule;
+      }
+      wb_entry.olh_epoch = olh_epoch;
+      wb_entry.unique_tag = unique_tag;
+      wb_target = true;
+    }
     virtual ~D4NFilterWriter() = default;
 
     virtual int prepare(optional_yield y);
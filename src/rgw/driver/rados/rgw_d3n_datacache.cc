@@ -9,6 +9,10 @@
 #include "rgw_auth_s3.h"
 #include "rgw_op.h"
 #include "rgw_crypt_sanitize.h"
+#include "rgw_perf_counters.h"
+#include "common/blkdev.h"
+#include "common/safe_io.h"
+#include "include/scope_guard.h"
 #if defined(__linux__)
 #include <features.h>
 #endif
@@ -25,16 +29,15 @@ namespace efs = std::experimental::filesystem;
 
 using namespace std;
 
-int D3nCacheAioWriteRequest::d3n_libaio_prepare_write_op(bufferlist& bl, unsigned int len, string oid, string cache_location)
+int D3nCacheAioWriteRequest::d3n_libaio_prepare_write_op(bufferlist& bl, unsigned int len, string location, off_t ofs, int flags)
 {
-  std::string location = cache_location + url_encode(oid, true);
   int r = 0;
 
   lsubdout(g_ceph_context, rgw_datacache, 20) << "D3nDataCache: " << __func__ << "(): Write To Cache, location=" << location << dendl;
   cb = new struct aiocb;
   mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
   memset(cb, 0, sizeof(struct aiocb));
-  r = fd = ::open(location.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+  r = fd = ::open(location.c_str(), O_WRONLY | flags, mode);
   if (fd < 0) {
     ldout(cct, 0) << "ERROR: D3nCacheAioWriteRequest::create_io: open file failed, errno=" << errno << ", location='" << location.c_str() << "'" << dendl;
     return r;
@@ -53,6 +56,7 @@ int D3nCacheAioWriteRequest::d3n_libaio_prepare_write_op(bufferlist& bl, unsigne
   cb->aio_buf = data;
   memcpy((void*)data, bl.c_str(), len);
   cb->aio_nbytes = len;
+  cb->aio_offset = ofs;
 
   return r;
 }
@@ -66,8 +70,7 @@ D3nDataCache::D3nDataCache()
 void D3nDataCache::init(CephContext *_cct) {
   cct = _cct;
   free_data_cache_size = cct->_conf->rgw_d3n_l1_datacache_size;
-  head = nullptr;
-  tail = nullptr;
+  shards = std::vector<D3nCacheShard>(std::max<uint64_t>(cct->_conf.get_val<uint64_t>("rgw_d3n_l1_index_shards"), 1));
   cache_location = cct->_conf->rgw_d3n_l1_datacache_persistent_path;
   if(cache_location.back() != '/') {
       cache_location += "/";
@@ -92,11 +95,13 @@ void D3nDataCache::init(CephContext *_cct) {
   }
 
   auto conf_eviction_policy = cct->_conf.get_val<std::string>("rgw_d3n_l1_eviction_policy");
-  ceph_assert(conf_eviction_policy == "lru" || conf_eviction_policy == "random");
+  ceph_assert(conf_eviction_policy == "lru" || conf_eviction_policy == "random" || conf_eviction_policy == "2q");
   if (conf_eviction_policy == "lru")
     eviction_policy = _eviction_policy::LRU;
   if (conf_eviction_policy == "random")
     eviction_policy = _eviction_policy::RANDOM;
+  if (conf_eviction_policy == "2q")
+    eviction_policy = _eviction_policy::TWOQ;
 
 #if defined(HAVE_LIBAIO) && defined(__GLIBC__)
   // libaio setup
@@ -106,6 +111,332 @@ void D3nDataCache::init(CephContext *_cct) {
   ainit.aio_idle_time = 10;
   aio_init(&ainit);
 #endif
+
+  auto conf_io_engine = cct->_conf.get_val<std::string>("rgw_d3n_io_engine");
+  if (conf_io_engine == "io_uring") {
+    uring = D3nIoUring::create(cct);
+  }
+  lsubdout(g_ceph_context, rgw_datacache, 5) << "D3nDataCache: init: using " << (uring ? "io_uring" : "POSIX AIO") << " for cache file io" << dendl;
+
+  if (cct->_conf.get_val<std::string>("rgw_d3n_l1_store") == "slab") {
+    int r = d3n_slab_init();
+    if (r < 0) {
+      lderr(g_ceph_context) << "D3nDataCache: init: ERROR initializing the slab store '" << slab_path <<
+                                "' : " << cpp_strerror(r) << ", storing a file per chunk" << dendl;
+    }
+  }
+
+  probation_target = free_data_cache_size * cct->_conf.get_val<double>("rgw_d3n_l1_2q_probation_ratio");
+  free_watermark = free_data_cache_size * cct->_conf.get_val<double>("rgw_d3n_l1_free_watermark");
+  fill_queue_max = cct->_conf.get_val<Option::size_t>("rgw_d3n_l1_fill_queue_size");
+  fill_rate = cct->_conf.get_val<Option::size_t>("rgw_d3n_l1_fill_rate_limit");
+
+  if (cct->_conf.get_val<bool>("rgw_d3n_l1_persistent_index")) {
+    int r = d3n_index_init();
+    if (r < 0) {
+      lderr(g_ceph_context) << "D3nDataCache: init: ERROR initializing the cache index: " << cpp_strerror(r) <<
+                                ", the cache won't be kept across restarts" << dendl;
+      index.reset();
+    }
+  }
+
+  filler = make_named_thread("d3n_fill", [this] { d3n_filler(); });
+}
+
+D3nDataCache::~D3nDataCache()
+{
+  {
+    const std::lock_guard l(fill_lock);
+    stopping = true;
+    fill_cond.notify_all();
+  }
+  if (filler.joinable()) {
+    filler.join();
+  }
+  uring.reset(); // completes the outstanding writes
+  if (verifier.joinable()) {
+    verifier.join();
+  }
+  if (index) {
+    // keep the cache, with its recency, for the next start
+    index->stop();
+    d3n_index_checkpoint();
+    index.reset();
+    for (auto& shard : shards) {
+      for (auto& [oid, chunk] : shard.map) {
+        delete chunk;
+      }
+    }
+  } else {
+    while (d3n_evict() > 0);
+  }
+  if (data_fd >= 0) {
+    ::close(data_fd);
+  }
+}
+
+int D3nDataCache::d3n_slab_init()
+{
+  slab_path = cct->_conf.get_val<std::string>("rgw_d3n_l1_slab_path");
+  if (slab_path.empty()) {
+    slab_path = cache_location + "d3n.slab";
+  }
+  uint64_t size = cct->_conf->rgw_d3n_l1_datacache_size;
+
+  int fd = TEMP_FAILURE_RETRY(::open(slab_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+  if (fd < 0) {
+    return -errno;
+  }
+  auto fd_closer = make_scope_guard([&fd] {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  });
+
+  struct stat st;
+  if (::fstat(fd, &st) < 0) {
+    return -errno;
+  }
+  if (S_ISBLK(st.st_mode)) {
+    BlkDev blkdev(fd);
+    int64_t dev_size = 0;
+    int r = blkdev.get_size(&dev_size);
+    if (r < 0) {
+      return r;
+    }
+    size = std::min<uint64_t>(size, dev_size);
+  } else {
+    // allocate the blocks up front, so that cache writes neither fail
+    // for lack of space nor fragment the file
+    int r = ::posix_fallocate(fd, 0, size);
+    if (r == EOPNOTSUPP || r == EINVAL) {
+      r = ::ftruncate(fd, size) < 0 ? errno : 0;
+    }
+    if (r != 0) {
+      return -r;
+    }
+  }
+
+  uint64_t slab_size = std::max<uint64_t>(cct->_conf.get_val<Option::size_t>("rgw_d3n_l1_slab_size"),
+                                          cct->_conf->rgw_get_obj_max_req_size);
+  uint64_t min_slot = std::max<uint64_t>(cct->_conf.get_val<Option::size_t>("rgw_d3n_l1_slab_min_slot"), 1);
+  auto s = std::make_unique<D3nSlabAllocator>(size, slab_size, min_slot);
+  if (s->get_capacity() == 0) {
+    return -ENOSPC;
+  }
+
+  lsubdout(g_ceph_context, rgw_datacache, 5) << "D3nDataCache: init: slab store '" << slab_path << "' of " << s->get_capacity()
+                                             << " bytes in slabs of " << slab_size << " bytes" << dendl;
+  free_data_cache_size = s->get_capacity();
+  slab = std::move(s);
+  data_fd = std::exchange(fd, -1);
+  return 0;
+}
+
+int D3nDataCache::d3n_index_init()
+{
+  if (data_fd < 0) {
+    data_fd = TEMP_FAILURE_RETRY(::open(cache_location.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (data_fd < 0) {
+      return -errno;
+    }
+  }
+
+  index = std::make_unique<D3nCacheIndex>(cct, cache_location);
+  std::list<D3nIndexEntry> entries;
+  int r = index->load(&entries);
+  if (r < 0) {
+    return r;
+  }
+
+  // most recently used first, so the least recently used are dropped if
+  // the cache shrank
+  std::vector<std::string> loaded;
+  std::set<std::string> files;
+  const auto now = ceph::coarse_mono_clock::now();
+  for (auto e = entries.rbegin(); e != entries.rend(); ++e) {
+    uint64_t charge;
+    if (slab) {
+      charge = e->extent.len;
+      if (charge < e->size || charge > free_data_cache_size || !slab->claim(e->extent)) {
+        continue;
+      }
+    } else {
+      charge = e->size;
+      string file = url_encode(e->oid, true);
+      struct stat st;
+      if (charge > free_data_cache_size ||
+          ::stat((cache_location + file).c_str(), &st) < 0 || static_cast<uint64_t>(st.st_size) != e->size) {
+        continue;
+      }
+      files.insert(std::move(file));
+    }
+    auto chunk_info = new D3nChunkDataInfo;
+    chunk_info->oid = e->oid;
+    chunk_info->set_ctx(cct);
+    chunk_info->size = e->size;
+    chunk_info->extent = e->extent;
+    chunk_info->crc = e->crc;
+    chunk_info->verified = false;
+    chunk_info->last_access = now - std::chrono::nanoseconds(loaded.size());
+    auto& shard = shard_of(e->oid);
+    if (!shard.map.emplace(e->oid, chunk_info).second) {
+      delete chunk_info;
+      continue;
+    }
+    shard.lru_insert_tail(chunk_info);
+    free_data_cache_size -= charge;
+    loaded.push_back(e->oid);
+  }
+
+  if (!slab) {
+    // files of chunks evicted while the index wasn't recording them
+    try {
+      for (auto& p : efs::directory_iterator(cache_location)) {
+        auto name = p.path().filename().string();
+        if (p.is_regular_file() && !files.count(name) && name.rfind("d3n.", 0) != 0) {
+          efs::remove(p.path());
+        }
+      }
+    } catch (const efs::filesystem_error& e) {
+      lderr(g_ceph_context) << "D3nDataCache: init: ERROR removing stale cache files: " << e.what() << dendl;
+    }
+  }
+
+  lsubdout(g_ceph_context, rgw_datacache, 5) << "D3nDataCache: init: reloaded " << loaded.size() << " of " << entries.size()
+                                             << " indexed chunks" << dendl;
+
+  r = index->checkpoint([&entries, &loaded, this] {
+    std::vector<D3nIndexEntry> kept;
+    kept.reserve(loaded.size());
+    for (auto& e : entries) {
+      auto& shard = shard_of(e.oid);
+      if (auto i = shard.map.find(e.oid); i != shard.map.end() && i->second->extent.ofs == e.extent.ofs) {
+        kept.push_back(e);
+      }
+    }
+    return kept;
+  });
+  if (r < 0) {
+    return r;
+  }
+  index->start([this] { return d3n_sync_data(); },
+               [this] { d3n_index_checkpoint(); });
+
+  if (!loaded.empty()) {
+    verifier = make_named_thread("d3n_verify", [this, oids = std::move(loaded)] () mutable {
+      d3n_verify(std::move(oids));
+    });
+  }
+  return 0;
+}
+
+void D3nDataCache::d3n_index_checkpoint()
+{
+  index->checkpoint([this] {
+    std::vector<D3nChunkDataInfo*> chunks;
+    std::vector<std::unique_lock<std::mutex>> locks;
+    locks.reserve(shards.size());
+    for (auto& shard : shards) {
+      locks.emplace_back(shard.lock);
+      for (auto c = shard.tail; c != nullptr; c = c->lru_prev) {
+        chunks.push_back(c);
+      }
+      for (auto c = shard.probation_tail; c != nullptr; c = c->lru_prev) {
+        chunks.push_back(c);
+      }
+    }
+    std::stable_sort(chunks.begin(), chunks.end(), [] (auto a, auto b) {
+      return a->last_access < b->last_access;
+    });
+
+    std::vector<D3nIndexEntry> entries;
+    entries.reserve(chunks.size());
+    for (auto c : chunks) {
+      entries.push_back({c->oid, c->size, c->extent, c->crc});
+    }
+    index->discard_pending();
+    return entries;
+  });
+}
+
+int D3nDataCache::d3n_sync_data()
+{
+  int r;
+  if (slab) {
+    r = ::fdatasync(data_fd);
+  } else {
+#if defined(__linux__)
+    r = ::syncfs(data_fd);
+#else
+    ::sync();
+    r = 0;
+#endif
+  }
+  return r < 0 ? -errno : 0;
+}
+
+void D3nDataCache::d3n_verify(std::vector<std::string> oids)
+{
+  size_t verified = 0, dropped = 0;
+
+  for (const auto& oid : oids) {
+    if (stopping) {
+      break;
+    }
+
+    D3nChunkDataInfo* chunk;
+    auto& shard = shard_of(oid);
+    {
+      const std::lock_guard l(shard.lock);
+      auto iter = shard.map.find(oid);
+      if (iter == shard.map.end() || iter->second->verified) {
+        continue;
+      }
+      chunk = iter->second;
+      // keeps the chunk in place, see get()
+      chunk->readers++;
+    }
+
+    bufferptr bp = buffer::create_page_aligned(chunk->size);
+    int fd = data_fd;
+    off_t ofs = chunk->extent.ofs;
+    if (!slab) {
+      fd = TEMP_FAILURE_RETRY(::open((cache_location + url_encode(oid, true)).c_str(), O_RDONLY | O_CLOEXEC));
+      ofs = 0;
+    }
+    bool ok = fd >= 0 && safe_pread_exact(fd, bp.c_str(), chunk->size, ofs) == 0 &&
+              ceph_crc32c(-1, reinterpret_cast<const unsigned char*>(bp.c_str()), chunk->size) == chunk->crc;
+    if (!slab && fd >= 0) {
+      ::close(fd);
+    }
+
+    bool drop = false;
+    {
+      const std::lock_guard l(shard.lock);
+      auto iter = shard.map.find(oid);
+      if (iter != shard.map.end() && iter->second == chunk) {
+        if (ok) {
+          chunk->verified = true;
+          verified++;
+        } else {
+          d3n_unlink_chunk(shard, chunk);
+          drop = true;
+          dropped++;
+        }
+      }
+    }
+    if (drop) {
+      ldout(cct, 1) << "D3nDataCache: " << __func__ << "(): dropping oid=" << oid << ", its data doesn't match the index" << dendl;
+      const uint64_t charge = slab ? chunk->extent.len : chunk->size;
+      d3n_release_chunk(chunk);
+      const std::lock_guard l(d3n_eviction_lock);
+      free_data_cache_size += charge;
+    }
+    d3n_unpin_chunk(chunk);
+  }
+
+  ldout(cct, 5) << "D3nDataCache: " << __func__ << "(): verified " << verified << " reloaded chunks, dropped " << dropped << dendl;
 }
 
 int D3nDataCache::d3n_io_write(bufferlist& bl, unsigned int len, std::string oid)
@@ -147,12 +478,13 @@ int D3nDataCache::d3n_io_write(bufferlist& bl, unsigned int len, std::string oid
   }
 
   { // update cahce_map entries for new chunk in cache
-    const std::lock_guard l(d3n_cache_lock);
+    auto& shard = shard_of(oid);
+    const std::lock_guard l(shard.lock);
     chunk_info = new D3nChunkDataInfo;
     chunk_info->oid = oid;
     chunk_info->set_ctx(cct);
     chunk_info->size = len;
-    d3n_cache_map.insert(pair<string, D3nChunkDataInfo*>(oid, chunk_info));
+    shard.map.insert(pair<string, D3nChunkDataInfo*>(oid, chunk_info));
   }
 
   return r;
@@ -167,39 +499,90 @@ void d3n_libaio_write_cb(sigval sigval)
 
 
 void D3nDataCache::d3n_libaio_write_completion_cb(D3nCacheAioWriteRequest* c)
+{
+  int r = -aio_error(c->cb);
+  if (r == 0 && static_cast<size_t>(aio_return(c->cb)) != c->cb->aio_nbytes) {
+    r = -EIO;
+  }
+  d3n_write_completion(c->chunk, r);
+
+  delete c;
+  c = nullptr;
+}
+
+void D3nDataCache::d3n_write_completion(const D3nIndexEntry& chunk, int r)
 {
   D3nChunkDataInfo* chunk_info{nullptr};
+  const std::string& oid = chunk.oid;
+  // space is accounted for in whole extents in the slab store
+  const uint64_t charge = slab ? chunk.extent.len : chunk.size;
 
-  ldout(cct, 5) << "D3nDataCache: " << __func__ << "(): oid=" << c->oid << dendl;
+  ldout(cct, 5) << "D3nDataCache: " << __func__ << "(): oid=" << oid << ", r=" << r << dendl;
 
-  { // update cache_map entries for new chunk in cache
-    const std::lock_guard l(d3n_cache_lock);
-    d3n_outstanding_write_list.erase(c->oid);
-    chunk_info = new D3nChunkDataInfo;
-    chunk_info->oid = c->oid;
-    chunk_info->set_ctx(cct);
-    chunk_info->size = c->cb->aio_nbytes;
-    d3n_cache_map.insert(pair<string, D3nChunkDataInfo*>(c->oid, chunk_info));
+  if (r < 0) {
+    ldout(cct, 1) << "ERROR: D3nDataCache: " << __func__ << "(): write of oid=" << oid << " failed, r=" << r << dendl;
+    if (slab) {
+      slab->release(chunk.extent);
+    } else {
+      ::remove((cache_location + url_encode(oid, true)).c_str());
+    }
+    {
+      auto& shard = shard_of(oid);
+      const std::lock_guard l(shard.lock);
+      shard.outstanding_writes.erase(oid);
+    }
+    const std::lock_guard l(d3n_eviction_lock);
+    outstanding_write_size -= charge;
+    return;
   }
 
   { // update free size
     const std::lock_guard l(d3n_eviction_lock);
-    free_data_cache_size -= c->cb->aio_nbytes;
-    outstanding_write_size -= c->cb->aio_nbytes;
-    lru_insert_head(chunk_info);
+    free_data_cache_size -= charge;
+    outstanding_write_size -= charge;
   }
 
-  delete c;
-  c = nullptr;
+  { // update cache_map entries for new chunk in cache
+    auto& shard = shard_of(oid);
+    const std::lock_guard l(shard.lock);
+    shard.outstanding_writes.erase(oid);
+    chunk_info = new D3nChunkDataInfo;
+    chunk_info->oid = oid;
+    chunk_info->set_ctx(cct);
+    chunk_info->size = chunk.size;
+    chunk_info->extent = chunk.extent;
+    chunk_info->crc = chunk.crc;
+    chunk_info->last_access = ceph::coarse_mono_clock::now();
+    if (eviction_policy == _eviction_policy::TWOQ) {
+      // new chunks are on probation, unless they were evicted from it
+      // recently, which means the probation list is too short for them
+      if (shard.ghost_remove(oid)) {
+        if (perfcounter) perfcounter->inc(l_rgw_d3n_ghost_hit);
+      } else {
+        chunk_info->probation = true;
+        probation_size += charge;
+      }
+    }
+    shard.map.insert(pair<string, D3nChunkDataInfo*>(oid, chunk_info));
+    shard.lru_insert_head(chunk_info);
+    if (index) {
+      index->add(chunk);
+    }
+  }
 }
 
-int D3nDataCache::d3n_libaio_create_write_request(bufferlist& bl, unsigned int len, std::string oid)
+int D3nDataCache::d3n_libaio_create_write_request(bufferlist& bl, const D3nIndexEntry& chunk)
 {
-  lsubdout(g_ceph_context, rgw_datacache, 30) << "D3nDataCache: " << __func__ << "(): Write To Cache, oid=" << oid << ", len=" << len << dendl;
+  lsubdout(g_ceph_context, rgw_datacache, 30) << "D3nDataCache: " << __func__ << "(): Write To Cache, oid=" << chunk.oid << ", len=" << chunk.size << dendl;
   auto wr = std::make_unique<struct D3nCacheAioWriteRequest>(cct);
   int r = 0;
 
-  if ((r = wr->d3n_libaio_prepare_write_op(bl, len, oid, cache_location)) < 0) {
+  if (slab) {
+    r = wr->d3n_libaio_prepare_write_op(bl, chunk.size, slab_path, chunk.extent.ofs, 0);
+  } else {
+    r = wr->d3n_libaio_prepare_write_op(bl, chunk.size, cache_location + url_encode(chunk.oid, true), 0, O_CREAT | O_TRUNC);
+  }
+  if (r < 0) {
     ldout(cct, 0) << "ERROR: D3nDataCache: " << __func__ << "() prepare libaio write op r=" << r << dendl;
     return r;
   }
@@ -207,7 +590,8 @@ int D3nDataCache::d3n_libaio_create_write_request(bufferlist& bl, unsigned int l
   wr->cb->aio_sigevent.sigev_notify_function = d3n_libaio_write_cb;
   wr->cb->aio_sigevent.sigev_notify_attributes = nullptr;
   wr->cb->aio_sigevent.sigev_value.sival_ptr = (void*)(wr.get());
-  wr->oid = oid;
+  wr->oid = chunk.oid;
+  wr->chunk = chunk;
   wr->priv_data = this;
 
   if ((r = ::aio_write(wr->cb)) != 0) {
@@ -222,25 +606,166 @@ int D3nDataCache::d3n_libaio_create_write_request(bufferlist& bl, unsigned int l
   return r;
 }
 
-void D3nDataCache::put(bufferlist& bl, unsigned int len, std::string& oid)
+int D3nDataCache::d3n_uring_create_write_request(bufferlist& bl, const D3nIndexEntry& chunk)
 {
-  size_t sr = 0;
-  uint64_t freed_size = 0, _free_data_cache_size = 0, _outstanding_write_size = 0;
+  lsubdout(g_ceph_context, rgw_datacache, 30) << "D3nDataCache: " << __func__ << "(): Write To Cache, oid=" << chunk.oid << ", len=" << chunk.size << dendl;
+
+  // the write shares the buffers of bl instead of copying them
+  bufferlist data;
+  data.substr_of(bl, 0, chunk.size);
+
+  auto completion = [this, chunk] (int r, bufferlist&&) {
+    d3n_write_completion(chunk, r);
+  };
+  int r;
+  if (slab) {
+    r = uring->write(slab_path, chunk.extent.ofs, std::move(data), std::move(completion));
+  } else {
+    r = uring->write(cache_location + url_encode(chunk.oid, true), std::move(data), std::move(completion));
+  }
+  if (r < 0 && r != -EAGAIN) {
+    ldout(cct, 0) << "ERROR: D3nDataCache: " << __func__ << "() io_uring write r=" << r << dendl;
+  }
+  return r;
+}
 
+void D3nDataCache::put(bufferlist& bl, unsigned int len, std::string& oid)
+{
   ldout(cct, 10) << "D3nDataCache::" << __func__ << "(): oid=" << oid << ", len=" << len << dendl;
+  if (slab && slab->slot_size(len) == 0) {
+    ldout(cct, 10) << "D3nDataCache::" << __func__ << "(): chunk larger than a slab, not writing to cache" << dendl;
+    return;
+  }
+  auto& shard = shard_of(oid);
   {
-    const std::lock_guard l(d3n_cache_lock);
-    std::unordered_map<string, D3nChunkDataInfo*>::iterator iter = d3n_cache_map.find(oid);
-    if (iter != d3n_cache_map.end()) {
+    const std::lock_guard l(shard.lock);
+    std::unordered_map<string, D3nChunkDataInfo*>::iterator iter = shard.map.find(oid);
+    if (iter != shard.map.end() && (iter->second->size >= len || iter->second->readers > 0)) {
       ldout(cct, 10) << "D3nDataCache::" << __func__ << "(): data already cached, no rewrite" << dendl;
       return;
     }
-    auto it = d3n_outstanding_write_list.find(oid);
-    if (it != d3n_outstanding_write_list.end()) {
+    auto it = shard.outstanding_writes.find(oid);
+    if (it != shard.outstanding_writes.end()) {
       ldout(cct, 10) << "D3nDataCache: NOTE: data put in cache already issued, no rewrite" << dendl;
       return;
     }
-    d3n_outstanding_write_list.insert(oid);
+    if (shard.pinned_evictions.count(oid)) {
+      ldout(cct, 10) << "D3nDataCache::" << __func__ << "(): evicted chunk still being read, no rewrite" << dendl;
+      return;
+    }
+    shard.outstanding_writes.insert(oid);
+  }
+  {
+    const std::lock_guard l(fill_lock);
+    if (fill_queue_bytes + len <= fill_queue_max) {
+      fill_queue_bytes += len;
+      fill_queue.push_back({bl, len, oid});
+      fill_cond.notify_one();
+      return;
+    }
+  }
+  // the cache can't keep up, drop the fill rather than wait
+  ldout(cct, 10) << "D3nDataCache::" << __func__ << "(): fill queue full, not writing to cache" << dendl;
+  if (perfcounter) perfcounter->inc(l_rgw_d3n_fill_dropped);
+  const std::lock_guard l(shard.lock);
+  shard.outstanding_writes.erase(oid);
+}
+
+void D3nDataCache::d3n_filler()
+{
+  using clock = std::chrono::steady_clock;
+  auto next = clock::now();
+  std::unique_lock l(fill_lock);
+  while (!stopping) {
+    if (fill_queue.empty()) {
+      l.unlock();
+      d3n_reclaim();
+      l.lock();
+      if (fill_queue.empty() && !stopping) {
+        fill_cond.wait(l);
+      }
+      continue;
+    }
+    if (fill_rate > 0 && clock::now() < next) {
+      fill_cond.wait_until(l, next);
+      continue;
+    }
+    auto fill = std::move(fill_queue.front());
+    fill_queue.pop_front();
+    fill_queue_bytes -= fill.len;
+    l.unlock();
+
+    d3n_fill(fill.bl, fill.len, fill.oid);
+    if (fill_rate > 0) {
+      // spread the writes to keep to the rate over time, without bursts
+      next = std::max(next, clock::now()) +
+	std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(double(fill.len) / fill_rate));
+    }
+    d3n_reclaim();
+    l.lock();
+  }
+}
+
+void D3nDataCache::d3n_reclaim()
+{
+  // evict a batch of chunks ahead of the fills, so that they rarely have
+  // to wait for evictions
+  uint64_t freed_size = 0;
+  while (!stopping) {
+    {
+      const std::lock_guard l(d3n_eviction_lock);
+      free_data_cache_size += freed_size;
+      freed_size = 0;
+      if (free_data_cache_size >= free_watermark + outstanding_write_size) {
+        return;
+      }
+    }
+    freed_size = d3n_evict();
+    if (freed_size == 0) {
+      return;
+    }
+    ldout(cct, 20) << "D3nDataCache: " << __func__ << "(): evicted " << freed_size << " bytes" << dendl;
+  }
+  const std::lock_guard l(d3n_eviction_lock);
+  free_data_cache_size += freed_size;
+}
+
+void D3nDataCache::d3n_fill(bufferlist& bl, unsigned int len, const std::string& oid)
+{
+  size_t sr = 0;
+  uint64_t freed_size = 0, _free_data_cache_size = 0, _outstanding_write_size = 0;
+  uint64_t charge = slab ? slab->slot_size(len) : len;
+  D3nIndexEntry chunk;
+  D3nExtent& extent = chunk.extent;
+
+  auto& shard = shard_of(oid);
+  D3nChunkDataInfo* stale = nullptr;
+  {
+    const std::lock_guard l(shard.lock);
+    if (shard.pinned_evictions.count(oid)) {
+      // evicted since the fill was queued, and still being read
+      ldout(cct, 10) << "D3nDataCache::" << __func__ << "(): evicted chunk still being read, no rewrite" << dendl;
+      shard.outstanding_writes.erase(oid);
+      return;
+    }
+    std::unordered_map<string, D3nChunkDataInfo*>::iterator iter = shard.map.find(oid);
+    if (iter != shard.map.end()) {
+      if (iter->second->readers > 0) {
+        ldout(cct, 10) << "D3nDataCache::" << __func__ << "(): cached prefix being read, no rewrite" << dendl;
+        shard.outstanding_writes.erase(oid);
+        return;
+      }
+      // only a prefix of the rados object was cached by a ranged read,
+      // replace it. it has no readers, so it is released right away and
+      // its file can't be removed after being rewritten
+      ldout(cct, 10) << "D3nDataCache::" << __func__ << "(): replacing cached prefix of " << iter->second->size << " bytes" << dendl;
+      stale = iter->second;
+      d3n_unlink_chunk(shard, stale);
+    }
+  }
+  if (stale) {
+    freed_size += d3n_charge(stale);
+    d3n_release_chunk(stale);
   }
   {
     const std::lock_guard l(d3n_eviction_lock);
@@ -248,133 +773,280 @@ void D3nDataCache::put(bufferlist& bl, unsigned int len, std::string& oid)
     _outstanding_write_size = outstanding_write_size;
   }
   ldout(cct, 20) << "D3nDataCache: Before eviction _free_data_cache_size:" << _free_data_cache_size << ", _outstanding_write_size:" << _outstanding_write_size << ", freed_size:" << freed_size << dendl;
-  while (len > (_free_data_cache_size - _outstanding_write_size + freed_size)) {
+  while (charge > (_free_data_cache_size - _outstanding_write_size + freed_size)) {
     ldout(cct, 20) << "D3nDataCache: enter eviction" << dendl;
-    if (eviction_policy == _eviction_policy::LRU) {
-      sr = lru_eviction();
-    } else if (eviction_policy == _eviction_policy::RANDOM) {
-      sr = random_eviction();
-    } else {
-      ldout(cct, 0) << "D3nDataCache: Warning: unknown cache eviction policy, defaulting to lru eviction" << dendl;
-      sr = lru_eviction();
-    }
+    sr = d3n_evict();
     if (sr == 0) {
       ldout(cct, 2) << "D3nDataCache: Warning: eviction was not able to free disk space, not writing to cache" << dendl;
-      d3n_outstanding_write_list.erase(oid);
+      {
+        const std::lock_guard l(shard.lock);
+        shard.outstanding_writes.erase(oid);
+      }
+      const std::lock_guard l(d3n_eviction_lock);
+      free_data_cache_size += freed_size;
       return;
     }
     ldout(cct, 20) << "D3nDataCache: completed eviction of " << sr << " bytes" << dendl;
     freed_size += sr;
   }
-  int r = 0;
-  r = d3n_libaio_create_write_request(bl, len, oid);
+  // free space may be held by slabs of other size classes, or by chunks
+  // that are still being read
+  while (slab && !slab->allocate(len, &extent)) {
+    sr = d3n_evict();
+    if (sr == 0) {
+      ldout(cct, 2) << "D3nDataCache: Warning: no free extent in the slab store, not writing to cache" << dendl;
+      {
+        const std::lock_guard l(shard.lock);
+        shard.outstanding_writes.erase(oid);
+      }
+      const std::lock_guard l(d3n_eviction_lock);
+      free_data_cache_size += freed_size;
+      return;
+    }
+    freed_size += sr;
+  }
+  {
+    // accounted before submitting, as the write may complete right away
+    const std::lock_guard l(d3n_eviction_lock);
+    free_data_cache_size += freed_size;
+    outstanding_write_size += charge;
+  }
+  chunk.oid = oid;
+  chunk.size = len;
+  if (index) {
+    chunk.crc = bl.crc32c(-1);
+  }
+  int r = -EAGAIN;
+  if (uring) {
+    r = d3n_uring_create_write_request(bl, chunk);
+  }
+  if (r == -EAGAIN) {
+    // no uring, or the ring is full
+    r = d3n_libaio_create_write_request(bl, chunk);
+  }
   if (r < 0) {
-    const std::lock_guard l(d3n_cache_lock);
-    d3n_outstanding_write_list.erase(oid);
+    if (slab) {
+      slab->release(extent);
+    }
+    {
+      const std::lock_guard l(shard.lock);
+      shard.outstanding_writes.erase(oid);
+    }
     ldout(cct, 1) << "D3nDataCache: create_aio_write_request fail, r=" << r << dendl;
+    const std::lock_guard l(d3n_eviction_lock);
+    outstanding_write_size -= charge;
     return;
   }
+}
 
-  const std::lock_guard l(d3n_eviction_lock);
-  free_data_cache_size += freed_size;
-  outstanding_write_size += len;
+bool D3nDataCache::get(const string& oid, const off_t ofs, const off_t len, Location* loc)
+{
+  auto& shard = shard_of(oid);
+  const std::lock_guard l(shard.lock);
+  lsubdout(g_ceph_context, rgw_datacache, 20) << "D3nDataCache: " << __func__ << "(): oid=" << oid << ", ofs=" << ofs << ", len=" << len << dendl;
+  // chunks are only indexed once written, and are neither removed nor
+  // reused while read from, so the index alone decides a hit
+  std::unordered_map<string, D3nChunkDataInfo*>::iterator iter = shard.map.find(oid);
+  if (iter == shard.map.end()) {
+    if (perfcounter) perfcounter->inc(l_rgw_d3n_cache_miss);
+    return false;
+  }
+  struct D3nChunkDataInfo* chdo = iter->second;
+  // any range within the cached part of the rados object is a hit
+  if (!chdo->verified || ofs < 0 || len < 0 ||
+      static_cast<uint64_t>(ofs + len) > chdo->size) {
+    if (perfcounter) perfcounter->inc(l_rgw_d3n_cache_miss);
+    return false;
+  }
+  if (perfcounter) perfcounter->inc(l_rgw_d3n_cache_hit);
+  chdo->readers++;
+  chdo->last_access = ceph::coarse_mono_clock::now();
+  shard.lru_remove(chdo);
+  if (chdo->probation) {
+    // read again since cached, so not only part of a scan
+    chdo->probation = false;
+    probation_size -= d3n_charge(chdo);
+  }
+  shard.lru_insert_head(chdo);
+  if (slab) {
+    loc->path = slab_path;
+    loc->ofs = chdo->extent.ofs + ofs;
+  } else {
+    loc->path = cache_location + url_encode(oid, true);
+    loc->ofs = ofs;
+  }
+  loc->pin = std::shared_ptr<void>(nullptr, [this, chdo] (void*) { d3n_unpin_chunk(chdo); });
+  return true;
 }
 
-bool D3nDataCache::get(const string& oid, const off_t len)
+bool D3nDataCache::is_cached(const string& oid)
 {
-  const std::lock_guard l(d3n_cache_lock);
-  bool exist = false;
-  string location = cache_location + url_encode(oid, true);
+  auto& shard = shard_of(oid);
+  const std::lock_guard l(shard.lock);
+  auto iter = shard.map.find(oid);
+  return iter != shard.map.end() && iter->second->verified;
+}
 
-  lsubdout(g_ceph_context, rgw_datacache, 20) << "D3nDataCache: " << __func__ << "(): location=" << location << dendl;
-  std::unordered_map<string, D3nChunkDataInfo*>::iterator iter = d3n_cache_map.find(oid);
-  if (!(iter == d3n_cache_map.end())) {
-    // check inside cache whether file exists or not!!!! then make exist true;
-    struct D3nChunkDataInfo* chdo = iter->second;
-    struct stat st;
-    int r = stat(location.c_str(), &st);
-    if ( r != -1 && st.st_size == len) { // file exists and containes required data range length
-      exist = true;
-      /*LRU*/
-      /*get D3nChunkDataInfo*/
-      const std::lock_guard l(d3n_eviction_lock);
-      lru_remove(chdo);
-      lru_insert_head(chdo);
-    } else {
-      d3n_cache_map.erase(oid);
-      const std::lock_guard l(d3n_eviction_lock);
-      lru_remove(chdo);
-      delete chdo;
-      exist = false;
+void D3nDataCache::d3n_unpin_chunk(D3nChunkDataInfo* chunk)
+{
+  auto& shard = shard_of(chunk->oid);
+  {
+    const std::lock_guard l(shard.lock);
+    if (--chunk->readers > 0 || !chunk->evicted) {
+      return;
     }
   }
-  return exist;
+  const std::string oid = chunk->oid;
+  d3n_free_chunk(chunk);
+  if (!slab) {
+    // the file is gone, so the oid may be cached again
+    const std::lock_guard l(shard.lock);
+    shard.pinned_evictions.erase(oid);
+  }
+}
+
+void D3nDataCache::d3n_release_chunk(D3nChunkDataInfo* chunk)
+{
+  {
+    auto& shard = shard_of(chunk->oid);
+    const std::lock_guard l(shard.lock);
+    if (chunk->readers > 0) {
+      // released by the last read
+      chunk->evicted = true;
+      if (!slab) {
+        shard.pinned_evictions.insert(chunk->oid);
+      }
+      return;
+    }
+  }
+  d3n_free_chunk(chunk);
+}
+
+void D3nDataCache::d3n_free_chunk(D3nChunkDataInfo* chunk)
+{
+  if (slab) {
+    slab->release(chunk->extent);
+  } else {
+    string location = cache_location + url_encode(chunk->oid, true);
+    ::remove(location.c_str());
+  }
+  delete chunk;
+}
+
+void D3nDataCache::d3n_unlink_chunk(D3nCacheShard& shard, D3nChunkDataInfo* chunk)
+{
+  shard.lru_remove(chunk);
+  if (chunk->probation) {
+    probation_size -= d3n_charge(chunk);
+  }
+  shard.map.erase(chunk->oid);
+  if (index) {
+    index->remove(chunk->oid);
+  }
+}
+
+size_t D3nDataCache::d3n_evict()
+{
+  if (eviction_policy == _eviction_policy::LRU) {
+    return lru_eviction();
+  } else if (eviction_policy == _eviction_policy::RANDOM) {
+    return random_eviction();
+  } else if (eviction_policy == _eviction_policy::TWOQ) {
+    return twoq_eviction();
+  }
+  ldout(cct, 0) << "D3nDataCache: Warning: unknown cache eviction policy, defaulting to lru eviction" << dendl;
+  return lru_eviction();
 }
 
 size_t D3nDataCache::random_eviction()
 {
   lsubdout(g_ceph_context, rgw_datacache, 20) << "D3nDataCache: " << __func__ << "()" << dendl;
-  int n_entries = 0;
-  int random_index = 0;
   size_t freed_size = 0;
   D3nChunkDataInfo* del_entry;
-  string del_oid, location;
-  {
-    const std::lock_guard l(d3n_cache_lock);
-    n_entries = d3n_cache_map.size();
-    if (n_entries <= 0) {
-      return -1;
-    }
-    srand (time(NULL));
-    random_index = ceph::util::generate_random_number<int>(0, n_entries-1);
-    std::unordered_map<string, D3nChunkDataInfo*>::iterator iter = d3n_cache_map.begin();
+  // start at a random shard, and take a random entry of the first one that
+  // isn't empty
+  const size_t first = ceph::util::generate_random_number<size_t>(0, shards.size() - 1);
+  for (size_t i = 0; i < shards.size(); i++) {
+    auto& shard = shards[(first + i) % shards.size()];
+    const std::lock_guard l(shard.lock);
+    const size_t n_entries = shard.map.size();
+    if (n_entries == 0) {
+      continue;
+    }
+    const size_t random_index = ceph::util::generate_random_number<size_t>(0, n_entries - 1);
+    auto iter = shard.map.begin();
     std::advance(iter, random_index);
-    del_oid = iter->first;
-    del_entry =  iter->second;
+    del_entry = iter->second;
     ldout(cct, 20) << "D3nDataCache: random_eviction: index:" << random_index << ", free size: " << del_entry->size << dendl;
-    freed_size = del_entry->size;
-    delete del_entry;
-    del_entry = nullptr;
-    d3n_cache_map.erase(del_oid); // oid
+    freed_size = d3n_charge(del_entry);
+    d3n_unlink_chunk(shard, del_entry);
+    break;
+  }
+  if (freed_size == 0) {
+    return 0;
   }
 
-  location = cache_location + url_encode(del_oid, true);
-  ::remove(location.c_str());
+  d3n_release_chunk(del_entry);
   return freed_size;
 }
 
-size_t D3nDataCache::lru_eviction()
+size_t D3nDataCache::lru_eviction(bool probation)
 {
-  lsubdout(g_ceph_context, rgw_datacache, 20) << "D3nDataCache: " << __func__ << "()" << dendl;
-  int n_entries = 0;
-  size_t freed_size = 0;
-  D3nChunkDataInfo* del_entry;
-  string del_oid, location;
+  lsubdout(g_ceph_context, rgw_datacache, 20) << "D3nDataCache: " << __func__ << "(): probation=" << probation << dendl;
+  D3nChunkDataInfo* del_entry = nullptr;
+  auto tail_of = [probation] (D3nCacheShard& shard) {
+    return probation ? shard.probation_tail : shard.tail;
+  };
 
-  {
-    const std::lock_guard l(d3n_eviction_lock);
-    del_entry = tail;
-    if (del_entry == nullptr) {
+  // the least recently used chunk is the oldest of the shards' tails. the
+  // shards are peeked at one at a time, so a tail that is read meanwhile
+  // may still be evicted, as an approximation of lru
+  while (del_entry == nullptr) {
+    D3nCacheShard* victim = nullptr;
+    ceph::coarse_mono_time oldest = ceph::coarse_mono_time::max();
+    for (auto& shard : shards) {
+      const std::lock_guard l(shard.lock);
+      auto tail = tail_of(shard);
+      if (tail != nullptr && tail->last_access <= oldest) {
+        oldest = tail->last_access;
+        victim = &shard;
+      }
+    }
+    if (victim == nullptr) {
       ldout(cct, 2) << "D3nDataCache: lru_eviction: del_entry=null_ptr" << dendl;
       return 0;
     }
-    lru_remove(del_entry);
-  }
 
-  {
-    const std::lock_guard l(d3n_cache_lock);
-    n_entries = d3n_cache_map.size();
-    if (n_entries <= 0) {
-      ldout(cct, 2) << "D3nDataCache: lru_eviction: cache_map.size<=0" << dendl;
-      return -1;
-    }
-    del_oid = del_entry->oid;
-    ldout(cct, 20) << "D3nDataCache: lru_eviction: oid to remove: " << del_oid << dendl;
-    d3n_cache_map.erase(del_oid); // oid
-  }
-  freed_size = del_entry->size;
-  delete del_entry;
-  location = cache_location + url_encode(del_oid, true);
-  ::remove(location.c_str());
+    const std::lock_guard l(victim->lock);
+    // the shard may have been emptied since it was peeked at, then scan again
+    del_entry = tail_of(*victim);
+    if (del_entry == nullptr) {
+      continue;
+    }
+    ldout(cct, 20) << "D3nDataCache: lru_eviction: oid to remove: " << del_entry->oid << dendl;
+    if (probation) {
+      // remember it, about as many as half the chunks of the shard
+      victim->ghost_insert(del_entry->oid, victim->map.size() / 2 + 1);
+    }
+    d3n_unlink_chunk(*victim, del_entry);
+  }
+  const size_t freed_size = d3n_charge(del_entry);
+  d3n_release_chunk(del_entry);
   return freed_size;
 }
+
+size_t D3nDataCache::twoq_eviction()
+{
+  // chunks read only once, as by a scan, are evicted first while they hold
+  // more than their share of the cache, so that they don't push out the
+  // chunks that are read again
+  if (probation_size > probation_target) {
+    if (size_t freed = lru_eviction(true); freed > 0) {
+      return freed;
+    }
+  }
+  if (size_t freed = lru_eviction(false); freed > 0) {
+    return freed;
+  }
+  return lru_eviction(true);
+}
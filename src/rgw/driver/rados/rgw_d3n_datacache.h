@@ -13,6 +13,9 @@
 #include "include/Context.h"
 #include "include/lru.h"
 #include "rgw_d3n_cacherequest.h"
+#include "rgw_d3n_index.h"
+#include "rgw_d3n_slab.h"
+#include "rgw_d3n_uring.h"
 
 
 /*D3nDataCache*/
@@ -26,6 +29,13 @@ struct D3nChunkDataInfo : public LRUObject {
 	std::string address;
 	std::string oid;
 	bool complete;
+	D3nExtent extent; // where the chunk is kept in the slab store
+	uint32_t crc = 0; // of the data, if the cache is indexed
+	bool verified = true; // reloaded chunks are read once checked against crc
+	int readers = 0; // reads of the chunk in flight
+	bool evicted = false; // the chunk is released once the reads complete
+	ceph::coarse_mono_time last_access; // orders the chunks of different shards
+	bool probation = false; // not read since cached, with the 2q policy
 	struct D3nChunkDataInfo* lru_prev;
 	struct D3nChunkDataInfo* lru_next;
 
@@ -48,7 +58,8 @@ struct D3nCacheAioWriteRequest {
 	CephContext *cct = nullptr;
 
 	D3nCacheAioWriteRequest(CephContext *_cct) : cct(_cct) {}
-	int d3n_libaio_prepare_write_op(bufferlist& bl, unsigned int len, std::string oid, std::string cache_location);
+	D3nIndexEntry chunk;
+	int d3n_libaio_prepare_write_op(bufferlist& bl, unsigned int len, std::string location, off_t ofs, int flags);
 
   ~D3nCacheAioWriteRequest() {
     ::close(fd);
@@ -58,53 +69,31 @@ struct D3nCacheAioWriteRequest {
   }
 };
 
-struct D3nDataCache {
-
-private:
-  std::unordered_map<std::string, D3nChunkDataInfo*> d3n_cache_map;
-  std::set<std::string> d3n_outstanding_write_list;
-  std::mutex d3n_cache_lock;
-  std::mutex d3n_eviction_lock;
-
-  CephContext *cct;
-  enum class _io_type {
-    SYNC_IO = 1,
-    ASYNC_IO = 2,
-    SEND_FILE = 3
-  } io_type;
-  enum class _eviction_policy {
-    LRU=0, RANDOM=1
-  } eviction_policy;
-
-  struct sigaction action;
-  uint64_t free_data_cache_size = 0;
-  uint64_t outstanding_write_size = 0;
-  struct D3nChunkDataInfo* head;
-  struct D3nChunkDataInfo* tail;
-
-private:
-  void add_io();
-
-public:
-  D3nDataCache();
-  ~D3nDataCache() {
-    while (lru_eviction() > 0);
-  }
-
-  std::string cache_location;
-
-  bool get(const std::string& oid, const off_t len);
-  void put(bufferlist& bl, unsigned int len, std::string& obj_key);
-  int d3n_io_write(bufferlist& bl, unsigned int len, std::string oid);
-  int d3n_libaio_create_write_request(bufferlist& bl, unsigned int len, std::string oid);
-  void d3n_libaio_write_completion_cb(D3nCacheAioWriteRequest* c);
-  size_t random_eviction();
-  size_t lru_eviction();
-
-  void init(CephContext *_cct);
+/* A part of the d3n cache index, picked by the hash of the chunk oid, with
+ * its own lock and recency list so that lookups on different shards don't
+ * contend. The readers, evicted, last_access and probation fields of its
+ * chunks are protected by its lock. */
+struct alignas(64) D3nCacheShard {
+  std::mutex lock;
+  std::unordered_map<std::string, D3nChunkDataInfo*> map;
+  std::set<std::string> outstanding_writes;
+  // oids of chunks evicted while read from, whose files are only removed by
+  // the last read. they aren't cached again until then, or the new file
+  // would be truncated under the reads and removed after them
+  std::set<std::string> pinned_evictions;
+  struct D3nChunkDataInfo* head = nullptr;
+  struct D3nChunkDataInfo* tail = nullptr;
+  // with the 2q policy, the chunks on probation are kept in a list of their
+  // own, and the oids last evicted from it are remembered as ghosts
+  struct D3nChunkDataInfo* probation_head = nullptr;
+  struct D3nChunkDataInfo* probation_tail = nullptr;
+  std::list<std::string> ghosts; // most recently evicted first
+  std::unordered_map<std::string, std::list<std::string>::iterator> ghost_map;
 
   void lru_insert_head(struct D3nChunkDataInfo* o) {
-    lsubdout(g_ceph_context, rgw_datacache, 30) << "D3nDataCache: " << __func__ << "()" << dendl;
+    lsubdout(g_ceph_context, rgw_datacache, 30) << "D3nCacheShard: " << __func__ << "()" << dendl;
+    auto& head = o->probation ? probation_head : this->head;
+    auto& tail = o->probation ? probation_tail : this->tail;
     o->lru_next = head;
     o->lru_prev = nullptr;
     if (head) {
@@ -116,7 +105,9 @@ public:
   }
 
   void lru_insert_tail(struct D3nChunkDataInfo* o) {
-    lsubdout(g_ceph_context, rgw_datacache, 30) << "D3nDataCache: " << __func__ << "()" << dendl;
+    lsubdout(g_ceph_context, rgw_datacache, 30) << "D3nCacheShard: " << __func__ << "()" << dendl;
+    auto& head = o->probation ? probation_head : this->head;
+    auto& tail = o->probation ? probation_tail : this->tail;
     o->lru_next = nullptr;
     o->lru_prev = tail;
     if (tail) {
@@ -128,7 +119,9 @@ public:
   }
 
   void lru_remove(struct D3nChunkDataInfo* o) {
-    lsubdout(g_ceph_context, rgw_datacache, 30) << "D3nDataCache: " << __func__ << "()" << dendl;
+    lsubdout(g_ceph_context, rgw_datacache, 30) << "D3nCacheShard: " << __func__ << "()" << dendl;
+    auto& head = o->probation ? probation_head : this->head;
+    auto& tail = o->probation ? probation_tail : this->tail;
     if (o->lru_next)
       o->lru_next->lru_prev = o->lru_prev;
     else
@@ -139,6 +132,128 @@ public:
       head = o->lru_next;
     o->lru_next = o->lru_prev = nullptr;
   }
+
+  void ghost_insert(const std::string& oid, size_t max_ghosts) {
+    ghost_remove(oid);
+    ghosts.push_front(oid);
+    ghost_map.emplace(oid, ghosts.begin());
+    while (ghosts.size() > max_ghosts) {
+      ghost_map.erase(ghosts.back());
+      ghosts.pop_back();
+    }
+  }
+
+  bool ghost_remove(const std::string& oid) {
+    auto i = ghost_map.find(oid);
+    if (i == ghost_map.end()) {
+      return false;
+    }
+    ghosts.erase(i->second);
+    ghost_map.erase(i);
+    return true;
+  }
+};
+
+struct D3nDataCache {
+
+private:
+  std::vector<D3nCacheShard> shards;
+  // guards the space accounting below
+  std::mutex d3n_eviction_lock;
+
+  CephContext *cct;
+  enum class _io_type {
+    SYNC_IO = 1,
+    ASYNC_IO = 2,
+    SEND_FILE = 3
+  } io_type;
+  enum class _eviction_policy {
+    LRU=0, RANDOM=1, TWOQ=2
+  } eviction_policy;
+  // bytes of the chunks on probation, and how many are evicted first
+  std::atomic<uint64_t> probation_size = 0;
+  uint64_t probation_target = 0;
+
+  struct sigaction action;
+  uint64_t free_data_cache_size = 0;
+  uint64_t outstanding_write_size = 0;
+  std::unique_ptr<D3nIoUring> uring; // unset when using POSIX AIO
+  std::unique_ptr<D3nSlabAllocator> slab; // unset when storing a file per chunk
+  std::string slab_path;
+  int data_fd = -1; // the slab store, or the cache directory
+  std::unique_ptr<D3nCacheIndex> index; // unset if the cache isn't kept across restarts
+  std::thread verifier;
+  std::atomic<bool> stopping = false;
+
+  // chunks read from rados are written to the cache by the filler thread,
+  // so that requests don't wait for evictions or for the writes to start
+  struct D3nFill {
+    bufferlist bl;
+    unsigned int len;
+    std::string oid;
+  };
+  std::mutex fill_lock;
+  std::condition_variable fill_cond;
+  std::deque<D3nFill> fill_queue;
+  uint64_t fill_queue_bytes = 0;
+  uint64_t fill_queue_max = 0;
+  uint64_t fill_rate = 0; // bytes per second, unlimited if 0
+  uint64_t free_watermark = 0; // bytes kept free ahead of the fills
+  std::thread filler;
+
+private:
+  void add_io();
+  D3nCacheShard& shard_of(const std::string& oid) {
+    return shards[std::hash<std::string>{}(oid) % shards.size()];
+  }
+  int d3n_slab_init();
+  int d3n_index_init();
+  void d3n_index_checkpoint();
+  int d3n_sync_data();
+  void d3n_verify(std::vector<std::string> oids);
+  size_t d3n_evict();
+  uint64_t d3n_charge(const D3nChunkDataInfo* chunk) const {
+    // space is accounted for in whole extents in the slab store
+    return slab ? chunk->extent.len : chunk->size;
+  }
+  void d3n_unlink_chunk(D3nCacheShard& shard, D3nChunkDataInfo* chunk);
+  void d3n_release_chunk(D3nChunkDataInfo* chunk);
+  void d3n_unpin_chunk(D3nChunkDataInfo* chunk);
+  void d3n_free_chunk(D3nChunkDataInfo* chunk);
+  void d3n_write_completion(const D3nIndexEntry& chunk, int r);
+  void d3n_filler();
+  void d3n_fill(bufferlist& bl, unsigned int len, const std::string& oid);
+  void d3n_reclaim();
+
+public:
+  D3nDataCache();
+  ~D3nDataCache();
+
+  std::string cache_location;
+
+  /* Where a cached range is read from */
+  struct Location {
+    std::string path;
+    off_t ofs = 0;
+    std::shared_ptr<void> pin; // keeps the chunk in place until dropped
+  };
+
+  /* Looks up len bytes at ofs of the rados object oid. Cached chunks hold
+   * the object from its start, so any range within them is a hit. */
+  bool get(const std::string& oid, const off_t ofs, const off_t len, Location* loc);
+  /* Whether oid is cached and readable, without counting it as a read */
+  bool is_cached(const std::string& oid);
+  void put(bufferlist& bl, unsigned int len, std::string& obj_key);
+  int d3n_io_write(bufferlist& bl, unsigned int len, std::string oid);
+  int d3n_libaio_create_write_request(bufferlist& bl, const D3nIndexEntry& chunk);
+  int d3n_uring_create_write_request(bufferlist& bl, const D3nIndexEntry& chunk);
+  void d3n_libaio_write_completion_cb(D3nCacheAioWriteRequest* c);
+  size_t random_eviction();
+  size_t lru_eviction(bool probation = false);
+  size_t twoq_eviction();
+
+  void init(CephContext *_cct);
+  D3nIoUring* get_uring() { return uring.get(); }
 };
 
 
@@ -231,26 +346,40 @@ int D3nRGWDataCache<T>::get_obj_iterate_cb(const DoutPrefixProvider *dpp, const
 
     const bool is_compressed = (astate->attrset.find(RGW_ATTR_COMPRESSION) != astate->attrset.end());
     const bool is_encrypted = (astate->attrset.find(RGW_ATTR_CRYPT_MODE) != astate->attrset.end());
-    if (read_ofs != 0 || astate->size != astate->accounted_size || is_compressed || is_encrypted) {
+    if (astate->size != astate->accounted_size || is_compressed || is_encrypted) {
       d->d3n_bypass_cache_write = true;
-      lsubdout(g_ceph_context, rgw, 5) << "D3nDataCache: " << __func__ << "(): Note - bypassing datacache: oid=" << read_obj.oid << ", read_ofs!=0 = " << read_ofs << ", size=" << astate->size << " != accounted_size=" << astate->accounted_size << ", is_compressed=" << is_compressed << ", is_encrypted=" << is_encrypted  << dendl;
+      lsubdout(g_ceph_context, rgw, 5) << "D3nDataCache: " << __func__ << "(): Note - bypassing datacache: oid=" << read_obj.oid << ", size=" << astate->size << " != accounted_size=" << astate->accounted_size << ", is_compressed=" << is_compressed << ", is_encrypted=" << is_encrypted  << dendl;
       auto completed = d->aio->get(ref.obj, rgw::Aio::librados_op(ref.pool.ioctx(), std::move(op), d->yield), cost, id);
       r = d->flush(std::move(completed));
       return r;
     }
 
-    if (d->rgwrados->d3n_data_cache->get(oid, len)) {
+    auto d3n = d->rgwrados->d3n_data_cache;
+    D3nDataCache::Location loc;
+    if (d3n->get(oid, read_ofs, len, &loc)) {
       // Read From Cache
       ldpp_dout(dpp, 20) << "D3nDataCache: " << __func__ << "(): READ FROM CACHE: oid=" << read_obj.oid << ", obj-ofs=" << obj_ofs << ", read_ofs=" << read_ofs << ", len=" << len << dendl;
-      auto completed = d->aio->get(ref.obj, rgw::Aio::d3n_cache_op(dpp, d->yield, read_ofs, len, d->rgwrados->d3n_data_cache->cache_location), cost, id);
+      {
+        // data read from the cache is never written back to it: the chunk
+        // may be evicted before the read completes, and a range of it
+        // would be cached as the start of the object
+        const std::lock_guard l(d->d3n_get_data.d3n_lock);
+        d->d3n_get_data.uncached_reads.insert(id);
+      }
+      auto completed = d->aio->get(ref.obj, rgw::Aio::d3n_cache_op(dpp, d->yield, loc.ofs, len, loc.path, d3n->get_uring(), std::move(loc.pin)), cost, id);
       r = d->flush(std::move(completed));
       if (r < 0) {
         lsubdout(g_ceph_context, rgw, 0) << "D3nDataCache: " << __func__ << "(): Error: failed to drain/flush, r= " << r << dendl;
       }
       return r;
     } else {
-      // Write To Cache
+      // Write To Cache, unless the read doesn't start at the beginning of
+      // the rados object, as chunks are cached from their start
       ldpp_dout(dpp, 20) << "D3nDataCache: " << __func__ << "(): WRITE TO CACHE: oid=" << read_obj.oid << ", obj-ofs=" << obj_ofs << ", read_ofs=" << read_ofs << " len=" << len << dendl;
+      if (read_ofs != 0) {
+        const std::lock_guard l(d->d3n_get_data.d3n_lock);
+        d->d3n_get_data.uncached_reads.insert(id);
+      }
       auto completed = d->aio->get(ref.obj, rgw::Aio::librados_op(ref.pool.ioctx(), std::move(op), d->yield), cost, id);
       return d->flush(std::move(completed));
     }
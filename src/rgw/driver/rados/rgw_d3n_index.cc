@@ -0,0 +1,292 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab ft=cpp
+
+#include "rgw_d3n_index.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <unordered_map>
+
+#include "include/compat.h"
+#include "common/ceph_context.h"
+#include "common/dout.h"
+#include "common/errno.h"
+#include "common/safe_io.h"
+#include "common/Thread.h"
+
+#define dout_subsys ceph_subsys_rgw_datacache
+#undef dout_prefix
+#define dout_prefix *_dout << "D3nDataCache: index: "
+
+namespace {
+
+const char* const INDEX_FILE = "d3n.index";
+const uint64_t INDEX_MAGIC = 0x3178646e696e3364ull; // "d3nindx1"
+
+enum : uint8_t {
+  D3N_INDEX_ADD = 1,
+  D3N_INDEX_REMOVE = 2,
+};
+
+/* A record is its length and crc, followed by the op and its payload */
+void encode_record(uint8_t op, const ceph::buffer::list& payload, ceph::buffer::list& bl)
+{
+  ceph::buffer::list rec;
+  encode(op, rec);
+  rec.append(payload);
+
+  encode(static_cast<uint32_t>(rec.length()), bl);
+  encode(rec.crc32c(-1), bl);
+  bl.claim_append(rec);
+}
+
+} // anonymous namespace
+
+D3nCacheIndex::D3nCacheIndex(CephContext *_cct, const std::string& _dir)
+  : cct(_cct), dir(_dir)
+{
+}
+
+D3nCacheIndex::~D3nCacheIndex()
+{
+  stop();
+  if (fd >= 0) {
+    VOID_TEMP_FAILURE_RETRY(::close(fd));
+  }
+}
+
+int D3nCacheIndex::load(std::list<D3nIndexEntry>* entries)
+{
+  std::string path = dir + "/" + INDEX_FILE;
+  ceph::buffer::list bl;
+  std::string err;
+
+  int r = bl.read_file(path.c_str(), &err);
+  if (r == -ENOENT) {
+    return 0;
+  }
+  if (r < 0) {
+    ldout(cct, 0) << "ERROR: " << __func__ << "(): can't read " << path << " : " << err << dendl;
+    return r;
+  }
+
+  std::unordered_map<std::string, std::list<D3nIndexEntry>::iterator> chunks;
+  uint64_t records = 0;
+  auto p = bl.cbegin();
+  try {
+    uint64_t magic;
+    decode(magic, p);
+    if (magic != INDEX_MAGIC) {
+      ldout(cct, 0) << "ERROR: " << __func__ << "(): " << path << " is not a d3n index" << dendl;
+      return -EINVAL;
+    }
+
+    while (p.get_remaining() > 0) {
+      uint32_t len, crc;
+      decode(len, p);
+      decode(crc, p);
+      if (p.get_remaining() < len) {
+        break;
+      }
+      ceph::buffer::list rec;
+      p.copy(len, rec);
+      if (rec.crc32c(-1) != crc) {
+        break;
+      }
+
+      auto q = rec.cbegin();
+      uint8_t op;
+      decode(op, q);
+      if (op == D3N_INDEX_ADD) {
+        D3nIndexEntry e;
+        decode(e, q);
+        if (auto i = chunks.find(e.oid); i != chunks.end()) {
+          entries->erase(i->second);
+        }
+        auto oid = e.oid;
+        chunks[oid] = entries->insert(entries->end(), std::move(e));
+      } else if (op == D3N_INDEX_REMOVE) {
+        std::string oid;
+        decode(oid, q);
+        if (auto i = chunks.find(oid); i != chunks.end()) {
+          entries->erase(i->second);
+          chunks.erase(i);
+        }
+      }
+      records++;
+    }
+  } catch (const ceph::buffer::error& e) {
+    // a record torn by a crash ends the index
+  }
+
+  if (p.get_remaining() > 0) {
+    ldout(cct, 1) << "WARNING: " << __func__ << "(): ignoring " << p.get_remaining()
+                  << " bytes at the end of " << path << dendl;
+  }
+  ldout(cct, 5) << "loaded " << entries->size() << " chunks from " << records << " records" << dendl;
+  return 0;
+}
+
+int D3nCacheIndex::checkpoint(const SnapshotFunc& snapshot)
+{
+  std::lock_guard l{io_lock};
+
+  std::vector<D3nIndexEntry> entries = snapshot();
+  {
+    std::lock_guard l{lock};
+    live = entries.size();
+  }
+
+  // the data of the chunks listed has to reach the disk first
+  if (sync_data) {
+    int r = sync_data();
+    if (r < 0) {
+      ldout(cct, 0) << "ERROR: " << __func__ << "(): can't sync the cached data: " << cpp_strerror(r) << dendl;
+      return r;
+    }
+  }
+
+  ceph::buffer::list bl;
+  encode(INDEX_MAGIC, bl);
+  for (const auto& e : entries) {
+    ceph::buffer::list payload;
+    encode(e, payload);
+    encode_record(D3N_INDEX_ADD, payload, bl);
+  }
+
+  int r = safe_write_file(dir.c_str(), INDEX_FILE, bl.c_str(), bl.length(), 0644);
+  if (r < 0) {
+    ldout(cct, 0) << "ERROR: " << __func__ << "(): can't write the index: " << cpp_strerror(r) << dendl;
+    return r;
+  }
+
+  if (fd >= 0) {
+    VOID_TEMP_FAILURE_RETRY(::close(fd));
+  }
+  std::string path = dir + "/" + INDEX_FILE;
+  fd = TEMP_FAILURE_RETRY(::open(path.c_str(), O_WRONLY|O_APPEND|O_CLOEXEC|O_BINARY));
+  if (fd < 0) {
+    r = -errno;
+    ldout(cct, 0) << "ERROR: " << __func__ << "(): can't open " << path << " : " << cpp_strerror(r) << dendl;
+    return r;
+  }
+  journal_records = entries.size();
+
+  ldout(cct, 10) << "wrote a checkpoint of " << entries.size() << " chunks" << dendl;
+  return 0;
+}
+
+void D3nCacheIndex::discard_pending()
+{
+  std::lock_guard l{lock};
+  pending.clear();
+  pending_records = 0;
+}
+
+void D3nCacheIndex::queue(uint8_t op, const ceph::buffer::list& payload)
+{
+  std::lock_guard l{lock};
+  encode_record(op, payload, pending);
+  pending_records++;
+  live += (op == D3N_INDEX_ADD) ? 1 : -1;
+}
+
+void D3nCacheIndex::add(const D3nIndexEntry& e)
+{
+  ceph::buffer::list payload;
+  encode(e, payload);
+  queue(D3N_INDEX_ADD, payload);
+}
+
+void D3nCacheIndex::remove(const std::string& oid)
+{
+  ceph::buffer::list payload;
+  encode(oid, payload);
+  queue(D3N_INDEX_REMOVE, payload);
+}
+
+int D3nCacheIndex::flush()
+{
+  std::unique_lock io{io_lock};
+
+  ceph::buffer::list bl;
+  uint64_t records;
+  {
+    std::lock_guard l{lock};
+    bl.swap(pending);
+    records = pending_records;
+    pending_records = 0;
+  }
+  if (records == 0) {
+    return 0;
+  }
+  if (fd < 0) {
+    return -EBADF;
+  }
+
+  // the chunks added have to reach the disk before their records
+  if (sync_data) {
+    int r = sync_data();
+    if (r < 0) {
+      ldout(cct, 0) << "ERROR: " << __func__ << "(): can't sync the cached data: " << cpp_strerror(r) << dendl;
+      return r;
+    }
+  }
+
+  int r = bl.write_fd(fd);
+  if (r == 0 && ::fdatasync(fd) < 0) {
+    r = -errno;
+  }
+  if (r < 0) {
+    ldout(cct, 0) << "ERROR: " << __func__ << "(): can't append to the index: " << cpp_strerror(r) << dendl;
+    return r;
+  }
+  journal_records += records;
+
+  uint64_t compact_at;
+  {
+    std::lock_guard l{lock};
+    compact_at = 2 * std::max<int64_t>(live, 0) + 1024;
+  }
+  if (journal_records > compact_at && compact) {
+    io.unlock();
+    compact();
+  }
+  return 0;
+}
+
+void D3nCacheIndex::start(SyncFunc _sync_data, CompactFunc _compact)
+{
+  sync_data = std::move(_sync_data);
+  compact = std::move(_compact);
+  {
+    std::lock_guard l{lock};
+    stopping = false;
+  }
+  flusher = make_named_thread("d3n_index", [this] { run(); });
+}
+
+void D3nCacheIndex::stop()
+{
+  {
+    std::lock_guard l{lock};
+    stopping = true;
+  }
+  cond.notify_all();
+  if (flusher.joinable()) {
+    flusher.join();
+  }
+}
+
+void D3nCacheIndex::run()
+{
+  std::unique_lock l{lock};
+  while (!stopping) {
+    auto interval = cct->_conf.get_val<std::chrono::seconds>("rgw_d3n_l1_index_sync_interval");
+    cond.wait_for(l, interval, [this] { return stopping; });
+    l.unlock();
+    flush();
+    l.lock();
+  }
+}
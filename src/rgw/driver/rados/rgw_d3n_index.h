@@ -0,0 +1,107 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab ft=cpp
+
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "include/buffer.h"
+#include "include/common_fwd.h"
+#include "include/encoding.h"
+#include "rgw_d3n_slab.h"
+
+/* A chunk in the d3n cache, as recorded in the index */
+struct D3nIndexEntry {
+  std::string oid;
+  uint64_t size = 0;
+  D3nExtent extent; // unused by the file store
+  uint32_t crc = 0; // crc32c of the data, checked when the index is loaded
+
+  void encode(ceph::buffer::list& bl) const {
+    ENCODE_START(1, 1, bl);
+    encode(oid, bl);
+    encode(size, bl);
+    encode(extent.ofs, bl);
+    encode(extent.len, bl);
+    encode(crc, bl);
+    ENCODE_FINISH(bl);
+  }
+
+  void decode(ceph::buffer::list::const_iterator& bl) {
+    DECODE_START(1, bl);
+    decode(oid, bl);
+    decode(size, bl);
+    decode(extent.ofs, bl);
+    decode(extent.len, bl);
+    decode(crc, bl);
+    DECODE_FINISH(bl);
+  }
+};
+WRITE_CLASS_ENCODER(D3nIndexEntry)
+
+/* On-disk index of the d3n cache, so a restarted gateway keeps its cache.
+ * It is a checkpoint of the chunks, least recently used first, followed by
+ * a journal of the chunks added and removed since. Each record carries a
+ * crc, and loading stops at the first torn or corrupt record.
+ *
+ * Changes are batched and appended every rgw_d3n_l1_index_sync_interval,
+ * after the cached data is synced, so a chunk is never recorded ahead of
+ * its data. A chunk may still be recorded after its space was reused by
+ * another, if the removal didn't reach the disk before a crash; the data
+ * crc catches that. Once the journal outgrows the chunks it describes, the
+ * owner is asked to write a new checkpoint. */
+class D3nCacheIndex {
+public:
+  using SyncFunc = std::function<int()>;
+  using CompactFunc = std::function<void()>;
+  using SnapshotFunc = std::function<std::vector<D3nIndexEntry>()>;
+
+  D3nCacheIndex(CephContext *cct, const std::string& dir);
+  ~D3nCacheIndex();
+
+  /* Returns the recorded chunks, least recently used first */
+  int load(std::list<D3nIndexEntry>* entries);
+  /* Replaces the index with the chunks listed by snapshot, least recently
+   * used first. snapshot must list them and call discard_pending() under
+   * the lock add() and remove() are called under. */
+  int checkpoint(const SnapshotFunc& snapshot);
+  void discard_pending();
+
+  /* sync_data makes the cached data durable, and compact writes a new
+   * checkpoint */
+  void start(SyncFunc sync_data, CompactFunc compact);
+  /* Appends the changes not appended yet */
+  void stop();
+
+  void add(const D3nIndexEntry& e);
+  void remove(const std::string& oid);
+
+private:
+  int flush();
+  void queue(uint8_t op, const ceph::buffer::list& payload);
+  void run();
+
+  CephContext *cct;
+  const std::string dir;
+  SyncFunc sync_data;
+  CompactFunc compact;
+
+  // serializes appends and checkpoints
+  std::mutex io_lock;
+  int fd = -1;
+  uint64_t journal_records = 0;
+
+  std::mutex lock;
+  std::condition_variable cond;
+  ceph::buffer::list pending;
+  uint64_t pending_records = 0;
+  int64_t live = 0; // chunks in the cache, roughly
+  bool stopping = false;
+  std::thread flusher;
+};
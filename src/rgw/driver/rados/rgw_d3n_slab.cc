@@ -0,0 +1,157 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab ft=cpp
+
+#include "rgw_d3n_slab.h"
+
+#include <algorithm>
+
+#include "include/ceph_assert.h"
+
+D3nSlabAllocator::D3nSlabAllocator(uint64_t size, uint64_t _slab_size, uint64_t min_slot)
+  : slab_size(_slab_size)
+{
+  ceph_assert(slab_size > 0);
+  ceph_assert(min_slot > 0);
+
+  slabs.resize(size / slab_size);
+  free_slabs.reserve(slabs.size());
+  // hand out the slabs at the start of the store first
+  for (uint32_t i = slabs.size(); i > 0; i--) {
+    free_slabs.push_back(i - 1);
+  }
+
+  for (uint64_t s = min_slot; s < slab_size; s *= 2) {
+    classes.push_back({s, static_cast<uint32_t>(slab_size / s), {}});
+  }
+  classes.push_back({slab_size, 1, {}});
+}
+
+int D3nSlabAllocator::class_of(uint64_t len) const
+{
+  for (size_t i = 0; i < classes.size(); i++) {
+    if (len <= classes[i].slot_size) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+uint64_t D3nSlabAllocator::slot_size(uint64_t len) const
+{
+  int cls = class_of(len);
+  return cls < 0 ? 0 : classes[cls].slot_size;
+}
+
+bool D3nSlabAllocator::allocate(uint64_t len, D3nExtent* e)
+{
+  int cls = class_of(len);
+  if (cls < 0) {
+    return false;
+  }
+  auto& c = classes[cls];
+
+  std::lock_guard l{lock};
+  if (c.partial.empty()) {
+    if (free_slabs.empty()) {
+      return false;
+    }
+    uint32_t n = free_slabs.back();
+    free_slabs.pop_back();
+
+    auto& slab = slabs[n];
+    slab.cls = cls;
+    slab.free_slots.clear();
+    for (uint32_t i = c.slots; i > 0; i--) {
+      slab.free_slots.push_back(i - 1);
+    }
+    slab.partial = true;
+    slab.partial_pos = c.partial.insert(c.partial.end(), n);
+  }
+
+  uint32_t n = c.partial.front();
+  auto& slab = slabs[n];
+  uint32_t slot = slab.free_slots.back();
+  slab.free_slots.pop_back();
+  if (slab.free_slots.empty()) {
+    c.partial.erase(slab.partial_pos);
+    slab.partial = false;
+  }
+
+  e->ofs = n * slab_size + slot * c.slot_size;
+  e->len = c.slot_size;
+  return true;
+}
+
+void D3nSlabAllocator::release(const D3nExtent& e)
+{
+  uint32_t n = e.ofs / slab_size;
+  ceph_assert(n < slabs.size());
+
+  std::lock_guard l{lock};
+  auto& slab = slabs[n];
+  ceph_assert(slab.cls >= 0);
+  auto& c = classes[slab.cls];
+  ceph_assert(e.len == c.slot_size);
+
+  slab.free_slots.push_back((e.ofs - n * slab_size) / c.slot_size);
+  if (slab.free_slots.size() == c.slots) {
+    // the slab is empty, so any class can use it
+    if (slab.partial) {
+      c.partial.erase(slab.partial_pos);
+      slab.partial = false;
+    }
+    slab.cls = -1;
+    slab.free_slots.clear();
+    free_slabs.push_back(n);
+  } else if (!slab.partial) {
+    slab.partial = true;
+    slab.partial_pos = c.partial.insert(c.partial.end(), n);
+  }
+}
+
+bool D3nSlabAllocator::claim(const D3nExtent& e)
+{
+  int cls = class_of(e.len);
+  if (cls < 0 || classes[cls].slot_size != e.len) {
+    return false;
+  }
+  auto& c = classes[cls];
+  uint32_t n = e.ofs / slab_size;
+  uint64_t slab_ofs = e.ofs - static_cast<uint64_t>(n) * slab_size;
+  if (n >= slabs.size() || slab_ofs % c.slot_size != 0 || slab_ofs / c.slot_size >= c.slots) {
+    return false;
+  }
+  uint32_t slot = slab_ofs / c.slot_size;
+
+  std::lock_guard l{lock};
+  auto& slab = slabs[n];
+  if (slab.cls < 0) {
+    free_slabs.erase(std::find(free_slabs.begin(), free_slabs.end(), n));
+    slab.cls = cls;
+    slab.free_slots.clear();
+    for (uint32_t i = c.slots; i > 0; i--) {
+      slab.free_slots.push_back(i - 1);
+    }
+    slab.partial = true;
+    slab.partial_pos = c.partial.insert(c.partial.end(), n);
+  } else if (slab.cls != cls) {
+    return false;
+  }
+
+  auto i = std::find(slab.free_slots.begin(), slab.free_slots.end(), slot);
+  if (i == slab.free_slots.end()) {
+    return false;
+  }
+  slab.free_slots.erase(i);
+  if (slab.free_slots.empty()) {
+    c.partial.erase(slab.partial_pos);
+    slab.partial = false;
+  }
+  return true;
+}
+
+size_t D3nSlabAllocator::get_free_slabs()
+{
+  std::lock_guard l{lock};
+  return free_slabs.size();
+}
@@ -0,0 +1,64 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab ft=cpp
+
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <vector>
+
+/* A range of the d3n slab store holding one chunk */
+struct D3nExtent {
+  uint64_t ofs = 0;
+  uint64_t len = 0; // allocated length, at least the length of the chunk
+};
+
+/* Hands out extents of a store that d3n chunks are packed into, in place
+ * of a file per chunk. The store is divided into slabs of slab_size bytes,
+ * and a slab is carved into equal slots of one size class the first time
+ * a chunk of that class needs room. The classes are the powers of two from
+ * min_slot up to slab_size, so a chunk wastes less than half its slot.
+ * Slabs go back to the pool once all of their slots are free, so the space
+ * follows the chunk sizes in use. Allocation and release are O(1). */
+class D3nSlabAllocator {
+public:
+  D3nSlabAllocator(uint64_t size, uint64_t slab_size, uint64_t min_slot);
+
+  /* The length of the extent allocated for len bytes, or 0 if len is
+   * larger than a slab */
+  uint64_t slot_size(uint64_t len) const;
+
+  /* Returns false if there is no free slot for len bytes */
+  bool allocate(uint64_t len, D3nExtent* e);
+  void release(const D3nExtent& e);
+  /* Allocates the given extent, as when reloading the chunks in the store.
+   * Returns false if it isn't a free slot of the current layout. */
+  bool claim(const D3nExtent& e);
+
+  uint64_t get_capacity() const { return slabs.size() * slab_size; }
+  uint64_t get_slab_size() const { return slab_size; }
+  size_t get_free_slabs();
+
+private:
+  struct Slab {
+    int cls = -1; // -1 while the slab is free
+    std::vector<uint32_t> free_slots;
+    bool partial = false; // on the partial list of its class
+    std::list<uint32_t>::iterator partial_pos;
+  };
+
+  struct SlabClass {
+    uint64_t slot_size;
+    uint32_t slots; // per slab
+    std::list<uint32_t> partial; // slabs of the class with free slots
+  };
+
+  int class_of(uint64_t len) const;
+
+  const uint64_t slab_size;
+  std::mutex lock;
+  std::vector<Slab> slabs;
+  std::vector<uint32_t> free_slabs;
+  std::vector<SlabClass> classes;
+};
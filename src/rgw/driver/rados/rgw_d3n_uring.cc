@@ -0,0 +1,398 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab ft=cpp
+
+#include "rgw_d3n_uring.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "include/compat.h"
+#include "include/intarith.h"
+#include "include/page.h"
+#include "common/ceph_context.h"
+#include "common/deleter.h"
+#include "common/dout.h"
+#include "common/errno.h"
+#include "common/Thread.h"
+
+#define dout_subsys ceph_subsys_rgw_datacache
+#undef dout_prefix
+#define dout_prefix *_dout << "D3nDataCache: io_uring: "
+
+#if defined(HAVE_LIBURING)
+
+#include "liburing.h"
+
+namespace {
+
+/* Buffers registered with the ring for reads. A buffer is handed on with
+ * the data read into it and only returned to the pool once the last
+ * reference to the data is dropped, which may be after the ring is gone,
+ * so the pool is reference counted. */
+struct D3nBufferPool {
+  size_t buf_size;
+  std::vector<char*> bufs;
+  std::mutex lock;
+  std::vector<int> free_bufs;
+
+  ~D3nBufferPool() {
+    for (auto b : bufs) {
+      ::free(b);
+    }
+  }
+
+  /* Returns -1 if none is free */
+  int get() {
+    std::lock_guard l{lock};
+    if (free_bufs.empty()) {
+      return -1;
+    }
+    int i = free_bufs.back();
+    free_bufs.pop_back();
+    return i;
+  }
+
+  void put(int i) {
+    std::lock_guard l{lock};
+    free_bufs.push_back(i);
+  }
+};
+
+struct D3nIoRequest {
+  int fd = -1;
+  bool write = false;
+  size_t len = 0;
+  off_t ofs = 0;
+  int buf = -1; /* Registered buffer read into, if any */
+  ceph::bufferlist bl;
+  std::vector<iovec> iov;
+  D3nIoUring::Callback cb;
+};
+
+} // anonymous namespace
+
+struct D3nIoUringData {
+  CephContext *cct;
+  struct io_uring ring;
+  unsigned depth;
+  int fadvise;
+  std::shared_ptr<D3nBufferPool> pool; /* Unset if there are no registered buffers */
+
+  /* Serializes submissions; completions are only reaped by the reaper */
+  std::mutex sq_lock;
+  unsigned inflight = 0;
+
+  std::thread reaper;
+
+  void reap();
+  int submit(D3nIoRequest *req);
+  int write(const std::string& path, int flags, off_t ofs,
+            ceph::bufferlist&& bl, D3nIoUring::Callback&& cb);
+  void complete(D3nIoRequest *req, int r);
+};
+
+void D3nIoUringData::reap()
+{
+  bool stopping = false;
+  std::vector<std::pair<D3nIoRequest*, int>> done;
+
+  /* Completions may arrive out of order, so the stop request is only
+   * honoured once nothing else is in flight */
+  auto busy = [this] { std::lock_guard l{sq_lock}; return inflight > 0; };
+  while (!stopping || busy()) {
+    struct io_uring_cqe *cqe = nullptr;
+    int r = io_uring_wait_cqe(&ring, &cqe);
+
+    if (r < 0) {
+      if (r != -EINTR) {
+        ldout(cct, 0) << "ERROR: " << __func__ << "(): io_uring_wait_cqe failed: " << cpp_strerror(r) << dendl;
+      }
+      continue;
+    }
+
+    /* Take every completion that is ready, so that the ring is advanced
+     * once per batch */
+    unsigned head;
+    unsigned n = 0;
+    io_uring_for_each_cqe(&ring, head, cqe) {
+      done.emplace_back(static_cast<D3nIoRequest*>(io_uring_cqe_get_data(cqe)), cqe->res);
+      n++;
+    }
+    io_uring_cq_advance(&ring, n);
+
+    for (auto& [req, res] : done) {
+      if (req == nullptr) {
+        stopping = true;
+        continue;
+      }
+      complete(req, res);
+    }
+
+    {
+      std::lock_guard l{sq_lock};
+      inflight -= std::count_if(done.begin(), done.end(), [] (const auto& c) { return c.first != nullptr; });
+
+      /* Submissions that failed earlier are retried */
+      if (io_uring_sq_ready(&ring) > 0) {
+        io_uring_submit(&ring);
+      }
+    }
+    done.clear();
+  }
+}
+
+int D3nIoUringData::submit(D3nIoRequest *req)
+{
+  std::unique_lock l{sq_lock};
+  /* Never wait for room, which would block the caller's thread */
+  if (inflight >= depth) {
+    return -EAGAIN;
+  }
+
+  /* Every submitter submits what it queued, so there is always room */
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+  if (sqe == nullptr) {
+    return -EAGAIN;
+  }
+
+  if (req->write) {
+    io_uring_prep_writev(sqe, req->fd, req->iov.data(), req->iov.size(), req->ofs);
+  } else if (req->buf >= 0) {
+    io_uring_prep_read_fixed(sqe, req->fd, req->iov[0].iov_base, req->len, req->ofs, req->buf);
+  } else {
+    io_uring_prep_readv(sqe, req->fd, req->iov.data(), 1, req->ofs);
+  }
+  io_uring_sqe_set_data(sqe, req);
+  inflight++;
+
+  int r = io_uring_submit(&ring);
+  if (r < 0) {
+    /* The request stays queued and is submitted along with the next one */
+    ldout(cct, 1) << "WARNING: " << __func__ << "(): io_uring_submit failed: " << cpp_strerror(r) << dendl;
+  }
+
+  return 0;
+}
+
+void D3nIoUringData::complete(D3nIoRequest *req, int r)
+{
+  ::close(req->fd);
+
+  if (r >= 0 && static_cast<size_t>(r) != req->len) {
+    ldout(cct, 1) << "ERROR: " << __func__ << "(): short " << (req->write ? "write" : "read")
+                  << " of " << r << " bytes out of " << req->len << dendl;
+    r = -EIO;
+  }
+
+  if (req->buf >= 0) {
+    if (r >= 0) {
+      auto p = pool;
+      int i = req->buf;
+      req->bl.append(ceph::buffer::ptr(ceph::buffer::claim_buffer(
+        req->len, p->bufs[i], make_deleter([p, i] { p->put(i); }))));
+    } else {
+      pool->put(req->buf);
+    }
+  }
+
+  if (!req->write && r < 0) {
+    req->bl.clear();
+  }
+
+  req->cb(r, std::move(req->bl));
+  delete req;
+}
+
+std::unique_ptr<D3nIoUring> D3nIoUring::create(CephContext *cct)
+{
+  auto d = std::make_unique<D3nIoUringData>();
+  d->cct = cct;
+  d->depth = std::max<unsigned>(1, cct->_conf.get_val<uint64_t>("rgw_d3n_io_uring_depth"));
+  d->fadvise = cct->_conf->rgw_d3n_l1_fadvise;
+
+  int r = io_uring_queue_init(d->depth, &d->ring, 0);
+  if (r < 0) {
+    ldout(cct, 1) << "io_uring is not available (" << cpp_strerror(r) << "), using POSIX AIO" << dendl;
+    return nullptr;
+  }
+
+  uint64_t nbufs = cct->_conf.get_val<uint64_t>("rgw_d3n_io_uring_registered_buffers");
+  if (nbufs > 0) {
+    auto pool = std::make_shared<D3nBufferPool>();
+    pool->buf_size = cct->_conf->rgw_get_obj_max_req_size;
+    std::vector<iovec> iov;
+
+    for (uint64_t i = 0; i < nbufs; i++) {
+      char *b = static_cast<char*>(::aligned_alloc(CEPH_PAGE_SIZE, p2roundup<size_t>(pool->buf_size, CEPH_PAGE_SIZE)));
+      if (b == nullptr) {
+        break;
+      }
+      pool->bufs.push_back(b);
+      pool->free_bufs.push_back(i);
+      iov.push_back({b, pool->buf_size});
+    }
+
+    /* Registering pins the buffers, which RLIMIT_MEMLOCK may not allow */
+    r = iov.empty() ? -ENOMEM : io_uring_register_buffers(&d->ring, iov.data(), iov.size());
+    if (r < 0) {
+      ldout(cct, 1) << "WARNING: can't register read buffers (" << cpp_strerror(r) << "), reading into ordinary buffers" << dendl;
+    } else {
+      d->pool = std::move(pool);
+    }
+  }
+
+  ldout(cct, 5) << "using io_uring with depth " << d->depth << " and "
+                << (d->pool ? d->pool->bufs.size() : 0) << " registered buffers" << dendl;
+
+  auto p = d.get();
+  d->reaper = make_named_thread("d3n_uring", [p] { p->reap(); });
+
+  return std::unique_ptr<D3nIoUring>(new D3nIoUring(std::move(d)));
+}
+
+D3nIoUring::D3nIoUring(std::unique_ptr<D3nIoUringData> _d) : d(std::move(_d)) {}
+
+D3nIoUring::~D3nIoUring()
+{
+  {
+    /* The reaper stops at this request once everything before it completed */
+    std::unique_lock l{d->sq_lock};
+    struct io_uring_sqe *sqe;
+    while ((sqe = io_uring_get_sqe(&d->ring)) == nullptr) {
+      io_uring_submit(&d->ring);
+    }
+    io_uring_prep_nop(sqe);
+    io_uring_sqe_set_data(sqe, nullptr);
+    io_uring_submit(&d->ring);
+  }
+
+  d->reaper.join();
+  io_uring_queue_exit(&d->ring);
+}
+
+int D3nIoUring::read(const std::string& path, off_t ofs, size_t len, Callback&& cb)
+{
+  int fd = TEMP_FAILURE_RETRY(::open(path.c_str(), O_RDONLY|O_CLOEXEC|O_BINARY));
+  if (fd < 0) {
+    int err = errno;
+    ldout(d->cct, 1) << "ERROR: " << __func__ << "(): can't open " << path << " : " << cpp_strerror(err) << dendl;
+    return -err;
+  }
+  if (d->fadvise != POSIX_FADV_NORMAL) {
+    posix_fadvise(fd, 0, 0, d->fadvise);
+  }
+
+  auto req = new D3nIoRequest;
+  req->fd = fd;
+  req->len = len;
+  req->ofs = ofs;
+  req->cb = std::move(cb);
+
+  if (d->pool && len <= d->pool->buf_size) {
+    req->buf = d->pool->get();
+  }
+  if (req->buf >= 0) {
+    req->iov.push_back({d->pool->bufs[req->buf], len});
+  } else {
+    ceph::bufferptr bp = ceph::buffer::create_page_aligned(len);
+    req->iov.push_back({bp.c_str(), len});
+    req->bl.append(std::move(bp));
+  }
+
+  int r = d->submit(req);
+  if (r < 0) {
+    if (req->buf >= 0) {
+      d->pool->put(req->buf);
+    }
+    ::close(fd);
+    delete req;
+  }
+  return r;
+}
+
+int D3nIoUringData::write(const std::string& path, int flags, off_t ofs,
+                          ceph::bufferlist&& bl, D3nIoUring::Callback&& cb)
+{
+  mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+  int fd = TEMP_FAILURE_RETRY(::open(path.c_str(), flags|O_WRONLY|O_CLOEXEC|O_BINARY, mode));
+  if (fd < 0) {
+    int err = errno;
+    ldout(cct, 0) << "ERROR: " << __func__ << "(): can't open " << path << " : " << cpp_strerror(err) << dendl;
+    return -err;
+  }
+  if (fadvise != POSIX_FADV_NORMAL) {
+    posix_fadvise(fd, 0, 0, fadvise);
+  }
+
+  auto req = new D3nIoRequest;
+  req->fd = fd;
+  req->write = true;
+  req->len = bl.length();
+  req->ofs = ofs;
+  req->cb = std::move(cb);
+
+  /* The data is written from the buffers it is held in, unless there are
+   * more of them than a single writev() takes */
+  if (bl.get_num_buffers() > IOV_MAX) {
+    bl.rebuild();
+  }
+  req->bl = std::move(bl);
+  for (auto& p : req->bl.buffers()) {
+    req->iov.push_back({const_cast<char*>(p.c_str()), p.length()});
+  }
+
+  int r = submit(req);
+  if (r < 0) {
+    ::close(fd);
+    delete req;
+  }
+  return r;
+}
+
+int D3nIoUring::write(const std::string& path, ceph::bufferlist&& bl, Callback&& cb)
+{
+  return d->write(path, O_CREAT|O_TRUNC, 0, std::move(bl), std::move(cb));
+}
+
+int D3nIoUring::write(const std::string& path, off_t ofs, ceph::bufferlist&& bl, Callback&& cb)
+{
+  return d->write(path, 0, ofs, std::move(bl), std::move(cb));
+}
+
+#else // HAVE_LIBURING
+
+struct D3nIoUringData {};
+
+std::unique_ptr<D3nIoUring> D3nIoUring::create(CephContext *cct)
+{
+  ldout(cct, 1) << "built without io_uring support, using POSIX AIO" << dendl;
+  return nullptr;
+}
+
+D3nIoUring::D3nIoUring(std::unique_ptr<D3nIoUringData> _d) : d(std::move(_d)) {}
+
+D3nIoUring::~D3nIoUring() {}
+
+int D3nIoUring::read(const std::string& path, off_t ofs, size_t len, Callback&& cb)
+{
+  return -EOPNOTSUPP;
+}
+
+int D3nIoUring::write(const std::string& path, ceph::bufferlist&& bl, Callback&& cb)
+{
+  return -EOPNOTSUPP;
+}
+
+int D3nIoUring::write(const std::string& path, off_t ofs, ceph::bufferlist&& bl, Callback&& cb)
+{
+  return -EOPNOTSUPP;
+}
+
+#endif // HAVE_LIBURING
@@ -0,0 +1,46 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab ft=cpp
+
+#pragma once
+
+#include "acconfig.h"
+
+#include <memory>
+#include <string>
+
+#include "include/buffer.h"
+#include "include/common_fwd.h"
+#include "include/function2.hpp"
+
+struct D3nIoUringData;
+
+/* Reads and writes d3n cache files through io_uring. Requests are submitted
+ * by the calling thread, and a single thread reaps their completions in
+ * batches and passes them to the callbacks, which hand them on to the
+ * requester's executor. Unlike glibc POSIX AIO, no thread is started per
+ * completion. */
+class D3nIoUring {
+public:
+  /* Called on the completion thread with the number of bytes transferred
+   * or a negative error code, and the data read */
+  using Callback = fu2::unique_function<void(int, ceph::bufferlist&&)>;
+
+  /* Returns nullptr if the build or the kernel doesn't support io_uring */
+  static std::unique_ptr<D3nIoUring> create(CephContext *cct);
+  /* Waits for the requests in flight to complete */
+  ~D3nIoUring();
+
+  /* Reads len bytes at ofs of the file at path. Returns a negative error
+   * code, without calling cb, if the request can't be submitted, and
+   * -EAGAIN while rgw_d3n_io_uring_depth requests are in flight. */
+  int read(const std::string& path, off_t ofs, size_t len, Callback&& cb);
+  /* Replaces the contents of the file at path with bl, as read() */
+  int write(const std::string& path, ceph::bufferlist&& bl, Callback&& cb);
+  /* Writes bl at ofs of the existing file at path, as read() */
+  int write(const std::string& path, off_t ofs, ceph::bufferlist&& bl, Callback&& cb);
+
+private:
+  explicit D3nIoUring(std::unique_ptr<D3nIoUringData> _d);
+
+  std::unique_ptr<D3nIoUringData> d;
+};
@@ -102,13 +102,13 @@ Aio::OpFunc aio_abstract(librados::IoCtx ctx, Op&& op,
 }
 
 
-Aio::OpFunc d3n_cache_aio_abstract(const DoutPrefixProvider *dpp, optional_yield y, off_t read_ofs, off_t read_len, std::string& cache_location) {
-  return [dpp, y, read_ofs, read_len, cache_location] (Aio* aio, AioResult& r) mutable {
+Aio::OpFunc d3n_cache_aio_abstract(const DoutPrefixProvider *dpp, optional_yield y, off_t read_ofs, off_t read_len, std::string& location, D3nIoUring* uring, std::shared_ptr<void> pin) {
+  return [dpp, y, read_ofs, read_len, location, uring, pin = std::move(pin)] (Aio* aio, AioResult& r) mutable {
     // d3n data cache requires yield context (rgw_beast_enable_async=true)
     ceph_assert(y);
     auto c = std::make_unique<D3nL1CacheRequest>();
-    lsubdout(g_ceph_context, rgw_datacache, 20) << "D3nDataCache: d3n_cache_aio_abstract(): libaio Read From Cache, oid=" << r.obj.oid << dendl;
-    c->file_aio_read_abstract(dpp, y.get_io_context(), y.get_yield_context(), cache_location, read_ofs, read_len, aio, r);
+    lsubdout(g_ceph_context, rgw_datacache, 20) << "D3nDataCache: d3n_cache_aio_abstract(): " << (uring ? "io_uring" : "libaio") << " Read From Cache, oid=" << r.obj.oid << dendl;
+    c->file_aio_read_abstract(dpp, y.get_io_context(), y.get_yield_context(), location, read_ofs, read_len, uring, std::move(pin), aio, r);
   };
 }
 
@@ -139,8 +139,9 @@ Aio::OpFunc Aio::librados_op(librados::IoCtx ctx,
 }
 
 Aio::OpFunc Aio::d3n_cache_op(const DoutPrefixProvider *dpp, optional_yield y,
-                              off_t read_ofs, off_t read_len, std::string& cache_location) {
-  return d3n_cache_aio_abstract(dpp, y, read_ofs, read_len, cache_location);
+                              off_t read_ofs, off_t read_len, std::string& location,
+                              D3nIoUring* uring, std::shared_ptr<void> pin) {
+  return d3n_cache_aio_abstract(dpp, y, read_ofs, read_len, location, uring, std::move(pin));
 }
 
 } // namespace rgw
@@ -28,6 +28,7 @@
 #include "include/function2.hpp"
 
 struct D3nGetObjData;
+class D3nIoUring;
 
 namespace rgw {
 
@@ -98,7 +99,8 @@ class Aio {
                             librados::ObjectWriteOperation&& op,
                             optional_yield y);
   static OpFunc d3n_cache_op(const DoutPrefixProvider *dpp, optional_yield y,
-                             off_t read_ofs, off_t read_len, std::string& location);
+                             off_t read_ofs, off_t read_len, std::string& location,
+                             D3nIoUring* uring = nullptr, std::shared_ptr<void> pin = nullptr);
 };
 
 } // namespace rgw
@@ -12,14 +12,14 @@ using namespace std;
 
 int ObjectCache::get(const DoutPrefixProvider *dpp, const string& name, ObjectCacheInfo& info, uint32_t mask, rgw_cache_entry_info *cache_info)
 {
-
-  std::shared_lock rl{lock};
-  std::unique_lock wl{lock, std::defer_lock}; // may be promoted to write lock
+  Shard& shard = shard_of(name);
+  std::shared_lock rl{shard.lock};
+  std::unique_lock wl{shard.lock, std::defer_lock}; // may be promoted to write lock
   if (!enabled) {
     return -ENOENT;
   }
-  auto iter = cache_map.find(name);
-  if (iter == cache_map.end()) {
+  auto iter = shard.cache_map.find(name);
+  if (iter == shard.cache_map.end()) {
     ldpp_dout(dpp, 10) << "cache get: name=" << name << " : miss" << dendl;
     if (perfcounter) {
       perfcounter->inc(l_rgw_cache_miss);
@@ -33,12 +33,12 @@ int ObjectCache::get(const DoutPrefixProvider *dpp, const string& name, ObjectCa
     rl.unlock();
     wl.lock(); // write lock for expiration
     // check that wasn't already removed by other thread
-    iter = cache_map.find(name);
-    if (iter != cache_map.end()) {
+    iter = shard.cache_map.find(name);
+    if (iter != shard.cache_map.end()) {
       for (auto &kv : iter->second.chained_entries)
         kv.first->invalidate(kv.second);
-      remove_lru(name, iter->second.lru_iter);
-      cache_map.erase(iter);
+      remove_lru(shard, iter->second.lru_iter);
+      shard.cache_map.erase(iter);
     }
     if (perfcounter) {
       perfcounter->inc(l_rgw_cache_miss);
@@ -47,25 +47,10 @@ int ObjectCache::get(const DoutPrefixProvider *dpp, const string& name, ObjectCa
   }
 
   ObjectCacheEntry *entry = &iter->second;
-
-  if (lru_counter - entry->lru_promotion_ts > lru_window) {
-    ldpp_dout(dpp, 20) << "cache get: touching lru, lru_counter=" << lru_counter
-                   << " promotion_ts=" << entry->lru_promotion_ts << dendl;
-    rl.unlock();
-    wl.lock(); // write lock for touch_lru()
-    /* need to redo this because entry might have dropped off the cache */
-    iter = cache_map.find(name);
-    if (iter == cache_map.end()) {
-      ldpp_dout(dpp, 10) << "lost race! cache get: name=" << name << " : miss" << dendl;
-      if(perfcounter) perfcounter->inc(l_rgw_cache_miss);
-      return -ENOENT;
-    }
-
-    entry = &iter->second;
-    /* check again, we might have lost a race here */
-    if (lru_counter - entry->lru_promotion_ts > lru_window) {
-      touch_lru(dpp, name, *entry, iter->second.lru_iter);
-    }
+  // keeps the entry past the next turn of the clock hand. checked first,
+  // so that hot entries don't write to their cache line on every hit
+  if (!entry->referenced.load(std::memory_order_relaxed)) {
+    entry->referenced.store(true, std::memory_order_relaxed);
   }
 
   ObjectCacheInfo& src = iter->second.info;
@@ -99,7 +84,16 @@ bool ObjectCache::chain_cache_entry(const DoutPrefixProvider *dpp,
                                     std::initializer_list<rgw_cache_entry_info*> cache_info_entries,
 				    RGWChainedCache::Entry *chained_entry)
 {
-  std::unique_lock l{lock};
+  // lock the shards of all the entries, in order
+  std::set<Shard*> locked;
+  for (auto cache_info : cache_info_entries) {
+    locked.insert(&shard_of(cache_info->cache_locator));
+  }
+  std::vector<std::unique_lock<ceph::shared_mutex>> locks;
+  locks.reserve(locked.size());
+  for (auto shard : locked) {
+    locks.emplace_back(shard->lock);
+  }
 
   if (!enabled) {
     return false;
@@ -111,6 +105,7 @@ bool ObjectCache::chain_cache_entry(const DoutPrefixProvider *dpp,
   for (auto cache_info : cache_info_entries) {
     ldpp_dout(dpp, 10) << "chain_cache_entry: cache_locator="
 		   << cache_info->cache_locator << dendl;
+    auto& cache_map = shard_of(cache_info->cache_locator).cache_map;
     auto iter = cache_map.find(cache_info->cache_locator);
     if (iter == cache_map.end()) {
       ldpp_dout(dpp, 20) << "chain_cache_entry: couldn't find cache locator" << dendl;
@@ -141,7 +136,8 @@ bool ObjectCache::chain_cache_entry(const DoutPrefixProvider *dpp,
 
 void ObjectCache::put(const DoutPrefixProvider *dpp, const string& name, ObjectCacheInfo& info, rgw_cache_entry_info *cache_info)
 {
-  std::unique_lock l{lock};
+  Shard& shard = shard_of(name);
+  std::unique_lock l{shard.lock};
 
   if (!enabled) {
     return;
@@ -150,11 +146,11 @@ void ObjectCache::put(const DoutPrefixProvider *dpp, const string& name, ObjectC
   ldpp_dout(dpp, 10) << "cache put: name=" << name << " info.flags=0x"
                  << std::hex << info.flags << std::dec << dendl;
 
-  auto [iter, inserted] = cache_map.emplace(name, ObjectCacheEntry{});
+  auto [iter, inserted] = shard.cache_map.try_emplace(name);
   ObjectCacheEntry& entry = iter->second;
   entry.info.time_added = ceph::coarse_mono_clock::now();
   if (inserted) {
-    entry.lru_iter = lru.end();
+    entry.lru_iter = shard.lru.end();
   }
   ObjectCacheInfo& target = entry.info;
 
@@ -163,7 +159,7 @@ void ObjectCache::put(const DoutPrefixProvider *dpp, const string& name, ObjectC
   entry.chained_entries.clear();
   entry.gen++;
 
-  touch_lru(dpp, name, entry, entry.lru_iter);
+  touch_lru(dpp, shard, name, entry);
 
   target.status = info.status;
 
@@ -218,14 +214,15 @@ void ObjectCache::put(const DoutPrefixProvider *dpp, const string& name, ObjectC
 // negative lookup. It must only invalidate.
 bool ObjectCache::invalidate_remove(const DoutPrefixProvider *dpp, const string& name)
 {
-  std::unique_lock l{lock};
+  Shard& shard = shard_of(name);
+  std::unique_lock l{shard.lock};
 
   if (!enabled) {
     return false;
   }
 
-  auto iter = cache_map.find(name);
-  if (iter == cache_map.end())
+  auto iter = shard.cache_map.find(name);
+  if (iter == shard.cache_map.end())
     return false;
 
   ldpp_dout(dpp, 10) << "removing " << name << " from cache" << dendl;
@@ -235,60 +232,64 @@ bool ObjectCache::invalidate_remove(const DoutPrefixProvider *dpp, const string&
     kv.first->invalidate(kv.second);
   }
 
-  remove_lru(name, iter->second.lru_iter);
-  cache_map.erase(iter);
+  remove_lru(shard, iter->second.lru_iter);
+  shard.cache_map.erase(iter);
   return true;
 }
 
-void ObjectCache::touch_lru(const DoutPrefixProvider *dpp, const string& name, ObjectCacheEntry& entry,
-			    std::list<string>::iterator& lru_iter)
+void ObjectCache::touch_lru(const DoutPrefixProvider *dpp, Shard& shard, const string& name,
+			    ObjectCacheEntry& entry)
 {
-  while (lru_size > (size_t)cct->_conf->rgw_cache_lru_size) {
-    auto iter = lru.begin();
-    if ((*iter).compare(name) == 0) {
-      /*
-       * if the entry we're touching happens to be at the lru end, don't remove it,
-       * lru shrinking can wait for next time
-       */
-      break;
+  const unsigned long max_size =
+    std::max<unsigned long>(cct->_conf->rgw_cache_lru_size / shards.size(), 1);
+  while (shard.lru_size > max_size) {
+    if (shard.hand == shard.lru.end()) {
+      shard.hand = shard.lru.begin();
     }
-    auto map_iter = cache_map.find(*iter);
-    ldout(cct, 10) << "removing entry: name=" << *iter << " from cache LRU" << dendl;
-    if (map_iter != cache_map.end()) {
-      ObjectCacheEntry& entry = map_iter->second;
-      invalidate_lru(entry);
-      cache_map.erase(map_iter);
+    if (shard.hand->compare(name) == 0) {
+      ++shard.hand;
+      continue;
     }
-    lru.pop_front();
-    lru_size--;
+    auto map_iter = shard.cache_map.find(*shard.hand);
+    if (map_iter != shard.cache_map.end()) {
+      ObjectCacheEntry& victim = map_iter->second;
+      if (victim.referenced.exchange(false, std::memory_order_relaxed)) {
+        // used since the hand last passed, give it another turn
+        ++shard.hand;
+        continue;
+      }
+      ldout(cct, 10) << "removing entry: name=" << *shard.hand << " from cache LRU" << dendl;
+      invalidate_lru(victim);
+      shard.cache_map.erase(map_iter);
+    }
+    shard.hand = shard.lru.erase(shard.hand);
+    shard.lru_size--;
   }
 
-  if (lru_iter == lru.end()) {
-    lru.push_back(name);
-    lru_size++;
-    lru_iter--;
-    ldpp_dout(dpp, 10) << "adding " << name << " to cache LRU end" << dendl;
+  if (entry.lru_iter == shard.lru.end()) {
+    // enters the clock just behind the hand, as the last to be considered
+    entry.lru_iter = shard.lru.insert(shard.hand, name);
+    shard.lru_size++;
+    ldpp_dout(dpp, 10) << "adding " << name << " to cache LRU" << dendl;
   } else {
-    ldpp_dout(dpp, 10) << "moving " << name << " to cache LRU end" << dendl;
-    lru.erase(lru_iter);
-    lru.push_back(name);
-    lru_iter = lru.end();
-    --lru_iter;
+    ldpp_dout(dpp, 10) << "referencing " << name << " in cache LRU" << dendl;
+    entry.referenced.store(true, std::memory_order_relaxed);
   }
-
-  lru_counter++;
-  entry.lru_promotion_ts = lru_counter;
 }
 
-void ObjectCache::remove_lru(const string& name,
+void ObjectCache::remove_lru(Shard& shard,
 			     std::list<string>::iterator& lru_iter)
 {
-  if (lru_iter == lru.end())
+  if (lru_iter == shard.lru.end())
     return;
 
-  lru.erase(lru_iter);
-  lru_size--;
-  lru_iter = lru.end();
+  if (shard.hand == lru_iter) {
+    shard.hand = shard.lru.erase(lru_iter);
+  } else {
+    shard.lru.erase(lru_iter);
+  }
+  shard.lru_size--;
+  lru_iter = shard.lru.end();
 }
 
 void ObjectCache::invalidate_lru(ObjectCacheEntry& entry)
@@ -320,12 +321,13 @@ void ObjectCache::invalidate_all()
 
 void ObjectCache::do_invalidate_all()
 {
-  cache_map.clear();
-  lru.clear();
-
-  lru_size = 0;
-  lru_counter = 0;
-  lru_window = 0;
+  for (auto& shard : shards) {
+    std::unique_lock l{shard.lock};
+    shard.cache_map.clear();
+    shard.lru.clear();
+    shard.hand = shard.lru.end();
+    shard.lru_size = 0;
+  }
 
   for (auto& cache : chained_cache) {
     cache->invalidate_all();
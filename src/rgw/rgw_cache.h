@@ -3,6 +3,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <string>
 #include <map>
 #include <unordered_map>
@@ -151,36 +152,47 @@ public:
 struct ObjectCacheEntry {
   ObjectCacheInfo info;
   std::list<std::string>::iterator lru_iter;
-  uint64_t lru_promotion_ts;
+  // set by hits under the shared lock, cleared as the clock hand passes
+  std::atomic<bool> referenced;
   uint64_t gen;
   std::vector<std::pair<RGWChainedCache *, std::string> > chained_entries;
 
-  ObjectCacheEntry() : lru_promotion_ts(0), gen(0) {}
+  ObjectCacheEntry() : referenced(false), gen(0) {}
 };
 
+/* The entries are spread over shards by the hash of their name, each with
+ * its own lock, and are evicted with the CLOCK algorithm so that hits only
+ * take the shared lock of their shard. */
 class ObjectCache {
-  std::unordered_map<std::string, ObjectCacheEntry> cache_map;
-  std::list<std::string> lru;
-  unsigned long lru_size;
-  unsigned long lru_counter;
-  unsigned long lru_window;
+  struct Shard {
+    ceph::shared_mutex lock = ceph::make_shared_mutex("ObjectCache::Shard");
+    std::unordered_map<std::string, ObjectCacheEntry> cache_map;
+    std::list<std::string> lru; // the clock, in insertion order
+    std::list<std::string>::iterator hand = lru.end(); // next entry considered for eviction
+    unsigned long lru_size = 0;
+  };
+  std::vector<Shard> shards;
+  // guards chained_cache, and enabling the cache
   ceph::shared_mutex lock = ceph::make_shared_mutex("ObjectCache");
   CephContext *cct;
 
   std::vector<RGWChainedCache *> chained_cache;
 
-  bool enabled;
+  std::atomic<bool> enabled;
   ceph::timespan expiry;
 
-  void touch_lru(const DoutPrefixProvider *dpp, const std::string& name, ObjectCacheEntry& entry,
-		 std::list<std::string>::iterator& lru_iter);
-  void remove_lru(const std::string& name, std::list<std::string>::iterator& lru_iter);
+  Shard& shard_of(const std::string& name) {
+    return shards[std::hash<std::string>{}(name) % shards.size()];
+  }
+  void touch_lru(const DoutPrefixProvider *dpp, Shard& shard, const std::string& name,
+		 ObjectCacheEntry& entry);
+  void remove_lru(Shard& shard, std::list<std::string>::iterator& lru_iter);
   void invalidate_lru(ObjectCacheEntry& entry);
 
   void do_invalidate_all();
 
 public:
-  ObjectCache() : lru_size(0), lru_counter(0), lru_window(0), cct(NULL), enabled(false) { }
+  ObjectCache() : shards(1), cct(NULL), enabled(false) { }
   ~ObjectCache();
   int get(const DoutPrefixProvider *dpp, const std::string& name, ObjectCacheInfo& bl, uint32_t mask, rgw_cache_entry_info *cache_info);
   std::optional<ObjectCacheInfo> get(const DoutPrefixProvider *dpp, const std::string& name) {
@@ -191,10 +203,13 @@ public:
 
   template<typename F>
   void for_each(const F& f) {
-    std::shared_lock l{lock};
-    if (enabled) {
-      auto now  = ceph::coarse_mono_clock::now();
-      for (const auto& [name, entry] : cache_map) {
+    if (!enabled) {
+      return;
+    }
+    auto now  = ceph::coarse_mono_clock::now();
+    for (auto& shard : shards) {
+      std::shared_lock l{shard.lock};
+      for (const auto& [name, entry] : shard.cache_map) {
         if (expiry.count() && (now - entry.info.time_added) < expiry) {
           f(name, entry);
         }
@@ -206,7 +221,7 @@ public:
   bool invalidate_remove(const DoutPrefixProvider *dpp, const std::string& name);
   void set_ctx(CephContext *_cct) {
     cct = _cct;
-    lru_window = cct->_conf->rgw_cache_lru_size / 2;
+    shards = std::vector<Shard>(std::max<uint64_t>(cct->_conf.get_val<uint64_t>("rgw_cache_shards"), 1));
     expiry = std::chrono::seconds(cct->_conf.get_val<uint64_t>(
 						"rgw_cache_expiry_interval"));
   }
@@ -6,6 +6,7 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <aio.h>
+#include <set>
 
 #include "include/rados/librados.hpp"
 #include "include/Context.h"
@@ -17,10 +18,12 @@
 
 #include "rgw_aio.h"
 #include "rgw_cache.h"
+#include "rgw_d3n_uring.h"
 
 
 struct D3nGetObjData {
   std::mutex d3n_lock;
+  std::set<uint64_t> uncached_reads; // ids of the reads not to write to the cache: cache hits, and reads not from the start of their chunk
 };
 
 struct D3nL1CacheRequest {
@@ -97,19 +100,36 @@ struct D3nL1CacheRequest {
 
   template <typename ExecutionContext, typename CompletionToken>
   auto async_read(const DoutPrefixProvider *dpp, ExecutionContext& ctx, const std::string& location,
-                  off_t read_ofs, off_t read_len, CompletionToken&& token) {
+                  off_t read_ofs, off_t read_len, D3nIoUring* uring, CompletionToken&& token) {
     using Op = AsyncFileReadOp;
     using Signature = typename Op::Signature;
+    using Completion = typename Op::Completion;
     boost::asio::async_completion<CompletionToken, Signature> init(token);
     auto p = Op::create(ctx.get_executor(), init.completion_handler);
     auto& op = p->user_data;
 
     ldpp_dout(dpp, 20) << "D3nDataCache: " << __func__ << "(): location=" << location << dendl;
-    int ret = op.init_async_read(dpp, location, read_ofs, read_len, p.get());
-    if(0 == ret) {
-      ret = ::aio_read(op.aio_cb.get());
+    int ret;
+    if (uring) {
+      ret = uring->read(location, read_ofs, read_len,
+        [c = p.get()] (int r, bufferlist&& bl) {
+          auto p = std::unique_ptr<Completion>{c};
+          boost::system::error_code ec;
+          if (r < 0) {
+            ec.assign(-r, boost::system::system_category());
+          }
+          ceph::async::dispatch(std::move(p), ec, std::move(bl));
+        });
+      ldpp_dout(dpp, 20) << "D3nDataCache: " << __func__ << "(): io_uring read, ret=" << ret << dendl;
+    }
+    if (!uring || ret == -EAGAIN) {
+      // the ring is full, read through POSIX AIO rather than wait for it
+      ret = op.init_async_read(dpp, location, read_ofs, read_len, p.get());
+      if(0 == ret) {
+        ret = ::aio_read(op.aio_cb.get());
+      }
+      ldpp_dout(dpp, 20) << "D3nDataCache: " << __func__ << "(): ::aio_read(), ret=" << ret << dendl;
     }
-    ldpp_dout(dpp, 20) << "D3nDataCache: " << __func__ << "(): ::aio_read(), ret=" << ret << dendl;
     if(ret < 0) {
       auto ec = boost::system::error_code{-ret, boost::system::system_category()};
       ceph::async::post(std::move(p), ec, bufferlist{});
@@ -123,6 +143,7 @@ struct D3nL1CacheRequest {
   struct d3n_libaio_handler {
     rgw::Aio* throttle = nullptr;
     rgw::AioResult& r;
+    std::shared_ptr<void> pin; // held until the read completes
     // read callback
     void operator()(boost::system::error_code ec, bufferlist bl) const {
       r.result = -ec.value();
@@ -132,14 +153,14 @@ struct D3nL1CacheRequest {
   };
 
   void file_aio_read_abstract(const DoutPrefixProvider *dpp, boost::asio::io_context& context, yield_context yield,
-                              std::string& cache_location, off_t read_ofs, off_t read_len,
-                              rgw::Aio* aio, rgw::AioResult& r) {
+                              std::string& location, off_t read_ofs, off_t read_len,
+                              D3nIoUring* uring, std::shared_ptr<void> pin, rgw::Aio* aio, rgw::AioResult& r) {
     using namespace boost::asio;
     async_completion<yield_context, void()> init(yield);
     auto ex = get_associated_executor(init.completion_handler);
 
     ldpp_dout(dpp, 20) << "D3nDataCache: " << __func__ << "(): oid=" << r.obj.oid << dendl;
-    async_read(dpp, context, cache_location+"/"+url_encode(r.obj.oid, true), read_ofs, read_len, bind_executor(ex, d3n_libaio_handler{aio, r}));
+    async_read(dpp, context, location, read_ofs, read_len, uring, bind_executor(ex, d3n_libaio_handler{aio, r, std::move(pin)}));
   }
 
 };
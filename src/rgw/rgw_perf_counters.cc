@@ -31,6 +31,11 @@ int rgw_perf_start(CephContext *cct)
   plb.add_u64_counter(l_rgw_cache_hit, "cache_hit", "Cache hits");
   plb.add_u64_counter(l_rgw_cache_miss, "cache_miss", "Cache miss");
 
+  plb.add_u64_counter(l_rgw_d3n_cache_hit, "d3n_cache_hit", "D3N cache hits");
+  plb.add_u64_counter(l_rgw_d3n_cache_miss, "d3n_cache_miss", "D3N cache misses");
+  plb.add_u64_counter(l_rgw_d3n_ghost_hit, "d3n_ghost_hit", "D3N cache misses of chunks recently evicted from probation");
+  plb.add_u64_counter(l_rgw_d3n_fill_dropped, "d3n_fill_dropped", "D3N cache fills dropped as the fill queue was full");
+
   plb.add_u64_counter(l_rgw_keystone_token_cache_hit, "keystone_token_cache_hit", "Keystone token cache hits");
   plb.add_u64_counter(l_rgw_keystone_token_cache_miss, "keystone_token_cache_miss", "Keystone token cache miss");
 
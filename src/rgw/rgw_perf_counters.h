@@ -29,6 +29,11 @@ enum {
   l_rgw_cache_hit,
   l_rgw_cache_miss,
 
+  l_rgw_d3n_cache_hit,
+  l_rgw_d3n_cache_miss,
+  l_rgw_d3n_ghost_hit,
+  l_rgw_d3n_fill_dropped,
+
   l_rgw_keystone_token_cache_hit,
   l_rgw_keystone_token_cache_miss,
 
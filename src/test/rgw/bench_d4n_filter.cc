@@ -0,0 +1,504 @@
+/* Drives the D4N filter with a reproducible mix of GETs and PUTs and reports
+ * throughput and latency percentiles, so that changes to the cache path can
+ * be compared. The backing store is dbstore and the cache is whatever redis
+ * instance --host and --port point at; run-d4n-bench.sh starts a throwaway
+ * redis-server for that. With --flush the bench empties that instance before
+ * it starts, which is only safe on an instance nothing else uses.
+ *
+ * GETs are split between a hot set of objects that is read once before the
+ * run, so reads of it are served by the cache, and a cold set written to
+ * the backing store only, of which every object is read at most once. The
+ * share of GETs sent to the hot set is --hit_ratio. Options the bench does
+ * not know are passed on to the ceph configuration, e.g.
+ * --rgw_d4n_write_back=true. */
+
+#include "common/ceph_context.h"
+#include "global/global_init.h"
+#include "rgw_process_env.h"
+#include "rgw_sal.h"
+#include "driver/d4n/rgw_sal_d4n.h"
+#include "driver/d4n/d4n_perf_counters.h"
+#include <cpp_redis/cpp_redis>
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define dout_subsys ceph_subsys_rgw
+
+using namespace std;
+using Clock = std::chrono::steady_clock;
+
+/* Objects are written in pieces of this size, as the frontends do */
+static constexpr uint64_t chunk_size = 4 * 1024 * 1024;
+
+struct parameters {
+  string host = "127.0.0.1";
+  int port = 6379;
+  int threads = 16;
+  uint64_t ops = 10000;
+  uint64_t hot_objects = 100;
+  double hit_ratio = 0.9;
+  double put_ratio = 0.0;
+  string size_dist = "fixed";
+  uint64_t size = 4 * 1024 * 1024;
+  uint64_t size_min = 4 * 1024;
+  uint64_t size_max = 16 * 1024 * 1024;
+  uint64_t seed = 0;
+  bool flush = false;
+};
+
+enum bench_op_type { BENCH_GET_HOT, BENCH_GET_COLD, BENCH_PUT, BENCH_NUM_TYPES };
+static const char* op_names[BENCH_NUM_TYPES] = {"GET hot", "GET cold", "PUT"};
+
+struct bench_op {
+  bench_op_type type;
+  uint64_t index; /* Into the hot or the cold set */
+};
+
+struct bench_object {
+  string name;
+  uint64_t size;
+};
+
+struct op_result {
+  bench_op_type type;
+  uint64_t bytes;
+  double lat_us;
+};
+
+/* Counts the bytes read without keeping them */
+class DiscardCB : public RGWGetDataCB {
+  public:
+    uint64_t bytes = 0;
+
+    int handle_data(bufferlist& bl, off_t bl_ofs, off_t bl_len) override {
+      bytes += bl_len;
+      return 0;
+    }
+};
+
+class SizeGenerator {
+  public:
+    SizeGenerator(const parameters& p, std::mt19937_64& _rng) : params(p), rng(_rng),
+      lognormal(std::log(p.size), 1.0) {}
+
+    uint64_t next() {
+      uint64_t s = params.size;
+
+      if (params.size_dist == "uniform") {
+	s = std::uniform_int_distribution<uint64_t>(params.size_min, params.size_max)(rng);
+      } else if (params.size_dist == "lognormal") {
+	/* Median of --size, like the long-tailed sizes of real object stores */
+	s = std::clamp<uint64_t>(lognormal(rng), params.size_min, params.size_max);
+      }
+
+      return std::max<uint64_t>(s, 1);
+    }
+
+  private:
+    const parameters& params;
+    std::mt19937_64& rng;
+    std::lognormal_distribution<double> lognormal;
+};
+
+/* Random bytes, so that compression in the cache does not flatter the
+ * results. Its own engine keeps the sizes and the mix independent of it. */
+static bufferlist make_payload(uint64_t size, uint64_t seed)
+{
+  std::mt19937_64 rng(seed);
+  bufferptr bp(size);
+  char* p = bp.c_str();
+
+  for (uint64_t i = 0; i < size; i += sizeof(uint64_t)) {
+    const uint64_t r = rng();
+    memcpy(p + i, &r, std::min<uint64_t>(sizeof(r), size - i));
+  }
+
+  bufferlist bl;
+  bl.append(std::move(bp));
+  return bl;
+}
+
+static int put_object(const DoutPrefixProvider* dpp, rgw::sal::Driver* driver,
+		      rgw::sal::Bucket* bucket, const bench_object& o, const bufferlist& data)
+{
+  unique_ptr<rgw::sal::Object> obj = bucket->get_object(rgw_obj_key(o.name));
+  rgw_placement_rule placement_rule;
+  unique_ptr<rgw::sal::Writer> writer = driver->get_atomic_writer(dpp, null_yield, obj.get(),
+								  bucket->get_info().owner,
+								  &placement_rule, 0, "");
+
+  int ret = writer->prepare(null_yield);
+
+  for (uint64_t ofs = 0; ret >= 0 && ofs < o.size; ofs += chunk_size) {
+    bufferlist bl;
+    bl.substr_of(data, 0, std::min(chunk_size, o.size - ofs));
+    ret = writer->process(std::move(bl), ofs);
+  }
+
+  if (ret >= 0) {
+    ret = writer->process({}, o.size);
+  }
+
+  if (ret < 0) {
+    return ret;
+  }
+
+  ceph::real_time mtime;
+  ceph::real_time delete_at;
+  map<string, bufferlist> attrs;
+  string user_data;
+  rgw_zone_set zones_trace;
+  bool canceled = false;
+
+  return writer->complete(o.size, "bench-" + o.name, &mtime, ceph::real_clock::now(), attrs,
+			  delete_at, nullptr, nullptr, &user_data, &zones_trace, &canceled,
+			  null_yield);
+}
+
+static int get_object(const DoutPrefixProvider* dpp, rgw::sal::Bucket* bucket,
+		      const bench_object& o, uint64_t* bytes)
+{
+  unique_ptr<rgw::sal::Object> obj = bucket->get_object(rgw_obj_key(o.name));
+  unique_ptr<rgw::sal::Object::ReadOp> op = obj->get_read_op();
+
+  int ret = op->prepare(null_yield, dpp);
+
+  if (ret < 0) {
+    return ret;
+  }
+
+  DiscardCB cb;
+  ret = op->iterate(dpp, 0, obj->get_obj_size() - 1, &cb, null_yield);
+  *bytes = cb.bytes;
+
+  return ret;
+}
+
+static int create_bucket(const DoutPrefixProvider* dpp, CephContext* cct,
+			 rgw::sal::Driver* driver, unique_ptr<rgw::sal::User>* user,
+			 unique_ptr<rgw::sal::Bucket>* bucket)
+{
+  rgw_user u("bench_tenant", "bench_user", "ns");
+
+  *user = driver->get_user(u);
+  (*user)->get_info().user_id = u;
+
+  int ret = (*user)->store_user(dpp, null_yield, false);
+
+  if (ret < 0) {
+    return ret;
+  }
+
+  rgw_bucket b;
+  rgw_placement_rule placement_rule;
+  const RGWAccessControlPolicy policy;
+  rgw::sal::Attrs attrs;
+  RGWBucketInfo info;
+  obj_version ep_objv;
+  bool bucket_exists;
+  RGWProcessEnv penv;
+  RGWEnv rgw_env;
+  req_state s(cct, penv, &rgw_env, 0);
+
+  b.name = "d4n_bench";
+  string swift_ver_location;
+
+  return (*user)->create_bucket(dpp, b, "bench_zonegroup", placement_rule, swift_ver_location, nullptr,
+				policy, attrs, info, ep_objv, false, false, &bucket_exists,
+				s.info, bucket, null_yield);
+}
+
+/* Cold objects the hit ratio asks for are sent to the backing store only,
+ * so the filter has to fetch them */
+static vector<bench_op> make_schedule(const parameters& params, std::mt19937_64& rng,
+				      uint64_t* num_cold)
+{
+  std::uniform_real_distribution<double> coin(0.0, 1.0);
+  std::uniform_int_distribution<uint64_t> hot(0, params.hot_objects - 1);
+  vector<bench_op> schedule;
+
+  *num_cold = 0;
+  schedule.reserve(params.ops);
+
+  for (uint64_t i = 0; i < params.ops; ++i) {
+    if (coin(rng) < params.put_ratio) {
+      schedule.push_back({BENCH_PUT, hot(rng)});
+    } else if (coin(rng) < params.hit_ratio) {
+      schedule.push_back({BENCH_GET_HOT, hot(rng)});
+    } else {
+      schedule.push_back({BENCH_GET_COLD, (*num_cold)++});
+    }
+  }
+
+  return schedule;
+}
+
+static double percentile(const vector<double>& sorted, double p)
+{
+  if (sorted.empty()) {
+    return 0;
+  }
+
+  size_t i = std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()));
+  return sorted[i];
+}
+
+static void report(const string& name, vector<double>& lat, uint64_t bytes, double secs)
+{
+  std::sort(lat.begin(), lat.end());
+
+  cout << std::left << std::setw(10) << name << std::right << std::fixed << std::setprecision(1)
+       << " ops=" << std::setw(8) << lat.size()
+       << " ops/s=" << std::setw(10) << lat.size() / secs
+       << " MB/s=" << std::setw(9) << bytes / secs / (1024 * 1024)
+       << " p50=" << std::setw(9) << percentile(lat, 0.50) << "us"
+       << " p99=" << std::setw(9) << percentile(lat, 0.99) << "us"
+       << " p99.9=" << std::setw(9) << percentile(lat, 0.999) << "us" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+  parameters params;
+  vector<string> ceph_args;
+
+  try {
+    using namespace boost::program_options;
+    options_description desc{"Options"};
+    desc.add_options()
+      ("help,h", "Help screen")
+      ("host", value<string>()->default_value(params.host), "redis host used as the cache")
+      ("port", value<int>()->default_value(params.port), "redis port used as the cache")
+      ("threads", value<int>()->default_value(params.threads), "number of concurrent clients")
+      ("ops", value<uint64_t>()->default_value(params.ops), "number of operations to run")
+      ("hot_objects", value<uint64_t>()->default_value(params.hot_objects), "objects in the cached working set")
+      ("hit_ratio", value<double>()->default_value(params.hit_ratio), "share of GETs sent to cached objects")
+      ("put_ratio", value<double>()->default_value(params.put_ratio), "share of operations that overwrite a cached object")
+      ("size_dist", value<string>()->default_value(params.size_dist), "object sizes: fixed, uniform or lognormal")
+      ("size", value<uint64_t>()->default_value(params.size), "object size, or the median one for lognormal")
+      ("size_min", value<uint64_t>()->default_value(params.size_min), "smallest object for uniform and lognormal")
+      ("size_max", value<uint64_t>()->default_value(params.size_max), "largest object for uniform and lognormal")
+      ("seed", value<uint64_t>()->default_value(params.seed), "seed of the object sizes and operation mix")
+      ("flush", bool_switch(&params.flush), "empty the redis instance before the run");
+    variables_map vm;
+    auto parsed = command_line_parser(argc, argv).options(desc).allow_unregistered().run();
+    store(parsed, vm);
+    if (vm.count("help")) {
+      cout << desc << std::endl;
+      return EXIT_SUCCESS;
+    }
+    params.host = vm["host"].as<string>();
+    params.port = vm["port"].as<int>();
+    params.threads = vm["threads"].as<int>();
+    params.ops = vm["ops"].as<uint64_t>();
+    params.hot_objects = vm["hot_objects"].as<uint64_t>();
+    params.hit_ratio = vm["hit_ratio"].as<double>();
+    params.put_ratio = vm["put_ratio"].as<double>();
+    params.size_dist = vm["size_dist"].as<string>();
+    params.size = vm["size"].as<uint64_t>();
+    params.size_min = vm["size_min"].as<uint64_t>();
+    params.size_max = vm["size_max"].as<uint64_t>();
+    params.seed = vm["seed"].as<uint64_t>();
+    ceph_args = collect_unrecognized(parsed.options, include_positional);
+  } catch (const boost::program_options::error& ex) {
+    cerr << ex.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (params.threads < 1 || params.hot_objects < 1 || params.size_min > params.size_max ||
+      (params.size_dist != "fixed" && params.size_dist != "uniform" &&
+       params.size_dist != "lognormal")) {
+    cerr << "Invalid options; see --help." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  /* Start from an empty cache so runs can be compared */
+  cpp_redis::client client;
+
+  try {
+    client.connect(params.host, params.port, nullptr, 0, 5, 1000);
+  } catch (std::exception& e) {
+    cerr << "Redis instance not running at " << params.host << ":" << params.port << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (params.flush) {
+    client.flushall();
+    client.sync_commit();
+  }
+  client.disconnect();
+
+  vector<const char*> args;
+  for (const auto& a : ceph_args) {
+    args.push_back(a.c_str());
+  }
+
+  auto cct = global_init(nullptr, args, CEPH_ENTITY_TYPE_CLIENT,
+			 CODE_ENVIRONMENT_UTILITY, CINIT_FLAG_NO_MON_CONFIG);
+  cct->_conf.set_val_or_die("rgw_d4n_host", params.host);
+  cct->_conf.set_val_or_die("rgw_d4n_port", std::to_string(params.port));
+
+  DoutPrefix dp(cct.get(), dout_subsys, "d4n bench: ");
+  DriverManager::Config cfg;
+  cfg.store_name = "dbstore";
+  cfg.filter_name = "d4n";
+
+  rgw::sal::Driver* driver = DriverManager::get_storage(&dp, cct.get(), cfg, false, false, false,
+							false, false, false, null_yield, false);
+
+  if (!driver) {
+    cerr << "Failed to set up the D4N filter over dbstore" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  auto filter = static_cast<rgw::sal::D4NFilterDriver*>(driver);
+  unique_ptr<rgw::sal::User> user;
+  unique_ptr<rgw::sal::Bucket> bucket;
+  unique_ptr<rgw::sal::Bucket> next_bucket;
+
+  int ret = create_bucket(&dp, cct.get(), driver, &user, &bucket);
+
+  if (ret >= 0) {
+    ret = filter->get_next()->get_bucket(&dp, nullptr, bucket->get_key(), &next_bucket, null_yield);
+  }
+
+  if (ret < 0) {
+    cerr << "Failed to create the bench bucket, ret=" << ret << std::endl;
+    delete driver;
+    return EXIT_FAILURE;
+  }
+
+  std::mt19937_64 rng(params.seed);
+  SizeGenerator sizes(params, rng);
+  uint64_t num_cold;
+  vector<bench_op> schedule = make_schedule(params, rng, &num_cold);
+  vector<bench_object> hot_set, cold_set;
+  const bufferlist payload = make_payload(chunk_size, params.seed);
+
+  for (uint64_t i = 0; i < params.hot_objects; ++i) {
+    hot_set.push_back({"hot_" + std::to_string(i), sizes.next()});
+  }
+  for (uint64_t i = 0; i < num_cold; ++i) {
+    cold_set.push_back({"cold_" + std::to_string(i), sizes.next()});
+  }
+
+  cout << "Writing " << hot_set.size() << " hot and " << cold_set.size() << " cold objects" << std::endl;
+
+  for (const auto& o : hot_set) {
+    uint64_t bytes;
+
+    ret = put_object(&dp, driver, bucket.get(), o, payload);
+
+    if (ret >= 0) {
+      ret = get_object(&dp, bucket.get(), o, &bytes);
+    }
+
+    if (ret < 0) {
+      cerr << "Failed to warm " << o.name << ", ret=" << ret << std::endl;
+      delete driver;
+      return EXIT_FAILURE;
+    }
+  }
+
+  for (const auto& o : cold_set) {
+    ret = put_object(&dp, filter->get_next(), next_bucket.get(), o, payload);
+
+    if (ret < 0) {
+      cerr << "Failed to write " << o.name << ", ret=" << ret << std::endl;
+      delete driver;
+      return EXIT_FAILURE;
+    }
+  }
+
+  uint64_t hits_before = 0, misses_before = 0;
+  if (d4n_perfcounter) {
+    hits_before = d4n_perfcounter->get(l_d4n_block_hit);
+    misses_before = d4n_perfcounter->get(l_d4n_block_miss);
+  }
+
+  cout << "Running " << schedule.size() << " operations on " << params.threads << " threads" << std::endl;
+
+  std::atomic<uint64_t> next_op = 0;
+  std::atomic<uint64_t> errors = 0;
+  vector<vector<op_result>> results(params.threads);
+  vector<std::thread> threads;
+
+  auto start = Clock::now();
+
+  for (int t = 0; t < params.threads; ++t) {
+    threads.emplace_back([&, t] {
+      for (uint64_t i = next_op++; i < schedule.size(); i = next_op++) {
+	const bench_op& op = schedule[i];
+	const bench_object& o = op.type == BENCH_GET_COLD ? cold_set[op.index] : hot_set[op.index];
+	uint64_t bytes = o.size;
+	auto op_start = Clock::now();
+	int r;
+
+	if (op.type == BENCH_PUT) {
+	  r = put_object(&dp, driver, bucket.get(), o, payload);
+	} else {
+	  r = get_object(&dp, bucket.get(), o, &bytes);
+	}
+
+	double lat = std::chrono::duration<double, std::micro>(Clock::now() - op_start).count();
+
+	if (r < 0) {
+	  errors++;
+	  continue;
+	}
+
+	results[t].push_back({op.type, bytes, lat});
+      }
+    });
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  double secs = std::chrono::duration<double>(Clock::now() - start).count();
+
+  vector<double> lat_all, lat_by_type[BENCH_NUM_TYPES];
+  uint64_t bytes_all = 0, bytes_by_type[BENCH_NUM_TYPES] = {};
+
+  for (const auto& r : results) {
+    for (const auto& res : r) {
+      lat_all.push_back(res.lat_us);
+      lat_by_type[res.type].push_back(res.lat_us);
+      bytes_all += res.bytes;
+      bytes_by_type[res.type] += res.bytes;
+    }
+  }
+
+  cout << "Ran for " << std::fixed << std::setprecision(2) << secs << "s, "
+       << errors << " operations failed" << std::endl;
+
+  for (int type = 0; type < BENCH_NUM_TYPES; ++type) {
+    if (!lat_by_type[type].empty()) {
+      report(op_names[type], lat_by_type[type], bytes_by_type[type], secs);
+    }
+  }
+  report("total", lat_all, bytes_all, secs);
+
+  if (d4n_perfcounter) {
+    uint64_t hits = d4n_perfcounter->get(l_d4n_block_hit) - hits_before;
+    uint64_t misses = d4n_perfcounter->get(l_d4n_block_miss) - misses_before;
+
+    cout << "Block hits=" << hits << " misses=" << misses;
+    if (hits + misses) {
+      cout << " hit ratio=" << std::setprecision(3) << double(hits) / (hits + misses);
+    }
+    cout << std::endl;
+  }
+
+  delete driver;
+
+  return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
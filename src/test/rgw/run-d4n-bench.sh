@@ -0,0 +1,14 @@
+#!/bin/bash
+# Runs bench_d4n_filter against a throwaway redis-server that keeps nothing
+# on disk, and has the bench flush it first. Arguments are passed on to the
+# bench, e.g.
+#   ./run-d4n-bench.sh --threads 32 --hit_ratio 0.5 --size_dist lognormal
+PORT=${D4N_BENCH_PORT:-6380}
+redis-server --port $PORT --save "" --appendonly no --daemonize yes
+echo "-----------Redis Server Started on port $PORT-----------"
+sleep 1
+../../../build/bin/bench_d4n_filter --port $PORT --flush "$@"
+RET=$?
+redis-cli -p $PORT shutdown nosave
+echo "-----------Redis Server Stopped-----------"
+exit $RET
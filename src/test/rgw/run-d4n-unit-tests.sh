@@ -11,10 +11,14 @@ echo "-----------Redis Server Started-----------"
 printf "\n-----------Directory Test Executed-----------\n"
 redis-cli FLUSHALL
 echo "-----------Redis Server Flushed-----------"
-../../../build/bin/ceph_test_rgw_d4n_filter
+CEPH_LIB=../../../build/lib ../../../build/bin/ceph_test_rgw_d4n_filter
 printf "\n-----------Filter Test Executed-----------\n"
 redis-cli FLUSHALL
 echo "-----------Redis Server Flushed-----------"
+../../../build/bin/ceph_test_rgw_d4n_writeback
+printf "\n-----------Write-Back Test Executed-----------\n"
+redis-cli FLUSHALL
+echo "-----------Redis Server Flushed-----------"
 REDIS_PID=$(lsof -i4TCP:6379 -sTCP:LISTEN -t)
 kill $REDIS_PID
 echo "-----------Redis Server Stopped-----------"
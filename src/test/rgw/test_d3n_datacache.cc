@@ -0,0 +1,339 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab ft=cpp
+
+#include "rgw_d3n_datacache.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <filesystem>
+#include <thread>
+#include <gtest/gtest.h>
+
+#include "global/global_context.h"
+#include "rgw_perf_counters.h"
+
+namespace fs = std::filesystem;
+using namespace std::chrono_literals;
+
+class D3nDataCacheTest : public ::testing::Test {
+protected:
+  std::string dir;
+  std::vector<std::string> conf_keys;
+  std::unique_ptr<D3nDataCache> cache;
+
+  void SetUp() override {
+    if (!perfcounter) {
+      rgw_perf_start(g_ceph_context);
+    }
+    dir = fs::temp_directory_path() / ("test_d3n_datacache." + std::to_string(getpid()));
+    set_conf("rgw_d3n_l1_datacache_persistent_path", dir);
+    set_conf("rgw_d3n_l1_datacache_size", "65536");
+    set_conf("rgw_d3n_io_engine", "posix_aio");
+    set_conf("rgw_d3n_l1_free_watermark", "0");
+  }
+
+  void TearDown() override {
+    cache.reset();
+    fs::remove_all(dir);
+    for (const auto& key : conf_keys) {
+      g_ceph_context->_conf.rm_val(key);
+    }
+  }
+
+  void set_conf(const std::string& key, const std::string& val) {
+    g_ceph_context->_conf.set_val_or_die(key, val);
+    conf_keys.push_back(key);
+  }
+
+  void start() {
+    cache = std::make_unique<D3nDataCache>();
+    cache->init(g_ceph_context);
+  }
+
+  static std::string data(std::string oid, size_t len) {
+    std::string s(len, '\0');
+    for (size_t i = 0; i < len; i++) {
+      s[i] = 'a' + (oid[0] + i) % 26;
+    }
+    return s;
+  }
+
+  void put(std::string oid, size_t len) {
+    bufferlist bl;
+    bl.append(data(oid, len));
+    cache->put(bl, len, oid);
+  }
+
+  // the cache is filled in the background
+  bool wait_cached(const std::string& oid) {
+    for (int i = 0; i < 500; i++) {
+      if (cache->is_cached(oid)) {
+	return true;
+      }
+      std::this_thread::sleep_for(10ms);
+    }
+    return false;
+  }
+
+  static std::string read(const D3nDataCache::Location& loc, size_t len) {
+    std::string s(len, '\0');
+    int fd = ::open(loc.path.c_str(), O_RDONLY);
+    EXPECT_LE(0, fd);
+    EXPECT_EQ(static_cast<ssize_t>(len), ::pread(fd, s.data(), len, loc.ofs));
+    ::close(fd);
+    return s;
+  }
+
+  static uint64_t counter(int idx) {
+    return perfcounter->get(idx);
+  }
+};
+
+TEST_F(D3nDataCacheTest, RangeHits)
+{
+  start();
+  put("a", 8192);
+  ASSERT_TRUE(wait_cached("a"));
+
+  D3nDataCache::Location loc;
+  ASSERT_TRUE(cache->get("a", 0, 8192, &loc));
+  EXPECT_EQ(data("a", 8192), read(loc, 8192));
+  loc = {};
+  ASSERT_TRUE(cache->get("a", 4096, 1000, &loc));
+  EXPECT_EQ(data("a", 8192).substr(4096, 1000), read(loc, 1000));
+  loc = {};
+  EXPECT_FALSE(cache->get("a", 4096, 8192, &loc));
+  EXPECT_FALSE(cache->get("b", 0, 1, &loc));
+}
+
+TEST_F(D3nDataCacheTest, RangeHitsSlab)
+{
+  // slabs are at least rgw_get_obj_max_req_size
+  set_conf("rgw_d3n_l1_store", "slab");
+  set_conf("rgw_d3n_l1_datacache_size", "16777216");
+  set_conf("rgw_d3n_l1_slab_min_slot", "4096");
+  start();
+  put("a", 4096);
+  put("b", 8192);
+  ASSERT_TRUE(wait_cached("a"));
+  ASSERT_TRUE(wait_cached("b"));
+
+  D3nDataCache::Location loc;
+  ASSERT_TRUE(cache->get("b", 100, 5000, &loc));
+  EXPECT_EQ(data("b", 8192).substr(100, 5000), read(loc, 5000));
+}
+
+TEST_F(D3nDataCacheTest, PrefixReplaced)
+{
+  start();
+  // cached by a read of the start of the object only
+  put("a", 4096);
+  ASSERT_TRUE(wait_cached("a"));
+  D3nDataCache::Location loc;
+  EXPECT_FALSE(cache->get("a", 4096, 4096, &loc));
+
+  put("a", 8192);
+  bool hit = false;
+  for (int i = 0; i < 500 && !hit; i++) {
+    loc = {};
+    hit = cache->get("a", 4096, 4096, &loc);
+    if (!hit) {
+      std::this_thread::sleep_for(10ms);
+    }
+  }
+  ASSERT_TRUE(hit);
+  EXPECT_EQ(data("a", 8192).substr(4096), read(loc, 4096));
+}
+
+TEST_F(D3nDataCacheTest, TwoQ)
+{
+  // room for four chunks, of which one on probation
+  set_conf("rgw_d3n_l1_datacache_size", "16384");
+  set_conf("rgw_d3n_l1_eviction_policy", "2q");
+  set_conf("rgw_d3n_l1_2q_probation_ratio", "0.25");
+  start();
+  for (auto oid : {"a", "b", "c", "d"}) {
+    put(oid, 4096);
+    ASSERT_TRUE(wait_cached(oid));
+    std::this_thread::sleep_for(20ms);
+  }
+  // a and b are read again, and leave probation
+  D3nDataCache::Location loc;
+  ASSERT_TRUE(cache->get("a", 0, 4096, &loc));
+  loc = {};
+  ASSERT_TRUE(cache->get("b", 0, 4096, &loc));
+  loc = {};
+
+  // a scan evicts the chunks on probation, oldest first
+  for (auto oid : {"e", "f"}) {
+    put(oid, 4096);
+    ASSERT_TRUE(wait_cached(oid));
+    std::this_thread::sleep_for(20ms);
+  }
+  EXPECT_TRUE(cache->is_cached("a"));
+  EXPECT_TRUE(cache->is_cached("b"));
+  EXPECT_FALSE(cache->is_cached("c"));
+  EXPECT_FALSE(cache->is_cached("d"));
+
+  // c was evicted from probation recently, so it skips it when cached
+  // again, in place of e, the oldest on probation now
+  const uint64_t ghost_hits = counter(l_rgw_d3n_ghost_hit);
+  put("c", 4096);
+  ASSERT_TRUE(wait_cached("c"));
+  EXPECT_EQ(ghost_hits + 1, counter(l_rgw_d3n_ghost_hit));
+  EXPECT_FALSE(cache->is_cached("e"));
+  std::this_thread::sleep_for(20ms);
+
+  // with probation within its share, the least recently used chunk goes
+  put("g", 4096);
+  ASSERT_TRUE(wait_cached("g"));
+  EXPECT_FALSE(cache->is_cached("a"));
+  EXPECT_TRUE(cache->is_cached("b"));
+  EXPECT_TRUE(cache->is_cached("c"));
+  EXPECT_TRUE(cache->is_cached("f"));
+}
+
+TEST_F(D3nDataCacheTest, TwoQEmptiedProbation)
+{
+  set_conf("rgw_d3n_l1_datacache_size", "8192");
+  set_conf("rgw_d3n_l1_eviction_policy", "2q");
+  set_conf("rgw_d3n_l1_index_shards", "1");
+  start();
+  put("a", 4096);
+  ASSERT_TRUE(wait_cached("a"));
+  std::this_thread::sleep_for(20ms);
+  put("b", 4096);
+  ASSERT_TRUE(wait_cached("b"));
+
+  // reads move the only chunks on probation to the main list, which
+  // eviction falls back to
+  D3nDataCache::Location loc;
+  ASSERT_TRUE(cache->get("a", 0, 4096, &loc));
+  loc = {};
+  ASSERT_TRUE(cache->get("b", 0, 4096, &loc));
+  loc = {};
+  put("c", 4096);
+  ASSERT_TRUE(wait_cached("c"));
+  EXPECT_FALSE(cache->is_cached("a"));
+  EXPECT_TRUE(cache->is_cached("b"));
+}
+
+TEST_F(D3nDataCacheTest, ShardedLru)
+{
+  set_conf("rgw_d3n_l1_datacache_size", "16384");
+  set_conf("rgw_d3n_l1_index_shards", "8");
+  start();
+  for (auto oid : {"a", "b", "c", "d"}) {
+    put(oid, 4096);
+    ASSERT_TRUE(wait_cached(oid));
+    std::this_thread::sleep_for(20ms);
+  }
+  D3nDataCache::Location loc;
+  ASSERT_TRUE(cache->get("a", 0, 4096, &loc));
+  loc = {};
+  std::this_thread::sleep_for(20ms);
+
+  // the least recently used chunk goes, whichever shard it is in
+  put("e", 4096);
+  ASSERT_TRUE(wait_cached("e"));
+  EXPECT_TRUE(cache->is_cached("a"));
+  EXPECT_FALSE(cache->is_cached("b"));
+  put("f", 4096);
+  ASSERT_TRUE(wait_cached("f"));
+  EXPECT_TRUE(cache->is_cached("a"));
+  EXPECT_FALSE(cache->is_cached("c"));
+  EXPECT_TRUE(cache->is_cached("d"));
+}
+
+TEST_F(D3nDataCacheTest, PinnedChunk)
+{
+  set_conf("rgw_d3n_l1_datacache_size", "4096");
+  start();
+  put("a", 4096);
+  ASSERT_TRUE(wait_cached("a"));
+  D3nDataCache::Location loc;
+  ASSERT_TRUE(cache->get("a", 0, 4096, &loc));
+
+  // evicted while read from, its file is only removed once the read is done
+  put("b", 4096);
+  ASSERT_TRUE(wait_cached("b"));
+  EXPECT_FALSE(cache->is_cached("a"));
+  EXPECT_TRUE(fs::exists(loc.path));
+  EXPECT_EQ(data("a", 4096), read(loc, 4096));
+  const std::string path = loc.path;
+  loc = {};
+  EXPECT_FALSE(fs::exists(path));
+}
+
+TEST_F(D3nDataCacheTest, PinnedChunkRefill)
+{
+  set_conf("rgw_d3n_l1_datacache_size", "4096");
+  start();
+  put("a", 4096);
+  ASSERT_TRUE(wait_cached("a"));
+  D3nDataCache::Location loc;
+  ASSERT_TRUE(cache->get("a", 0, 4096, &loc));
+  put("b", 4096);
+  ASSERT_TRUE(wait_cached("b"));
+
+  // not cached again while the evicted chunk is read from, which would
+  // truncate its file
+  put("a", 2048);
+  std::this_thread::sleep_for(100ms);
+  EXPECT_FALSE(cache->is_cached("a"));
+  EXPECT_EQ(data("a", 4096), read(loc, 4096));
+
+  // and cached again once the read is done
+  loc = {};
+  put("a", 4096);
+  ASSERT_TRUE(wait_cached("a"));
+  ASSERT_TRUE(cache->get("a", 0, 4096, &loc));
+  EXPECT_EQ(data("a", 4096), read(loc, 4096));
+}
+
+TEST_F(D3nDataCacheTest, FillQueueFull)
+{
+  set_conf("rgw_d3n_l1_fill_queue_size", "0");
+  start();
+  const uint64_t dropped = counter(l_rgw_d3n_fill_dropped);
+  put("a", 4096);
+  EXPECT_EQ(dropped + 1, counter(l_rgw_d3n_fill_dropped));
+  std::this_thread::sleep_for(100ms);
+  EXPECT_FALSE(cache->is_cached("a"));
+}
+
+TEST_F(D3nDataCacheTest, FillRateLimit)
+{
+  set_conf("rgw_d3n_l1_fill_rate_limit", "8192");
+  start();
+  const auto start = std::chrono::steady_clock::now();
+  for (auto oid : {"a", "b", "c"}) {
+    put(oid, 4096);
+  }
+  // half a second per chunk after the first
+  ASSERT_TRUE(wait_cached("c"));
+  EXPECT_LE(900ms, std::chrono::steady_clock::now() - start);
+  EXPECT_TRUE(cache->is_cached("a"));
+  EXPECT_TRUE(cache->is_cached("b"));
+}
+
+TEST_F(D3nDataCacheTest, FreeWatermark)
+{
+  set_conf("rgw_d3n_l1_datacache_size", "16384");
+  set_conf("rgw_d3n_l1_free_watermark", "0.5");
+  start();
+  for (auto oid : {"a", "b", "c"}) {
+    put(oid, 4096);
+    ASSERT_TRUE(wait_cached(oid));
+    std::this_thread::sleep_for(20ms);
+  }
+  // evicted in the background, ahead of the next fill
+  for (int i = 0; i < 500 && cache->is_cached("a"); i++) {
+    std::this_thread::sleep_for(10ms);
+  }
+  EXPECT_FALSE(cache->is_cached("a"));
+  EXPECT_TRUE(cache->is_cached("b"));
+  EXPECT_TRUE(cache->is_cached("c"));
+}
@@ -0,0 +1,138 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab ft=cpp
+
+#include "rgw_d3n_index.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <gtest/gtest.h>
+
+#include "global/global_context.h"
+
+namespace fs = std::filesystem;
+
+class D3nCacheIndexTest : public ::testing::Test {
+protected:
+  std::string dir;
+
+  void SetUp() override {
+    dir = fs::temp_directory_path() / ("test_d3n_index." + std::to_string(getpid()));
+    fs::create_directories(dir);
+  }
+
+  void TearDown() override {
+    fs::remove_all(dir);
+  }
+
+  static D3nIndexEntry entry(const std::string& oid, uint64_t ofs) {
+    return {oid, 4096, {ofs, 65536}, 0x1234};
+  }
+
+  std::list<D3nIndexEntry> load() {
+    D3nCacheIndex index(g_ceph_context, dir);
+    std::list<D3nIndexEntry> entries;
+    EXPECT_EQ(0, index.load(&entries));
+    return entries;
+  }
+
+  static std::vector<std::string> oids(const std::list<D3nIndexEntry>& entries) {
+    std::vector<std::string> v;
+    for (const auto& e : entries) {
+      v.push_back(e.oid);
+    }
+    return v;
+  }
+};
+
+TEST_F(D3nCacheIndexTest, Missing)
+{
+  EXPECT_TRUE(load().empty());
+}
+
+TEST_F(D3nCacheIndexTest, CheckpointAndJournal)
+{
+  {
+    D3nCacheIndex index(g_ceph_context, dir);
+    ASSERT_EQ(0, index.checkpoint([] {
+      return std::vector<D3nIndexEntry>{entry("a", 0), entry("b", 65536)};
+    }));
+    index.start([] { return 0; }, [] {});
+    index.add(entry("c", 131072));
+    index.remove("a");
+    // readded, so most recently used
+    index.add(entry("b", 65536));
+    index.stop();
+  }
+
+  auto entries = load();
+  EXPECT_EQ((std::vector<std::string>{"c", "b"}), oids(entries));
+  EXPECT_EQ(131072, entries.front().extent.ofs);
+  EXPECT_EQ(65536, entries.front().extent.len);
+  EXPECT_EQ(4096, entries.front().size);
+  EXPECT_EQ(0x1234, entries.front().crc);
+}
+
+TEST_F(D3nCacheIndexTest, CheckpointDropsPending)
+{
+  D3nCacheIndex index(g_ceph_context, dir);
+  ASSERT_EQ(0, index.checkpoint([] { return std::vector<D3nIndexEntry>{}; }));
+  index.start([] { return 0; }, [] {});
+  index.add(entry("a", 0));
+  index.add(entry("b", 65536));
+
+  // the snapshot already reflects the changes queued before it
+  ASSERT_EQ(0, index.checkpoint([&index] {
+    index.discard_pending();
+    return std::vector<D3nIndexEntry>{entry("b", 65536)};
+  }));
+  index.add(entry("c", 131072));
+  index.stop();
+
+  EXPECT_EQ((std::vector<std::string>{"b", "c"}), oids(load()));
+}
+
+TEST_F(D3nCacheIndexTest, TornRecord)
+{
+  {
+    D3nCacheIndex index(g_ceph_context, dir);
+    ASSERT_EQ(0, index.checkpoint([] {
+      return std::vector<D3nIndexEntry>{entry("a", 0)};
+    }));
+    index.start([] { return 0; }, [] {});
+    index.add(entry("b", 65536));
+    index.stop();
+  }
+
+  // a record cut short by a crash, and one with a bad crc
+  std::string path = dir + "/d3n.index";
+  auto size = fs::file_size(path);
+  int fd = ::open(path.c_str(), O_WRONLY|O_APPEND);
+  ASSERT_GE(fd, 0);
+  const char torn[] = {0x40, 0, 0, 0, 1, 2};
+  ASSERT_EQ(sizeof(torn), ::write(fd, torn, sizeof(torn)));
+  ::close(fd);
+  EXPECT_EQ((std::vector<std::string>{"a", "b"}), oids(load()));
+
+  fs::resize_file(path, size);
+  fd = ::open(path.c_str(), O_WRONLY|O_APPEND);
+  ASSERT_GE(fd, 0);
+  const char corrupt[] = {1, 0, 0, 0, 0, 0, 0, 0, 1};
+  ASSERT_EQ(sizeof(corrupt), ::write(fd, corrupt, sizeof(corrupt)));
+  ::close(fd);
+  EXPECT_EQ((std::vector<std::string>{"a", "b"}), oids(load()));
+}
+
+TEST_F(D3nCacheIndexTest, NotAnIndex)
+{
+  std::string path = dir + "/d3n.index";
+  int fd = ::open(path.c_str(), O_WRONLY|O_CREAT, 0644);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(8, ::write(fd, "whatever", 8));
+  ::close(fd);
+
+  D3nCacheIndex index(g_ceph_context, dir);
+  std::list<D3nIndexEntry> entries;
+  EXPECT_EQ(-EINVAL, index.load(&entries));
+}
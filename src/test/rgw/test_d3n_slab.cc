@@ -0,0 +1,131 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab ft=cpp
+
+#include "rgw_d3n_slab.h"
+
+#include <set>
+#include <gtest/gtest.h>
+
+static constexpr uint64_t K = 1024;
+static constexpr uint64_t M = 1024 * K;
+
+TEST(D3nSlabAllocator, SizeClasses)
+{
+  D3nSlabAllocator a(16 * M, 4 * M, 64 * K);
+
+  EXPECT_EQ(16 * M, a.get_capacity());
+  EXPECT_EQ(64 * K, a.slot_size(1));
+  EXPECT_EQ(64 * K, a.slot_size(64 * K));
+  EXPECT_EQ(128 * K, a.slot_size(64 * K + 1));
+  EXPECT_EQ(4 * M, a.slot_size(3 * M));
+  EXPECT_EQ(4 * M, a.slot_size(4 * M));
+  EXPECT_EQ(0, a.slot_size(4 * M + 1));
+}
+
+TEST(D3nSlabAllocator, SlabSizeNotPowerOfTwo)
+{
+  D3nSlabAllocator a(20 * M, 5 * M, 1 * M);
+
+  EXPECT_EQ(4 * M, a.slot_size(3 * M));
+  EXPECT_EQ(5 * M, a.slot_size(4 * M + 1));
+
+  // only one 4M slot fits in a slab
+  D3nExtent e1, e2;
+  ASSERT_TRUE(a.allocate(4 * M, &e1));
+  ASSERT_TRUE(a.allocate(4 * M, &e2));
+  EXPECT_NE(e1.ofs / (5 * M), e2.ofs / (5 * M));
+}
+
+TEST(D3nSlabAllocator, ExtentsDontOverlap)
+{
+  D3nSlabAllocator a(8 * M, 4 * M, 64 * K);
+  std::set<uint64_t> starts;
+  D3nExtent e;
+
+  // the first slab is carved into 64K slots, the second into 1M slots
+  for (int i = 0; i < 64; i++) {
+    ASSERT_TRUE(a.allocate(10 * K, &e));
+    EXPECT_EQ(64 * K, e.len);
+    EXPECT_LT(e.ofs + e.len, 4 * M + 1);
+    EXPECT_TRUE(starts.insert(e.ofs).second);
+  }
+  for (int i = 0; i < 4; i++) {
+    ASSERT_TRUE(a.allocate(1 * M, &e));
+    EXPECT_EQ(1 * M, e.len);
+    EXPECT_GE(e.ofs, 4 * M);
+    EXPECT_TRUE(starts.insert(e.ofs).second);
+  }
+  EXPECT_FALSE(a.allocate(10 * K, &e));
+  EXPECT_FALSE(a.allocate(1 * M, &e));
+  EXPECT_EQ(0, a.get_free_slabs());
+}
+
+TEST(D3nSlabAllocator, EmptySlabsChangeClass)
+{
+  D3nSlabAllocator a(4 * M, 4 * M, 64 * K);
+  std::vector<D3nExtent> small;
+  D3nExtent e;
+
+  for (int i = 0; i < 64; i++) {
+    ASSERT_TRUE(a.allocate(64 * K, &e));
+    small.push_back(e);
+  }
+  EXPECT_FALSE(a.allocate(4 * M, &e));
+
+  // a slab with a slot in use keeps its class
+  for (size_t i = 1; i < small.size(); i++) {
+    a.release(small[i]);
+  }
+  EXPECT_FALSE(a.allocate(4 * M, &e));
+  ASSERT_TRUE(a.allocate(64 * K, &e));
+  small[1] = e;
+
+  a.release(small[0]);
+  a.release(small[1]);
+  EXPECT_EQ(1, a.get_free_slabs());
+  ASSERT_TRUE(a.allocate(4 * M, &e));
+  EXPECT_EQ(0, e.ofs);
+  EXPECT_EQ(4 * M, e.len);
+}
+
+TEST(D3nSlabAllocator, ReleasedSlotsAreReused)
+{
+  D3nSlabAllocator a(4 * M, 4 * M, 1 * M);
+  D3nExtent e[4];
+
+  for (auto& x : e) {
+    ASSERT_TRUE(a.allocate(1 * M, &x));
+  }
+  D3nExtent f;
+  EXPECT_FALSE(a.allocate(1 * M, &f));
+
+  a.release(e[2]);
+  ASSERT_TRUE(a.allocate(1 * M, &f));
+  EXPECT_EQ(e[2].ofs, f.ofs);
+}
+
+TEST(D3nSlabAllocator, Claim)
+{
+  D3nSlabAllocator a(8 * M, 4 * M, 1 * M);
+
+  EXPECT_TRUE(a.claim({5 * M, 1 * M}));
+  EXPECT_FALSE(a.claim({5 * M, 1 * M}));
+  // another class in the same slab, a slot off the grid, past the end
+  EXPECT_FALSE(a.claim({4 * M, 2 * M}));
+  EXPECT_FALSE(a.claim({512 * K, 1 * M}));
+  EXPECT_FALSE(a.claim({8 * M, 1 * M}));
+  EXPECT_FALSE(a.claim({0, 3 * M}));
+
+  // the claimed slot isn't handed out again
+  D3nExtent e;
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(a.allocate(1 * M, &e));
+    EXPECT_NE(5 * M, e.ofs);
+    EXPECT_GE(e.ofs, 4 * M);
+  }
+  ASSERT_TRUE(a.allocate(1 * M, &e));
+  EXPECT_LT(e.ofs, 4 * M);
+
+  a.release({5 * M, 1 * M});
+  EXPECT_TRUE(a.claim({5 * M, 1 * M}));
+}
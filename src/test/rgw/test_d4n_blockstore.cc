@@ -0,0 +1,164 @@
+#include "d4n_blockstore.h"
+#include "d4n_policy.h"
+#include "gtest/gtest.h"
+#include <map>
+#include <stdlib.h>
+
+using namespace std;
+
+class D4NLocalBlockStoreFixture : public ::testing::Test {
+  protected:
+    string location;
+    unique_ptr<RGWD4NLocalBlockStore> store;
+
+    void SetUp() override {
+      char tmpl[] = "/tmp/test_d4n_blockstore.XXXXXX";
+      ASSERT_NE(mkdtemp(tmpl), nullptr);
+      location = tmpl;
+
+      store = make_unique<RGWD4NLocalBlockStore>(location);
+      ASSERT_EQ(store->init(false), 0);
+    }
+
+    void TearDown() override {
+      store.reset();
+      ASSERT_EQ(system(("rm -rf " + location).c_str()), 0);
+    }
+
+    /* Reads a single block, returning it empty if it is not stored */
+    buffer::list get(const string& oid, uint64_t offset, bool* compressed = nullptr) {
+      vector<buffer::list> data;
+      vector<bool> comp;
+
+      EXPECT_EQ(store->getBlocks(oid, {offset}, &data, &comp, null_yield), 0);
+      EXPECT_EQ(data.size(), (size_t)1);
+
+      if (compressed) {
+        *compressed = comp[0];
+      }
+
+      return data[0];
+    }
+
+    map<pair<string, uint64_t>, uint64_t> list() {
+      map<pair<string, uint64_t>, uint64_t> found;
+
+      EXPECT_EQ(store->listBlocks([&] (const string& oid, uint64_t offset, uint64_t size) {
+        found[{oid, offset}] = size;
+      }), 0);
+
+      return found;
+    }
+};
+
+TEST_F(D4NLocalBlockStoreFixture, PutGet) {
+  buffer::list bl;
+  bl.append("test data");
+
+  ASSERT_EQ(store->putBlock("bucket/obj", 0, bl, false, false, null_yield), 0);
+
+  bool compressed = true;
+  EXPECT_EQ(get("bucket/obj", 0, &compressed).to_str(), "test data");
+  EXPECT_FALSE(compressed);
+
+  /* Blocks that were never stored come back empty */
+  EXPECT_EQ(get("bucket/obj", 4096).length(), (size_t)0);
+  EXPECT_EQ(get("bucket/other", 0).length(), (size_t)0);
+}
+
+TEST_F(D4NLocalBlockStoreFixture, PutSync) {
+  buffer::list bl;
+  bl.append("test data");
+
+  ASSERT_EQ(store->putBlock("bucket/obj", 0, bl, false, true, null_yield), 0);
+  EXPECT_EQ(get("bucket/obj", 0).to_str(), "test data");
+}
+
+TEST_F(D4NLocalBlockStoreFixture, ReplaceFormat) {
+  buffer::list plain, packed;
+  plain.append("plain data");
+  packed.append("packed");
+
+  ASSERT_EQ(store->putBlock("bucket/obj", 0, plain, false, false, null_yield), 0);
+  ASSERT_EQ(store->putBlock("bucket/obj", 0, packed, true, false, null_yield), 0);
+
+  bool compressed = false;
+  EXPECT_EQ(get("bucket/obj", 0, &compressed).to_str(), "packed");
+  EXPECT_TRUE(compressed);
+
+  /* Only one copy of the block is kept */
+  size_t copies = 0;
+  ASSERT_EQ(store->listBlocks([&] (const string& oid, uint64_t offset, uint64_t size) {
+    EXPECT_EQ(size, packed.length());
+    copies++;
+  }), 0);
+  EXPECT_EQ(copies, (size_t)1);
+
+  ASSERT_EQ(store->putBlock("bucket/obj", 0, plain, false, false, null_yield), 0);
+  EXPECT_EQ(get("bucket/obj", 0, &compressed).to_str(), "plain data");
+  EXPECT_FALSE(compressed);
+}
+
+TEST_F(D4NLocalBlockStoreFixture, Delete) {
+  buffer::list bl;
+  bl.append("test data");
+
+  ASSERT_EQ(store->putBlock("bucket/obj", 0, bl, false, false, null_yield), 0);
+  ASSERT_EQ(store->putBlock("bucket/obj", 9, bl, true, false, null_yield), 0);
+  ASSERT_EQ(store->putBlock("bucket/other", 0, bl, false, false, null_yield), 0);
+
+  ASSERT_EQ(store->delBlock("bucket/obj", 9, null_yield), 0);
+  EXPECT_EQ(get("bucket/obj", 9).length(), (size_t)0);
+  EXPECT_EQ(get("bucket/obj", 0).to_str(), "test data");
+
+  /* Deleting what isn't there is not an error */
+  EXPECT_EQ(store->delBlock("bucket/obj", 9, null_yield), 0);
+
+  ASSERT_EQ(store->delBlocks("bucket/obj", null_yield), 0);
+  EXPECT_EQ(get("bucket/obj", 0).length(), (size_t)0);
+  EXPECT_EQ(get("bucket/other", 0).to_str(), "test data");
+
+  EXPECT_EQ(store->delBlocks("bucket/obj", null_yield), 0);
+}
+
+/* A restarted gateway finds the blocks it kept, and counts them against
+ * the capacity of its policy */
+TEST_F(D4NLocalBlockStoreFixture, Capacity) {
+  buffer::list small, large;
+  small.append(string(10, 'a'));
+  large.append(string(20, 'b'));
+
+  ASSERT_EQ(store->putBlock("bucket/obj", 0, large, false, false, null_yield), 0);
+  ASSERT_EQ(store->putBlock("bucket/obj", 20, small, true, false, null_yield), 0);
+  ASSERT_EQ(store->putBlock("bucket/other", 0, small, false, false, null_yield), 0);
+
+  store = make_unique<RGWD4NLocalBlockStore>(location);
+  ASSERT_EQ(store->init(false), 0);
+
+  auto found = list();
+  EXPECT_EQ(found.size(), (size_t)3);
+  EXPECT_EQ((found[{"bucket/obj", 0}]), (uint64_t)20);
+  EXPECT_EQ((found[{"bucket/obj", 20}]), (uint64_t)10);
+  EXPECT_EQ((found[{"bucket/other", 0}]), (uint64_t)10);
+
+  auto policy = RGWD4NPolicy::create("lru", 30);
+  vector<RGWD4NPolicy::Block> victims;
+
+  ASSERT_EQ(store->listBlocks([&] (const string& oid, uint64_t offset, uint64_t size) {
+    RGWD4NPolicy::Block b;
+    b.oid = oid;
+    b.offset = offset;
+    b.size = size;
+    policy->insert(b, 0, &victims);
+  }), 0);
+
+  /* Which block goes depends on the order the blocks were written in */
+  EXPECT_EQ(victims.size(), (size_t)1);
+  EXPECT_LE(policy->get_size(), (uint64_t)30);
+  EXPECT_GE(policy->get_size(), (uint64_t)20);
+
+  /* Evicting drops the old contents */
+  store = make_unique<RGWD4NLocalBlockStore>(location);
+  ASSERT_EQ(store->init(true), 0);
+  EXPECT_TRUE(list().empty());
+}
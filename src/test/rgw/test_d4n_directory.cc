@@ -12,6 +12,7 @@ string hostStr;
 string redisHost = "";
 string oid = "samoid";
 string bucketName = "testBucket";
+string dirKey = "rgw-object:" + bucketName + ":" + oid + "::directory";
 int blkSize = 123;
 
 class DirectoryFixture: public ::testing::Test {
@@ -55,7 +56,7 @@ TEST_F(DirectoryFixture, SetValueTest) {
   string bucket_name;
   string obj_name;
   std::vector<std::string> fields;
-  int setReturn = blk_dir->setValue(c_blk);
+  int setReturn = blk_dir->setValue(c_blk, null_yield);
 
   ASSERT_EQ(setReturn, 0);
 
@@ -68,7 +69,7 @@ TEST_F(DirectoryFixture, SetValueTest) {
   client.connect(hostStr, stoi(portStr), nullptr, 0, 5, 1000);
   ASSERT_EQ((bool)client.is_connected(), (bool)1);
 
-  client.hmget("rgw-object:" + oid + ":directory", fields, [&key, &hosts, &size, &bucket_name, &obj_name, &key_exist](cpp_redis::reply& reply) {
+  client.hmget(dirKey, fields, [&key, &hosts, &size, &bucket_name, &obj_name, &key_exist](cpp_redis::reply& reply) {
     auto arr = reply.as_array();
 
     if (!arr[0].is_null()) {
@@ -84,7 +85,7 @@ TEST_F(DirectoryFixture, SetValueTest) {
   client.sync_commit();
 
   EXPECT_EQ(key_exist, 0);
-  EXPECT_EQ(key, "rgw-object:" + oid + ":directory");
+  EXPECT_EQ(key, dirKey);
   EXPECT_EQ(hosts, redisHost);
   EXPECT_EQ(size, to_string(blkSize));
   EXPECT_EQ(bucket_name, bucketName);
@@ -103,7 +104,7 @@ TEST_F(DirectoryFixture, GetValueTest) {
   string bucket_name;
   string obj_name;
   std::vector<std::string> fields;
-  int setReturn = blk_dir->setValue(c_blk);
+  int setReturn = blk_dir->setValue(c_blk, null_yield);
 
   ASSERT_EQ(setReturn, 0);
 
@@ -116,7 +117,7 @@ TEST_F(DirectoryFixture, GetValueTest) {
   client.connect(hostStr, stoi(portStr), nullptr, 0, 5, 1000);
   ASSERT_EQ((bool)client.is_connected(), (bool)1);
 
-  client.hmget("rgw-object:" + oid + ":directory", fields, [&key, &hosts, &size, &bucket_name, &obj_name, &key_exist](cpp_redis::reply& reply) {
+  client.hmget(dirKey, fields, [&key, &hosts, &size, &bucket_name, &obj_name, &key_exist](cpp_redis::reply& reply) {
     auto arr = reply.as_array();
 
     if (!arr[0].is_null()) {
@@ -132,14 +133,14 @@ TEST_F(DirectoryFixture, GetValueTest) {
   client.sync_commit();
 
   EXPECT_EQ(key_exist, 0);
-  EXPECT_EQ(key, "rgw-object:" + oid + ":directory");
+  EXPECT_EQ(key, dirKey);
   EXPECT_EQ(hosts, redisHost);
   EXPECT_EQ(size, to_string(blkSize));
   EXPECT_EQ(bucket_name, bucketName);
   EXPECT_EQ(obj_name, oid);
 
   /* Check if object name in directory instance matches redis update */
-  client.hset("rgw-object:" + oid + ":directory", "obj_name", "newoid", [](cpp_redis::reply& reply) {
+  client.hset(dirKey, "obj_name", "newoid", [](cpp_redis::reply& reply) {
     if (reply.is_integer()) {
       ASSERT_EQ(reply.as_integer(), 0); /* Zero keys exist */
     }
@@ -147,7 +148,7 @@ TEST_F(DirectoryFixture, GetValueTest) {
 
   client.sync_commit();
 
-  int getReturn = blk_dir->getValue(c_blk);
+  int getReturn = blk_dir->getValue(c_blk, null_yield);
 
   ASSERT_EQ(getReturn, 0);
   EXPECT_EQ(c_blk->c_obj.obj_name, "newoid");
@@ -155,16 +156,37 @@ TEST_F(DirectoryFixture, GetValueTest) {
   client.flushall();
 }
 
+/* Locations of an entry are stored and returned in order */
+TEST_F(DirectoryFixture, HostsListTest) {
+  cpp_redis::client client;
+  cache_block blk;
+
+  c_blk->hosts_list.push_back("127.0.0.2:6379");
+  ASSERT_EQ(blk_dir->setValue(c_blk, null_yield), 0);
+
+  blk.c_obj.bucket_name = bucketName;
+  blk.c_obj.obj_name = oid;
+
+  ASSERT_EQ(blk_dir->getValue(&blk, null_yield), 0);
+  EXPECT_EQ(blk.hosts_list, vector<string>({redisHost, "127.0.0.2:6379"}));
+  EXPECT_EQ(blk.size_in_bytes, (uint64_t)blkSize);
+
+  client.connect(hostStr, stoi(portStr), nullptr, 0, 5, 1000);
+  ASSERT_EQ((bool)client.is_connected(), (bool)1);
+  client.flushall();
+  client.sync_commit();
+}
+
 /* Successful delValue Call and Redis Check */
 TEST_F(DirectoryFixture, DelValueTest) {
   cpp_redis::client client;
   vector<string> keys;
-  int setReturn = blk_dir->setValue(c_blk);
+  int setReturn = blk_dir->setValue(c_blk, null_yield);
 
   ASSERT_EQ(setReturn, 0);
 
   /* Ensure cache entry exists in cache before deletion */
-  keys.push_back("rgw-object:" + oid + ":directory");
+  keys.push_back(dirKey);
 
   client.exists(keys, [](cpp_redis::reply& reply) {
     if (reply.is_integer()) {
@@ -172,7 +194,7 @@ TEST_F(DirectoryFixture, DelValueTest) {
     }
   });
 
-  int delReturn = blk_dir->delValue(c_blk);
+  int delReturn = blk_dir->delValue(c_blk, null_yield);
 
   ASSERT_EQ(delReturn, 0);
 
@@ -185,6 +207,122 @@ TEST_F(DirectoryFixture, DelValueTest) {
   client.flushall();
 }
 
+/* Block entries track each gateway holding a copy */
+TEST_F(DirectoryFixture, BlockHostsTest) {
+  cpp_redis::client client;
+  cache_block blk;
+
+  blk.c_obj.bucket_name = bucketName;
+  blk.c_obj.obj_name = oid;
+  blk.block_id = 4194304;
+  blk.size_in_bytes = blkSize;
+
+  ASSERT_EQ(blk_dir->setValue(c_blk, null_yield), 0);
+  ASSERT_EQ(blk_dir->addBlockHost(&blk, "http://gw1:8000", null_yield), 0);
+  ASSERT_EQ(blk_dir->addBlockHost(&blk, "http://gw2:8000", null_yield), 0);
+  ASSERT_EQ(blk_dir->addBlockHost(&blk, "http://gw1:8000", null_yield), 0);
+
+  vector<cache_block> blocks(2, blk);
+  blocks[1].block_id = 0;
+
+  ASSERT_EQ(blk_dir->getBlockValues(&blocks, null_yield), 0);
+  EXPECT_EQ(blocks[0].hosts_list, vector<string>({"http://gw1:8000", "http://gw2:8000"}));
+  EXPECT_EQ(blocks[0].size_in_bytes, (uint64_t)blkSize);
+  EXPECT_TRUE(blocks[1].hosts_list.empty());
+
+  ASSERT_EQ(blk_dir->delBlockHost(&blk, "http://gw1:8000", null_yield), 0);
+  ASSERT_EQ(blk_dir->getBlockValues(&blocks, null_yield), 0);
+  EXPECT_EQ(blocks[0].hosts_list, vector<string>({"http://gw2:8000"}));
+
+  /* Removing the object's entry removes its block entries */
+  ASSERT_EQ(blk_dir->delValue(c_blk, null_yield), 0);
+  ASSERT_EQ(blk_dir->getBlockValues(&blocks, null_yield), 0);
+  EXPECT_TRUE(blocks[0].hosts_list.empty());
+  EXPECT_EQ(blk_dir->delBlockHost(&blk, "http://gw2:8000", null_yield), -2);
+
+  client.connect(hostStr, stoi(portStr), nullptr, 0, 5, 1000);
+  ASSERT_EQ((bool)client.is_connected(), (bool)1);
+  client.flushall();
+  client.sync_commit();
+}
+
+/* Objects of the same name in other buckets keep their entries */
+TEST_F(DirectoryFixture, BucketsTest) {
+  cpp_redis::client client;
+  cache_block other = *c_blk;
+  other.c_obj.bucket_name = "otherBucket";
+
+  vector<cache_block> blocks(1, *c_blk);
+  vector<cache_block> other_blocks(1, other);
+
+  ASSERT_EQ(blk_dir->setValue(c_blk, null_yield), 0);
+  ASSERT_EQ(blk_dir->setValue(&other, null_yield), 0);
+  ASSERT_EQ(blk_dir->addBlockHost(&blocks[0], "http://gw1:8000", null_yield), 0);
+  ASSERT_EQ(blk_dir->addBlockHost(&other_blocks[0], "http://gw1:8000", null_yield), 0);
+
+  ASSERT_EQ(blk_dir->delValue(c_blk, null_yield), 0);
+  EXPECT_EQ(blk_dir->getValue(c_blk, null_yield), -2);
+
+  ASSERT_EQ(blk_dir->getValue(&other, null_yield), 0);
+  EXPECT_EQ(other.c_obj.bucket_name, "otherBucket");
+  ASSERT_EQ(blk_dir->getBlockValues(&other_blocks, null_yield), 0);
+  EXPECT_EQ(other_blocks[0].hosts_list, vector<string>({"http://gw1:8000"}));
+
+  client.connect(hostStr, stoi(portStr), nullptr, 0, 5, 1000);
+  ASSERT_EQ((bool)client.is_connected(), (bool)1);
+  client.flushall();
+  client.sync_commit();
+}
+
+/* Endpoint lists are parsed from the configuration format */
+TEST(D4NRedisClusterTest, ParseEndpoints) {
+  vector<RGWD4NRedisCluster::Endpoint> endpoints;
+
+  ASSERT_EQ(RGWD4NRedisCluster::parse_endpoints("10.0.0.1:6379, 10.0.0.2:6380", &endpoints), 0);
+  ASSERT_EQ(endpoints.size(), (size_t)2);
+  EXPECT_EQ(endpoints[0], make_pair(string("10.0.0.1"), 6379));
+  EXPECT_EQ(endpoints[1], make_pair(string("10.0.0.2"), 6380));
+
+  endpoints.clear();
+  EXPECT_EQ(RGWD4NRedisCluster::parse_endpoints("10.0.0.1", &endpoints), -EINVAL);
+}
+
+/* Keys spread over every endpoint, and adding one only moves part of them */
+TEST(D4NRedisClusterTest, ConsistentPlacement) {
+  vector<RGWD4NRedisCluster::Endpoint> endpoints{{"10.0.0.1", 6379}, {"10.0.0.2", 6379}, {"10.0.0.3", 6379}};
+  RGWD4NRedisCluster cluster(endpoints, 1, 160);
+
+  endpoints.push_back({"10.0.0.4", 6379});
+  RGWD4NRedisCluster grown(endpoints, 1, 160);
+
+  map<string, int> counts;
+  int moved = 0;
+  const int keys = 3000;
+
+  for (int i = 0; i < keys; ++i) {
+    string key = "object" + to_string(i);
+    RGWD4NRedisPool* pool = cluster.get(key);
+    RGWD4NRedisPool* grown_pool = grown.get(key);
+
+    EXPECT_EQ(pool, cluster.get(key));
+    counts[pool->get_host()]++;
+
+    if (pool->get_host() != grown_pool->get_host()) {
+      EXPECT_EQ(grown_pool->get_host(), "10.0.0.4");
+      moved++;
+    }
+  }
+
+  ASSERT_EQ(counts.size(), (size_t)3);
+
+  for (const auto& count : counts) {
+    EXPECT_GT(count.second, keys / 6);
+  }
+
+  EXPECT_GT(moved, 0);
+  EXPECT_LT(moved, keys / 2);
+}
+
 int main(int argc, char *argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
 
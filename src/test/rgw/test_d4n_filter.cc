@@ -1,12 +1,14 @@
 #include "gtest/gtest.h"
 #include "common/ceph_context.h"
 #include <iostream>
+#include <random>
 #include <string>
 #include "rgw_process_env.h"
 #include <cpp_redis/cpp_redis>
 #include "driver/dbstore/common/dbstore.h"
 #include "rgw_sal_store.h"
 #include "driver/d4n/rgw_sal_d4n.h"
+#include "compressor/Compressor.h"
 
 #include "rgw_sal.h"
 #include "rgw_auth.h"
@@ -14,8 +16,6 @@
 
 #define dout_subsys ceph_subsys_rgw
 
-#define METADATA_LENGTH 22
-
 using namespace std;
 
 string portStr;
@@ -52,6 +52,14 @@ class Environment : public ::testing::Environment {
 		        CODE_ENVIRONMENT_UTILITY, 
 			CINIT_FLAG_NO_MON_CONFIG);
       
+      /* Tests change cached metadata in redis directly, which the filter
+         only notices by checking its in-process copy on every use */
+      cct->_conf.set_val_or_die("rgw_d4n_meta_cache_ttl_ms", "0");
+
+      /* The small objects of most tests don't compress well enough and are
+         cached as they are */
+      cct->_conf.set_val_or_die("rgw_d4n_compression", "zlib");
+
       dpp = new DoutPrefix(cct->get(), dout_subsys, "d4n test: ");
       DriverManager::Config cfg;
 
@@ -199,6 +207,42 @@ class D4NFilterFixture : public ::testing::Test {
       return ret;
     }
 
+    /* Writes the object's data and completes it */
+    int writeObject(string name, buffer::list data) {
+      unique_ptr<rgw::sal::Object> obj = testBucket->get_object(rgw_obj_key(name));
+      rgw_user owner;
+      rgw_placement_rule ptail_placement_rule;
+      string unique_tag;
+
+      testWriter = driver->get_atomic_writer(dpp, null_yield, obj.get(), owner,
+					     &ptail_placement_rule, 123, unique_tag);
+
+      uint64_t size = data.length();
+      ceph::real_time mtime;
+      map<string, bufferlist> attrs;
+      string user_data;
+      rgw_zone_set zones_trace;
+      bool canceled;
+
+      int ret = testWriter->prepare(null_yield);
+
+      if (ret == 0) {
+        ret = testWriter->process(move(data), 0);
+      }
+
+      if (ret == 0) {
+        ret = testWriter->process({}, size);
+      }
+
+      if (ret == 0) {
+        ret = testWriter->complete(size, "test_etag", &mtime, ceph::real_time(), attrs,
+				   ceph::real_time(), nullptr, nullptr, &user_data,
+				   &zones_trace, &canceled, null_yield);
+      }
+
+      return ret;
+    }
+
     void clientSetUp(cpp_redis::client* client) {
       client->connect(hostStr, stoi(portStr), nullptr, 0, 5, 1000);
       ASSERT_EQ((bool)client->is_connected(), (bool)1);
@@ -211,6 +255,67 @@ class D4NFilterFixture : public ::testing::Test {
       client->flushdb([](cpp_redis::reply& reply) {});
       client->sync_commit();
     }
+
+    /* Key the cache holds the named object of the test bucket under */
+    string cacheOid(string name) {
+      unique_ptr<rgw::sal::Object> obj = testBucket->get_object(rgw_obj_key(name));
+      return rgw::sal::D4NFilterDriver::cache_oid(obj.get());
+    }
+
+    /* Reads the metadata cached for an object straight from redis */
+    int getCachedObject(cpp_redis::client* client, string name, RGWD4NObjectMeta* meta) {
+      int ret = -1;
+
+      client->get("rgw-object:" + cacheOid(name) + ":cache", [&](cpp_redis::reply& reply) {
+        if (reply.is_string()) {
+          buffer::list bl;
+          bl.append(reply.as_string());
+          auto iter = bl.cbegin();
+          *meta = RGWD4NObjectMeta();
+          decode(*meta, iter);
+          ret = 0;
+        }
+      });
+
+      client->sync_commit();
+
+      return ret;
+    }
+
+    /* Replaces the metadata cached for an object as another gateway would */
+    int setCachedObject(cpp_redis::client* client, string name, const RGWD4NObjectMeta& meta) {
+      int ret = -1;
+      buffer::list bl;
+      encode(meta, bl);
+      string oid = cacheOid(name);
+
+      client->mset({{"rgw-object:" + oid + ":cache", bl.to_str()},
+                    {"rgw-object:" + oid + ":version", "test_version"}}, [&](cpp_redis::reply& reply) {
+        if (reply.is_string() && reply.as_string() == "OK") {
+          ret = 0;
+        }
+      });
+
+      client->sync_commit();
+
+      return ret;
+    }
+
+    /* Returns the cached values of the given attributes, or nothing if the
+     * object is not cached */
+    vector<string> getCachedAttrs(cpp_redis::client* client, string name, const vector<string>& fields) {
+      RGWD4NObjectMeta meta;
+      vector<string> values;
+
+      if (getCachedObject(client, name, &meta) == 0) {
+        for (const auto& field : fields) {
+          auto it = meta.attrs.find(field);
+          values.push_back(it != meta.attrs.end() ? it->second.to_str() : "");
+        }
+      }
+
+      return values;
+    }
 };
 
 /* General operation-related tests */
@@ -242,25 +347,14 @@ TEST_F(D4NFilterFixture, PutObject) {
   EXPECT_EQ(putObject("PutObject"), 0);
   EXPECT_NE(testWriter, nullptr);
 
-  client.hgetall("rgw-object:test_object_PutObject:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_PutObject", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)1);
 
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 2 + METADATA_LENGTH);
-    }
-  });
-
-  client.sync_commit();
+  vector<string> values = getCachedAttrs(&client, "test_object_PutObject", fields);
+  ASSERT_EQ(values.size(), fields.size());
 
-  client.hmget("rgw-object:test_object_PutObject:cache", fields, [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ(arr[0].as_string(), "test_attrs_value_PutObject");
-    }
-  });
-
-  client.sync_commit();
+  EXPECT_EQ(values[0], "test_attrs_value_PutObject");
 
   clientReset(&client);
 }
@@ -293,25 +387,14 @@ TEST_F(D4NFilterFixture, GetObject) {
   EXPECT_NE(testROp, nullptr);
   EXPECT_EQ(testROp->prepare(null_yield, dpp), 0);
 
-  client.hgetall("rgw-object:test_object_GetObject:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 2 + METADATA_LENGTH);
-    }
-  });
-
-  client.sync_commit();
-
-  client.hmget("rgw-object:test_object_GetObject:cache", fields, [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_GetObject", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)1);
 
-    if (!arr[0].is_null()) {
-      EXPECT_EQ(arr[0].as_string(), "test_attrs_value_GetObject");
-    }
-  });
+  vector<string> values = getCachedAttrs(&client, "test_object_GetObject", fields);
+  ASSERT_EQ(values.size(), fields.size());
 
-  client.sync_commit();
+  EXPECT_EQ(values[0], "test_attrs_value_GetObject");
 
   clientReset(&client);
 }
@@ -363,25 +446,14 @@ TEST_F(D4NFilterFixture, CopyObjectNone) {
 			      delete_at, NULL, &tag, &etag,
 			      NULL, NULL, dpp, null_yield), 0);
 
-  client.hgetall("rgw-object:test_object_CopyObjectNone:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 2 + METADATA_LENGTH);
-    }
-  });
-
-  client.sync_commit();
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_CopyObjectNone", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)1);
   
-  client.hmget("rgw-object:test_object_CopyObjectNone:cache", fields, [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ(arr[0].as_string(), "test_attrs_value_CopyObjectNone");
-    }
-  });
+  vector<string> values = getCachedAttrs(&client, "test_object_CopyObjectNone", fields);
+  ASSERT_EQ(values.size(), fields.size());
 
-  client.sync_commit();
+  EXPECT_EQ(values[0], "test_attrs_value_CopyObjectNone");
 }
 
 TEST_F(D4NFilterFixture, CopyObjectReplace) {
@@ -470,7 +542,7 @@ TEST_F(D4NFilterFixture, CopyObjectReplace) {
 
   /* Ensure the original object is still in the cache */
   vector<string> keys;
-  keys.push_back("rgw-object:test_object_CopyObjectReplace:cache");
+  keys.push_back("rgw-object:" + cacheOid("test_object_CopyObjectReplace") + ":cache");
 
   client.exists(keys, [](cpp_redis::reply& reply) {
     if (reply.is_integer()) {
@@ -481,27 +553,16 @@ TEST_F(D4NFilterFixture, CopyObjectReplace) {
   client.sync_commit();
 
   /* Check copy */
-  client.hgetall("rgw-object:test_object_copy:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 4 + METADATA_LENGTH); /* With etag */
-    }
-  });
-
-  client.sync_commit();
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_copy", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)2); /* With etag */
   
   fields.push_back("test_attrs_key_CopyObjectReplace");
   
-  client.hmget("rgw-object:test_object_copy:cache", fields, [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ(arr[0].as_string(), "test_attrs_copy_value");
-    }
-  });
+  vector<string> values = getCachedAttrs(&client, "test_object_copy", fields);
+  ASSERT_EQ(values.size(), fields.size());
 
-  client.sync_commit();
+  EXPECT_EQ(values[0], "test_attrs_copy_value");
 
   clientReset(&client);
 }
@@ -595,7 +656,7 @@ TEST_F(D4NFilterFixture, CopyObjectMerge) {
 
   /* Ensure the original object is still in the cache */
   vector<string> keys;
-  keys.push_back("rgw-object:test_object_CopyObjectMerge:cache");
+  keys.push_back("rgw-object:" + cacheOid("test_object_CopyObjectMerge") + ":cache");
 
   client.exists(keys, [](cpp_redis::reply& reply) {
     if (reply.is_integer()) {
@@ -606,29 +667,18 @@ TEST_F(D4NFilterFixture, CopyObjectMerge) {
   client.sync_commit();
 
   /* Check copy */
-  client.hgetall("rgw-object:test_object_copy:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 6 + METADATA_LENGTH); /* With etag */
-    }
-  });
-
-  client.sync_commit();
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_copy", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)3); /* With etag */
   
   fields.push_back("test_attrs_key_CopyObjectMerge");
   fields.push_back("test_attrs_copy_extra_key");
   
-  client.hmget("rgw-object:test_object_copy:cache", fields, [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
+  vector<string> values = getCachedAttrs(&client, "test_object_copy", fields);
+  ASSERT_EQ(values.size(), fields.size());
 
-    if (!arr[0].is_null()) {
-      EXPECT_EQ(arr[0].as_string(), "test_attrs_value_CopyObjectMerge");
-      EXPECT_EQ(arr[1].as_string(), "test_attrs_copy_extra_value");
-    }
-  });
-
-  client.sync_commit();
+  EXPECT_EQ(values[0], "test_attrs_value_CopyObjectMerge");
+  EXPECT_EQ(values[1], "test_attrs_copy_extra_value");
 
   clientReset(&client);
 }
@@ -636,7 +686,6 @@ TEST_F(D4NFilterFixture, CopyObjectMerge) {
 TEST_F(D4NFilterFixture, DelObject) {
   cpp_redis::client client;
   vector<string> keys;
-  keys.push_back("rgw-object:test_object_DelObject:cache");
   clientSetUp(&client); 
 
   ASSERT_EQ(createUser(), 0);
@@ -644,6 +693,8 @@ TEST_F(D4NFilterFixture, DelObject) {
    
   ASSERT_EQ(createBucket(), 0);
   ASSERT_NE(testBucket, nullptr);
+
+  keys.push_back("rgw-object:" + cacheOid("test_object_DelObject") + ":cache");
   
   ASSERT_EQ(putObject("DelObject"), 0);
   ASSERT_NE(testWriter, nullptr);
@@ -699,26 +750,15 @@ TEST_F(D4NFilterFixture, SetObjectAttrs) {
 
   EXPECT_EQ(testObject_SetObjectAttrs->set_obj_attrs(dpp, &test_attrs, NULL, null_yield), 0);
 
-  client.hgetall("rgw-object:test_object_SetObjectAttrs:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_SetObjectAttrs", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)2);
 
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 4 + METADATA_LENGTH);
-    }
-  });
+  vector<string> values = getCachedAttrs(&client, "test_object_SetObjectAttrs", fields);
+  ASSERT_EQ(values.size(), fields.size());
 
-  client.sync_commit();
-
-  client.hmget("rgw-object:test_object_SetObjectAttrs:cache", fields, [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ(arr[0].as_string(), "test_attrs_value_SetObjectAttrs");
-      EXPECT_EQ(arr[1].as_string(), "test_attrs_value_extra");
-    }
-  });
-
-  client.sync_commit();
+  EXPECT_EQ(values[0], "test_attrs_value_SetObjectAttrs");
+  EXPECT_EQ(values[1], "test_attrs_value_extra");
 
   clientReset(&client);
 }
@@ -749,26 +789,15 @@ TEST_F(D4NFilterFixture, GetObjectAttrs) {
 
   EXPECT_EQ(testObject_GetObjectAttrs->get_obj_attrs(null_yield, dpp, NULL), 0);
 
-  client.hgetall("rgw-object:test_object_GetObjectAttrs:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 4 + METADATA_LENGTH);
-    }
-  });
-
-  client.sync_commit();
-
-  client.hmget("rgw-object:test_object_GetObjectAttrs:cache", fields, [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_GetObjectAttrs", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)2);
 
-    if (!arr[0].is_null()) {
-      EXPECT_EQ(arr[0].as_string(), "test_attrs_value_GetObjectAttrs");
-      EXPECT_EQ(arr[1].as_string(), "test_attrs_value_extra");
-    }
-  });
+  vector<string> values = getCachedAttrs(&client, "test_object_GetObjectAttrs", fields);
+  ASSERT_EQ(values.size(), fields.size());
 
-  client.sync_commit();
+  EXPECT_EQ(values[0], "test_attrs_value_GetObjectAttrs");
+  EXPECT_EQ(values[1], "test_attrs_value_extra");
 
   clientReset(&client);
 }
@@ -795,36 +824,17 @@ TEST_F(D4NFilterFixture, DelObjectAttrs) {
   ASSERT_NE(nextObject->get_attrs().empty(), true);
 
   /* Check that the attributes exist before deletion */ 
-  client.hgetall("rgw-object:test_object_DelObjectAttrs:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 4 + METADATA_LENGTH);
-    }
-  });
-
-  client.sync_commit();
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_DelObjectAttrs", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)2);
 
   EXPECT_EQ(testObject_DelObjectAttrs->set_obj_attrs(dpp, NULL, &test_attrs, null_yield), 0);
 
   /* Check that the attribute does not exist after deletion */ 
-  client.hgetall("rgw-object:test_object_DelObjectAttrs:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 2 + METADATA_LENGTH);
-    }
-  });
-
-  client.sync_commit();
+  ASSERT_EQ(getCachedObject(&client, "test_object_DelObjectAttrs", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)1);
 
-  client.hexists("rgw-object:test_object_DelObjectAttrs:cache", "test_attrs_key_extra", [](cpp_redis::reply& reply) {
-    if (reply.is_integer()) {
-      EXPECT_EQ(reply.as_integer(), 0);
-    }
-  });
-
-  client.sync_commit();
+  EXPECT_EQ(meta.attrs.count("test_attrs_key_extra"), (size_t)0);
 
   clientReset(&client);
 }
@@ -855,29 +865,18 @@ TEST_F(D4NFilterFixture, SetLongObjectAttrs) {
 
   EXPECT_EQ(testObject_SetLongObjectAttrs->set_obj_attrs(dpp, &test_attrs_long, NULL, null_yield), 0);
 
-  client.hgetall("rgw-object:test_object_SetLongObjectAttrs:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 22 + METADATA_LENGTH);
-    }
-  });
-
-  client.sync_commit();
-
-  client.hmget("rgw-object:test_object_SetLongObjectAttrs:cache", fields, [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_SetLongObjectAttrs", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)11);
 
-    if (!arr[0].is_null()) {
-      EXPECT_EQ(arr[0].as_string(), "test_attrs_value_SetLongObjectAttrs");
+  vector<string> values = getCachedAttrs(&client, "test_object_SetLongObjectAttrs", fields);
+  ASSERT_EQ(values.size(), fields.size());
 
-      for (int i = 1; i < 11; ++i) {
-	EXPECT_EQ(arr[i].as_string(), "test_attrs_value_extra_" + to_string(i - 1));
-      }
-    }
-  });
+  EXPECT_EQ(values[0], "test_attrs_value_SetLongObjectAttrs");
 
-  client.sync_commit();
+  for (int i = 1; i < 11; ++i) {
+    EXPECT_EQ(values[i], "test_attrs_value_extra_" + to_string(i - 1));
+  }
 
   clientReset(&client);
 }
@@ -914,29 +913,18 @@ TEST_F(D4NFilterFixture, GetLongObjectAttrs) {
 
   EXPECT_EQ(testObject_GetLongObjectAttrs->get_obj_attrs(null_yield, dpp, NULL), 0);
 
-  client.hgetall("rgw-object:test_object_GetLongObjectAttrs:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 22 + METADATA_LENGTH);
-    }
-  });
-
-  client.sync_commit();
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_GetLongObjectAttrs", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)11);
 
-  client.hmget("rgw-object:test_object_GetLongObjectAttrs:cache", fields, [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
+  vector<string> values = getCachedAttrs(&client, "test_object_GetLongObjectAttrs", fields);
+  ASSERT_EQ(values.size(), fields.size());
 
-    if (!arr[0].is_null()) {
-      EXPECT_EQ(arr[0].as_string(), "test_attrs_value_GetLongObjectAttrs");
+  EXPECT_EQ(values[0], "test_attrs_value_GetLongObjectAttrs");
 
-      for (int i = 1; i < 11; ++i) {
-	EXPECT_EQ(arr[i].as_string(), "test_attrs_value_extra_" + to_string(i - 1));
-      }
-    }
-  });
-
-  client.sync_commit();
+  for (int i = 1; i < 11; ++i) {
+    EXPECT_EQ(values[i], "test_attrs_value_extra_" + to_string(i - 1));
+  }
 
   clientReset(&client);
 }
@@ -977,33 +965,22 @@ TEST_F(D4NFilterFixture, ModifyObjectAttr) {
 
   EXPECT_EQ(testObject_ModifyObjectAttr->modify_obj_attrs("test_attrs_key_extra_5", bl_tmp, null_yield, dpp), 0);
 
-  client.hgetall("rgw-object:test_object_ModifyObjectAttr:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 22 + METADATA_LENGTH);
-    }
-  });
-
-  client.sync_commit();
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_ModifyObjectAttr", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)11);
 
-  client.hmget("rgw-object:test_object_ModifyObjectAttr:cache", fields, [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
+  vector<string> values = getCachedAttrs(&client, "test_object_ModifyObjectAttr", fields);
+  ASSERT_EQ(values.size(), fields.size());
 
-    if (!arr[0].is_null()) {
-      EXPECT_EQ(arr[0].as_string(), "test_attrs_value_ModifyObjectAttr");
+  EXPECT_EQ(values[0], "test_attrs_value_ModifyObjectAttr");
 
-      for (int i = 1; i < 11; ++i) {
-	if (i == 6) {
-          EXPECT_EQ(arr[i].as_string(), "new_test_attrs_value_extra_" + to_string(i - 1));
-        } else {
-          EXPECT_EQ(arr[i].as_string(), "test_attrs_value_extra_" + to_string(i - 1));
-	}
-      }
+  for (int i = 1; i < 11; ++i) {
+    if (i == 6) {
+      EXPECT_EQ(values[i], "new_test_attrs_value_extra_" + to_string(i - 1));
+    } else {
+      EXPECT_EQ(values[i], "test_attrs_value_extra_" + to_string(i - 1));
     }
-  });
-
-  client.sync_commit();
+  }
 
   clientReset(&client);
 }
@@ -1039,32 +1016,19 @@ TEST_F(D4NFilterFixture, DelLongObjectAttrs) {
   ASSERT_NE(nextObject->get_attrs().empty(), true);
   
   /* Check that the attributes exist before deletion */
-  client.hgetall("rgw-object:test_object_DelLongObjectAttrs:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 22 + METADATA_LENGTH);
-    }
-  });
-
-  client.sync_commit();
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_DelLongObjectAttrs", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)11);
 
   EXPECT_EQ(testObject_DelLongObjectAttrs->set_obj_attrs(dpp, NULL, &test_attrs_long, null_yield), 0);
 
   /* Check that the attributes do not exist after deletion */
-  client.hgetall("rgw-object:test_object_DelLongObjectAttrs:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 2 + METADATA_LENGTH);
-
-      for (int i = 0; i < (int)arr.size(); ++i) {
-          EXPECT_EQ((int)arr[i].as_string().find("extra"), -1);
-      }
-    }
-  });
+  ASSERT_EQ(getCachedObject(&client, "test_object_DelLongObjectAttrs", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)1);
 
-  client.sync_commit();
+  for (const auto& attr : meta.attrs) {
+    EXPECT_EQ((int)attr.first.find("extra"), -1);
+  }
 
   clientReset(&client);
 }
@@ -1100,36 +1064,17 @@ TEST_F(D4NFilterFixture, DelObjectAttr) {
   ASSERT_NE(nextObject->get_attrs().empty(), true);
   
   /* Check that the attribute exists before deletion */
-  client.hgetall("rgw-object:test_object_DelObjectAttr:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 22 + METADATA_LENGTH);
-    }
-  });
-
-  client.sync_commit();
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_DelObjectAttr", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)11);
 
   EXPECT_EQ(testObject_DelObjectAttr->delete_obj_attrs(dpp, "test_attrs_key_extra_5", null_yield), 0);
 
   /* Check that the attribute does not exist after deletion */
-  client.hgetall("rgw-object:test_object_DelObjectAttr:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 20 + METADATA_LENGTH);
-    }
-  });
-
-  client.sync_commit();
+  ASSERT_EQ(getCachedObject(&client, "test_object_DelObjectAttr", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)10);
 
-  client.hexists("rgw-object:test_object_DelObjectAttr:cache", "test_attrs_key_extra_5", [](cpp_redis::reply& reply) {
-    if (reply.is_integer()) {
-      EXPECT_EQ(reply.as_integer(), 0);
-    }
-  });
-
-  client.sync_commit();
+  EXPECT_EQ(meta.attrs.count("test_attrs_key_extra_5"), (size_t)0);
 
   clientReset(&client);
 }
@@ -1187,25 +1132,14 @@ TEST_F(D4NFilterFixture, PrepareCopyObject) {
 			      delete_at, NULL, &tag, &etag,
 			      NULL, NULL, dpp, null_yield), 0);
 
-  client.hgetall("rgw-object:test_object_PrepareCopyObject:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 2 + METADATA_LENGTH);
-    }
-  });
-
-  client.sync_commit();
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_PrepareCopyObject", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)1);
   
-  client.hmget("rgw-object:test_object_PrepareCopyObject:cache", fields, [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
+  vector<string> values = getCachedAttrs(&client, "test_object_PrepareCopyObject", fields);
+  ASSERT_EQ(values.size(), fields.size());
 
-    if (!arr[0].is_null()) {
-      EXPECT_EQ(arr[0].as_string(), "test_attrs_value_PrepareCopyObject");
-    }
-  });
-
-  client.sync_commit();
+  EXPECT_EQ(values[0], "test_attrs_value_PrepareCopyObject");
   
   clientReset(&client);
 }
@@ -1247,26 +1181,15 @@ TEST_F(D4NFilterFixture, SetDelAttrs) {
   
   EXPECT_EQ(testObject_SetDelAttrs->set_obj_attrs(dpp, &test_attrs_new, &test_attrs_base, null_yield), 0);
 
-  client.hgetall("rgw-object:test_object_SetDelAttrs:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_SetDelAttrs", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)2);
 
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 4 + METADATA_LENGTH);
-    }
-  });
-
-  client.sync_commit();
-
-  client.hmget("rgw-object:test_object_SetDelAttrs:cache", fields, [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ(arr[0].as_string(), "test_attrs_value_SetDelAttrs");
-      EXPECT_EQ(arr[1].as_string(), "test_attrs_value_extra");
-    }
-  });
+  vector<string> values = getCachedAttrs(&client, "test_object_SetDelAttrs", fields);
+  ASSERT_EQ(values.size(), fields.size());
 
-  client.sync_commit();
+  EXPECT_EQ(values[0], "test_attrs_value_SetDelAttrs");
+  EXPECT_EQ(values[1], "test_attrs_value_extra");
 
   clientReset(&client);
 }
@@ -1308,32 +1231,21 @@ TEST_F(D4NFilterFixture, ModifyNonexistentAttr) {
 
   fields.push_back("test_attrs_key_extra_ModifyNonexistentAttr");
 
-  client.hgetall("rgw-object:test_object_ModifyNonexistentAttr:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 24 + METADATA_LENGTH);
-    }
-  });
-
-  client.sync_commit();
-
-  client.hmget("rgw-object:test_object_ModifyNonexistentAttr:cache", fields, [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_ModifyNonexistentAttr", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)12);
 
-    if (!arr[0].is_null()) {
-      EXPECT_EQ(arr[0].as_string(), "test_attrs_value_ModifyNonexistentAttr");
+  vector<string> values = getCachedAttrs(&client, "test_object_ModifyNonexistentAttr", fields);
+  ASSERT_EQ(values.size(), fields.size());
 
-      for (int i = 1; i < 11; ++i) {
-	EXPECT_EQ(arr[i].as_string(), "test_attrs_value_extra_" + to_string(i - 1));
-      }
+  EXPECT_EQ(values[0], "test_attrs_value_ModifyNonexistentAttr");
 
-      /* New attribute will be created and stored since it was not found in the existing attributes */
-      EXPECT_EQ(arr[11].as_string(), "new_test_attrs_value_extra_ModifyNonexistentAttr");
-    }
-  });
+  for (int i = 1; i < 11; ++i) {
+    EXPECT_EQ(values[i], "test_attrs_value_extra_" + to_string(i - 1));
+  }
 
-  client.sync_commit();
+  /* New attribute will be created and stored since it was not found in the existing attributes */
+  EXPECT_EQ(values[11], "new_test_attrs_value_extra_ModifyNonexistentAttr");
 
   clientReset(&client);
 }
@@ -1376,33 +1288,22 @@ TEST_F(D4NFilterFixture, ModifyGetAttrs) {
   ASSERT_EQ(nextObject->get_obj_attrs(null_yield, dpp, NULL), 0);
   EXPECT_EQ(testObject_ModifyGetAttrs->get_obj_attrs(null_yield, dpp, NULL), 0);
 
-  client.hgetall("rgw-object:test_object_ModifyGetAttrs:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 22 + METADATA_LENGTH);
-    }
-  });
-
-  client.sync_commit();
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_ModifyGetAttrs", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)11);
 
-  client.hmget("rgw-object:test_object_ModifyGetAttrs:cache", fields, [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
+  vector<string> values = getCachedAttrs(&client, "test_object_ModifyGetAttrs", fields);
+  ASSERT_EQ(values.size(), fields.size());
 
-    if (!arr[0].is_null()) {
-      EXPECT_EQ(arr[0].as_string(), "test_attrs_value_ModifyGetAttrs");
+  EXPECT_EQ(values[0], "test_attrs_value_ModifyGetAttrs");
 
-      for (int i = 1; i < 11; ++i) {
-	if (i == 6) {
-          EXPECT_EQ(arr[i].as_string(), "new_test_attrs_value_extra_5");
-        } else {
-          EXPECT_EQ(arr[i].as_string(), "test_attrs_value_extra_" + to_string(i - 1));
-	}
-      }
+  for (int i = 1; i < 11; ++i) {
+    if (i == 6) {
+      EXPECT_EQ(values[i], "new_test_attrs_value_extra_5");
+    } else {
+      EXPECT_EQ(values[i], "test_attrs_value_extra_" + to_string(i - 1));
     }
-  });
-
-  client.sync_commit();
+  }
 
   clientReset(&client);
 }
@@ -1440,29 +1341,18 @@ TEST_F(D4NFilterFixture, DelNonexistentAttr) {
   /* Attempt to delete an attribute that does not exist */
   ASSERT_EQ(testObject_DelNonexistentAttr->delete_obj_attrs(dpp, "test_attrs_key_extra_12", null_yield), 0);
 
-  client.hgetall("rgw-object:test_object_DelNonexistentAttr:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 22 + METADATA_LENGTH);
-    }
-  });
-
-  client.sync_commit();
-
-  client.hmget("rgw-object:test_object_DelNonexistentAttr:cache", fields, [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_DelNonexistentAttr", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)11);
 
-    if (!arr[0].is_null()) {
-      EXPECT_EQ(arr[0].as_string(), "test_attrs_value_DelNonexistentAttr");
+  vector<string> values = getCachedAttrs(&client, "test_object_DelNonexistentAttr", fields);
+  ASSERT_EQ(values.size(), fields.size());
 
-      for (int i = 1; i < 11; ++i) {
-	EXPECT_EQ(arr[i].as_string(), "test_attrs_value_extra_" + to_string(i - 1));
-      }
-    }
-  });
+  EXPECT_EQ(values[0], "test_attrs_value_DelNonexistentAttr");
 
-  client.sync_commit();
+  for (int i = 1; i < 11; ++i) {
+    EXPECT_EQ(values[i], "test_attrs_value_extra_" + to_string(i - 1));
+  }
 
   clientReset(&client);
 }
@@ -1502,15 +1392,9 @@ TEST_F(D4NFilterFixture, DelSetWithNonexisentAttr) {
   /* Attempt to delete a set of attrs, including one that does not exist */
   EXPECT_EQ(testObject_DelSetWithNonexistentAttr->set_obj_attrs(dpp, NULL, &test_attrs_base, null_yield), 0);
 
-  client.hgetall("rgw-object:test_object_DelSetWithNonexistentAttr:cache", [](cpp_redis::reply& reply) {
-    auto arr = reply.as_array();
-
-    if (!arr[0].is_null()) {
-      EXPECT_EQ((int)arr.size(), 2 + METADATA_LENGTH);
-    }
-  });
-
-  client.sync_commit();
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_DelSetWithNonexistentAttr", &meta), 0);
+  EXPECT_EQ(meta.attrs.size(), (size_t)1);
 
   clientReset(&client);
 }
@@ -1624,29 +1508,19 @@ TEST_F(D4NFilterFixture, StoreGetAttrs) {
   nextObject->get_obj_attrs(null_yield, dpp, NULL);
 
   /* Change an attribute through redis */
-  vector< pair<string, string> > value;
-  value.push_back(make_pair("test_attrs_key_extra_5", "new_test_attrs_value_extra_5"));
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_StoreGetAttrs", &meta), 0);
 
-  client.hmset("rgw-object:test_object_StoreGetAttrs:cache", value, [&](cpp_redis::reply& reply) {
-    if (!reply.is_null()) {
-      EXPECT_EQ(reply.as_string(), "OK");
-    }
-  });
+  buffer::list bl_new;
+  bl_new.append("new_test_attrs_value_extra_5");
+  meta.attrs["test_attrs_key_extra_5"] = bl_new;
 
-  client.sync_commit();
-
-  /* Artificially adding the data field so getObject will succeed 
-     for the purposes of this test                                */
-  value.clear();
-  value.push_back(make_pair("data", ""));
-
-  client.hmset("rgw-object:test_object_StoreGetAttrs:cache", value, [&](cpp_redis::reply& reply) {
-    if (!reply.is_null()) {
-      ASSERT_EQ(reply.as_string(), "OK");
-    }
-  });
+  /* Artificially adding the data fields so getObject will succeed 
+     for the purposes of this test                                 */
+  meta.data_size = 0;
+  meta.block_size = 4194304;
 
-  client.sync_commit();
+  ASSERT_EQ(setCachedObject(&client, "test_object_StoreGetAttrs", meta), 0);
 
   ASSERT_EQ(testObject_StoreGetAttrs->get_obj_attrs(null_yield, dpp, NULL), 0); /* Cache attributes */
 
@@ -1716,38 +1590,26 @@ TEST_F(D4NFilterFixture, StoreGetMetadata) {
   ASSERT_EQ(nextObject->get_obj_attrs(null_yield, dpp, NULL), 0);
 
   /* Change metadata values through redis */
-  vector< pair<string, string> > value;
-  value.push_back(make_pair("mtime", "2021-11-08T21:13:38.334696731Z"));
-  value.push_back(make_pair("object_size", "100"));
-  value.push_back(make_pair("accounted_size", "200"));
-  value.push_back(make_pair("epoch", "3")); /* version_id is not tested because the object does not have an instance */
-  value.push_back(make_pair("source_zone_short_id", "300"));
-  value.push_back(make_pair("bucket_count", "10"));
-  value.push_back(make_pair("bucket_size", "20"));
-  value.push_back(make_pair("user_quota.max_size", "0"));
-  value.push_back(make_pair("user_quota.max_objects", "0"));
-  value.push_back(make_pair("max_buckets", "2000"));
-
-  client.hmset("rgw-object:test_object_StoreGetMetadata:cache", value, [](cpp_redis::reply& reply) {
-    if (!reply.is_null()) {
-      EXPECT_EQ(reply.as_string(), "OK");
-    }
-  });
-
-  client.sync_commit();
-
-  /* Artificially adding the data field so getObject will succeed 
-     for the purposes of this test                                */
-  value.clear();
-  value.push_back(make_pair("data", ""));
-
-  client.hmset("rgw-object:test_object_StoreGetMetadata:cache", value, [](cpp_redis::reply& reply) {
-    if (!reply.is_null()) {
-      ASSERT_EQ(reply.as_string(), "OK");
-    }
-  });
-
-  client.sync_commit();
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_StoreGetMetadata", &meta), 0);
+
+  parse_time("2021-11-08T21:13:38.334696731Z", &meta.mtime);
+  meta.object_size = 100;
+  meta.accounted_size = 200;
+  meta.epoch = 3; /* version_id is not tested because the object does not have an instance */
+  meta.source_zone_short_id = 300;
+  meta.bucket_count = 10;
+  meta.bucket_size = 20;
+  meta.user_quota_max_size = 0;
+  meta.user_quota_max_objects = 0;
+  meta.max_buckets = 2000;
+
+  /* Artificially adding the data fields so getObject will succeed 
+     for the purposes of this test                                 */
+  meta.data_size = 0;
+  meta.block_size = 4194304;
+
+  ASSERT_EQ(setCachedObject(&client, "test_object_StoreGetMetadata", meta), 0);
 
   unique_ptr<rgw::sal::Object::ReadOp> testROp = testObject_StoreGetMetadata->get_read_op();
 
@@ -1917,7 +1779,7 @@ TEST_F(D4NFilterFixture, DataCheck) {
 		 &zones_trace, &canceled,
 		 null_yield), 0);
  
-  client.hget("rgw-object:test_object_DataCheck:cache", "data", [&data](cpp_redis::reply& reply) {
+  client.get("rgw-object:" + cacheOid("test_object_DataCheck") + ":block:0", [&data](cpp_redis::reply& reply) {
     if (reply.is_string()) {
       EXPECT_EQ(reply.as_string(), data.to_str());
     }
@@ -1942,7 +1804,7 @@ TEST_F(D4NFilterFixture, DataCheck) {
 		 &zones_trace, &canceled,
 		 null_yield), 0);
 
-  client.hget("rgw-object:test_object_DataCheck:cache", "data", [&dataNew](cpp_redis::reply& reply) {
+  client.get("rgw-object:" + cacheOid("test_object_DataCheck") + ":block:0", [&dataNew](cpp_redis::reply& reply) {
     if (reply.is_string()) {
       EXPECT_EQ(reply.as_string(), dataNew.to_str());
     }
@@ -1953,6 +1815,216 @@ TEST_F(D4NFilterFixture, DataCheck) {
   clientReset(&client);
 }
 
+/* Collects the data returned by iterate */
+class DataCollectorCB : public RGWGetDataCB {
+  public:
+    buffer::list collected;
+
+    int handle_data(bufferlist& bl, off_t bl_ofs, off_t bl_len) override {
+      buffer::list part;
+      part.substr_of(bl, bl_ofs, bl_len);
+      collected.append(part);
+      return 0;
+    }
+};
+
+/* SAL object data is read back from the cache */
+TEST_F(D4NFilterFixture, DataIterate) {
+  cpp_redis::client client;
+  clientSetUp(&client); 
+
+  createUser();
+  createBucket();
+  
+  unique_ptr<rgw::sal::Object> obj = testBucket->get_object(rgw_obj_key("test_object_DataIterate"));
+  rgw_user owner;
+  rgw_placement_rule ptail_placement_rule;
+  uint64_t olh_epoch = 123;
+  string unique_tag;
+
+  obj->get_obj_attrs(null_yield, dpp);
+
+  testWriter = driver->get_atomic_writer(dpp, 
+	    null_yield,
+	    obj.get(),
+	    owner,
+	    &ptail_placement_rule,
+	    olh_epoch,
+	    unique_tag);
+
+  size_t accounted_size = 9;
+  string etag("test_etag");
+  ceph::real_time mtime; 
+  ceph::real_time set_mtime;
+
+  buffer::list bl;
+  bl.append("test_attrs_value_DataIterate");
+  map<string, bufferlist> attrs{{"test_attrs_key_DataIterate", bl}};
+  buffer::list data;
+  data.append("test data");
+
+  ceph::real_time delete_at;
+  char if_match;
+  char if_nomatch;
+  string user_data;
+  rgw_zone_set zones_trace;
+  bool canceled;
+
+  ASSERT_EQ(testWriter->prepare(null_yield), 0);
+  ASSERT_EQ(testWriter->process(move(data), 0), 0);
+  ASSERT_EQ(testWriter->complete(accounted_size, etag,
+		 &mtime, set_mtime,
+		 attrs,
+		 delete_at,
+		 &if_match, &if_nomatch,
+		 &user_data,
+		 &zones_trace, &canceled,
+		 null_yield), 0);
+
+  /* Replace the cached block so a hit can be told apart from a backend read */
+  client.set("rgw-object:" + cacheOid("test_object_DataIterate") + ":block:0", "TEST DATA", [](cpp_redis::reply& reply) {
+    EXPECT_EQ(reply.as_string(), "OK");
+  });
+  client.sync_commit();
+
+  unique_ptr<rgw::sal::Object> readObj = testBucket->get_object(rgw_obj_key("test_object_DataIterate"));
+  unique_ptr<rgw::sal::Object::ReadOp> testROp = readObj->get_read_op();
+
+  ASSERT_EQ(testROp->prepare(null_yield, dpp), 0);
+  ASSERT_EQ(readObj->get_obj_size(), (uint64_t)9);
+
+  DataCollectorCB cb;
+  ASSERT_EQ(testROp->iterate(dpp, 2, 6, &cb, null_yield), 0);
+  EXPECT_EQ(cb.collected.to_str(), "ST DA");
+
+  clientReset(&client);
+}
+
+/* Objects another gateway may have changed while notices were missed keep
+ * their blocks only if their metadata is found unchanged */
+TEST_F(D4NFilterFixture, InvalidateAll) {
+  cpp_redis::client client;
+  clientSetUp(&client);
+
+  createUser();
+  createBucket();
+
+  buffer::list data;
+  data.append("test data");
+
+  ASSERT_EQ(writeObject("test_object_InvalidateAll_a", data), 0);
+  ASSERT_EQ(writeObject("test_object_InvalidateAll_b", data), 0);
+
+  auto filter = dynamic_cast<rgw::sal::D4NFilterDriver*>(driver);
+  ASSERT_TRUE(filter->get_policy()->contains(cacheOid("test_object_InvalidateAll_a"), 0));
+  ASSERT_TRUE(filter->get_policy()->contains(cacheOid("test_object_InvalidateAll_b"), 0));
+
+  /* Another gateway replaces the metadata of b */
+  RGWD4NObjectMeta meta;
+  ASSERT_EQ(getCachedObject(&client, "test_object_InvalidateAll_b", &meta), 0);
+  ASSERT_EQ(setCachedObject(&client, "test_object_InvalidateAll_b", meta), 0);
+
+  filter->invalidate("");
+
+  EXPECT_TRUE(filter->get_policy()->contains(cacheOid("test_object_InvalidateAll_a"), 0));
+  EXPECT_FALSE(filter->get_policy()->contains(cacheOid("test_object_InvalidateAll_b"), 0));
+
+  clientReset(&client);
+}
+
+/* Compression tests */
+class D4NCompressionFixture : public D4NFilterFixture {
+  protected:
+    void SetUp() override {
+      D4NFilterFixture::SetUp();
+
+      if (!Compressor::create(get_pointer(env->cct), "zlib")) {
+        GTEST_SKIP() << "zlib compressor plugin not found; set CEPH_LIB";
+      }
+    }
+
+    buffer::list readObject(string name) {
+      unique_ptr<rgw::sal::Object> obj = testBucket->get_object(rgw_obj_key(name));
+      unique_ptr<rgw::sal::Object::ReadOp> op = obj->get_read_op();
+      DataCollectorCB cb;
+
+      EXPECT_EQ(op->prepare(null_yield, dpp), 0);
+      EXPECT_EQ(op->iterate(dpp, 0, obj->get_obj_size() - 1, &cb, null_yield), 0);
+
+      return cb.collected;
+    }
+
+    bool exists(cpp_redis::client* client, string key) {
+      bool found = false;
+
+      client->exists({key}, [&found](cpp_redis::reply& reply) {
+        found = reply.is_integer() && reply.as_integer() == 1;
+      });
+      client->sync_commit();
+
+      return found;
+    }
+
+    static buffer::list randomData(uint64_t size) {
+      std::mt19937_64 rng(size);
+      string s(size, 0);
+
+      for (auto& c : s) {
+        c = rng();
+      }
+
+      buffer::list bl;
+      bl.append(s);
+      return bl;
+    }
+};
+
+TEST_F(D4NCompressionFixture, CompressedBlock) {
+  cpp_redis::client client;
+  clientSetUp(&client);
+
+  createUser();
+  createBucket();
+
+  buffer::list data;
+  data.append(string(64 * 1024, 'a'));
+
+  ASSERT_EQ(writeObject("test_object_CompressedBlock", data), 0);
+
+  EXPECT_TRUE(exists(&client, "rgw-object:" + cacheOid("test_object_CompressedBlock") + ":zblock:0"));
+  EXPECT_FALSE(exists(&client, "rgw-object:" + cacheOid("test_object_CompressedBlock") + ":block:0"));
+
+  /* The block is read back as it was written */
+  EXPECT_EQ(readObject("test_object_CompressedBlock").to_str(), data.to_str());
+
+  clientReset(&client);
+}
+
+/* Data RGW compressed or encrypted doesn't compress well either, and the
+ * blocks after the first one that doesn't aren't tried */
+TEST_F(D4NCompressionFixture, IncompressibleBlocks) {
+  cpp_redis::client client;
+  clientSetUp(&client);
+
+  createUser();
+  createBucket();
+
+  uint64_t block_size = get_pointer(env->cct)->_conf->rgw_max_chunk_size;
+  buffer::list data = randomData(block_size);
+  data.append(string(block_size, 'a'));
+
+  ASSERT_EQ(writeObject("test_object_IncompressibleBlocks", data), 0);
+
+  EXPECT_TRUE(exists(&client, "rgw-object:" + cacheOid("test_object_IncompressibleBlocks") + ":block:0"));
+  EXPECT_FALSE(exists(&client, "rgw-object:" + cacheOid("test_object_IncompressibleBlocks") + ":zblock:0"));
+  EXPECT_TRUE(exists(&client, "rgw-object:" + cacheOid("test_object_IncompressibleBlocks") + ":block:" + to_string(block_size)));
+  EXPECT_FALSE(exists(&client, "rgw-object:" + cacheOid("test_object_IncompressibleBlocks") + ":zblock:" + to_string(block_size)));
+
+  EXPECT_EQ(readObject("test_object_IncompressibleBlocks").to_str(), data.to_str());
+
+  clientReset(&client);
+}
+
 int main(int argc, char *argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
 
@@ -0,0 +1,87 @@
+#include "d4n_perf_counters.h"
+#include "common/perf_counters.h"
+#include "common/perf_counters_collection.h"
+#include "common/ceph_context.h"
+#include "global/global_context.h"
+#include "gtest/gtest.h"
+#include <set>
+
+using namespace std;
+
+/* Paths of the rgw_d4n counters registered with the context */
+static set<string> registered() {
+  set<string> paths;
+
+  g_ceph_context->get_perfcounters_collection()->with_counters(
+    [&] (const PerfCountersCollectionImpl::CounterMap& by_path) {
+      for (const auto& [path, ref] : by_path) {
+        if (path.rfind("rgw_d4n.", 0) == 0) {
+          paths.insert(path);
+        }
+      }
+    });
+
+  return paths;
+}
+
+TEST(D4NPerfCounters, StartStop) {
+  ASSERT_EQ(d4n_perfcounter, nullptr);
+  EXPECT_TRUE(registered().empty());
+
+  ASSERT_EQ(d4n_perf_start(g_ceph_context), 0);
+  ASSERT_NE(d4n_perfcounter, nullptr);
+
+  /* Every index of the set has a counter */
+  set<string> paths = registered();
+  EXPECT_EQ(paths.size(), (size_t)(l_d4n_last - l_d4n_first - 1));
+
+  for (const auto& path : {"rgw_d4n.meta_l1_hit", "rgw_d4n.block_hit", "rgw_d4n.evict_b",
+			   "rgw_d4n.wb_flush", "rgw_d4n.redis_lat", "rgw_d4n.redis_lat_histogram"}) {
+    EXPECT_EQ(paths.count(path), (size_t)1) << path;
+  }
+
+  d4n_perf_stop(g_ceph_context);
+  EXPECT_EQ(d4n_perfcounter, nullptr);
+  EXPECT_TRUE(registered().empty());
+}
+
+/* The counters are meant for sizing the cache, so all of them are exported */
+TEST(D4NPerfCounters, Priority) {
+  ASSERT_EQ(d4n_perf_start(g_ceph_context), 0);
+
+  g_ceph_context->get_perfcounters_collection()->with_counters(
+    [&] (const PerfCountersCollectionImpl::CounterMap& by_path) {
+      for (const auto& [path, ref] : by_path) {
+        if (path.rfind("rgw_d4n.", 0) == 0) {
+          EXPECT_GE(ref.perf_counters->get_adjusted_priority(ref.data->prio),
+		    PerfCountersBuilder::PRIO_USEFUL) << path;
+        }
+      }
+    });
+
+  d4n_perf_stop(g_ceph_context);
+}
+
+TEST(D4NPerfCounters, Count) {
+  ASSERT_EQ(d4n_perf_start(g_ceph_context), 0);
+
+  d4n_perfcounter->inc(l_d4n_block_hit);
+  d4n_perfcounter->inc(l_d4n_block_hit);
+  d4n_perfcounter->inc(l_d4n_cache_out_b, 4096);
+  EXPECT_EQ(d4n_perfcounter->get(l_d4n_block_hit), (uint64_t)2);
+  EXPECT_EQ(d4n_perfcounter->get(l_d4n_cache_out_b), (uint64_t)4096);
+  EXPECT_EQ(d4n_perfcounter->get(l_d4n_block_miss), (uint64_t)0);
+
+  d4n_perfcounter->tinc(l_d4n_redis_lat, std::chrono::milliseconds(2));
+  d4n_perfcounter->tinc(l_d4n_redis_lat, std::chrono::milliseconds(4));
+  auto [count, sum] = d4n_perfcounter->get_tavg_ns(l_d4n_redis_lat);
+  EXPECT_EQ(count, (uint64_t)2);
+  EXPECT_EQ(sum, (uint64_t)6000000);
+
+  /* A new set starts from zero */
+  d4n_perf_stop(g_ceph_context);
+  ASSERT_EQ(d4n_perf_start(g_ceph_context), 0);
+  EXPECT_EQ(d4n_perfcounter->get(l_d4n_block_hit), (uint64_t)0);
+
+  d4n_perf_stop(g_ceph_context);
+}
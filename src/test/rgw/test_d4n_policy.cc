@@ -0,0 +1,253 @@
+#include "d4n_policy.h"
+#include "d4n_admission.h"
+#include "d4n_prefetch.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+
+using namespace std;
+
+static RGWD4NPolicy::Block block(const string& oid, uint64_t offset, uint64_t size) {
+  RGWD4NPolicy::Block b;
+  b.bucket_name = "testBucket";
+  b.oid = oid;
+  b.offset = offset;
+  b.size = size;
+  return b;
+}
+
+static vector<uint64_t> offsets(const vector<RGWD4NPolicy::Block>& blocks) {
+  vector<uint64_t> result;
+
+  for (const auto& b : blocks) {
+    result.push_back(b.offset);
+  }
+
+  return result;
+}
+
+TEST(D4NPolicy, LRUEvictsLeastRecentlyRead) {
+  auto policy = RGWD4NPolicy::create("lru", 30);
+  vector<RGWD4NPolicy::Block> victims;
+
+  policy->insert(block("obj", 0, 10), 0, &victims);
+  policy->insert(block("obj", 10, 10), 0, &victims);
+  policy->insert(block("obj", 20, 10), 0, &victims);
+  EXPECT_TRUE(victims.empty());
+  EXPECT_EQ(policy->get_size(), (uint64_t)30);
+
+  policy->access("obj", 0);
+  policy->insert(block("obj", 30, 10), 0, &victims);
+
+  EXPECT_EQ(offsets(victims), vector<uint64_t>({10}));
+  EXPECT_EQ(policy->get_size(), (uint64_t)30);
+}
+
+TEST(D4NPolicy, LFUEvictsLeastFrequentlyRead) {
+  auto policy = RGWD4NPolicy::create("lfu", 30);
+  vector<RGWD4NPolicy::Block> victims;
+
+  policy->insert(block("obj", 0, 10), 0, &victims);
+  policy->insert(block("obj", 10, 10), 0, &victims);
+  policy->insert(block("obj", 20, 10), 0, &victims);
+
+  policy->access("obj", 0);
+  policy->access("obj", 0);
+  policy->access("obj", 10);
+  policy->access("obj", 20);
+  policy->access("obj", 20);
+
+  /* The new block has been read least often */
+  policy->insert(block("obj", 30, 10), 0, &victims);
+  EXPECT_EQ(offsets(victims), vector<uint64_t>({30}));
+}
+
+TEST(D4NPolicy, GDSFPrefersSmallExpensiveBlocks) {
+  auto policy = RGWD4NPolicy::create("gdsf", 100);
+  vector<RGWD4NPolicy::Block> victims;
+
+  policy->insert(block("cheap", 0, 40), 10, &victims);
+  policy->insert(block("costly", 0, 40), 1000, &victims);
+  policy->insert(block("small", 0, 10), 10, &victims);
+  EXPECT_TRUE(victims.empty());
+
+  policy->insert(block("new", 0, 20), 100, &victims);
+  ASSERT_EQ(victims.size(), (size_t)1);
+  EXPECT_EQ(victims[0].oid, "cheap");
+}
+
+TEST(D4NPolicy, EraseObject) {
+  auto policy = RGWD4NPolicy::create("lru", 100);
+  vector<RGWD4NPolicy::Block> victims;
+
+  policy->insert(block("a", 0, 10), 0, &victims);
+  policy->insert(block("a", 10, 10), 0, &victims);
+  policy->insert(block("b", 0, 10), 0, &victims);
+
+  vector<RGWD4NPolicy::Block> erased;
+  policy->erase_object("a", &erased);
+  EXPECT_EQ(policy->get_size(), (uint64_t)10);
+  EXPECT_EQ(offsets(erased), (vector<uint64_t>{0, 10}));
+
+  /* Replacing a block doesn't count it twice */
+  policy->insert(block("b", 0, 20), 0, &victims);
+  EXPECT_EQ(policy->get_size(), (uint64_t)20);
+
+  policy->erase("b", 0);
+  EXPECT_EQ(policy->get_size(), (uint64_t)0);
+  EXPECT_TRUE(victims.empty());
+}
+
+TEST(D4NPolicy, Clear) {
+  auto policy = RGWD4NPolicy::create("lru", 100);
+  vector<RGWD4NPolicy::Block> victims;
+
+  policy->insert(block("a", 0, 10), 0, &victims);
+  policy->insert(block("b", 0, 10), 0, &victims);
+
+  vector<RGWD4NPolicy::Block> erased;
+  policy->clear(&erased);
+  EXPECT_EQ(erased.size(), 2u);
+  EXPECT_EQ(policy->get_size(), (uint64_t)0);
+  EXPECT_FALSE(policy->contains("a", 0));
+
+  /* Blocks cached afterwards are tracked as before */
+  policy->insert(block("a", 0, 10), 0, &victims);
+  EXPECT_EQ(policy->get_size(), (uint64_t)10);
+}
+
+TEST(D4NPolicy, ListObjects) {
+  auto policy = RGWD4NPolicy::create("lru", 100);
+  vector<RGWD4NPolicy::Block> victims;
+
+  policy->insert(block("a", 0, 10), 0, &victims);
+  policy->insert(block("a", 10, 10), 0, &victims);
+  policy->insert(block("b", 0, 10), 0, &victims);
+
+  vector<string> oids;
+  policy->list_objects(&oids);
+  sort(oids.begin(), oids.end());
+  EXPECT_EQ(oids, vector<string>({"a", "b"}));
+
+  oids.clear();
+  policy->erase("b");
+  policy->list_objects(&oids);
+  EXPECT_EQ(oids, vector<string>({"a"}));
+}
+
+TEST(D4NPolicy, PeekVictim) {
+  auto policy = RGWD4NPolicy::create("lru", 20);
+  vector<RGWD4NPolicy::Block> victims;
+  RGWD4NPolicy::Block victim;
+
+  policy->insert(block("obj", 0, 10), 0, &victims);
+  EXPECT_FALSE(policy->peek_victim(10, &victim));
+
+  policy->insert(block("obj", 10, 10), 0, &victims);
+  ASSERT_TRUE(policy->peek_victim(10, &victim));
+  EXPECT_EQ(victim.offset, (uint64_t)0);
+
+  /* Peeking doesn't evict anything */
+  EXPECT_EQ(policy->get_size(), (uint64_t)20);
+}
+
+TEST(D4NPolicy, Contains) {
+  auto policy = RGWD4NPolicy::create("lru", 30);
+  vector<RGWD4NPolicy::Block> victims;
+
+  policy->insert(block("obj", 0, 10), 0, &victims);
+  EXPECT_TRUE(policy->contains("obj", 0));
+  EXPECT_FALSE(policy->contains("obj", 10));
+
+  policy->erase("obj", 0);
+  EXPECT_FALSE(policy->contains("obj", 0));
+}
+
+TEST(D4NFrequencySketch, Estimate) {
+  RGWD4NFrequencySketch sketch(1024, 100000);
+
+  for (int i = 0; i < 5; ++i) {
+    sketch.increment("hot");
+  }
+  sketch.increment("cold");
+
+  EXPECT_GE(sketch.estimate("hot"), 5u);
+  EXPECT_GE(sketch.estimate("cold"), 1u);
+  EXPECT_LT(sketch.estimate("cold"), sketch.estimate("hot"));
+
+  /* Counters saturate */
+  for (int i = 0; i < 100; ++i) {
+    sketch.increment("hot");
+  }
+  EXPECT_EQ(sketch.estimate("hot"), 15u);
+}
+
+TEST(D4NFrequencySketch, Aging) {
+  RGWD4NFrequencySketch sketch(1024, 64);
+
+  for (int i = 0; i < 8; ++i) {
+    sketch.increment("old");
+  }
+
+  /* Enough other requests to halve the counters */
+  for (int i = 0; i < 64; ++i) {
+    sketch.increment("key" + to_string(i));
+  }
+
+  EXPECT_LE(sketch.estimate("old"), 4u);
+}
+
+TEST(D4NAccessTracker, SequentialStream) {
+  RGWD4NAccessTracker tracker(16, 2, 4);
+  uint64_t ofs = 0, end = 0;
+
+  EXPECT_FALSE(tracker.record("obj", 0, 9, 100, 10, &ofs, &end));
+
+  /* The second sequential read starts the prefetch */
+  ASSERT_TRUE(tracker.record("obj", 10, 19, 100, 10, &ofs, &end));
+  EXPECT_EQ(ofs, 20u);
+  EXPECT_EQ(end, 59u);
+
+  /* More than half of the prefetched blocks are still ahead */
+  EXPECT_FALSE(tracker.record("obj", 20, 29, 100, 10, &ofs, &end));
+  EXPECT_FALSE(tracker.record("obj", 30, 39, 100, 10, &ofs, &end));
+
+  /* Only blocks not yet prefetched are requested */
+  ASSERT_TRUE(tracker.record("obj", 40, 49, 100, 10, &ofs, &end));
+  EXPECT_EQ(ofs, 60u);
+  EXPECT_EQ(end, 89u);
+}
+
+TEST(D4NAccessTracker, RandomReads) {
+  RGWD4NAccessTracker tracker(16, 2, 4);
+  uint64_t ofs = 0, end = 0;
+
+  EXPECT_FALSE(tracker.record("obj", 50, 59, 100, 10, &ofs, &end));
+  EXPECT_FALSE(tracker.record("obj", 0, 9, 100, 10, &ofs, &end));
+  EXPECT_FALSE(tracker.record("obj", 80, 89, 100, 10, &ofs, &end));
+  EXPECT_FALSE(tracker.record("obj", 30, 39, 100, 10, &ofs, &end));
+}
+
+TEST(D4NAccessTracker, EndOfObject) {
+  RGWD4NAccessTracker tracker(16, 2, 4);
+  uint64_t ofs = 0, end = 0;
+
+  EXPECT_FALSE(tracker.record("obj", 0, 9, 25, 10, &ofs, &end));
+  ASSERT_TRUE(tracker.record("obj", 10, 19, 25, 10, &ofs, &end));
+  EXPECT_EQ(ofs, 20u);
+  EXPECT_EQ(end, 24u);
+
+  EXPECT_FALSE(tracker.record("obj", 20, 24, 25, 10, &ofs, &end));
+}
+
+TEST(D4NAccessTracker, ForgetsStreams) {
+  RGWD4NAccessTracker tracker(1, 2, 4);
+  uint64_t ofs = 0, end = 0;
+
+  /* Following a second object drops the first */
+  EXPECT_FALSE(tracker.record("obj1", 0, 9, 100, 10, &ofs, &end));
+  EXPECT_FALSE(tracker.record("obj2", 0, 9, 100, 10, &ofs, &end));
+  EXPECT_FALSE(tracker.record("obj1", 10, 19, 100, 10, &ofs, &end));
+
+  tracker.forget("obj1");
+  EXPECT_FALSE(tracker.record("obj1", 20, 29, 100, 10, &ofs, &end));
+}
@@ -0,0 +1,457 @@
+#include "gtest/gtest.h"
+#include "common/ceph_context.h"
+#include <iostream>
+#include <string>
+#include "rgw_process_env.h"
+#include <cpp_redis/cpp_redis>
+#include "driver/dbstore/common/dbstore.h"
+#include "rgw_sal_store.h"
+#include "driver/d4n/rgw_sal_d4n.h"
+
+#include "rgw_sal.h"
+#include "rgw_auth.h"
+#include "rgw_auth_registry.h"
+
+#define dout_subsys ceph_subsys_rgw
+
+using namespace std;
+
+string portStr;
+string hostStr;
+
+vector<const char*> args;
+class Environment* env;
+const DoutPrefixProvider* dpp;
+
+class Environment : public ::testing::Environment {
+  public:
+    Environment() {}
+
+    virtual ~Environment() {}
+
+    void SetUp() override {
+      /* Ensure redis instance is running */
+      try {
+        env_client.connect(hostStr, stoi(portStr), nullptr, 0, 5, 1000);
+      } catch (std::exception &e) {
+        std::cerr << "[          ] ERROR: Redis instance not running." << std::endl;
+      }
+
+      ASSERT_EQ((bool)env_client.is_connected(), (bool)1);
+
+      cct = global_init(nullptr, args, CEPH_ENTITY_TYPE_CLIENT,
+		        CODE_ENVIRONMENT_UTILITY,
+			CINIT_FLAG_NO_MON_CONFIG);
+
+      /* Objects are only written back when a test flushes them */
+      cct->_conf.set_val_or_die("rgw_d4n_write_back", "true");
+      cct->_conf.set_val_or_die("rgw_d4n_write_back_interval_ms", "3600000");
+      cct->_conf.set_val_or_die("rgw_d4n_meta_cache_ttl_ms", "0");
+
+      dpp = new DoutPrefix(cct->get(), dout_subsys, "d4n write-back test: ");
+      DriverManager::Config cfg;
+
+      cfg.store_name = "dbstore";
+      cfg.filter_name = "d4n";
+
+      driver = DriverManager::get_storage(dpp, dpp->get_cct(),
+              cfg,
+              false,
+              false,
+              false,
+              false,
+              false,
+              false, null_yield,
+	      false);
+
+      ASSERT_NE(driver, nullptr);
+    }
+
+    void TearDown() override {
+      if (env_client.is_connected()) {
+        delete driver;
+        delete dpp;
+
+	env_client.disconnect();
+      }
+    }
+
+    boost::intrusive_ptr<CephContext> cct;
+    rgw::sal::Driver* driver;
+    cpp_redis::client env_client;
+};
+
+/* Collects the data returned by iterate */
+class DataCollectorCB : public RGWGetDataCB {
+  public:
+    buffer::list collected;
+
+    int handle_data(bufferlist& bl, off_t bl_ofs, off_t bl_len) override {
+      buffer::list part;
+      part.substr_of(bl, bl_ofs, bl_len);
+      collected.append(part);
+      return 0;
+    }
+};
+
+class D4NWriteBackFixture : public ::testing::Test {
+  protected:
+    rgw::sal::Driver* driver;
+    rgw::sal::D4NFilterDriver* filter;
+    unique_ptr<rgw::sal::User> testUser = nullptr;
+    unique_ptr<rgw::sal::Bucket> testBucket = nullptr;
+    cpp_redis::client client;
+
+  public:
+    void SetUp() override {
+      driver = env->driver;
+      filter = dynamic_cast<rgw::sal::D4NFilterDriver*>(driver);
+      ASSERT_NE(filter, nullptr);
+      ASSERT_NE(filter->get_cleaner(), nullptr);
+
+      client.connect(hostStr, stoi(portStr), nullptr, 0, 5, 1000);
+      ASSERT_EQ((bool)client.is_connected(), (bool)1);
+
+      client.flushdb([](cpp_redis::reply& reply) {});
+      client.sync_commit();
+
+      ASSERT_EQ(createUser(), 0);
+      ASSERT_EQ(createBucket(), 0);
+    }
+
+    void TearDown() override {
+      client.flushdb([](cpp_redis::reply& reply) {});
+      client.sync_commit();
+      client.disconnect();
+    }
+
+    int createUser() {
+      rgw_user u("test_tenant", "test_user", "ns");
+
+      testUser = driver->get_user(u);
+      testUser->get_info().user_id = u;
+
+      return testUser->store_user(dpp, null_yield, false);
+    }
+
+    int createBucket() {
+      rgw_bucket b;
+      rgw_placement_rule placement_rule;
+      string swift_ver_location;
+      const RGWAccessControlPolicy policy;
+      rgw::sal::Attrs attrs;
+      RGWBucketInfo info;
+      obj_version ep_objv;
+      bool bucket_exists;
+
+      CephContext* cct = get_pointer(env->cct);
+      RGWProcessEnv penv;
+      RGWEnv rgw_env;
+      req_state s(cct->get(), penv, &rgw_env, 0);
+      req_info _req_info = s.info;
+
+      b.name = "test_bucket_wb";
+      placement_rule.storage_class = "test_sc";
+
+      return testUser->create_bucket(dpp, b, "test_id", placement_rule, swift_ver_location,
+				     nullptr, policy, attrs, info, ep_objv, false, false,
+				     &bucket_exists, _req_info, &testBucket, null_yield);
+    }
+
+    int writeObject(string name, buffer::list data, const char* if_match = nullptr,
+		    const char* if_nomatch = nullptr) {
+      unique_ptr<rgw::sal::Object> obj = testBucket->get_object(rgw_obj_key(name));
+      rgw_user owner;
+      rgw_placement_rule ptail_placement_rule;
+      string unique_tag;
+
+      unique_ptr<rgw::sal::Writer> writer = driver->get_atomic_writer(dpp, null_yield, obj.get(), owner,
+								      &ptail_placement_rule, 0, unique_tag);
+
+      uint64_t size = data.length();
+      ceph::real_time mtime;
+      buffer::list bl;
+      bl.append("test_attrs_value_" + name);
+      map<string, bufferlist> attrs{{"test_attrs_key_" + name, bl}};
+      string user_data;
+      rgw_zone_set zones_trace;
+      bool canceled;
+
+      int ret = writer->prepare(null_yield);
+
+      if (ret == 0) {
+        ret = writer->process(move(data), 0);
+      }
+
+      if (ret == 0) {
+        ret = writer->process({}, size);
+      }
+
+      if (ret == 0) {
+        ret = writer->complete(size, "test_etag", &mtime, ceph::real_time(), attrs,
+			       ceph::real_time(), if_match, if_nomatch, &user_data,
+			       &zones_trace, &canceled, null_yield);
+      }
+
+      return ret;
+    }
+
+    /* Reads bytes ofs to end of the object through the filter */
+    int readObject(string name, int64_t ofs, int64_t end, buffer::list* data) {
+      unique_ptr<rgw::sal::Object> obj = testBucket->get_object(rgw_obj_key(name));
+      unique_ptr<rgw::sal::Object::ReadOp> op = obj->get_read_op();
+      DataCollectorCB cb;
+
+      int ret = op->prepare(null_yield, dpp);
+
+      if (ret == 0) {
+        ret = op->iterate(dpp, ofs, end, &cb, null_yield);
+      }
+
+      *data = std::move(cb.collected);
+      return ret;
+    }
+
+    /* Whether the object is in the backing store */
+    bool written_back(string name) {
+      unique_ptr<rgw::sal::Bucket> bucket;
+
+      if (filter->get_next()->get_bucket(dpp, nullptr, testBucket->get_key(), &bucket, null_yield) < 0) {
+        return false;
+      }
+
+      unique_ptr<rgw::sal::Object> obj = bucket->get_object(rgw_obj_key(name));
+      return obj->get_obj_attrs(null_yield, dpp) == 0;
+    }
+
+    /* Key the cache holds the named object of the test bucket under */
+    string cacheOid(string name) {
+      unique_ptr<rgw::sal::Object> obj = testBucket->get_object(rgw_obj_key(name));
+      return rgw::sal::D4NFilterDriver::cache_oid(obj.get());
+    }
+
+    bool dirty(string name) {
+      RGWD4NObjectMeta meta;
+      bool found = false;
+
+      client.get("rgw-object:" + cacheOid(name) + ":cache", [&](cpp_redis::reply& reply) {
+        if (reply.is_string()) {
+          buffer::list bl;
+          bl.append(reply.as_string());
+          auto iter = bl.cbegin();
+          decode(meta, iter);
+          found = true;
+        }
+      });
+      client.sync_commit();
+
+      return found && meta.dirty_gen != 0;
+    }
+};
+
+/* An acknowledged object is read back from the cache before it reaches the
+ * backing store */
+TEST_F(D4NWriteBackFixture, GetBeforeFlush) {
+  buffer::list data;
+  data.append("test data");
+
+  ASSERT_EQ(writeObject("test_object_GetBeforeFlush", data), 0);
+  EXPECT_TRUE(dirty("test_object_GetBeforeFlush"));
+  EXPECT_FALSE(written_back("test_object_GetBeforeFlush"));
+
+  buffer::list read;
+  ASSERT_EQ(readObject("test_object_GetBeforeFlush", 0, data.length() - 1, &read), 0);
+  EXPECT_EQ(read.to_str(), data.to_str());
+
+  ASSERT_EQ(readObject("test_object_GetBeforeFlush", 2, 6, &read), 0);
+  EXPECT_EQ(read.to_str(), "st da");
+
+  /* The same is read once it was written back */
+  ASSERT_EQ(filter->get_cleaner()->flush_object(cacheOid("test_object_GetBeforeFlush")), 0);
+  EXPECT_FALSE(dirty("test_object_GetBeforeFlush"));
+  EXPECT_TRUE(written_back("test_object_GetBeforeFlush"));
+
+  ASSERT_EQ(readObject("test_object_GetBeforeFlush", 0, data.length() - 1, &read), 0);
+  EXPECT_EQ(read.to_str(), data.to_str());
+}
+
+/* A PUT of an object not yet written back replaces it without writing the
+ * earlier data to the backing store first; it is written through, since
+ * the earlier data is kept until it has replaced it */
+TEST_F(D4NWriteBackFixture, OverwriteDirty) {
+  buffer::list data;
+  data.append("test data, first and longer version");
+
+  ASSERT_EQ(writeObject("test_object_OverwriteDirty", data), 0);
+  ASSERT_TRUE(dirty("test_object_OverwriteDirty"));
+
+  buffer::list newer;
+  newer.append("test data, second");
+
+  ASSERT_EQ(writeObject("test_object_OverwriteDirty", newer), 0);
+  EXPECT_FALSE(dirty("test_object_OverwriteDirty"));
+  EXPECT_TRUE(written_back("test_object_OverwriteDirty"));
+
+  buffer::list read;
+  ASSERT_EQ(readObject("test_object_OverwriteDirty", 0, newer.length() - 1, &read), 0);
+  EXPECT_EQ(read.to_str(), newer.to_str());
+
+  /* The earlier PUT is not written over it */
+  ASSERT_EQ(filter->get_cleaner()->flush_object(cacheOid("test_object_OverwriteDirty")), 0);
+
+  unique_ptr<rgw::sal::Bucket> bucket;
+  ASSERT_EQ(filter->get_next()->get_bucket(dpp, nullptr, testBucket->get_key(), &bucket, null_yield), 0);
+  unique_ptr<rgw::sal::Object> stored = bucket->get_object(rgw_obj_key("test_object_OverwriteDirty"));
+  unique_ptr<rgw::sal::Object::ReadOp> op = stored->get_read_op();
+  DataCollectorCB cb;
+
+  ASSERT_EQ(op->prepare(null_yield, dpp), 0);
+  EXPECT_EQ(stored->get_obj_size(), newer.length());
+  ASSERT_EQ(op->iterate(dpp, 0, newer.length() - 1, &cb, null_yield), 0);
+  EXPECT_EQ(cb.collected.to_str(), newer.to_str());
+}
+
+/* A write-through PUT supersedes an earlier one not yet written back */
+TEST_F(D4NWriteBackFixture, WriteThroughOverDirty) {
+  buffer::list data;
+  data.append("test data");
+
+  ASSERT_EQ(writeObject("test_object_WriteThroughOverDirty", data), 0);
+  ASSERT_TRUE(dirty("test_object_WriteThroughOverDirty"));
+
+  /* Objects over rgw_d4n_write_back_max_object_size are written through */
+  buffer::list large;
+  large.append(string(env->cct->_conf->rgw_d4n_write_back_max_object_size + 1, 'a'));
+
+  ASSERT_EQ(writeObject("test_object_WriteThroughOverDirty", large), 0);
+  EXPECT_FALSE(dirty("test_object_WriteThroughOverDirty"));
+  EXPECT_TRUE(written_back("test_object_WriteThroughOverDirty"));
+
+  /* Nothing is left for the cleaner to write over it */
+  ASSERT_EQ(filter->get_cleaner()->flush_object(cacheOid("test_object_WriteThroughOverDirty")), 0);
+
+  buffer::list read;
+  ASSERT_EQ(readObject("test_object_WriteThroughOverDirty", 0, large.length() - 1, &read), 0);
+  EXPECT_EQ(read.length(), large.length());
+  EXPECT_EQ(read.to_str(), large.to_str());
+}
+
+/* Conditions of a PUT over an object not yet written back are evaluated
+ * against it, and a PUT that fails leaves it in place */
+TEST_F(D4NWriteBackFixture, ConditionalOverDirty) {
+  buffer::list data;
+  data.append("test data");
+
+  ASSERT_EQ(writeObject("test_object_ConditionalOverDirty", data), 0);
+  ASSERT_TRUE(dirty("test_object_ConditionalOverDirty"));
+
+  buffer::list newer;
+  newer.append("newer test data");
+
+  EXPECT_EQ(writeObject("test_object_ConditionalOverDirty", newer, nullptr, "*"), -ERR_PRECONDITION_FAILED);
+  EXPECT_EQ(writeObject("test_object_ConditionalOverDirty", newer, "other_etag"), -ERR_PRECONDITION_FAILED);
+  EXPECT_TRUE(dirty("test_object_ConditionalOverDirty"));
+
+  buffer::list read;
+  ASSERT_EQ(readObject("test_object_ConditionalOverDirty", 0, data.length() - 1, &read), 0);
+  EXPECT_EQ(read.to_str(), data.to_str());
+
+  ASSERT_EQ(writeObject("test_object_ConditionalOverDirty", newer, "test_etag"), 0);
+  EXPECT_FALSE(dirty("test_object_ConditionalOverDirty"));
+  EXPECT_TRUE(written_back("test_object_ConditionalOverDirty"));
+
+  ASSERT_EQ(readObject("test_object_ConditionalOverDirty", 0, newer.length() - 1, &read), 0);
+  EXPECT_EQ(read.to_str(), newer.to_str());
+}
+
+/* The backing store copies its own copy of the source, so the source is
+ * written back first, and the copy is not left waiting to be written back */
+TEST_F(D4NWriteBackFixture, CopyDirty) {
+  buffer::list data;
+  data.append("test data");
+
+  ASSERT_EQ(writeObject("test_object_CopyDirty", data), 0);
+  ASSERT_TRUE(dirty("test_object_CopyDirty"));
+
+  unique_ptr<rgw::sal::Object> obj = testBucket->get_object(rgw_obj_key("test_object_CopyDirty"));
+  unique_ptr<rgw::sal::Object> copy = testBucket->get_object(rgw_obj_key("test_object_CopyDirty_copy"));
+  ASSERT_EQ(obj->get_obj_attrs(null_yield, dpp, NULL), 0);
+
+  RGWEnv rgw_env;
+  req_info info(get_pointer(env->cct), &rgw_env);
+  rgw_zone_id source_zone;
+  rgw_placement_rule dest_placement;
+  ceph::real_time src_mtime;
+  ceph::real_time mtime;
+  rgw::sal::Attrs attrs;
+  string tag;
+  string etag;
+
+  ASSERT_EQ(obj->copy_object(testUser.get(), &info, source_zone, copy.get(),
+			     testBucket.get(), testBucket.get(), dest_placement,
+			     &src_mtime, &mtime, nullptr, nullptr, false, nullptr, nullptr,
+			     rgw::sal::ATTRSMOD_NONE, false, attrs, RGWObjCategory::Main, 0,
+			     boost::none, nullptr, &tag, &etag, nullptr, nullptr,
+			     dpp, null_yield), 0);
+
+  EXPECT_FALSE(dirty("test_object_CopyDirty"));
+  EXPECT_TRUE(written_back("test_object_CopyDirty"));
+  EXPECT_FALSE(dirty("test_object_CopyDirty_copy"));
+  EXPECT_TRUE(written_back("test_object_CopyDirty_copy"));
+
+  buffer::list read;
+  ASSERT_EQ(readObject("test_object_CopyDirty_copy", 0, data.length() - 1, &read), 0);
+  EXPECT_EQ(read.to_str(), data.to_str());
+}
+
+/* Attrs changed before the object is written back are not lost */
+TEST_F(D4NWriteBackFixture, SetAttrsDirty) {
+  buffer::list data;
+  data.append("test data");
+
+  ASSERT_EQ(writeObject("test_object_SetAttrsDirty", data), 0);
+  ASSERT_TRUE(dirty("test_object_SetAttrsDirty"));
+
+  unique_ptr<rgw::sal::Object> obj = testBucket->get_object(rgw_obj_key("test_object_SetAttrsDirty"));
+  buffer::list bl;
+  bl.append("test_attrs_value_extra");
+  map<string, bufferlist> setattrs{{"test_attrs_key_extra", bl}};
+
+  ASSERT_EQ(obj->set_obj_attrs(dpp, &setattrs, NULL, null_yield), 0);
+  EXPECT_FALSE(dirty("test_object_SetAttrsDirty"));
+
+  bl.clear();
+  bl.append("test_attrs_value_modified");
+  ASSERT_EQ(obj->modify_obj_attrs("test_attrs_key_extra", bl, null_yield, dpp), 0);
+
+  unique_ptr<rgw::sal::Bucket> bucket;
+  ASSERT_EQ(filter->get_next()->get_bucket(dpp, nullptr, testBucket->get_key(), &bucket, null_yield), 0);
+  unique_ptr<rgw::sal::Object> stored = bucket->get_object(rgw_obj_key("test_object_SetAttrsDirty"));
+  ASSERT_EQ(stored->get_obj_attrs(null_yield, dpp), 0);
+
+  auto attr = stored->get_attrs().find("test_attrs_key_extra");
+  ASSERT_NE(attr, stored->get_attrs().end());
+  EXPECT_EQ(attr->second.to_str(), "test_attrs_value_modified");
+  EXPECT_EQ(stored->get_attrs().count("test_attrs_key_test_object_SetAttrsDirty"), (size_t)1);
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+
+  /* Other host and port can be passed to the program */
+  if (argc == 1) {
+    portStr = "6379";
+    hostStr = "127.0.0.1";
+  } else if (argc == 3) {
+    hostStr = argv[1];
+    portStr = argv[2];
+  } else {
+    std::cout << "Incorrect number of arguments." << std::endl;
+    return -1;
+  }
+
+  env = new Environment();
+  ::testing::AddGlobalTestEnvironment(env);
+
+  return RUN_ALL_TESTS();
+}
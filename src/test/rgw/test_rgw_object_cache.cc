@@ -0,0 +1,105 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab ft=cpp
+
+#include "rgw_cache.h"
+
+#include <gtest/gtest.h>
+
+#include "common/dout.h"
+#include "global/global_context.h"
+
+class ObjectCacheTest : public ::testing::Test {
+protected:
+  NoDoutPrefix dpp{g_ceph_context, ceph_subsys_rgw};
+  ObjectCache cache;
+
+  void SetUp() override {
+    g_ceph_context->_conf.set_val_or_die("rgw_cache_lru_size", "4");
+    g_ceph_context->_conf.set_val_or_die("rgw_cache_shards", "1");
+    cache.set_ctx(g_ceph_context);
+    cache.set_enabled(true);
+  }
+
+  void TearDown() override {
+    g_ceph_context->_conf.rm_val("rgw_cache_lru_size");
+    g_ceph_context->_conf.rm_val("rgw_cache_shards");
+  }
+
+  void put(const std::string& name) {
+    ObjectCacheInfo info;
+    info.status = 0;
+    info.flags = CACHE_FLAG_DATA;
+    info.data.append(name);
+    cache.put(&dpp, name, info, nullptr);
+  }
+
+  bool cached(const std::string& name) {
+    ObjectCacheInfo info;
+    return cache.get(&dpp, name, info, CACHE_FLAG_DATA, nullptr) == 0;
+  }
+};
+
+TEST_F(ObjectCacheTest, PutGet)
+{
+  EXPECT_FALSE(cached("a"));
+  put("a");
+  ObjectCacheInfo info;
+  ASSERT_EQ(0, cache.get(&dpp, "a", info, CACHE_FLAG_DATA, nullptr));
+  EXPECT_EQ("a", info.data.to_str());
+  EXPECT_EQ(-ENOENT, cache.get(&dpp, "a", info, CACHE_FLAG_XATTRS, nullptr));
+}
+
+TEST_F(ObjectCacheTest, InvalidateRemove)
+{
+  put("a");
+  EXPECT_TRUE(cache.invalidate_remove(&dpp, "a"));
+  EXPECT_FALSE(cached("a"));
+  EXPECT_FALSE(cache.invalidate_remove(&dpp, "a"));
+}
+
+TEST_F(ObjectCacheTest, Evict)
+{
+  // entries are evicted before adding one, so one more than
+  // rgw_cache_lru_size stay
+  for (auto name : {"a", "b", "c", "d", "e", "f"}) {
+    put(name);
+  }
+  int n = 0;
+  for (auto name : {"a", "b", "c", "d", "e", "f"}) {
+    n += cached(name);
+  }
+  EXPECT_EQ(5, n);
+  EXPECT_FALSE(cached("a"));
+  EXPECT_TRUE(cached("f"));
+}
+
+TEST_F(ObjectCacheTest, ReferencedSurvive)
+{
+  for (auto name : {"a", "b", "c", "d", "e", "f"}) {
+    put(name);
+  }
+  // the hand evicted a and stopped at b, which is read, so c goes next
+  ASSERT_FALSE(cached("a"));
+  ASSERT_TRUE(cached("b"));
+  put("g");
+  EXPECT_TRUE(cached("b"));
+  EXPECT_FALSE(cached("c"));
+  EXPECT_TRUE(cached("d"));
+}
+
+TEST_F(ObjectCacheTest, Shards)
+{
+  g_ceph_context->_conf.set_val_or_die("rgw_cache_lru_size", "1000");
+  g_ceph_context->_conf.set_val_or_die("rgw_cache_shards", "8");
+  cache.set_ctx(g_ceph_context);
+  for (int i = 0; i < 100; i++) {
+    put(std::to_string(i));
+  }
+  for (int i = 0; i < 100; i++) {
+    EXPECT_TRUE(cached(std::to_string(i)));
+  }
+  cache.invalidate_all();
+  for (int i = 0; i < 100; i++) {
+    EXPECT_FALSE(cached(std::to_string(i)));
+  }
+}